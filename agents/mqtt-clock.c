@@ -1,6 +1,9 @@
 /*
  * Clock Example
  *
+ * Publishes the wall clock on each second boundary. With -m a time stamp in
+ * milliseconds is published as well.
+ *
  * SPDX-License-Identifier: MIT
  * License-Filename: LICENSES/MIT.txt
  */
@@ -16,7 +19,8 @@
 #include <signal.h>
 
 #include <time.h>
-#include <sys/time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
 
 #include <mqtt-tools/mqtta.h>
 #include <mqtt-tools/mosqhelper.h>
@@ -30,51 +34,31 @@
 #	define LOG_ERR  stderr
 #endif
 
-struct clock_state {
-  uint8_t current_second;
-  uint8_t current_minute;
-};
+/* Topic for the optional millisecond time stamp, enabled with -m */
+#define TOPIC_TIMESTAMP_MS  "Netz39/Service/Clock/UnixTimestampMillis"
 
-struct datetime {
-  int year;
-  int month;
-  int day;
-  int hour;
-  int minute;
-  int second;
+struct clock_state {
+  /* second of the last emission */
+  time_t now;
+  /* broken-down local time of `now` */
+  struct tm tm;
+  bool valid;
+
+  bool with_millis;
+
+  /* emission delay after the second boundary, over the current minute */
+  uint64_t jitter_sum_us;
+  uint64_t jitter_max_us;
+  unsigned jitter_count;
 };
 
-/**
- * Get the seconds since epoch.
- */
-time_t current_unixtime() {
-  struct timeval tv;
-  gettimeofday(&tv, 0);
-
-  return tv.tv_sec;
-}
-
-
-void decode_current_time(struct datetime *dt)
-{
-  time_t t = time(NULL);
-  struct tm tm = *localtime(&t);
-
-  dt->year 	= tm.tm_year;
-  dt->month	= tm.tm_mon;
-  dt->day	= tm.tm_mday;
-  dt->hour	= tm.tm_hour;
-  dt->minute 	= tm.tm_min;
-  dt->second	= tm.tm_sec;
-}
-
 struct mqtta_message* create_value_message(const char* topic,
                                            const char* format,
-                                           const int val)
+                                           const long long val)
 {
-    char buf[16];
+    char buf[24];
 
-    snprintf(buf, 16, format, val);
+    snprintf(buf, sizeof(buf), format, val);
 
     struct mqtta_message *msg;
     msg = mqtta_create_message(topic,
@@ -86,32 +70,10 @@ struct mqtta_message* create_value_message(const char* topic,
     return msg;
 }
 
-int mqtta_send_message(struct mosqagent* agent,
-                       struct mqtta_message *msg)
-{
-    if (!agent || !msg) {
-        errno = EINVAL;
-        goto fail;
-    }
-
-    int ret;
-
-    ret = mqtt_publish(agent->mosq, NULL,
-                       msg->topic,
-                       strlen(msg->payload), msg->payload,
-                       msg->qos,
-                       msg->retain);
-
-    return ret;
-
-fail:
-    return -1;
-}
-
 void send_value(struct mosqagent* agent,
                 const char *topic,
                 const char* format,
-                int val)
+                long long val)
 {
     int ret;
 
@@ -126,58 +88,166 @@ void send_value(struct mosqagent* agent,
         syslog(LOG_ERR, "Error on publish %d", ret);
 }
 
-struct mosqagent_result* clock_idle(struct mosqagent *agent)
+/**
+ * Advance the broken-down time to the second `now`.
+ *
+ * Within a minute only the seconds are counted up. `localtime_r` is called
+ * on the minute change, which also covers DST changes, and whenever the
+ * clock did not advance by exactly one second.
+ *
+ * \returns true if the time was decoded again.
+ */
+static bool advance_time(struct clock_state *state, const time_t now)
+{
+    const bool incremental = state->valid &&
+                             (now == state->now + 1) &&
+                             (state->tm.tm_sec < 59);
+
+    if (incremental)
+        state->tm.tm_sec++;
+    else
+        localtime_r(&now, &state->tm);
+
+    state->now = now;
+    state->valid = true;
+
+    return !incremental;
+}
+
+static void send_jitter(struct mosqagent *agent, struct clock_state *state)
+{
+    if (!state->jitter_count)
+        return;
+
+    send_value(agent,
+		"Netz39/Service/Clock/Jitter/MeanMicros",
+		"%lld",
+		(long long)(state->jitter_sum_us / state->jitter_count));
+    send_value(agent,
+		"Netz39/Service/Clock/Jitter/MaxMicros",
+		"%lld",
+		(long long)state->jitter_max_us);
+
+    state->jitter_sum_us = 0;
+    state->jitter_max_us = 0;
+    state->jitter_count = 0;
+}
+
+/**
+ * Emit the time for the second boundary that just passed.
+ *
+ * The per-second values go out first, the per-minute values and statistics
+ * afterwards, so that they do not add to the delay of the second.
+ */
+void clock_tick(struct mosqagent *agent)
 {
   struct clock_state *state;
-  struct datetime current_dt;
+  struct timespec ts;
 
   state = (struct clock_state*) mosqagent_get_private_data(agent);
 
-  decode_current_time(&current_dt);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  const bool decoded = advance_time(state, ts.tv_sec);
+
+  send_value(agent,
+		"Netz39/Service/Clock/Wallclock/Simple/Second",
+		"%02lld",
+		(long long)state->tm.tm_sec);
+
+  send_value(agent,
+		"Netz39/Service/Clock/UnixTimestamp",
+		"%lld",
+		(long long)state->now);
 
+  if (state->with_millis)
+    send_value(agent,
+		TOPIC_TIMESTAMP_MS,
+		"%lld",
+		(long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+
+  // delay from the boundary until the second has been handed to the library
+  struct timespec done;
+  clock_gettime(CLOCK_REALTIME, &done);
+  const int64_t jitter_us = ((int64_t)(done.tv_sec - state->now)) * 1000000 +
+                            done.tv_nsec / 1000;
+  if (jitter_us >= 0) {
+    state->jitter_sum_us += jitter_us;
+    if ((uint64_t)jitter_us > state->jitter_max_us)
+      state->jitter_max_us = jitter_us;
+    state->jitter_count++;
+  }
 
-  if (state->current_minute != current_dt.minute) {
+  if (decoded) {
     send_value(agent,
 		"Netz39/Service/Clock/Wallclock/Simple/Year",
-		"%02d",
-		1900 + current_dt.year);
+		"%02lld",
+		1900LL + state->tm.tm_year);
 
     send_value(agent,
 		"Netz39/Service/Clock/Wallclock/Simple/Month",
-		"%02d",
-		1 + current_dt.month);
+		"%02lld",
+		1LL + state->tm.tm_mon);
 
     send_value(agent,
 		"Netz39/Service/Clock/Wallclock/Simple/Day",
-		"%02d",
-		current_dt.day);
+		"%02lld",
+		(long long)state->tm.tm_mday);
 
     send_value(agent,
 		"Netz39/Service/Clock/Wallclock/Simple/Hour",
-		"%02d",
-		current_dt.hour);
+		"%02lld",
+		(long long)state->tm.tm_hour);
 
     send_value(agent,
 		"Netz39/Service/Clock/Wallclock/Simple/Minute",
-		"%02d",
-		current_dt.minute);
-    state->current_minute = current_dt.minute;
+		"%02lld",
+		(long long)state->tm.tm_min);
+
+    send_jitter(agent, state);
   }
+}
 
-  if (state->current_second != current_dt.second) {
-    send_value(agent,
-		"Netz39/Service/Clock/Wallclock/Simple/Second",
-		"%02d",
-		current_dt.second);
-    state->current_second = current_dt.second;
+/**
+ * Arm the timer on the next second boundary of CLOCK_REALTIME.
+ *
+ * The timer is cancelled if the clock is set, so that it can be re-armed
+ * for the new time line.
+ */
+static int arm_second_timer(int tfd)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
 
-    send_value(agent,
-		"Netz39/Service/Clock/UnixTimestamp",
-		"%d",
-		current_unixtime());
-  }
+    const struct itimerspec its = {
+        .it_interval = { 1, 0 },
+        .it_value = { now.tv_sec + 1, 0 },
+    };
+
+    return timerfd_settime(tfd,
+                           TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                           &its, NULL);
+}
+
+/**
+ * Consume the timer expirations.
+ *
+ * \returns true if a second boundary has passed.
+ */
+static bool second_timer_expired(int tfd)
+{
+    uint64_t expirations;
+
+    if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        return true;
+
+    if (errno == ECANCELED) {
+        syslog(LOG_INFO, "System clock changed, re-arming the clock timer.");
+        if (arm_second_timer(tfd))
+            syslog(LOG_ERR, "Cannot re-arm the clock timer: %s",
+                   strerror(errno));
+    }
 
-  return NULL;
+    return false;
 }
 
 bool run = true;
@@ -210,20 +280,40 @@ int set_signal_handlers() {
 }
 
 int main(int argc, char *argv[]) {
+    bool with_millis = false;
+    int opt;
     int ret;
 
+    while ((opt = getopt(argc, argv, "m")) != -1) {
+        switch (opt) {
+        case 'm':
+            with_millis = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m]\n"
+                    "\t-m  also publish %s\n",
+                    argv[0], TOPIC_TIMESTAMP_MS);
+            return -1;
+        }
+    }
+
     ret = set_signal_handlers();
     if (ret) {
         printf("Error setting signal handlers!\n");
         return -1;
     }
 
-    // set to non-time values
     struct clock_state state = {
-        .current_second = 0xff,
-        .current_minute = 0xff,
+        .valid = false,
+        .with_millis = with_millis,
     };
 
+    const int tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ((tfd < 0) || arm_second_timer(tfd)) {
+        printf("Cannot create the clock timer: %s\n", strerror(errno));
+        return -1;
+    }
+
     struct mosqagent* agent;
     agent = mosqagent_init_agent(&state);
     if (!agent) {
@@ -255,19 +345,34 @@ int main(int argc, char *argv[]) {
 	    mosqagent_strerror(errno));
     }
 
-    ret = mosqagent_add_idle_call(agent, clock_idle);
-    if (ret)
-      syslog(LOG_ERR, "Cannot add clock idle call: %s",
-	     mosqagent_strerror(ret));
-
   run &= (agent != NULL);
   while (run) {
-    mosqagent_idle(agent);
-
-    usleep(200*1000);
+    struct pollfd fds[2] = {
+      { .fd = tfd, .events = POLLIN },
+      { .fd = mosquitto_socket(agent->mosq), .events = POLLIN },
+    };
+    if (mosquitto_want_write(agent->mosq))
+      fds[1].events |= POLLOUT;
+
+    // wake up regularly for the agent's timers and the keep-alive
+    ret = poll(fds, 2, 100);
+    if ((ret < 0) && (errno != EINTR))
+      syslog(LOG_ERR, "Error in poll: %s", strerror(errno));
+
+    if ((fds[0].revents & POLLIN) && second_timer_expired(tfd))
+      clock_tick(agent);
+
+    // never block here, the network is waited for in poll
+    mosqagent_run_timers(agent);
+    mosqagent_flush_lanes(agent);
+    mqtt_loop_wait(agent->mosq, 0);
+    // the client has written what it could, refill from the lanes
+    mosqagent_flush_lanes(agent);
+    mosqagent_watchdog_iteration(agent);
   } // while (run)
 
   mosqagent_close_agent(agent);
+  close(tfd);
 
   syslog(LOG_INFO, "MQTT Clock serivce quit.");
 
@@ -0,0 +1,685 @@
+/*
+ * Load generator
+ *
+ * Simulates a number of clients, spread over worker threads, that publish
+ * to templated topics at a fixed rate per client, with payload sizes from
+ * a distribution. With a subscription filter, each client also receives
+ * and the end-to-end latency is measured.
+ *
+ * Sending is open-loop: every message has an intended send time from the
+ * schedule, which does not wait for the broker. If the generator falls
+ * behind, it catches up and the latency still counts from the intended
+ * time, so stalls show up in the results instead of being hidden by
+ * fewer samples (coordinated omission). The delay from intended to actual
+ * send is measured as well.
+ *
+ * The clients connect to a broker, or with -l join a local group, which
+ * stands in for a broker on this host.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-histogram.h>
+#include <mqtt-tools/mqtta-local.h>
+
+/* Intended send time at the start of each payload, in ns */
+#define STAMP_LEN       20
+#define MAX_PAYLOAD     (1 << 20)
+
+/* Time to wait for messages in flight after sending */
+#define DRAIN_NS        1000000000ull
+/* Longest sleep of a worker without a subscription */
+#define MAX_SLEEP_NS    10000000ull
+
+/* Histogram range: 1 ns to a minute, three significant digits */
+#define HIST_HIGHEST    60000000000ull
+#define HIST_DIGITS     3
+
+enum size_distribution {
+    SIZE_FIXED = 0,
+    SIZE_UNIFORM,
+    SIZE_EXPONENTIAL,
+};
+
+struct loadgen {
+    struct mosqagent_config broker;
+    const char *group;
+
+    int clients;
+    int threads;
+    const char *topic;
+    unsigned long keys;
+    /* messages per second and client */
+    double rate;
+    bool poisson;
+    enum size_distribution size;
+    size_t size_min;
+    size_t size_max;
+    double size_mean;
+    int qos;
+    const char *filter;
+    unsigned int duration_s;
+
+    pthread_barrier_t start;
+};
+
+struct client {
+    struct mosqagent *agent;
+    struct mosqagent_config config;
+    char name[64];
+    int index;
+    /* intended send time of the next message */
+    uint64_t next_ns;
+    unsigned long key;
+};
+
+struct worker {
+    struct loadgen *lg;
+    pthread_t thread;
+    int index;
+    bool failed;
+
+    struct client *clients;
+    int count;
+
+    uint64_t random;
+    char *payload;
+    char topic[256];
+
+    unsigned long sent;
+    unsigned long errors;
+    unsigned long received;
+    uint64_t sending_ns;
+    /* intended to actual send time */
+    struct mqtta_histogram *lag;
+    /* intended send to receive time */
+    struct mqtta_histogram *latency;
+};
+
+volatile bool run = true;
+
+void sig_finish_handler(int signum) {
+    (void) signum; /* unused */
+
+    run = false;
+}
+
+int set_signal_handlers() {
+    struct sigaction sact;
+    sigset_t block_mask;
+    int ret = 0;
+
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGQUIT);
+
+    sact.sa_handler = &sig_finish_handler;
+    sact.sa_mask = block_mask;
+    sact.sa_flags = 0;
+
+    ret |= sigaction(SIGINT, &sact, NULL);
+    ret |= sigaction(SIGTERM, &sact, NULL);
+    ret |= sigaction(SIGQUIT, &sact, NULL);
+
+    return ret;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_ns(const uint64_t ns)
+{
+    const struct timespec ts = {
+        .tv_sec = ns / 1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * xorshift64*, uniform in [0, 1)
+ */
+static double uniform(struct worker *w)
+{
+    w->random ^= w->random >> 12;
+    w->random ^= w->random << 25;
+    w->random ^= w->random >> 27;
+
+    return ((w->random * 2685821657736338717ull) >> 11) * 0x1.0p-53;
+}
+
+static uint64_t interval_ns(struct worker *w)
+{
+    const double mean = 1e9 / w->lg->rate;
+
+    if (w->lg->poisson)
+        return (uint64_t)(-log(1.0 - uniform(w)) * mean) + 1;
+
+    return (uint64_t)mean;
+}
+
+static size_t payload_size(struct worker *w)
+{
+    const struct loadgen *lg = w->lg;
+    double size;
+
+    switch (lg->size) {
+    case SIZE_UNIFORM:
+        size = lg->size_min + uniform(w) * (lg->size_max - lg->size_min + 1);
+        break;
+    case SIZE_EXPONENTIAL:
+        size = -log(1.0 - uniform(w)) * lg->size_mean;
+        break;
+    default:
+        return lg->size_min;
+    }
+
+    if (size < lg->size_min)
+        return lg->size_min;
+    if (size > lg->size_max)
+        return lg->size_max;
+    return (size_t)size;
+}
+
+/*
+ * Expand %c (client), %t (thread) and %k (key) in the topic template.
+ */
+static void expand_topic(struct worker *w, const struct client *c)
+{
+    const char *p;
+    size_t n = 0;
+
+    for (p = w->lg->topic; *p && (n + 1 < sizeof(w->topic)); p++) {
+        if ((p[0] != '%') || !p[1]) {
+            w->topic[n++] = *p;
+            continue;
+        }
+
+        const size_t left = sizeof(w->topic) - n;
+        int len;
+        switch (*++p) {
+        case 'c':
+            len = snprintf(w->topic + n, left, "%d", c->index);
+            break;
+        case 't':
+            len = snprintf(w->topic + n, left, "%d", w->index);
+            break;
+        case 'k':
+            len = snprintf(w->topic + n, left, "%lu", c->key % w->lg->keys);
+            break;
+        default:
+            w->topic[n++] = *p;
+            continue;
+        }
+        n += ((size_t)len < left) ? (size_t)len : left - 1;
+    }
+    w->topic[n] = '\0';
+}
+
+static void publish(struct worker *w, struct client *c)
+{
+    const size_t size = payload_size(w);
+    char stamp[STAMP_LEN + 1];
+
+    snprintf(stamp, sizeof(stamp), "%0*" PRIu64, STAMP_LEN, c->next_ns);
+    memcpy(w->payload, stamp, STAMP_LEN);
+    w->payload[size] = '\0';
+
+    expand_topic(w, c);
+    c->key++;
+
+    struct mqtta_message msg = {
+        .topic = w->topic,
+        .payload = w->payload,
+        .payloadlen = size,
+        .qos = w->lg->qos,
+    };
+    if (mqtta_send_message(c->agent, &msg))
+        w->errors++;
+    else
+        w->sent++;
+
+    mqtta_histogram_record(w->lag, now_ns() - c->next_ns);
+    w->payload[size] = 'x';
+}
+
+static void receive_handler(struct mosqagent *agent,
+                            const struct mqtta_message *msg,
+                            void *handler_data)
+{
+    struct worker *w = handler_data;
+    const uint64_t now = now_ns();
+
+    (void) agent; /* unused */
+
+    w->received++;
+
+    // messages of other publishers have no stamp
+    if (msg->payloadlen < STAMP_LEN)
+        return;
+    const uint64_t sent = strtoull(msg->payload, NULL, 10);
+    if (sent && (sent <= now))
+        mqtta_histogram_record(w->latency, now - sent);
+}
+
+static int connect_client(struct worker *w, struct client *c)
+{
+    const struct loadgen *lg = w->lg;
+    const struct mqtta_loop_config loop = {
+        .mode = MQTTA_LOOP_BUSY_POLL,
+        .cpu = -1,
+    };
+
+    c->agent = mosqagent_init_agent(NULL);
+    if (!c->agent)
+        return -1;
+
+    if (lg->group) {
+        // all topics are local, the group is the broker
+        if (mosqagent_local_join(c->agent, lg->group, false) ||
+            mosqagent_local_topic(c->agent, "#"))
+            return -1;
+    } else {
+        c->config = lg->broker;
+        snprintf(c->name, sizeof(c->name), "mqtt-loadgen-%d-%d",
+                 (int)getpid(), c->index);
+        c->config.client_name = c->name;
+        mqtta_set_configuration(c->agent, &c->config);
+    }
+
+    if (lg->filter &&
+        mosqagent_subscribe(c->agent, lg->filter, lg->qos,
+                            receive_handler, w))
+        return -1;
+
+    if (!lg->group && mosqagent_setup_mqtt(c->agent))
+        return -1;
+
+    // the loop must not block, one thread serves several clients
+    return mosqagent_set_loop(c->agent, &loop);
+}
+
+static void* worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct loadgen *lg = w->lg;
+    int i;
+
+    for (i = 0; i < w->count; i++)
+        if (connect_client(w, &w->clients[i])) {
+            fprintf(stderr, "Client %d: %s\n", w->clients[i].index,
+                    mosqagent_strerror(errno));
+            w->failed = true;
+            break;
+        }
+
+    pthread_barrier_wait(&lg->start);
+    if (w->failed)
+        goto out;
+
+    const uint64_t started = now_ns();
+    uint64_t now = started;
+    const uint64_t end = lg->duration_s ?
+                         now + lg->duration_s * 1000000000ull : UINT64_MAX;
+
+    // spread the first messages over an interval
+    for (i = 0; i < w->count; i++)
+        w->clients[i].next_ns = (lg->rate > 0.0) ?
+                                now + interval_ns(w) * uniform(w) :
+                                UINT64_MAX;
+
+    while (run && (now < end)) {
+        uint64_t next = now + MAX_SLEEP_NS;
+
+        for (i = 0; i < w->count; i++) {
+            struct client *c = &w->clients[i];
+
+            while (c->next_ns <= now) {
+                publish(w, c);
+                c->next_ns += interval_ns(w);
+            }
+            if (c->next_ns < next)
+                next = c->next_ns;
+
+            mosqagent_idle(c->agent);
+        }
+
+        now = now_ns();
+        // receivers poll all the time, the latency would suffer otherwise
+        if (!lg->filter && (next > now)) {
+            sleep_ns(next - now);
+            now = now_ns();
+        }
+    }
+
+    w->sending_ns = now_ns() - started;
+
+    // receive the messages in flight
+    const uint64_t drained = now_ns() + DRAIN_NS;
+    while (lg->filter && (now_ns() < drained))
+        for (i = 0; i < w->count; i++)
+            mosqagent_idle(w->clients[i].agent);
+
+out:
+    for (i = 0; i < w->count; i++)
+        if (w->clients[i].agent)
+            mosqagent_close_agent(w->clients[i].agent);
+
+    return NULL;
+}
+
+/*
+ * Parse host[:port] into the broker configuration.
+ */
+static int parse_broker(char *arg, struct mosqagent_config *config)
+{
+    char *colon = strrchr(arg, ':');
+    if (colon) {
+        *colon = '\0';
+        config->port = atoi(colon + 1);
+    }
+    config->host = arg;
+
+    return (config->host[0] && (config->port > 0)) ? 0 : -1;
+}
+
+/*
+ * Parse the payload size: "n" fixed, "min-max" uniform or "exp:mean"
+ * exponential, up to 16 times the mean.
+ */
+static int parse_size(const char *arg, struct loadgen *lg)
+{
+    char *end;
+
+    if (!strncmp(arg, "exp:", 4)) {
+        lg->size = SIZE_EXPONENTIAL;
+        lg->size_mean = strtod(arg + 4, &end);
+        lg->size_min = STAMP_LEN;
+        lg->size_max = (size_t)(16 * lg->size_mean);
+    } else {
+        lg->size = SIZE_FIXED;
+        lg->size_min = strtoul(arg, &end, 10);
+        lg->size_max = lg->size_min;
+        if (*end == '-') {
+            lg->size = SIZE_UNIFORM;
+            lg->size_max = strtoul(end + 1, &end, 10);
+        }
+    }
+
+    if (lg->size_min < STAMP_LEN)
+        lg->size_min = STAMP_LEN;
+    if (lg->size_max > MAX_PAYLOAD)
+        lg->size_max = MAX_PAYLOAD;
+
+    return (*end || (lg->size_max < lg->size_min)) ? -1 : 0;
+}
+
+static void print_row(const char *name, const struct mqtta_histogram *h)
+{
+    if (!mqtta_histogram_count(h)) {
+        printf("%-10s no messages\n", name);
+        return;
+    }
+
+    printf("%-10s %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+           mqtta_histogram_value_at(h, 50.0) / 1000.0,
+           mqtta_histogram_value_at(h, 90.0) / 1000.0,
+           mqtta_histogram_value_at(h, 99.0) / 1000.0,
+           mqtta_histogram_value_at(h, 99.9) / 1000.0,
+           mqtta_histogram_max(h) / 1000.0);
+}
+
+static int write_histogram(const char *prefix,
+                           const char *name,
+                           const struct mqtta_histogram *h)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s-%s.hgrm", prefix, name);
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        printf("Cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // values in µs
+    int ret = mqtta_histogram_print(h, f, 1000.0);
+    ret |= fclose(f);
+    if (ret)
+        printf("Cannot write %s: %s\n", path, strerror(errno));
+
+    return ret ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-b host[:port] | -l group] [-n clients] [-j threads]\n"
+        "          [-t topic] [-k keys] [-r rate] [-P] [-s size] [-q qos]\n"
+        "          [-f filter] [-d duration] [-o prefix]\n"
+        "\t-b broker    default localhost:1883\n"
+        "\t-l group     use this local group instead of a broker (at most %d clients)\n"
+        "\t-n clients   number of clients, default 10\n"
+        "\t-j threads   number of worker threads, default 1\n"
+        "\t-t topic     topic template with %%c client, %%t thread and %%k key,\n"
+        "\t             default loadgen/%%c\n"
+        "\t-k keys      number of keys for %%k, default 1\n"
+        "\t-r rate      messages per second and client, default 10, 0 to only receive\n"
+        "\t-P           Poisson arrivals instead of a fixed interval\n"
+        "\t-s size      payload bytes: n, min-max (uniform) or exp:mean, default 64\n"
+        "\t-q qos       QoS for publish and subscription, default 0\n"
+        "\t-f filter    subscribe each client and measure the latency\n"
+        "\t-d duration  in seconds, default 10, 0 until interrupted\n"
+        "\t-o prefix    HdrHistogram output files, default mqtt-loadgen\n",
+        name, MQTTA_LOCAL_MAX_MEMBERS);
+}
+
+int main(int argc, char *argv[])
+{
+    struct loadgen lg = {
+        .broker = {
+            .host = "localhost",
+            .port = 1883,
+            .protocol_version = 5,
+        },
+        .clients = 10,
+        .threads = 1,
+        .topic = "loadgen/%c",
+        .keys = 1,
+        .rate = 10.0,
+        .size = SIZE_FIXED,
+        .size_min = 64,
+        .size_max = 64,
+        .duration_s = 10,
+    };
+    const char *prefix = "mqtt-loadgen";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:l:n:j:t:k:r:Ps:q:f:d:o:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (parse_broker(optarg, &lg.broker)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'l':
+            lg.group = optarg;
+            break;
+        case 'n':
+            lg.clients = atoi(optarg);
+            break;
+        case 'j':
+            lg.threads = atoi(optarg);
+            break;
+        case 't':
+            lg.topic = optarg;
+            break;
+        case 'k':
+            lg.keys = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            lg.rate = strtod(optarg, NULL);
+            break;
+        case 'P':
+            lg.poisson = true;
+            break;
+        case 's':
+            if (parse_size(optarg, &lg)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'q':
+            lg.qos = atoi(optarg);
+            break;
+        case 'f':
+            lg.filter = optarg;
+            break;
+        case 'd':
+            lg.duration_s = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            prefix = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if ((lg.clients < 1) || (lg.threads < 1) || (lg.threads > lg.clients) ||
+        !lg.keys || (lg.rate < 0.0) || (lg.qos < 0) || (lg.qos > 2) ||
+        (lg.group && (lg.clients > MQTTA_LOCAL_MAX_MEMBERS))) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (set_signal_handlers()) {
+        printf("Error setting signal handlers!\n");
+        return -1;
+    }
+
+    struct worker *workers = calloc(lg.threads, sizeof(*workers));
+    struct client *clients = calloc(lg.clients, sizeof(*clients));
+    if (!workers || !clients) {
+        printf("Out of memory!\n");
+        return -1;
+    }
+
+    pthread_barrier_init(&lg.start, NULL, lg.threads + 1);
+
+    // clients are assigned to the workers round-robin
+    int i;
+    for (i = 0; i < lg.clients; i++)
+        clients[i].index = i;
+
+    struct client *next = clients;
+    for (i = 0; i < lg.threads; i++) {
+        struct worker *w = &workers[i];
+
+        w->lg = &lg;
+        w->index = i;
+        w->count = lg.clients / lg.threads + (i < lg.clients % lg.threads);
+        w->clients = next;
+        next += w->count;
+
+        w->random = now_ns() * (i + 1) | 1;
+        w->payload = malloc(lg.size_max + 1);
+        w->lag = mqtta_histogram_create(1, HIST_HIGHEST, HIST_DIGITS);
+        w->latency = mqtta_histogram_create(1, HIST_HIGHEST, HIST_DIGITS);
+        if (!w->payload || !w->lag || !w->latency) {
+            printf("Out of memory!\n");
+            return -1;
+        }
+        memset(w->payload, 'x', lg.size_max + 1);
+
+        if (pthread_create(&w->thread, NULL, worker_run, w)) {
+            printf("Cannot start worker %d: %s\n", i, strerror(errno));
+            return -1;
+        }
+    }
+
+    // wait for all clients to connect
+    pthread_barrier_wait(&lg.start);
+    bool failed = false;
+    for (i = 0; i < lg.threads; i++)
+        failed |= workers[i].failed;
+    if (failed)
+        run = false;
+    else
+        printf("%d clients on %d threads, %.1f messages/s each.\n",
+               lg.clients, lg.threads, lg.rate);
+
+    for (i = 0; i < lg.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    if (failed) {
+        printf("Clients could not connect!\n");
+        return -1;
+    }
+
+    unsigned long sent = 0;
+    unsigned long errors = 0;
+    unsigned long received = 0;
+    uint64_t sending_ns = 1;
+    for (i = 0; i < lg.threads; i++) {
+        if (workers[i].sending_ns > sending_ns)
+            sending_ns = workers[i].sending_ns;
+        sent += workers[i].sent;
+        errors += workers[i].errors;
+        received += workers[i].received;
+        if (i) {
+            mqtta_histogram_add(workers[0].lag, workers[i].lag);
+            mqtta_histogram_add(workers[0].latency, workers[i].latency);
+        }
+    }
+
+    const double elapsed = sending_ns / 1e9;
+    printf("sent %lu (%.1f/s), failed %lu\n", sent, sent / elapsed, errors);
+    if (lg.filter)
+        printf("received %lu (%.1f/s)\n", received, received / elapsed);
+    printf("%-10s %9s %9s %9s %9s %9s\n", "",
+           "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    print_row("send lag", workers[0].lag);
+    if (lg.filter)
+        print_row("latency", workers[0].latency);
+
+    int ret = write_histogram(prefix, "send", workers[0].lag);
+    if (lg.filter)
+        ret |= write_histogram(prefix, "latency", workers[0].latency);
+
+    for (i = 0; i < lg.threads; i++) {
+        free(workers[i].payload);
+        mqtta_histogram_destroy(workers[i].lag);
+        mqtta_histogram_destroy(workers[i].latency);
+    }
+    free(workers);
+    free(clients);
+    pthread_barrier_destroy(&lg.start);
+
+    return ret;
+}
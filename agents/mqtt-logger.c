@@ -0,0 +1,268 @@
+/*
+ * Archive messages to disk
+ *
+ * Subscribes to the filters in logger.topics and writes every message to a
+ * message archive in logger.dir, see mqtta-archive.h. With -r the archive
+ * is read instead and the messages of a time range are printed, one line
+ * per message with time stamp, topic and payload.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+
+#include <libconfig.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-archive.h>
+
+bool run = true;
+
+void sig_finish_handler(int signum) {
+    (void) signum; /* unused */
+
+    run = false;
+}
+
+int set_signal_handlers() {
+    struct sigaction sact;
+    sigset_t block_mask;
+    int ret = 0;
+
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGQUIT);
+
+    sact.sa_handler = &sig_finish_handler;
+    sact.sa_mask = block_mask;
+    sact.sa_flags = 0;
+
+    ret |= sigaction(SIGINT, &sact, NULL);
+    ret |= sigaction(SIGTERM, &sact, NULL);
+    ret |= sigaction(SIGQUIT, &sact, NULL);
+
+    return ret;
+}
+
+static void archive_handler(struct mosqagent *agent,
+                            const struct mqtta_message *msg,
+                            void *handler_data)
+{
+    (void) agent; /* unused */
+
+    // a full queue is counted in the archive's statistics
+    mqtta_archive_write(handler_data, 0,
+                        msg->topic,
+                        msg->payload, msg->payloadlen,
+                        msg->qos,
+                        msg->retain);
+}
+
+/*
+ * Load logger.dir and the archive settings; the directory is copied to dir.
+ */
+static int load_logger(const char *config_file,
+                       struct mqtta_archive_config *archive,
+                       char *dir, const size_t dirlen,
+                       config_t *configuration)
+{
+    config_init(configuration);
+    if (config_read_file(configuration, config_file) == CONFIG_FALSE) {
+        fprintf(stderr, "Cannot read config file: %s\n",
+                config_error_text(configuration));
+        return -1;
+    }
+
+    const char *s;
+    if (!config_lookup_string(configuration, "logger.dir", &s)) {
+        fprintf(stderr, "No archive directory in logger.dir.\n");
+        return -1;
+    }
+    snprintf(dir, dirlen, "%s", s);
+    archive->dir = dir;
+
+    int value;
+    if (config_lookup_int(configuration, "logger.partition", &value))
+        archive->partition_s = value > 0 ? value : 0;
+    if (config_lookup_int(configuration, "logger.block_size", &value))
+        archive->block_size = value > 0 ? value : 0;
+    if (config_lookup_int(configuration, "logger.commit_ms", &value))
+        archive->commit_ms = value > 0 ? value : 0;
+    if (config_lookup_int(configuration, "logger.commit_mb", &value))
+        archive->commit_bytes = value > 0 ? (size_t)value << 20 : 0;
+    if (config_lookup_int(configuration, "logger.queue_mb", &value))
+        archive->queue_size = value > 0 ? (size_t)value << 20 : 0;
+    if (config_lookup_int(configuration, "logger.level", &value))
+        archive->level = value;
+
+    return 0;
+}
+
+/*
+ * Print the messages of a time range, times in seconds since the epoch.
+ */
+static int read_archive(const char *dir, const double from, const double to)
+{
+    const uint64_t from_ns = from > 0.0 ? (uint64_t)(from * 1e9) : 0;
+    const uint64_t to_ns = to > 0.0 ? (uint64_t)(to * 1e9) : UINT64_MAX;
+
+    struct mqtta_archive_reader *reader;
+    reader = mqtta_archive_reader_open(dir, from_ns, to_ns);
+    if (!reader) {
+        printf("Cannot open archive %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    struct mqtta_archive_record record;
+    int ret;
+    while (run && ((ret = mqtta_archive_reader_next(reader, &record)) > 0))
+        printf("%llu.%09llu %s %.*s\n",
+               (unsigned long long)(record.timestamp_ns / 1000000000),
+               (unsigned long long)(record.timestamp_ns % 1000000000),
+               record.topic,
+               record.payloadlen, record.payload);
+
+    if (ret < 0)
+        printf("Error reading the archive: %s\n", strerror(errno));
+
+    mqtta_archive_reader_close(reader);
+
+    return ret < 0 ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-c config] [-r [-s from] [-e to]]\n"
+        "\t-c config  agent configuration, default mqtta-config\n"
+        "\t-r         print the archive instead of writing it\n"
+        "\t-s from    first time stamp to print, seconds since the epoch\n"
+        "\t-e to      last time stamp to print, seconds since the epoch\n",
+        name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *config_file = "mqtta-config";
+    bool read_mode = false;
+    double from = 0.0;
+    double to = 0.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:rs:e:")) != -1) {
+        switch (opt) {
+        case 'c':
+            config_file = optarg;
+            break;
+        case 'r':
+            read_mode = true;
+            break;
+        case 's':
+            from = strtod(optarg, NULL);
+            break;
+        case 'e':
+            to = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (set_signal_handlers()) {
+        printf("Error setting signal handlers!\n");
+        return -1;
+    }
+
+    config_t configuration;
+    struct mqtta_archive_config archive_config = { .dir = NULL };
+    char dir[4096];
+    if (load_logger(config_file, &archive_config, dir, sizeof(dir),
+                    &configuration)) {
+        config_destroy(&configuration);
+        printf("Failed to load the logger configuration!\n");
+        return -1;
+    }
+
+    if (read_mode) {
+        config_destroy(&configuration);
+        return read_archive(dir, from, to);
+    }
+
+    struct mosqagent* agent;
+    agent = mosqagent_init_agent(NULL);
+    if (!agent) {
+        printf("Could not initialize the agent!\n");
+        return -1;
+    }
+
+    if (mqtta_load_configuration(agent, config_file)) {
+        printf("Failed to load the configuration!\n");
+        return -1;
+    }
+
+    struct mqtta_archive *archive = mqtta_archive_open(&archive_config);
+    if (!archive) {
+        printf("Cannot open archive %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    const config_setting_t *topics = config_lookup(&configuration,
+                                                   "logger.topics");
+    const int count = topics ? config_setting_length(topics) : 0;
+    if (!count) {
+        printf("No topics to archive in logger.topics!\n");
+        return -1;
+    }
+
+    int qos = 0;
+    config_lookup_int(&configuration, "logger.qos", &qos);
+    if ((qos < 0) || (qos > 2)) {
+        printf("Invalid QoS %d in logger.qos!\n", qos);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < count; i++) {
+        const char *filter = config_setting_get_string_elem(topics, i);
+        if (!filter || mosqagent_subscribe(agent, filter, qos,
+                                           archive_handler, archive)) {
+            printf("Invalid topic filter %s\n", filter ? filter : "");
+            return -1;
+        }
+    }
+    config_destroy(&configuration);
+
+    if (mosqagent_setup_mqtt(agent)) {
+        printf("Mosquitto Agent could not connect: %s\n",
+               mosqagent_strerror(errno));
+        return -1;
+    }
+
+    printf("Archiving %d topic filters to %s.\n", count, dir);
+
+    while (run)
+        mosqagent_idle(agent);
+
+    mosqagent_close_agent(agent);
+
+    struct mqtta_archive_stats stats;
+    if (mqtta_archive_close(archive, &stats))
+        printf("Error writing the archive: %s\n", strerror(errno));
+
+    printf("Archived %lu messages in %lu blocks (%llu bytes, %lu commits), "
+           "dropped %lu.\n",
+           stats.written, stats.blocks, (unsigned long long)stats.bytes,
+           stats.commits, stats.dropped);
+
+    return 0;
+}
@@ -0,0 +1,652 @@
+/*
+ * Relay between two brokers
+ *
+ * Forwards topic subtrees between the broker in mosqagent.broker ("local")
+ * and the broker in relay.remote ("remote"), in both directions, with a
+ * topic prefix rewrite per rule. Payloads are published from the receive
+ * buffer of the other connection without a copy of their own. Publishes of
+ * one loop round are batched with TCP_CORK, so that many small messages
+ * share few segments.
+ *
+ * Loop prevention: each relayed message carries the names of the relays it
+ * has passed as MQTT v5 user properties, and a relay drops messages that
+ * carry its own name. This needs protocol version 5 on both sides.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+
+#include <time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <libconfig.h>
+#include <mosquitto.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mosqhelper.h>
+
+/* User property with the name of a relay the message has passed */
+#define RELAY_PROPERTY      "mqtt-relay"
+
+/* Default number of publishes per TCP_CORK batch */
+#define DEFAULT_BATCH       64
+
+bool run = true;
+
+void sig_finish_handler(int signum) {
+    (void) signum; /* unused */
+
+    run = false;
+}
+
+int set_signal_handlers() {
+    struct sigaction sact;
+    sigset_t block_mask;
+    int ret = 0;
+
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGQUIT);
+
+    sact.sa_handler = &sig_finish_handler;
+    sact.sa_mask = block_mask;
+    sact.sa_flags = 0;
+
+    ret |= sigaction(SIGINT, &sact, NULL);
+    ret |= sigaction(SIGTERM, &sact, NULL);
+    ret |= sigaction(SIGQUIT, &sact, NULL);
+
+    return ret;
+}
+
+struct relay;
+
+/*
+ * One broker connection, the target of the rules of the other side.
+ */
+struct side {
+    struct mosqagent *agent;
+    struct relay *relay;
+    bool v5;
+
+    /* publishes in the current TCP_CORK batch */
+    unsigned int batched;
+    bool corked;
+
+    /* messages published to this side */
+    unsigned long forwarded;
+    unsigned long failed;
+};
+
+struct rule {
+    struct rule *next;
+    char *filter;
+    int qos;
+    /* prefix to replace and its replacement, may be NULL */
+    char *from;
+    char *to;
+
+    struct side *target;
+    /* messages that came back to this relay */
+    unsigned long looped;
+};
+
+struct relay {
+    const char *name;
+    struct side local;
+    struct side remote;
+    struct rule *rules;
+
+    unsigned int batch;
+    /* the marker for messages that have not passed a relay yet */
+    mosquitto_property *marker;
+
+    /* topic rewrite buffer */
+    char *topic;
+    size_t topic_size;
+
+    /* messages forwarded in the current loop round */
+    unsigned long round;
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void cork(struct side *side, const bool on)
+{
+    const int fd = mosquitto_socket(side->agent->mosq);
+    const int value = on;
+
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+
+    side->corked = on;
+    side->batched = 0;
+}
+
+/*
+ * Send what has been batched on this side.
+ */
+static void flush(struct side *side)
+{
+    if (side->corked)
+        cork(side, false);
+}
+
+/*
+ * Replace the rule's prefix, returns the topic itself if there is nothing
+ * to rewrite.
+ */
+static const char* rewrite(struct relay *relay,
+                           const struct rule *rule,
+                           const char *topic)
+{
+    if (!rule->to)
+        return topic;
+
+    const size_t from_len = rule->from ? strlen(rule->from) : 0;
+    if (from_len && strncmp(topic, rule->from, from_len))
+        return topic;
+
+    const size_t to_len = strlen(rule->to);
+    const size_t len = to_len + strlen(topic + from_len) + 1; // plus \0
+
+    if (len > relay->topic_size) {
+        char *buf = mqtta_realloc(relay->topic, len);
+        if (!buf)
+            return NULL;
+        relay->topic = buf;
+        relay->topic_size = len;
+    }
+
+    memcpy(relay->topic, rule->to, to_len);
+    strcpy(relay->topic + to_len, topic + from_len);
+
+    return relay->topic;
+}
+
+/*
+ * Check the relay markers of a message.
+ *
+ * \returns true if the message has passed this relay, *path is set if it
+ *          has passed others.
+ */
+static bool passed(const struct relay *relay,
+                   const mosquitto_property *props,
+                   bool *path)
+{
+    bool own = false;
+    char *name = NULL;
+    char *value = NULL;
+
+    *path = false;
+
+    const mosquitto_property *p;
+    p = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY,
+                                            &name, &value, false);
+    while (p && !own) {
+        if (!strcmp(name, RELAY_PROPERTY)) {
+            *path = true;
+            own = !strcmp(value, relay->name);
+        }
+        // property values are allocated by libmosquitto
+        free(name);
+        free(value);
+        name = value = NULL;
+
+        p = mosquitto_property_read_string_pair(p, MQTT_PROP_USER_PROPERTY,
+                                                &name, &value, true);
+    }
+    free(name);
+    free(value);
+
+    return own;
+}
+
+/*
+ * The markers of the relays a message has passed, plus this one.
+ */
+static mosquitto_property* extend_path(const struct relay *relay,
+                                       const mosquitto_property *props)
+{
+    mosquitto_property *path = NULL;
+    char *name = NULL;
+    char *value = NULL;
+
+    const mosquitto_property *p;
+    p = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY,
+                                            &name, &value, false);
+    while (p) {
+        if (!strcmp(name, RELAY_PROPERTY) &&
+            mosquitto_property_add_string_pair(&path, MQTT_PROP_USER_PROPERTY,
+                                               name, value))
+            goto fail;
+        free(name);
+        free(value);
+        name = value = NULL;
+
+        p = mosquitto_property_read_string_pair(p, MQTT_PROP_USER_PROPERTY,
+                                                &name, &value, true);
+    }
+
+    if (mosquitto_property_add_string_pair(&path, MQTT_PROP_USER_PROPERTY,
+                                           RELAY_PROPERTY, relay->name))
+        goto fail;
+
+    return path;
+
+fail:
+    free(name);
+    free(value);
+    mosquitto_property_free_all(&path);
+    return NULL;
+}
+
+static void forward_handler(struct mosqagent *agent,
+                            const struct mqtta_message *msg,
+                            void *handler_data)
+{
+    struct rule *rule = handler_data;
+    struct side *target = rule->target;
+    struct relay *relay = target->relay;
+
+    (void) agent; /* unused */
+
+    bool path = false;
+    if (msg->properties && passed(relay, msg->properties, &path)) {
+        rule->looped++;
+        return;
+    }
+
+    const char *topic = rewrite(relay, rule, msg->topic);
+    if (!topic || !target->agent->connected) {
+        target->failed++;
+        return;
+    }
+
+    mosquitto_property *props = NULL;
+    if (target->v5) {
+        props = path ? extend_path(relay, msg->properties) : relay->marker;
+        if (!props) {
+            target->failed++;
+            return;
+        }
+    }
+
+    if ((relay->batch > 1) && !target->corked)
+        cork(target, true);
+
+    // straight from the receive buffer, libmosquitto copies into the packet
+    const int ret = mqtt_publish_v5(target->agent->mosq, NULL,
+                                    topic,
+                                    msg->payloadlen, msg->payload,
+                                    msg->qos,
+                                    msg->retain,
+                                    props);
+    if (props != relay->marker)
+        mosquitto_property_free_all(&props);
+
+    if (ret) {
+        target->failed++;
+        return;
+    }
+
+    target->forwarded++;
+    relay->round++;
+
+    if (target->corked && (++target->batched >= relay->batch))
+        cork(target, false);
+}
+
+/*
+ * Block until one of the connections has data, up to 100 ms.
+ */
+static void wait_sockets(struct relay *relay)
+{
+    struct side *sides[] = { &relay->local, &relay->remote };
+    struct pollfd fds[2];
+    nfds_t n = 0;
+
+    unsigned int i;
+    for (i = 0; i < 2; i++) {
+        struct mosquitto *mosq = sides[i]->agent->mosq;
+        const int fd = mosquitto_socket(mosq);
+        if (fd < 0)
+            continue;
+
+        fds[n].fd = fd;
+        fds[n].events = POLLIN | (mosquitto_want_write(mosq) ? POLLOUT : 0);
+        fds[n].revents = 0;
+        n++;
+    }
+
+    // without connections the agent loops pace the reconnects
+    if (n)
+        poll(fds, n, 100);
+}
+
+static char* dup_setting(const config_setting_t *setting, const char *name)
+{
+    const char *s;
+    if (!config_setting_lookup_string(setting, name, &s))
+        return NULL;
+
+    return mqtta_strdup(NULL, s);
+}
+
+/*
+ * Load the rules from relay.forward: direction ("out" from the local to the
+ * remote broker, "in" the other way), filter, optional qos and the prefix
+ * rewrite from/to.
+ */
+static int load_rules(struct relay *relay, const config_setting_t *forward)
+{
+    struct rule **tail = &relay->rules;
+
+    const int count = config_setting_length(forward);
+    int i;
+    for (i = 0; i < count; i++) {
+        const config_setting_t *e = config_setting_get_elem(forward, i);
+        const char *direction = NULL;
+        const char *filter = NULL;
+
+        if (!config_setting_lookup_string(e, "direction", &direction) ||
+            !config_setting_lookup_string(e, "filter", &filter) ||
+            (mosquitto_sub_topic_check(filter) != MOSQ_ERR_SUCCESS)) {
+            fprintf(stderr, "Rule %d needs a direction and a valid filter.\n",
+                    i);
+            return -1;
+        }
+
+        struct rule *rule = mqtta_calloc(NULL, 1, sizeof(*rule));
+        if (!rule)
+            return -1;
+        *tail = rule;
+        tail = &rule->next;
+
+        if (!strcmp(direction, "out")) {
+            rule->target = &relay->remote;
+        } else if (!strcmp(direction, "in")) {
+            rule->target = &relay->local;
+        } else {
+            fprintf(stderr, "Rule %d: direction must be \"in\" or \"out\".\n",
+                    i);
+            return -1;
+        }
+
+        config_setting_lookup_int(e, "qos", &rule->qos);
+        if ((rule->qos < 0) || (rule->qos > 2)) {
+            fprintf(stderr, "Rule %d: invalid QoS %d.\n", i, rule->qos);
+            return -1;
+        }
+
+        rule->filter = mqtta_strdup(NULL, filter);
+        rule->from = dup_setting(e, "from");
+        rule->to = dup_setting(e, "to");
+        if (!rule->filter)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void free_rules(struct relay *relay)
+{
+    struct rule *rule = relay->rules;
+    while (rule) {
+        struct rule *next = rule->next;
+        mqtta_free(rule->filter);
+        mqtta_free(rule->from);
+        mqtta_free(rule->to);
+        mqtta_free(rule);
+        rule = next;
+    }
+    relay->rules = NULL;
+}
+
+/*
+ * Build the configuration of the remote agent from relay.remote, the client
+ * name defaults to the local one.
+ */
+static struct mosqagent_config* remote_configuration(
+        const config_setting_t *remote,
+        const char *client_name)
+{
+    struct mosqagent_config *config = mqtta_calloc(NULL, 1, sizeof(*config));
+    if (!config)
+        return NULL;
+
+    config->client_name = dup_setting(remote, "name");
+    if (!config->client_name)
+        config->client_name = mqtta_strdup(NULL, client_name);
+    config->host = dup_setting(remote, "host");
+
+    config->port = 1883;
+    config_setting_lookup_int(remote, "port", &config->port);
+    config->protocol_version = 5;
+    config_setting_lookup_int(remote, "protocol", &config->protocol_version);
+
+    if (!config->client_name || !config->host) {
+        mqtta_configuration_deallocator(config);
+        return NULL;
+    }
+
+    return config;
+}
+
+static int load_relay(struct relay *relay, const char *config_file)
+{
+    config_t configuration;
+    int ret = -1;
+
+    config_init(&configuration);
+    if (config_read_file(&configuration, config_file) == CONFIG_FALSE) {
+        fprintf(stderr, "Cannot read config file: %s\n",
+                config_error_text(&configuration));
+        goto out;
+    }
+
+    const struct mosqagent_config *local =
+        mqtta_get_configuration(relay->local.agent);
+
+    const config_setting_t *remote = config_lookup(&configuration,
+                                                   "relay.remote");
+    if (!remote) {
+        fprintf(stderr, "No remote broker in relay.remote.\n");
+        goto out;
+    }
+
+    struct mosqagent_config *config;
+    config = remote_configuration(remote, local->client_name);
+    if (!config) {
+        fprintf(stderr, "The remote broker needs a host.\n");
+        goto out;
+    }
+    mqtta_move_configuration(relay->remote.agent, config);
+
+    const char *name = local->client_name;
+    config_lookup_string(&configuration, "relay.name", &name);
+    relay->name = mqtta_strdup(NULL, name);
+
+    int batch = DEFAULT_BATCH;
+    config_lookup_int(&configuration, "relay.batch", &batch);
+    relay->batch = batch > 0 ? batch : 1;
+
+    const config_setting_t *forward = config_lookup(&configuration,
+                                                    "relay.forward");
+    if (!forward || !config_setting_length(forward)) {
+        fprintf(stderr, "Nothing to forward in relay.forward.\n");
+        goto out;
+    }
+
+    if (!relay->name || load_rules(relay, forward))
+        goto out;
+
+    relay->local.v5 = !local->protocol_version ||
+                      (local->protocol_version == 5);
+    relay->remote.v5 = (config->protocol_version == 5);
+
+    ret = 0;
+
+out:
+    config_destroy(&configuration);
+    return ret;
+}
+
+static struct mosqagent* source_of(struct relay *relay, const struct rule *rule)
+{
+    return (rule->target == &relay->remote) ? relay->local.agent
+                                            : relay->remote.agent;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-c config]\n"
+        "\t-c config  agent configuration, default mqtta-config\n",
+        name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *config_file = "mqtta-config";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c':
+            config_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (set_signal_handlers()) {
+        printf("Error setting signal handlers!\n");
+        return -1;
+    }
+
+    struct relay relay = {
+        .local = { .relay = &relay },
+        .remote = { .relay = &relay },
+    };
+
+    relay.local.agent = mosqagent_init_agent(&relay);
+    relay.remote.agent = mosqagent_init_agent(&relay);
+    if (!relay.local.agent || !relay.remote.agent) {
+        printf("Could not initialize the agents!\n");
+        return -1;
+    }
+
+    if (mqtta_load_configuration(relay.local.agent, config_file)) {
+        printf("Failed to load the configuration!\n");
+        return -1;
+    }
+
+    if (load_relay(&relay, config_file)) {
+        printf("Failed to load the relay configuration!\n");
+        return -1;
+    }
+
+    if (mosquitto_property_add_string_pair(&relay.marker,
+                                           MQTT_PROP_USER_PROPERTY,
+                                           RELAY_PROPERTY, relay.name)) {
+        printf("Could not create the relay marker!\n");
+        return -1;
+    }
+
+    struct rule *rule;
+    for (rule = relay.rules; rule; rule = rule->next)
+        if (mosqagent_subscribe(source_of(&relay, rule), rule->filter,
+                                rule->qos, forward_handler, rule)) {
+            printf("Invalid rule for %s: %s\n", rule->filter, strerror(errno));
+            return -1;
+        }
+
+    if (mosqagent_setup_mqtt(relay.local.agent) ||
+        mosqagent_setup_mqtt(relay.remote.agent)) {
+        printf("Mosquitto Agent could not connect: %s\n",
+               mosqagent_strerror(errno));
+        return -1;
+    }
+
+    // the relay waits on both sockets itself, the agents only poll
+    const struct mqtta_loop_config *configured =
+        mqtta_get_configuration(relay.local.agent)->loop;
+    struct mqtta_loop_config loop = { .cpu = -1 };
+    if (configured)
+        loop = *configured;
+    const unsigned int spin_us =
+        (loop.mode == MQTTA_LOOP_BUSY_POLL) ? loop.spin_us : 0;
+    const bool spin = (loop.mode == MQTTA_LOOP_BUSY_POLL);
+
+    loop.mode = MQTTA_LOOP_BUSY_POLL;
+    loop.spin_us = 0;
+    if (mosqagent_set_loop(relay.local.agent, &loop) ||
+        mosqagent_set_loop(relay.remote.agent, &loop)) {
+        printf("Could not set the loop mode: %s\n", strerror(errno));
+        return -1;
+    }
+
+    printf("Relay %s is running.\n", relay.name);
+
+    uint64_t last_work = now_us();
+    while (run) {
+        relay.round = 0;
+
+        mosqagent_idle(relay.local.agent);
+        mosqagent_idle(relay.remote.agent);
+
+        flush(&relay.local);
+        flush(&relay.remote);
+
+        if (relay.round) {
+            last_work = now_us();
+            continue;
+        }
+
+        // busy polling: block only after the idle spin period
+        if (!spin || (spin_us && (now_us() - last_work > spin_us)))
+            wait_sockets(&relay);
+    }
+
+    unsigned long looped = 0;
+    for (rule = relay.rules; rule; rule = rule->next)
+        looped += rule->looped;
+
+    printf("Forwarded %lu messages to local (%lu failed), "
+           "%lu to remote (%lu failed), dropped %lu looped.\n",
+           relay.local.forwarded, relay.local.failed,
+           relay.remote.forwarded, relay.remote.failed,
+           looped);
+
+    mosqagent_close_agent(relay.local.agent);
+    mosqagent_close_agent(relay.remote.agent);
+
+    mosquitto_property_free_all(&relay.marker);
+    free_rules(&relay);
+    mqtta_free(relay.topic);
+    mqtta_free((char*)relay.name);
+
+    return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Replay a record log to a broker
+ *
+ * Reads a log written by an agent with recording enabled and publishes the
+ * messages again, keeping their relative timing at 1x, Nx or maximum speed.
+ * By default only the inbound messages are replayed, i.e. the load the
+ * recorded agent has seen; use -a for all messages or -o for outbound only.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+
+#include <time.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-record.h>
+#include <mqtt-tools/mosqhelper.h>
+
+/* Service the network after this many messages at maximum speed. */
+#define MAX_SPEED_BATCH 64
+
+bool run = true;
+
+void sig_finish_handler(int signum) {
+    (void) signum; /* unused */
+
+    run = false;
+}
+
+int set_signal_handlers() {
+    struct sigaction sact;
+    sigset_t block_mask;
+    int ret = 0;
+
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    sigaddset(&block_mask, SIGQUIT);
+
+    sact.sa_handler = &sig_finish_handler;
+    sact.sa_mask = block_mask;
+    sact.sa_flags = 0;
+
+    ret |= sigaction(SIGINT, &sact, NULL);
+    ret |= sigaction(SIGTERM, &sact, NULL);
+    ret |= sigaction(SIGQUIT, &sact, NULL);
+
+    return ret;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * One pass of the agent loop: timers, waiting messages of the priority
+ * lanes and the network, reported to the watchdog.
+ */
+static void service(struct mosqagent *agent, const int wait_ms)
+{
+    mosqagent_run_timers(agent);
+    mosqagent_flush_lanes(agent);
+    mqtt_loop_wait(agent->mosq, wait_ms);
+    // the client has written what it could, refill from the lanes
+    mosqagent_flush_lanes(agent);
+    mosqagent_watchdog_iteration(agent);
+}
+
+static unsigned int lanes_queued(const struct mosqagent *agent)
+{
+    unsigned int queued = 0;
+    enum mqtta_priority p;
+
+    for (p = MQTTA_PRIORITY_CRITICAL; p <= MQTTA_PRIORITY_LOW; p++) {
+        struct mqtta_lane_stats stats;
+        if (!mosqagent_lane_stats(agent, p, &stats))
+            queued += stats.queued;
+    }
+
+    return queued;
+}
+
+/*
+ * Keep the network going until the target time, then sleep the rest.
+ */
+static void wait_until(struct mosqagent *agent, const uint64_t target)
+{
+    uint64_t now;
+
+    while (run && ((now = now_ns()) + 1000000 < target)) {
+        const uint64_t wait_ms = (target - now) / 1000000;
+
+        service(agent, wait_ms > 100 ? 100 : (int)wait_ms);
+    }
+
+    now = now_ns();
+    if (run && (now < target)) {
+        const struct timespec ts = { 0, (long)(target - now) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-c config] [-s speed | -m] [-a | -o] logfile\n"
+        "\t-c config  agent configuration, default mqtta-config\n"
+        "\t-s speed   replay speed factor, default 1\n"
+        "\t-m         replay at maximum speed\n"
+        "\t-a         replay inbound and outbound messages\n"
+        "\t-o         replay outbound messages only\n",
+        name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *config_file = "mqtta-config";
+    double speed = 1.0;
+    bool max_speed = false;
+    bool inbound = true;
+    bool outbound = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:s:mao")) != -1) {
+        switch (opt) {
+        case 'c':
+            config_file = optarg;
+            break;
+        case 's':
+            speed = strtod(optarg, NULL);
+            if (!(speed > 0.0)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'm':
+            max_speed = true;
+            break;
+        case 'a':
+            inbound = outbound = true;
+            break;
+        case 'o':
+            inbound = false;
+            outbound = true;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (set_signal_handlers()) {
+        printf("Error setting signal handlers!\n");
+        return -1;
+    }
+
+    struct mqtta_record_reader *reader;
+    reader = mqtta_record_reader_open(argv[optind]);
+    if (!reader) {
+        printf("Cannot open record log %s: %s\n", argv[optind], strerror(errno));
+        return -1;
+    }
+
+    struct mosqagent* agent;
+    agent = mosqagent_init_agent(NULL);
+    if (!agent) {
+        printf("Could not initialize the agent!\n");
+        return -1;
+    }
+
+    if (mqtta_load_configuration(agent, config_file)) {
+        printf("Failed to load the configuration!\n");
+        return -1;
+    }
+
+    if (mosqagent_setup_mqtt(agent)) {
+        printf("Mosquitto Agent could not connect: %s\n",
+               mosqagent_strerror(errno));
+        return -1;
+    }
+
+    printf("Replaying %lu messages from %s at %s speed.\n",
+           mqtta_record_reader_count(reader), argv[optind],
+           max_speed ? "maximum" : "recorded");
+
+    struct mqtta_record record;
+    uint64_t first_ts = 0;
+    uint64_t start = 0;
+    uint64_t max_late = 0;
+    unsigned long sent = 0;
+    int ret;
+
+    while (run && ((ret = mqtta_record_reader_next(reader, &record)) > 0)) {
+        if (!((record.direction == MQTTA_RECORD_INBOUND) ? inbound : outbound))
+            continue;
+
+        if (!sent) {
+            first_ts = record.timestamp_ns;
+            start = now_ns();
+        }
+
+        if (max_speed) {
+            if (!(sent % MAX_SPEED_BATCH))
+                service(agent, 0);
+        } else {
+            // a clock stepped back while recording keeps the message in place
+            const uint64_t offset = (record.timestamp_ns > first_ts)
+                                    ? record.timestamp_ns - first_ts : 0;
+            const uint64_t target = start + (uint64_t)(offset / speed);
+
+            wait_until(agent, target);
+
+            const uint64_t now = now_ns();
+            if ((now > target) && (now - target > max_late))
+                max_late = now - target;
+        }
+
+        struct mqtta_message msg = {
+            .topic = (char*)record.topic,
+            .payload = (char*)record.payload,
+            .payloadlen = record.payloadlen,
+            .qos = record.qos,
+            .retain = record.retain,
+        };
+        ret = mqtta_send_message(agent, &msg);
+        if (ret)
+            printf("Error on publish %d\n", ret);
+
+        // close messages do not wait for the network, but are progress
+        mosqagent_watchdog_iteration(agent);
+        ++sent;
+    }
+
+    // let the last messages go out, also those waiting in the lanes
+    int flush;
+    for (flush = 0; flush < 10; flush++)
+        service(agent, 100);
+    while (run && lanes_queued(agent))
+        service(agent, 100);
+
+    const double elapsed = sent ? (now_ns() - start) / 1e9 : 0.0;
+    printf("Sent %lu messages in %.3f s (%.0f msg/s), max. delay %.3f ms.\n",
+           sent, elapsed, elapsed > 0.0 ? sent / elapsed : 0.0,
+           max_late / 1e6);
+
+    mosqagent_close_agent(agent);
+    mqtta_record_reader_close(reader);
+
+    return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Latency of the agent loop modes
+ *
+ * Sends timestamped messages over the shared-memory transport to an agent
+ * running in its own thread, once with each loop mode, and prints the
+ * latency distribution. The busy-poll mode should show a much shorter tail
+ * than the blocking mode, at the cost of a core.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-local.h>
+
+#include "mqtta-bench.h"
+
+#define BENCH_TOPIC     "bench/loop"
+
+struct bench {
+    const char *group;
+    struct mqtta_loop_config loop;
+
+    unsigned long count;
+    unsigned long received;
+    uint64_t *latency_ns;
+
+    volatile bool ready;
+    volatile bool run;
+};
+
+static void receive_handler(struct mosqagent *agent,
+                            const struct mqtta_message *msg,
+                            void *handler_data)
+{
+    struct bench *b = handler_data;
+    const uint64_t now = bench_now_ns();
+
+    (void) agent; /* unused */
+
+    if (b->received < b->count)
+        b->latency_ns[b->received++] = now - strtoull(msg->payload, NULL, 10);
+}
+
+static void* receiver(void *arg)
+{
+    struct bench *b = arg;
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    if (!agent ||
+        mosqagent_local_join(agent, b->group, false) ||
+        mosqagent_local_topic(agent, BENCH_TOPIC) ||
+        mosqagent_subscribe(agent, BENCH_TOPIC, 0, receive_handler, b)) {
+        perror("receiver");
+        goto out;
+    }
+
+    // the scheduling settings apply to this thread
+    if (mosqagent_set_loop(agent, &b->loop)) {
+        perror("loop mode");
+        goto out;
+    }
+
+    b->ready = true;
+    while (b->run)
+        mosqagent_idle(agent);
+
+out:
+    b->ready = true;
+    mosqagent_close_agent(agent);
+    return NULL;
+}
+
+static int run_mode(const char *name,
+                    struct bench *b,
+                    const unsigned long interval_us)
+{
+    pthread_t thread;
+    char payload[32];
+
+    b->received = 0;
+    b->ready = false;
+    b->run = true;
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    if (!agent ||
+        mosqagent_local_join(agent, b->group, false) ||
+        mosqagent_local_topic(agent, BENCH_TOPIC)) {
+        perror("sender");
+        mosqagent_close_agent(agent);
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, receiver, b)) {
+        perror("pthread_create");
+        mosqagent_close_agent(agent);
+        return -1;
+    }
+    while (!b->ready)
+        bench_sleep_ns(1000000);
+
+    unsigned long i;
+    for (i = 0; b->run && (i < b->count); i++) {
+        snprintf(payload, sizeof(payload), "%" PRIu64, bench_now_ns());
+
+        struct mqtta_message msg = {
+            .topic = BENCH_TOPIC,
+            .payload = payload,
+            .payloadlen = strlen(payload),
+        };
+        if (mqtta_send_message(agent, &msg))
+            perror("send");
+
+        bench_sleep_ns(interval_us * 1000);
+    }
+
+    // give the last message a moment
+    bench_sleep_ns(100000000);
+    b->run = false;
+    pthread_join(thread, NULL);
+    mosqagent_close_agent(agent);
+
+    bench_print_latency(name, b->latency_ns, b->received);
+
+    return b->received ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-n count] [-i interval] [-s spin] [-c cpu] [-p priority]\n"
+        "\t-n count     messages per mode, default 10000\n"
+        "\t-i interval  between messages in us, default 100\n"
+        "\t-s spin      idle spin of the adaptive mode in us, default 1000\n"
+        "\t-c cpu       pin the receiver to this CPU\n"
+        "\t-p priority  run the receiver with this SCHED_FIFO priority\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long interval_us = 100;
+    unsigned int spin_us = 1000;
+    struct bench b = {
+        .count = 10000,
+        .loop = { .cpu = -1 },
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:i:s:c:p:")) != -1) {
+        switch (opt) {
+        case 'n':
+            b.count = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval_us = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            spin_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            b.loop.cpu = atoi(optarg);
+            break;
+        case 'p':
+            b.loop.fifo_priority = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!b.count) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    b.latency_ns = calloc(b.count, sizeof(*b.latency_ns));
+    if (!b.latency_ns) {
+        perror("calloc");
+        return -1;
+    }
+
+    char group[32];
+    snprintf(group, sizeof(group), "bench%d", (int)getpid());
+    b.group = group;
+
+    printf("%lu messages per mode, one every %lu us\n\n", b.count, interval_us);
+    bench_print_header();
+
+    int ret = 0;
+
+    b.loop.mode = MQTTA_LOOP_BLOCKING;
+    b.loop.spin_us = 0;
+    ret |= run_mode("blocking", &b, interval_us);
+
+    b.loop.mode = MQTTA_LOOP_BUSY_POLL;
+    ret |= run_mode("busy-poll", &b, interval_us);
+
+    b.loop.spin_us = spin_us;
+    ret |= run_mode("adaptive", &b, interval_us);
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s", MQTTA_LOCAL_SHM_PREFIX, group);
+    shm_unlink(name);
+
+    free(b.latency_ns);
+
+    return ret ? -1 : 0;
+}
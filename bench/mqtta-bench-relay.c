@@ -0,0 +1,240 @@
+/*
+ * Throughput and latency of mqtt-relay
+ *
+ * Publishes timestamped messages to the local broker of a running
+ * mqtt-relay and receives the relayed messages from the remote broker.
+ * Prints the message rate that made it through and the latency
+ * distribution. With -i 0 messages are sent as fast as possible.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <mqtt-tools/mqtta.h>
+
+#include "mqtta-bench.h"
+
+/* Time to wait for the last messages after sending */
+#define DRAIN_NS        2000000000ull
+
+struct bench {
+    unsigned long count;
+    unsigned long received;
+    uint64_t *latency_ns;
+    uint64_t last_ns;
+};
+
+static void receive_handler(struct mosqagent *agent,
+                            const struct mqtta_message *msg,
+                            void *handler_data)
+{
+    struct bench *b = handler_data;
+    const uint64_t now = bench_now_ns();
+
+    (void) agent; /* unused */
+
+    if (b->received < b->count)
+        b->latency_ns[b->received++] = now - strtoull(msg->payload, NULL, 10);
+    b->last_ns = now;
+}
+
+/*
+ * Parse host[:port] into a configuration.
+ */
+static int parse_broker(char *arg, struct mosqagent_config *config)
+{
+    char *colon = strrchr(arg, ':');
+    if (colon) {
+        *colon = '\0';
+        config->port = atoi(colon + 1);
+    }
+    config->host = arg;
+
+    return (config->host[0] && (config->port > 0)) ? 0 : -1;
+}
+
+static struct mosqagent* connect_agent(struct mosqagent_config *config)
+{
+    const struct mqtta_loop_config loop = {
+        .mode = MQTTA_LOOP_BUSY_POLL,
+        .cpu = -1,
+    };
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    if (!agent)
+        return NULL;
+
+    mqtta_set_configuration(agent, config);
+
+    if (mosqagent_setup_mqtt(agent) || mosqagent_set_loop(agent, &loop)) {
+        fprintf(stderr, "Could not connect to %s:%d: %s\n",
+                config->host, config->port, mosqagent_strerror(errno));
+        mosqagent_close_agent(agent);
+        return NULL;
+    }
+
+    return agent;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-a host[:port]] [-b host[:port]] [-t topic] [-r topic]\n"
+        "          [-n count] [-i interval] [-q qos]\n"
+        "\t-a broker  local broker of the relay, default localhost:1883\n"
+        "\t-b broker  remote broker of the relay, default localhost:1883\n"
+        "\t-t topic   topic to publish to, default bench/relay\n"
+        "\t-r topic   topic the relay forwards to, default relayed/bench/relay\n"
+        "\t-n count   number of messages, default 100000\n"
+        "\t-i interval between messages in us, default 0 for maximum rate\n"
+        "\t-q qos     QoS for publish and subscription, default 0\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct mosqagent_config sender_config = {
+        .client_name = "mqtta-bench-relay-pub",
+        .host = "localhost",
+        .port = 1883,
+        .protocol_version = 5,
+    };
+    struct mosqagent_config receiver_config = {
+        .client_name = "mqtta-bench-relay-sub",
+        .host = "localhost",
+        .port = 1883,
+        .protocol_version = 5,
+    };
+    const char *topic = "bench/relay";
+    const char *relayed = "relayed/bench/relay";
+    unsigned long interval_us = 0;
+    int qos = 0;
+    struct bench b = { .count = 100000 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:b:t:r:n:i:q:")) != -1) {
+        switch (opt) {
+        case 'a':
+            if (parse_broker(optarg, &sender_config)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'b':
+            if (parse_broker(optarg, &receiver_config)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 't':
+            topic = optarg;
+            break;
+        case 'r':
+            relayed = optarg;
+            break;
+        case 'n':
+            b.count = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            qos = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!b.count || (qos < 0) || (qos > 2)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    b.latency_ns = calloc(b.count, sizeof(*b.latency_ns));
+    if (!b.latency_ns) {
+        perror("calloc");
+        return -1;
+    }
+
+    struct mosqagent *receiver = connect_agent(&receiver_config);
+    if (!receiver)
+        return -1;
+    if (mosqagent_subscribe(receiver, relayed, qos, receive_handler, &b)) {
+        perror("subscribe");
+        return -1;
+    }
+
+    struct mosqagent *sender = connect_agent(&sender_config);
+    if (!sender)
+        return -1;
+
+    // let the subscription settle
+    const uint64_t settle = bench_now_ns() + 500000000ull;
+    while (bench_now_ns() < settle) {
+        mosqagent_idle(receiver);
+        mosqagent_idle(sender);
+    }
+
+    char payload[32];
+    unsigned long failed = 0;
+    const uint64_t start = bench_now_ns();
+    uint64_t next = start;
+
+    unsigned long i;
+    for (i = 0; i < b.count; i++) {
+        snprintf(payload, sizeof(payload), "%" PRIu64, bench_now_ns());
+
+        struct mqtta_message msg = {
+            .topic = (char*)topic,
+            .payload = payload,
+            .payloadlen = strlen(payload),
+            .qos = qos,
+        };
+        if (mqtta_send_message(sender, &msg))
+            ++failed;
+
+        mosqagent_idle(sender);
+        mosqagent_idle(receiver);
+
+        next += interval_us * 1000;
+        while (interval_us && (bench_now_ns() < next)) {
+            mosqagent_idle(sender);
+            mosqagent_idle(receiver);
+        }
+    }
+    const uint64_t sent_ns = bench_now_ns() - start;
+
+    const uint64_t drain = bench_now_ns() + DRAIN_NS;
+    while ((b.received < b.count) && (bench_now_ns() < drain)) {
+        mosqagent_idle(sender);
+        mosqagent_idle(receiver);
+    }
+
+    const double elapsed = (b.received ? b.last_ns - start : sent_ns) / 1e9;
+    printf("Sent %lu messages (%lu failed) in %.3f s (%.0f msg/s), "
+           "received %lu (%.0f msg/s).\n\n",
+           b.count, failed, sent_ns / 1e9,
+           sent_ns ? b.count / (sent_ns / 1e9) : 0.0,
+           b.received, elapsed > 0.0 ? b.received / elapsed : 0.0);
+
+    bench_print_header();
+    bench_print_latency("relay", b.latency_ns, b.received);
+
+    mosqagent_close_agent(sender);
+    mosqagent_close_agent(receiver);
+    free(b.latency_ns);
+
+    return b.received ? 0 : -1;
+}
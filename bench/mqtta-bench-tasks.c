@@ -0,0 +1,171 @@
+/*
+ * Cost of tasks
+ *
+ * Starts many tasks at the same time that sleep on the agent's timers,
+ * return at once or yield, and prints the memory of the waiting tasks, the
+ * time to start and finish a task and the time per task switch.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-task.h>
+
+#include "mqtta-bench.h"
+
+struct run {
+    unsigned long yields;
+    unsigned int sleep_ms;
+    unsigned long done;
+};
+
+static void yield_task(struct mosqagent *agent, void *data)
+{
+    struct run *r = data;
+
+    unsigned long i;
+    for (i = 0; i < r->yields; i++)
+        mqtta_task_yield(agent);
+
+    r->done++;
+}
+
+static void sleep_task(struct mosqagent *agent, void *data)
+{
+    struct run *r = data;
+
+    mqtta_task_sleep(agent, r->sleep_ms);
+    r->done++;
+}
+
+static void empty_task(struct mosqagent *agent, void *data)
+{
+    struct run *r = data;
+
+    (void) agent; /* unused */
+
+    r->done++;
+}
+
+static int spawn(struct mosqagent *agent, mqtta_task_function function,
+                 struct run *r, unsigned long tasks)
+{
+    r->done = 0;
+
+    unsigned long i;
+    for (i = 0; i < tasks; i++)
+        if (mqtta_task_spawn(agent, function, r)) {
+            perror("mqtta_task_spawn");
+            return -1;
+        }
+
+    return 0;
+}
+
+static void finish(struct mosqagent *agent, const struct run *r,
+                   unsigned long tasks)
+{
+    while (r->done < tasks)
+        mosqagent_idle(agent);
+}
+
+static long max_rss_kib(void)
+{
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) ? 0 : usage.ru_maxrss;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-t tasks] [-y yields] [-s stack] [-p pool]\n"
+        "\t-t tasks   concurrent tasks, default 10000\n"
+        "\t-y yields  yields per task, default 100\n"
+        "\t-s stack   stack size in KiB, default 64\n"
+        "\t-p pool    stacks kept for the next tasks, default 64\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long tasks = 10000;
+    struct run r = { .yields = 100, .sleep_ms = 100 };
+    struct mqtta_task_config config = { .stack_size = 0 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:y:s:p:")) != -1) {
+        switch (opt) {
+        case 't':
+            tasks = strtoul(optarg, NULL, 10);
+            break;
+        case 'y':
+            r.yields = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            config.stack_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'p':
+            config.pool = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!tasks || !r.yields) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    if (!agent || mqtta_task_configure(agent, &config)) {
+        perror("mqtta_task_configure");
+        return -1;
+    }
+
+    const long base_kib = max_rss_kib();
+
+    // all tasks wait at the same time
+    uint64_t start = bench_now_ns();
+    if (spawn(agent, sleep_task, &r, tasks))
+        return -1;
+    mosqagent_idle(agent);
+    const long waiting_kib = max_rss_kib() - base_kib;
+    finish(agent, &r, tasks);
+    const double sleep_ms = (bench_now_ns() - start) / 1e6;
+
+    // tasks that return at once, stacks beyond the pool are mapped anew
+    start = bench_now_ns();
+    if (spawn(agent, empty_task, &r, tasks))
+        return -1;
+    finish(agent, &r, tasks);
+    const double start_ns = (double)(bench_now_ns() - start) / tasks;
+
+    start = bench_now_ns();
+    if (spawn(agent, yield_task, &r, tasks))
+        return -1;
+    finish(agent, &r, tasks);
+    // each yield switches to the task and back
+    const double switch_ns = (double)(bench_now_ns() - start) /
+                             (tasks * (r.yields + 1) * 2);
+
+    printf("%lu tasks, %lu yields each\n\n", tasks, r.yields);
+    printf("start and finish  %8.1f ns/task\n", start_ns);
+    printf("switch            %8.1f ns\n", switch_ns);
+    printf("sleep %u ms        %8.1f ms for all tasks\n", r.sleep_ms, sleep_ms);
+    printf("memory waiting    %8.1f KiB/task\n", (double)waiting_kib / tasks);
+
+    mosqagent_close_agent(agent);
+
+    return 0;
+}
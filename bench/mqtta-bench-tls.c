@@ -0,0 +1,230 @@
+/*
+ * Cost of the TLS handshake on connect
+ *
+ * Connects to a TLS-enabled broker again and again, each time with a new
+ * agent: first without a session to resume, so each connect does the full
+ * handshake, then with the session of a first connect from a cache file,
+ * as an agent does after a restart. Prints the distribution of handshake
+ * time and of the time until the broker acknowledged the connect.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <mqtt-tools/mqtta.h>
+
+#include "mqtta-bench.h"
+
+/* Time to wait for a connect */
+#define CONNECT_NS      5000000000ull
+
+struct result {
+    unsigned long count;
+    unsigned long resumed;
+    uint64_t *handshake_ns;
+    uint64_t *connect_ns;
+};
+
+/*
+ * Parse host[:port] into a configuration.
+ */
+static int parse_broker(char *arg, struct mosqagent_config *config)
+{
+    char *colon = strrchr(arg, ':');
+    if (colon) {
+        *colon = '\0';
+        config->port = atoi(colon + 1);
+    }
+    config->host = arg;
+
+    return (config->host[0] && (config->port > 0)) ? 0 : -1;
+}
+
+/*
+ * Connect one agent and record its handshake and connect time.
+ */
+static int connect_once(struct mosqagent_config *config,
+                        struct result *r)
+{
+    struct mqtta_connection_stats connection = { .ready = false };
+    struct mqtta_tls_stats tls;
+    int ret = -1;
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    if (!agent)
+        return -1;
+
+    mqtta_set_configuration(agent, config);
+
+    if (mosqagent_setup_mqtt(agent)) {
+        fprintf(stderr, "Could not connect to %s:%d: %s\n",
+                config->host, config->port, mosqagent_strerror(errno));
+        goto out;
+    }
+
+    const uint64_t deadline = bench_now_ns() + CONNECT_NS;
+    while (!connection.ready && (bench_now_ns() < deadline)) {
+        mosqagent_idle(agent);
+        mosqagent_connection_stats(agent, &connection);
+    }
+    mosqagent_tls_stats(agent, &tls);
+
+    if (!connection.ready || !tls.handshakes) {
+        fprintf(stderr, "No TLS connection to %s:%d\n",
+                config->host, config->port);
+        goto out;
+    }
+
+    r->handshake_ns[r->count] = tls.last_us * 1000;
+    r->connect_ns[r->count] = connection.ready_us * 1000;
+    r->count++;
+    if (tls.resumed)
+        r->resumed++;
+    ret = 0;
+
+out:
+    mosqagent_close_agent(agent);
+
+    return ret;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-b host[:port]] (-c cafile | -p psk -i identity)\n"
+        "          [-C certfile -K keyfile] [-v version] [-k] [-n count]\n"
+        "\t-b broker   TLS broker, default localhost:8883\n"
+        "\t-c cafile   CA certificates to verify the broker\n"
+        "\t-C certfile client certificate\n"
+        "\t-K keyfile  client key\n"
+        "\t-p psk      pre-shared key in hex, instead of certificates\n"
+        "\t-i identity identity of the pre-shared key\n"
+        "\t-v version  TLS version, e.g. tlsv1.2, default the highest\n"
+        "\t-k          do not check the broker's host name\n"
+        "\t-n count    number of connects per mode, default 100\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    char client_name[64];
+    char session_cache[64];
+    struct mqtta_tls_config tls = { .cafile = NULL };
+    struct mosqagent_config config = {
+        .client_name = client_name,
+        .host = "localhost",
+        .port = 8883,
+        .protocol_version = 5,
+        .tls = &tls,
+    };
+    unsigned long count = 100;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:c:C:K:p:i:v:kn:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (parse_broker(optarg, &config)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'c':
+            tls.cafile = optarg;
+            break;
+        case 'C':
+            tls.certfile = optarg;
+            break;
+        case 'K':
+            tls.keyfile = optarg;
+            break;
+        case 'p':
+            tls.psk = optarg;
+            break;
+        case 'i':
+            tls.identity = optarg;
+            break;
+        case 'v':
+            tls.version = optarg;
+            break;
+        case 'k':
+            tls.insecure = true;
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!count || (!tls.cafile == !tls.psk) || (tls.psk && !tls.identity)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    snprintf(client_name, sizeof(client_name),
+             "mqtta-bench-tls-%d", (int)getpid());
+    snprintf(session_cache, sizeof(session_cache),
+             "/tmp/mqtta-bench-tls-%d.session", (int)getpid());
+
+    struct result full = { .count = 0 };
+    struct result resumed = { .count = 0 };
+    full.handshake_ns = calloc(count, sizeof(uint64_t));
+    full.connect_ns = calloc(count, sizeof(uint64_t));
+    resumed.handshake_ns = calloc(count, sizeof(uint64_t));
+    resumed.connect_ns = calloc(count, sizeof(uint64_t));
+    if (!full.handshake_ns || !full.connect_ns ||
+        !resumed.handshake_ns || !resumed.connect_ns) {
+        perror("calloc");
+        return -1;
+    }
+
+    int ret = 0;
+    unsigned long i;
+
+    // a new agent has no session to offer
+    for (i = 0; (i < count) && !ret; i++)
+        ret = connect_once(&config, &full);
+
+    // the first connect writes the session, the others resume it
+    tls.session_cache = session_cache;
+    struct result first = {
+        .handshake_ns = resumed.handshake_ns,
+        .connect_ns = resumed.connect_ns,
+    };
+    if (!ret)
+        ret = connect_once(&config, &first);
+    for (i = 0; (i < count) && !ret; i++)
+        ret = connect_once(&config, &resumed);
+    unlink(session_cache);
+
+    printf("%lu connects with full handshake, %lu of %lu resumed.\n\n",
+           full.count, resumed.resumed, resumed.count);
+
+    printf("TLS handshake:\n");
+    bench_print_header();
+    bench_print_latency("full", full.handshake_ns, full.count);
+    bench_print_latency("resumed", resumed.handshake_ns, resumed.count);
+
+    printf("\nConnect until CONNACK:\n");
+    bench_print_header();
+    bench_print_latency("full", full.connect_ns, full.count);
+    bench_print_latency("resumed", resumed.connect_ns, resumed.count);
+
+    free(full.handshake_ns);
+    free(full.connect_ns);
+    free(resumed.handshake_ns);
+    free(resumed.connect_ns);
+
+    return ret;
+}
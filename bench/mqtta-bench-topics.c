@@ -0,0 +1,223 @@
+/*
+ * Cost and accuracy of the topic tracking
+ *
+ * Dispatches a Zipf-distributed stream of messages over many topics to an
+ * agent with a wildcard subscription, as a gateway has, once without and
+ * once with topic tracking, and prints the time per message. Then compares the top list and the
+ * number of distinct topics with the exact counts.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+
+#include <mqtt-tools/mqtta.h>
+
+#include "mqtta-bench.h"
+
+#define TOPIC_LEN   48
+
+struct workload {
+    unsigned long topics;
+    unsigned long count;
+    char (*topic)[TOPIC_LEN];
+    /** topic index of each message */
+    uint32_t *sequence;
+    uint64_t *exact;
+};
+
+/*
+ * Draw the message sequence from a Zipf distribution with exponent s.
+ */
+static int create_workload(struct workload *w, double s)
+{
+    w->topic = calloc(w->topics, TOPIC_LEN);
+    w->sequence = calloc(w->count, sizeof(*w->sequence));
+    w->exact = calloc(w->topics, sizeof(*w->exact));
+    double *cdf = calloc(w->topics, sizeof(*cdf));
+    if (!w->topic || !w->sequence || !w->exact || !cdf) {
+        free(cdf);
+        return -1;
+    }
+
+    double sum = 0;
+    unsigned long i;
+    for (i = 0; i < w->topics; i++) {
+        snprintf(w->topic[i], TOPIC_LEN, "site/%lu/sensor/%lu/value",
+                 i % 97, i);
+        sum += 1.0 / pow(i + 1, s);
+        cdf[i] = sum;
+    }
+
+    srand48(42);
+    for (i = 0; i < w->count; i++) {
+        const double x = drand48() * sum;
+        unsigned long lo = 0, hi = w->topics - 1;
+        while (lo < hi) {
+            const unsigned long mid = (lo + hi) / 2;
+            if (cdf[mid] < x)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        w->sequence[i] = lo;
+        w->exact[lo]++;
+    }
+
+    free(cdf);
+    return 0;
+}
+
+static void count_message(struct mosqagent *agent,
+                          const struct mqtta_message *msg,
+                          void *handler_data)
+{
+    unsigned long *received = handler_data;
+
+    (void) agent; /* unused */
+    (void) msg;   /* unused */
+
+    (*received)++;
+}
+
+/*
+ * Dispatch the whole sequence, returns the time per message in ns.
+ */
+static double run(struct mosqagent *agent, const struct workload *w)
+{
+    const uint64_t start = bench_now_ns();
+
+    unsigned long i;
+    for (i = 0; i < w->count; i++)
+        mqtta_dispatch_message(agent, w->topic[w->sequence[i]], "1", 1,
+                               0, false);
+
+    return (double)(bench_now_ns() - start) / w->count;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-t topics] [-n count] [-s exponent] [-w width] [-k top]\n"
+        "\t-t topics   distinct topics, default 100000\n"
+        "\t-n count    messages, default 2000000\n"
+        "\t-s exponent of the Zipf distribution, default 1.1\n"
+        "\t-w width    counters per sketch row, default 1024\n"
+        "\t-k top      length of the top list, default 16\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct workload w = { .topics = 100000, .count = 2000000 };
+    struct mqtta_topics_config config = { .width = 0 };
+    double s = 1.1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:s:w:k:")) != -1) {
+        switch (opt) {
+        case 't':
+            w.topics = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            w.count = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            s = atof(optarg);
+            break;
+        case 'w':
+            config.width = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            config.top = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!w.topics || (w.topics > UINT32_MAX) || !w.count || (s <= 0)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (create_workload(&w, s)) {
+        perror("calloc");
+        return -1;
+    }
+
+    unsigned long received = 0;
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    if (!agent ||
+        mosqagent_subscribe(agent, "site/#", 0, count_message, &received)) {
+        perror("mosqagent_init_agent");
+        return -1;
+    }
+
+    // warm up the topic strings in the cache
+    run(agent, &w);
+    const double plain_ns = run(agent, &w);
+
+    if (mosqagent_track_topics(agent, &config)) {
+        perror("mosqagent_track_topics");
+        return -1;
+    }
+    const double tracked_ns = run(agent, &w);
+
+    printf("%lu messages on %lu topics, Zipf exponent %.2f\n\n",
+           w.count, w.topics, s);
+    printf("dispatch       %8.1f ns/message\n", plain_ns);
+    printf("with tracking  %8.1f ns/message (+%.1f ns)\n\n",
+           tracked_ns, tracked_ns - plain_ns);
+
+    // only the last run was tracked
+    struct mqtta_topics_stats stats;
+    mosqagent_topic_stats(agent, &stats);
+
+    unsigned long distinct = 0;
+    unsigned long i;
+    for (i = 0; i < w.topics; i++)
+        if (w.exact[i])
+            distinct++;
+    printf("distinct topics %lu, estimated %lu (%+.2f%%)\n", distinct,
+           (unsigned long)stats.distinct,
+           100.0 * ((double)stats.distinct - distinct) / distinct);
+    printf("count error bound %lu\n\n", (unsigned long)stats.error);
+
+    // topics are numbered by rank, so the top list should be 0, 1, ...
+    const unsigned int k = config.top ? config.top : 16;
+    struct mqtta_topic_count *top = calloc(k, sizeof(*top));
+    const int n = top ? mosqagent_top_topics(agent, top, k) : -1;
+    int hits = 0;
+
+    printf("%-32s %10s %10s\n", "topic", "estimate", "exact");
+    int j;
+    for (j = 0; j < n; j++) {
+        unsigned long site, index;
+        sscanf(top[j].topic, "site/%lu/sensor/%lu/", &site, &index);
+        if (index < k)
+            hits++;
+        printf("%-32s %10lu %10lu\n", top[j].topic,
+               (unsigned long)top[j].count,
+               (unsigned long)w.exact[index]);
+    }
+    printf("\n%d of the %u busiest topics found\n", hits, k);
+
+    free(top);
+    mosqagent_close_agent(agent);
+    free(w.topic);
+    free(w.sequence);
+    free(w.exact);
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Helpers shared by the benchmarks
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtta-bench.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_sleep_ns(const uint64_t ns)
+{
+    struct timespec ts = {
+        .tv_sec = ns / 1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
+    while (nanosleep(&ts, &ts) && (errno == EINTR))
+        ;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted,
+                            const unsigned long n,
+                            const double p)
+{
+    unsigned long i = (unsigned long)(p / 100.0 * n);
+    if (i >= n)
+        i = n - 1;
+
+    return sorted[i] / 1000.0;
+}
+
+void bench_print_header(void)
+{
+    printf("%-10s %8s %9s %9s %9s %9s %9s\n", "mode", "received",
+           "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+}
+
+void bench_print_latency(const char *name,
+                         uint64_t *latency_ns,
+                         const unsigned long n)
+{
+    if (!n) {
+        printf("%-10s no messages received\n", name);
+        return;
+    }
+
+    qsort(latency_ns, n, sizeof(*latency_ns), cmp_u64);
+    printf("%-10s %8lu %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, n,
+           percentile_us(latency_ns, n, 50.0),
+           percentile_us(latency_ns, n, 90.0),
+           percentile_us(latency_ns, n, 99.0),
+           percentile_us(latency_ns, n, 99.9),
+           latency_ns[n - 1] / 1000.0);
+}
@@ -0,0 +1,36 @@
+/*******************************************************************//**
+ * \file		mqtta-bench.h
+ *
+ * \brief		Helpers shared by the benchmarks.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * \brief Monotonic time in nanoseconds.
+ */
+uint64_t bench_now_ns(void);
+
+/**
+ * \brief Sleep, also across signals.
+ */
+void bench_sleep_ns(uint64_t ns);
+
+/**
+ * \brief Print the header for `bench_print_latency`.
+ */
+void bench_print_header(void);
+
+/**
+ * \brief Sort the latencies and print count and percentiles in µs.
+ */
+void bench_print_latency(const char *name,
+                         uint64_t *latency_ns,
+                         unsigned long n);
@@ -21,13 +21,29 @@ int mqtt_init(const char* clientname,
 	      struct mosquitto **mosq,
 	      void *mqtt_obj);
 
+int mqtt_set_protocol(struct mosquitto *mosq,
+                      int version);
+
 int mqtt_connect(struct mosquitto *mosq,
                  const char* host,
                  int port,
                  int retries);
 
+int mqtt_connect_v5(struct mosquitto *mosq,
+                    const char* host,
+                    int port,
+                    int retries,
+                    const mosquitto_property *props);
+
 int mqtt_loop(struct mosquitto *mosq);
 
+int mqtt_loop_wait(struct mosquitto *mosq,
+                   int timeout);
+
+int mqtt_loop_events(struct mosquitto *mosq,
+                     bool readable,
+                     bool writable);
+
 int mqtt_close(struct mosquitto *mosq);
 
 int mqtt_publish(struct mosquitto *mosq,
@@ -37,3 +53,44 @@ int mqtt_publish(struct mosquitto *mosq,
 		 const char* payload,
 		 int qos,
 		 bool retain);
+
+int mqtt_publish_v5(struct mosquitto *mosq,
+		    int* mid,
+		    const char* topic,
+		    int payloadlen,
+		    const void* payload,
+		    int qos,
+		    bool retain,
+		    const mosquitto_property *props);
+
+int mqtt_subscribe(struct mosquitto *mosq,
+		   int* mid,
+		   const char* sub,
+		   int qos);
+
+int mqtt_subscribe_multiple(struct mosquitto *mosq,
+			    int* mid,
+			    int count,
+			    char *const *const subs,
+			    int qos);
+
+int mqtt_unsubscribe(struct mosquitto *mosq,
+		     int* mid,
+		     const char* sub);
+
+int mqtt_set_tls(struct mosquitto *mosq,
+		 const char* cafile,
+		 const char* capath,
+		 const char* certfile,
+		 const char* keyfile,
+		 const char* version,
+		 const char* ciphers,
+		 bool insecure);
+
+int mqtt_set_tls_psk(struct mosquitto *mosq,
+		     const char* psk,
+		     const char* identity,
+		     const char* ciphers);
+
+int mqtt_set_ssl_ctx(struct mosquitto *mosq,
+		     void *ssl_ctx);
@@ -0,0 +1,144 @@
+/*******************************************************************//**
+ * \file		mqtta-aggregate.h
+ *
+ * \brief		Windowed aggregation of numeric message streams
+ *
+ * An aggregator subscribes to a topic filter, parses each payload as a
+ * number and keeps per-topic statistics over tumbling or sliding windows.
+ * When a window closes, the summary is published on a derived topic as
+ * JSON object:
+ *
+ *     {"count":..,"min":..,"max":..,"mean":..,"last":..,"p50":..,"p90":..,"p99":..}
+ *
+ * Memory per topic is fixed: percentiles are estimated with a log-bucket
+ * histogram sketch with about 3% relative error. The sketch takes about
+ * 6 KiB per pane, so a topic needs 6 KiB with tumbling windows and up to
+ * 100 KiB with 16 panes; size `max_topics` accordingly. A topic that had no
+ * values for a whole window is dropped until its next value.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mqtt-tools/mqtta.h>
+
+/** Maximum number of panes (window / slide) of a sliding window */
+#define MQTTA_AGGREGATE_MAX_PANES   16
+
+/** Default for the maximum number of topics of an aggregator, up to 6 MiB */
+#define MQTTA_AGGREGATE_DEFAULT_TOPICS  64
+
+struct mqtta_aggregator;
+
+enum mqtta_window_type {
+    /** Non-overlapping windows, one result per window */
+    MQTTA_WINDOW_TUMBLING,
+    /** Overlapping windows, one result per slide interval */
+    MQTTA_WINDOW_SLIDING,
+};
+
+/**
+ * \brief Summary of a topic's values over one window.
+ */
+struct mqtta_aggregate {
+    unsigned long count;
+    double min;
+    double max;
+    double mean;
+    double last;
+    double p50;
+    double p90;
+    double p99;
+};
+
+/**
+ * \brief Called for each topic when its window closes, before publishing.
+ */
+typedef void (*mqtta_aggregate_callback)(struct mosqagent *agent,
+                                         const char *topic,
+                                         const struct mqtta_aggregate *result,
+                                         void *callback_data);
+
+/**
+ * \brief Aggregator settings
+ */
+struct mqtta_aggregate_config {
+    /** Topic filter to subscribe to */
+    const char *filter;
+    /** Appended to a topic to get its result topic, `NULL` for "/aggregate" */
+    const char *suffix;
+    enum mqtta_window_type type;
+    /** Window length */
+    unsigned int window_ms;
+    /** Sliding windows only: result interval, must divide `window_ms` */
+    unsigned int slide_ms;
+    /** QoS for subscription and results */
+    int qos;
+    /**
+     * Maximum number of topics, 0 for `MQTTA_AGGREGATE_DEFAULT_TOPICS`.
+     * Values of further topics are dropped until others have been idle
+     * for a window.
+     */
+    unsigned int max_topics;
+    bool retain;
+    /** Do not publish, only call the callback */
+    bool no_publish;
+    /** Optional result callback */
+    mqtta_aggregate_callback callback;
+    void *callback_data;
+};
+
+/**
+ * \brief Create an aggregator on the agent.
+ *
+ * Subscribes to the filter and adds a timer for closing windows. The
+ * configuration is copied.
+ *
+ * \returns the aggregator or `NULL` with errno set.
+ */
+struct mqtta_aggregator* mqtta_aggregator_create(struct mosqagent *agent,
+                                                 const struct mqtta_aggregate_config *config);
+
+/**
+ * \brief Add a value for a topic to the current window.
+ *
+ * Incoming messages are added automatically, use this for values from
+ * other sources.
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`EINVAL` if the
+ *          value is not finite, `ENOSPC` if the topic is new and the
+ *          aggregator has `max_topics` already).
+ */
+int mqtta_aggregator_add(struct mqtta_aggregator *agg,
+                         const char *topic,
+                         double value);
+
+/**
+ * \brief Get the summary of the currently open window for a topic.
+ *
+ * \returns 0 on success, -1 with errno `ENOENT` if the topic is unknown.
+ */
+int mqtta_aggregator_peek(struct mqtta_aggregator *agg,
+                          const char *topic,
+                          struct mqtta_aggregate *result);
+
+/**
+ * \brief Close the current window of all topics now.
+ *
+ * This is what the aggregator's timer calls.
+ */
+void mqtta_aggregator_close_window(struct mqtta_aggregator *agg);
+
+/**
+ * \brief Cancel the timer, remove the subscription and free the aggregator.
+ *
+ * Must not be called from a message handler.
+ */
+void mqtta_aggregator_dispose(struct mqtta_aggregator *agg);
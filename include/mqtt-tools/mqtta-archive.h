@@ -0,0 +1,160 @@
+/*******************************************************************//**
+ * \file		mqtta-archive.h
+ *
+ * \brief		Append-only message archive
+ *
+ * An archive is a directory of files, one per time partition (an hour by
+ * default). Each file is a sequence of blocks, and each block holds the
+ * messages of a short period with a dictionary of their topics, so that a
+ * topic is stored once per block. Blocks are compressed with deflate if
+ * the library is built with zlib.
+ *
+ * Writing is done by a thread of the archive: `mqtta_archive_write` only
+ * copies the message into a lock-free queue. The writer thread commits in
+ * groups, with one `fdatasync` per commit period or commit size, whichever
+ * comes first. Messages of the last commit period may be lost on a crash.
+ *
+ * Readers map the files and skip partitions and blocks outside of the
+ * requested time range by their headers.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** File name suffix of the partitions */
+#define MQTTA_ARCHIVE_SUFFIX        ".mqlog"
+
+struct mqtta_archive;
+struct mqtta_archive_reader;
+
+/**
+ * \brief Archive settings, zero values select the defaults.
+ */
+struct mqtta_archive_config {
+    /** Directory of the archive, must exist */
+    const char *dir;
+    /** Length of a partition in seconds, default 3600 */
+    unsigned int partition_s;
+    /** Uncompressed size of a block in bytes, default 64 KiB */
+    size_t block_size;
+    /** Commit at least every this many milliseconds, default 1000 */
+    unsigned int commit_ms;
+    /** Commit after this many bytes, default 4 MiB */
+    size_t commit_bytes;
+    /** Size of the queue to the writer thread, default 8 MiB */
+    size_t queue_size;
+    /** Deflate level 1 to 9, default 6, -1 to store uncompressed */
+    int level;
+};
+
+struct mqtta_archive_stats {
+    /** Messages written to disk */
+    unsigned long written;
+    /** Messages dropped because the queue was full */
+    unsigned long dropped;
+    unsigned long blocks;
+    /** Bytes written to disk */
+    uint64_t bytes;
+    /** Calls to fdatasync */
+    unsigned long commits;
+};
+
+/**
+ * \brief A message read from an archive.
+ *
+ * Topic and payload are `\0`-terminated and valid until the next call to
+ * `mqtta_archive_reader_next`.
+ */
+struct mqtta_archive_record {
+    /** CLOCK_REALTIME in nanoseconds */
+    uint64_t timestamp_ns;
+    int qos;
+    bool retain;
+    const char *topic;
+    const char *payload;
+    int payloadlen;
+};
+
+/**
+ * \brief Open an archive for writing and start its writer thread.
+ *
+ * A partition that exists already is continued, after cutting off a block
+ * that was not written completely.
+ *
+ * \returns the archive or `NULL` with errno set.
+ */
+struct mqtta_archive* mqtta_archive_open(const struct mqtta_archive_config *config);
+
+/**
+ * \brief Queue a message for the archive.
+ *
+ * Must be called from one thread only, usually the agent loop.
+ *
+ * \param timestamp_ns CLOCK_REALTIME in nanoseconds, 0 for now
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`EAGAIN` if the
+ *          queue is full; the message is counted as dropped).
+ */
+int mqtta_archive_write(struct mqtta_archive *archive,
+                        uint64_t timestamp_ns,
+                        const char *topic,
+                        const void *payload,
+                        int payloadlen,
+                        int qos,
+                        bool retain);
+
+/**
+ * \brief Get the statistics while the archive is open.
+ *
+ * The writer thread may still have messages queued; the final numbers come
+ * from `mqtta_archive_close`.
+ */
+void mqtta_archive_stats(const struct mqtta_archive *archive,
+                         struct mqtta_archive_stats *stats);
+
+/**
+ * \brief Write and commit the queued messages, stop the writer thread and
+ *        close the archive.
+ *
+ * \param stats is set to the final statistics, after the last commit; may
+ *              be `NULL`
+ *
+ * \returns 0 on success, -1 with errno set if writing failed at some
+ *          point.
+ */
+int mqtta_archive_close(struct mqtta_archive *archive,
+                        struct mqtta_archive_stats *stats);
+
+/**
+ * \brief Open an archive for a scan of a time range.
+ *
+ * \param from_ns first time stamp to read, CLOCK_REALTIME in nanoseconds
+ * \param to_ns last time stamp to read, `UINT64_MAX` for all
+ *
+ * \returns the reader or `NULL` with errno set.
+ */
+struct mqtta_archive_reader* mqtta_archive_reader_open(const char *dir,
+                                                       uint64_t from_ns,
+                                                       uint64_t to_ns);
+
+/**
+ * \brief Read the next message in the time range.
+ *
+ * Messages come in the order they were written.
+ *
+ * \returns 1 if a message was read, 0 at the end and -1 with errno set on a
+ *          corrupt file (`ENOTSUP` for compressed blocks in a build without
+ *          zlib).
+ */
+int mqtta_archive_reader_next(struct mqtta_archive_reader *reader,
+                              struct mqtta_archive_record *record);
+
+void mqtta_archive_reader_close(struct mqtta_archive_reader *reader);
@@ -0,0 +1,89 @@
+/*******************************************************************//**
+ * \file		mqtta-histogram.h
+ *
+ * \brief		High dynamic range histograms
+ *
+ * A histogram covers the values from `lowest` to `highest` with a fixed
+ * number of significant decimal digits, in the layout of HdrHistogram:
+ * each power of two is split into the same number of linear buckets.
+ * Recording is a few instructions without allocation, so histograms can be
+ * used on hot paths. They are not thread-safe, use one per thread and add
+ * them up for the results.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct mqtta_histogram;
+
+/**
+ * \brief Create an empty histogram.
+ *
+ * \param lowest smallest value that can be told apart from 0, at least 1
+ * \param highest largest value, at least twice `lowest`
+ * \param digits significant decimal digits, 1 to 5
+ *
+ * \returns the histogram or `NULL` with errno set.
+ */
+struct mqtta_histogram* mqtta_histogram_create(uint64_t lowest,
+                                               uint64_t highest,
+                                               int digits);
+
+void mqtta_histogram_destroy(struct mqtta_histogram *histogram);
+
+/**
+ * \brief Record a value; values above `highest` are recorded as `highest`.
+ */
+void mqtta_histogram_record(struct mqtta_histogram *histogram,
+                            uint64_t value);
+
+/**
+ * \brief Add the values of `src` to `dst`.
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`EINVAL` if the
+ *          histograms were created with different ranges).
+ */
+int mqtta_histogram_add(struct mqtta_histogram *dst,
+                        const struct mqtta_histogram *src);
+
+void mqtta_histogram_reset(struct mqtta_histogram *histogram);
+
+uint64_t mqtta_histogram_count(const struct mqtta_histogram *histogram);
+
+/** \brief Smallest recorded value, 0 if empty */
+uint64_t mqtta_histogram_min(const struct mqtta_histogram *histogram);
+
+/** \brief Largest recorded value, 0 if empty */
+uint64_t mqtta_histogram_max(const struct mqtta_histogram *histogram);
+
+double mqtta_histogram_mean(const struct mqtta_histogram *histogram);
+
+/**
+ * \brief Value at a percentile (0 to 100).
+ *
+ * \returns the largest value that is equivalent to the recorded ones at the
+ *          percentile, 0 if empty.
+ */
+uint64_t mqtta_histogram_value_at(const struct mqtta_histogram *histogram,
+                                  double percentile);
+
+/**
+ * \brief Print the percentile distribution.
+ *
+ * The output has the format of HdrHistogram's `outputPercentileDistribution`
+ * and can be plotted with its tools.
+ *
+ * \param scale the values are divided by this, e.g. 1000 for ns to µs
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mqtta_histogram_print(const struct mqtta_histogram *histogram,
+                          FILE *file,
+                          double scale);
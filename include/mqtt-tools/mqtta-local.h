@@ -0,0 +1,91 @@
+/*******************************************************************//**
+ * \file		mqtta-local.h
+ *
+ * \brief		Shared-memory transport between agents on one host
+ *
+ * Agents that join the same local group exchange messages on their local
+ * topics through shared memory instead of the broker. Each member has an
+ * inbound ring, which all other members write to; a sleeping member is
+ * woken through a datagram socket, so its loop can wait for the broker and
+ * the ring at the same time.
+ *
+ * A message is delivered locally if its topic matches a local topic filter
+ * of both the sender and the receiver. With mirroring, it is also published
+ * to the broker, marked with the group name, so that the local members do
+ * not receive it twice; the marker is a user property, so with older
+ * protocol versions members that also subscribe at the broker get the
+ * message twice. Messages with MQTT v5 properties (e.g. requests) and
+ * messages too large for the ring always go through the broker.
+ *
+ * If a member's ring is full, a message with QoS 0 is dropped for that
+ * member and counted (see `mosqagent_local_dropped`). Sending a message
+ * with QoS 1 or 2 fails with `EAGAIN` instead; the other members have it
+ * already, so that a retry may deliver it to them twice, as with QoS 1.
+ *
+ * Linux only: the rings are POSIX shared memory objects, the wake-up
+ * sockets live in the abstract unix socket namespace.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mqtt-tools/mqtta.h>
+
+/** Name prefix of the shared memory objects, followed by the group name */
+#define MQTTA_LOCAL_SHM_PREFIX      "/mqtta."
+
+#define MQTTA_LOCAL_MAX_MEMBERS     16
+#define MQTTA_LOCAL_MAX_TOPICS      8
+#define MQTTA_LOCAL_TOPIC_LEN       128
+
+/** Size of each member's inbound ring in bytes */
+#define MQTTA_LOCAL_RING_SIZE       (1 << 20)
+
+/** User property that marks mirrored messages, value is the group name */
+#define MQTTA_LOCAL_PROPERTY        "mqtta-local"
+
+/**
+ * \brief Join a local group.
+ *
+ * Also done on MQTT setup if `mosqagent.local.group` is configured.
+ *
+ * \param group name of the group, a single topic level
+ * \param mirror also publish local messages to the broker
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`EBUSY` if the group
+ *          is full).
+ */
+int mosqagent_local_join(struct mosqagent *agent,
+                         const char *group,
+                         bool mirror);
+
+/**
+ * \brief Declare a topic filter as local.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_local_topic(struct mosqagent *agent,
+                          const char *filter);
+
+/**
+ * \brief Dispatch the messages waiting in the agent's ring.
+ *
+ * Called by `mosqagent_idle`, only needed for agents with their own loop.
+ * Handlers see topic and payload in the shared memory ring.
+ *
+ * \returns the number of messages, -1 with errno set on error.
+ */
+int mosqagent_local_poll(struct mosqagent *agent);
+
+/**
+ * \brief Number of messages for this agent that did not fit its ring, lost
+ *        with QoS 0 or failed for the sender with QoS 1 and 2.
+ */
+uint64_t mosqagent_local_dropped(const struct mosqagent *agent);
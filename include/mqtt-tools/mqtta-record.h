@@ -0,0 +1,119 @@
+/*******************************************************************//**
+ * \file		mqtta-record.h
+ *
+ * \brief		Binary traffic recorder and reader
+ *
+ * A record log is an append-only file of length-prefixed records: one per
+ * inbound or outbound message with time stamp, topic, QoS, retain flag and
+ * payload. Every MQTTA_RECORD_INDEX_INTERVAL messages an index block with
+ * the offsets of the preceding messages is written, so that readers can
+ * seek without scanning. The file is written and read through `mmap`.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mqtt-tools/mqtta.h>
+
+#define MQTTA_RECORD_INDEX_INTERVAL     1024
+
+struct mqtta_recorder;
+struct mqtta_record_reader;
+
+enum mqtta_record_direction {
+    MQTTA_RECORD_INBOUND    = 0,
+    MQTTA_RECORD_OUTBOUND   = 1,
+};
+
+/**
+ * \brief A message read from a record log.
+ *
+ * Topic and payload point into the mapped file and are `\0`-terminated.
+ * They are valid until the reader is closed.
+ */
+struct mqtta_record {
+    /** CLOCK_REALTIME in nanoseconds */
+    uint64_t timestamp_ns;
+    enum mqtta_record_direction direction;
+    int qos;
+    bool retain;
+    const char *topic;
+    const char *payload;
+    int payloadlen;
+};
+
+/**
+ * \brief Open a record log for appending, create it if needed.
+ *
+ * \returns the recorder or `NULL` with errno set.
+ */
+struct mqtta_recorder* mqtta_recorder_open(const char *path);
+
+/**
+ * \brief Append a message to the log.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mqtta_recorder_write(struct mqtta_recorder *rec,
+                         enum mqtta_record_direction direction,
+                         const char *topic,
+                         const void *payload,
+                         int payloadlen,
+                         int qos,
+                         bool retain);
+
+/**
+ * \brief Flush, trim the file to its content and close the log.
+ */
+void mqtta_recorder_close(struct mqtta_recorder *rec);
+
+/**
+ * \brief Record all messages the agent sends and receives.
+ *
+ * The log is closed with the agent. Recording is also enabled by the
+ * configuration setting `mosqagent.record`.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_record(struct mosqagent *agent, const char *path);
+
+/**
+ * \brief Open a record log for reading.
+ *
+ * \returns the reader or `NULL` with errno set.
+ */
+struct mqtta_record_reader* mqtta_record_reader_open(const char *path);
+
+/**
+ * \brief Read the next message.
+ *
+ * \returns 1 if a message was read, 0 at the end of the log and -1 with
+ *          errno set on a corrupt log.
+ */
+int mqtta_record_reader_next(struct mqtta_record_reader *reader,
+                             struct mqtta_record *record);
+
+/**
+ * \brief Skip to the first message at or after a time stamp.
+ *
+ * Uses the index blocks, so only the messages of one index interval are
+ * scanned.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mqtta_record_reader_seek(struct mqtta_record_reader *reader,
+                             uint64_t timestamp_ns);
+
+/**
+ * \brief Number of messages in the log.
+ */
+unsigned long mqtta_record_reader_count(const struct mqtta_record_reader *reader);
+
+void mqtta_record_reader_close(struct mqtta_record_reader *reader);
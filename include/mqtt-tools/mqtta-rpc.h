@@ -0,0 +1,83 @@
+/*******************************************************************//**
+ * \file		mqtta-rpc.h
+ *
+ * \brief		Request/response calls between agents
+ *
+ * Requests are published with the MQTT v5 properties response topic and
+ * correlation data. The responder publishes its answer to the response
+ * topic with the same correlation data, so the requester can match it to
+ * the pending request. All requests of an agent share one response topic,
+ * which is subscribed with the first request.
+ *
+ * This needs protocol version 5, see `mosqagent.broker.protocol`.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <mqtt-tools/mqtta.h>
+
+/** Topic prefix for the agents' response topics */
+#define MQTTA_RPC_TOPIC_PREFIX  "mqtta/rpc/"
+
+/**
+ * \brief Response callback
+ *
+ * Called exactly once for each request.
+ *
+ * \param status 0 if a response arrived, `ETIMEDOUT` if there was no
+ *               response in time and `ECANCELED` if the agent was closed
+ * \param response the response message, `NULL` unless status is 0; only
+ *                 valid during the callback
+ * \param ctx the pointer provided with the request
+ */
+typedef void (*mqtta_response_callback)(struct mosqagent *agent,
+                                        int status,
+                                        const struct mqtta_message *response,
+                                        void *ctx);
+
+/**
+ * \brief Publish a request and wait for the response asynchronously.
+ *
+ * The callback is run from the agent loop as soon as the response is
+ * received, or from the agent's timers on timeout. Any number of requests
+ * may be in flight. Requests are not subject to the agent's rate limits.
+ *
+ * \param qos QoS for the request and the response subscription
+ * \param timeout_ms time to wait for the response, must not be 0
+ *
+ * \returns 0 if the request has been sent, -1 with errno set otherwise. The
+ *          callback is not called if the request could not be sent.
+ */
+int mqtta_request(struct mosqagent *agent,
+                  const char *topic,
+                  const void *payload,
+                  int payloadlen,
+                  int qos,
+                  unsigned int timeout_ms,
+                  mqtta_response_callback callback,
+                  void *ctx);
+
+/**
+ * \brief Publish the response to a received request.
+ *
+ * Call this from the message handler, while the request is valid.
+ * Responses are not subject to the agent's rate limits.
+ *
+ * \returns 0 if the response has been sent, -1 with errno set otherwise;
+ *          errno is `EINVAL` if the message has no response topic.
+ */
+int mqtta_respond(struct mosqagent *agent,
+                  const struct mqtta_message *request,
+                  const void *payload,
+                  int payloadlen,
+                  int qos);
+
+/**
+ * \brief Number of requests waiting for a response.
+ */
+unsigned int mqtta_requests_pending(const struct mosqagent *agent);
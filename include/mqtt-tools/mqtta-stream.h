@@ -0,0 +1,189 @@
+/*******************************************************************//**
+ * \file		mqtta-stream.h
+ *
+ * \brief		Chunked streaming of large payloads
+ *
+ * A stream sends an object, e.g. a firmware image, as a sequence of chunk
+ * messages on one topic. Each chunk starts with a header that carries the
+ * stream id, the object size, the chunk's sequence number and a CRC-32C of
+ * the chunk; the last chunk also has the CRC-32C of the whole object. The
+ * header is part of the payload, so streams work with all protocol
+ * versions and through local groups.
+ *
+ * The sender reads from a memory-mapped file or from a producer callback
+ * and only has one chunk in memory. Sending is driven by the agent loop
+ * and limited to a window of chunks that libmosquitto has not completed
+ * yet: with QoS 0 until they are written to the socket, with QoS 1 and 2
+ * until the broker acknowledged them. Streams are not subject to the
+ * agent's rate limits and priority lanes.
+ *
+ * The receiver feeds the chunks into a reassembly, which writes them into
+ * a buffer of the caller or a memory-mapped file and checks both CRCs.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <mqtt-tools/mqtta.h>
+
+/** Size of the chunk header in front of the data */
+#define MQTTA_STREAM_HEADER_SIZE    40
+
+struct mqtta_reassembly;
+
+/**
+ * \brief Stream settings, zero values select the defaults.
+ */
+struct mqtta_stream_config {
+    /** Data bytes per chunk, without the header, default 64 KiB */
+    size_t chunk_size;
+    /** Chunks in flight, default 16 */
+    unsigned int window;
+    /** QoS of the chunks; streams with QoS 0 fail on a connection loss */
+    int qos;
+};
+
+/**
+ * \brief Completion callback of a stream
+ *
+ * Called exactly once for each stream that has been started.
+ *
+ * \param status 0 when all chunks have been completed, `ECANCELED` if the
+ *               stream was cancelled or the agent closed, `ECONNRESET` if
+ *               QoS 0 chunks were lost, or the error of the producer or
+ *               the client
+ * \param ctx the pointer provided with the stream
+ */
+typedef void (*mqtta_stream_callback)(struct mosqagent *agent,
+                                      uint64_t id,
+                                      int status,
+                                      void *ctx);
+
+/**
+ * \brief Producer of the data of a stream
+ *
+ * Called from the agent loop whenever the stream wants to send a chunk.
+ * The stream ends when the size given on start has been produced.
+ *
+ * \param buf where to write the data
+ * \param len the space left in buf, at most the rest of the object
+ *
+ * \returns the number of bytes written, 0 if there is no data yet, or -1
+ *          with errno set to abort the stream.
+ */
+typedef ssize_t (*mqtta_stream_producer)(struct mosqagent *agent,
+                                         void *buf,
+                                         size_t len,
+                                         void *ctx);
+
+/**
+ * \brief Stream a file.
+ *
+ * The file is mapped into memory and must not be truncated until the
+ * stream has completed.
+ *
+ * \param config the settings, `NULL` for the defaults
+ * \param id is set to the stream id, may be `NULL`
+ *
+ * \returns 0 if the stream has been started, -1 with errno set otherwise.
+ *          The callback is not called if the stream could not be started.
+ */
+int mqtta_stream_file(struct mosqagent *agent,
+                      const char *topic,
+                      const char *path,
+                      const struct mqtta_stream_config *config,
+                      mqtta_stream_callback callback,
+                      void *ctx,
+                      uint64_t *id);
+
+/**
+ * \brief Stream an object of known size from a producer.
+ *
+ * \returns 0 if the stream has been started, -1 with errno set otherwise.
+ *          The callback is not called if the stream could not be started.
+ */
+int mqtta_stream_produce(struct mosqagent *agent,
+                         const char *topic,
+                         uint64_t size,
+                         mqtta_stream_producer producer,
+                         const struct mqtta_stream_config *config,
+                         mqtta_stream_callback callback,
+                         void *ctx,
+                         uint64_t *id);
+
+/**
+ * \brief Stop a stream, its callback is called with `ECANCELED`.
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`ENOENT` if there is
+ *          no such stream).
+ */
+int mqtta_stream_cancel(struct mosqagent *agent, uint64_t id);
+
+/**
+ * \brief Number of streams that have not completed yet.
+ */
+unsigned int mqtta_streams_pending(const struct mosqagent *agent);
+
+/**
+ * \brief Reassemble into a buffer of the caller.
+ *
+ * \param capacity the size of the buffer; larger objects are refused
+ */
+struct mqtta_reassembly* mqtta_reassembly_buffer(void *buf, size_t capacity);
+
+/**
+ * \brief Reassemble into a file.
+ *
+ * The chunks are written into `<path>.part`, which is created with the
+ * object size from the first chunk and mapped into memory. It is renamed
+ * to path when the object is complete, and removed if the reassembly is
+ * destroyed before.
+ *
+ * \param max_size the largest object to accept; larger objects are refused
+ *                 before the file is created
+ */
+struct mqtta_reassembly* mqtta_reassembly_file(const char *path,
+                                               size_t max_size);
+
+/**
+ * \brief Add a received chunk.
+ *
+ * Call this from the message handler with the payload. The first chunk
+ * selects the stream; chunks of other streams are refused. Duplicates,
+ * e.g. after a reconnect with QoS 1, are ignored.
+ *
+ * \returns 1 if the object is complete and its checksum matches, 0 if
+ *          the chunk has been added or was a duplicate, -1 with errno set
+ *          otherwise: `EBADMSG` for an invalid chunk or a wrong object
+ *          checksum, `ESTALE` for a chunk of another stream, `EMSGSIZE`
+ *          if the object does not fit into the buffer.
+ */
+int mqtta_reassembly_feed(struct mqtta_reassembly *r,
+                          const void *payload,
+                          size_t len);
+
+struct mqtta_reassembly_status {
+    /** Stream id, 0 before the first chunk */
+    uint64_t id;
+    uint64_t size;
+    uint32_t chunks;
+    uint32_t received;
+    bool complete;
+};
+
+void mqtta_reassembly_status(const struct mqtta_reassembly *r,
+                             struct mqtta_reassembly_status *status);
+
+/**
+ * \brief Release the reassembly, the buffer stays with the caller.
+ */
+void mqtta_reassembly_destroy(struct mqtta_reassembly *r);
@@ -0,0 +1,154 @@
+/*******************************************************************//**
+ * \file		mqtta-task.h
+ *
+ * \brief		Tasks that wait for acknowledgements, responses and timers
+ *
+ * A task is a function that runs on its own stack in the agent thread and
+ * can wait in the middle of its work: for a publish to complete, for the
+ * response to a request or for some time to pass. While it waits, the
+ * agent loop goes on and runs the other tasks, so a sequence like publish,
+ * wait for the ack, send a request and wait for the response is written
+ * as plain code instead of a state machine in the private data.
+ *
+ * Tasks are cooperative: a task runs until it waits, yields or returns,
+ * and only one task runs at a time. They are run from an idle call of the
+ * agent loop. Stacks are mapped with a guard page below them and kept in a
+ * pool for the next tasks; the memory of a stack is only committed where
+ * it is used, so thousands of waiting tasks fit into one agent.
+ *
+ * The wait functions may only be called from a task of the same agent.
+ * Tasks must not call `mosqagent_idle` or `mosqagent_close_agent` and
+ * should keep large buffers off their stack.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <mqtt-tools/mqtta.h>
+
+/** Default stack size of a task */
+#define MQTTA_TASK_STACK_SIZE   (64 * 1024)
+
+/**
+ * \brief Task settings, zero values select the defaults.
+ */
+struct mqtta_task_config {
+    /** Stack size, at least 16 KiB, rounded up to pages */
+    size_t stack_size;
+    /** Stacks kept for the next tasks, default 64 */
+    unsigned int pool;
+};
+
+/**
+ * \brief Function of a task
+ *
+ * \param data the pointer provided with the task
+ */
+typedef void (*mqtta_task_function)(struct mosqagent *agent, void *data);
+
+/**
+ * \brief Change the task settings.
+ *
+ * \returns 0 on success, -1 with errno set otherwise; errno is `EBUSY` if
+ *          the agent has tasks already.
+ */
+int mqtta_task_configure(struct mosqagent *agent,
+                         const struct mqtta_task_config *config);
+
+/**
+ * \brief Start a task.
+ *
+ * The task is run from the next pass of the agent loop, tasks started
+ * together run in order. Each task runs to its end, also when the agent is
+ * closed; then all waits fail with `ECANCELED`.
+ *
+ * \returns 0 if the task has been started, -1 with errno set otherwise.
+ */
+int mqtta_task_spawn(struct mosqagent *agent,
+                     mqtta_task_function function,
+                     void *data);
+
+/**
+ * \brief Subscribe to a topic filter with a handler that runs as a task.
+ *
+ * Each message starts a task with a retained copy of the message (see
+ * `mqtta_message_retain`), which is valid until the handler returns.
+ * Messages that arrive while the tasks can not be started are dropped.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mqtta_task_subscribe(struct mosqagent *agent,
+                         const char *filter,
+                         int qos,
+                         mosqagent_message_handler handler,
+                         void *handler_data);
+
+/**
+ * \brief Let the other tasks and the agent loop run.
+ *
+ * \returns 0 when the task is continued, -1 with errno set otherwise.
+ */
+int mqtta_task_yield(struct mosqagent *agent);
+
+/**
+ * \brief Wait for some time.
+ *
+ * Backed by the agent's timers, with their resolution.
+ *
+ * \returns 0 after the time, -1 with errno set otherwise.
+ */
+int mqtta_task_sleep(struct mosqagent *agent, unsigned int ms);
+
+/**
+ * \brief Publish a message and wait until the client completed it.
+ *
+ * With QoS 0 the message is complete when it was written to the socket,
+ * with QoS 1 and 2 when the broker acknowledged it, and at once when it
+ * was delivered in the local group. The message is not subject to the
+ * agent's rate limits and priority lanes.
+ *
+ * \param timeout_ms time to wait for the completion, 0 for no limit
+ *
+ * \returns 0 when the message is complete, -1 with errno set otherwise;
+ *          errno is `ETIMEDOUT` on timeout and `ECONNRESET` if a QoS 0
+ *          message was lost with the connection.
+ */
+int mqtta_task_publish(struct mosqagent *agent,
+                       const struct mqtta_message *msg,
+                       unsigned int timeout_ms);
+
+/**
+ * \brief Send a request and wait for the response.
+ *
+ * See `mqtta_request` in mqtta-rpc.h.
+ *
+ * \param response is set to a retained copy of the response message, free
+ *                 it with `mqtta_mo_free`; may be `NULL`
+ *
+ * \returns 0 when the response arrived, -1 with errno set otherwise;
+ *          errno is `ETIMEDOUT` if there was no response in time.
+ */
+int mqtta_task_request(struct mosqagent *agent,
+                       const char *topic,
+                       const void *payload,
+                       int payloadlen,
+                       int qos,
+                       unsigned int timeout_ms,
+                       struct mqtta_memory_object *response);
+
+/**
+ * \brief Check if the caller runs in a task of the agent.
+ */
+bool mqtta_in_task(const struct mosqagent *agent);
+
+/**
+ * \brief Number of tasks that have not returned yet.
+ */
+unsigned int mqtta_tasks_pending(const struct mosqagent *agent);
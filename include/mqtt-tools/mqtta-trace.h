@@ -0,0 +1,139 @@
+/*******************************************************************//**
+ * \file		mqtta-trace.h
+ *
+ * \brief		End-to-end latency tracing
+ *
+ * With tracing enabled, an agent stamps each message it publishes to the
+ * broker with three MQTT v5 user properties: the source name, a sequence
+ * number per topic and the send time. A tracing agent that receives such a
+ * message records the latency from the send time to its handlers in a
+ * histogram per topic and counts gaps in the sequence numbers. With older
+ * protocol versions, messages are sent without stamps and only the loop
+ * spans are recorded.
+ *
+ * The send time is taken from CLOCK_REALTIME, so latencies between hosts
+ * are only as good as their clock synchronisation.
+ *
+ * Topics and the sources per topic are limited, see `mqtta_trace_limit`.
+ * Messages on further topics are sent without stamps and not recorded,
+ * those of further sources are recorded without checking their sequence.
+ *
+ * The agent loop also records its phases (timers, idle calls, network and
+ * dispatch) as spans, which can be written as Chrome trace JSON to be
+ * viewed in `chrome://tracing` or Perfetto.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+#include <mqtt-tools/mqtta.h>
+
+/** User property names of the trace stamps */
+#define MQTTA_TRACE_SOURCE      "mqtta-src"
+#define MQTTA_TRACE_SEQUENCE    "mqtta-seq"
+#define MQTTA_TRACE_TIMESTAMP   "mqtta-ts"
+
+/** Number of loop spans kept for the trace dump */
+#define MQTTA_TRACE_SPANS       65536
+
+/** Default for the maximum number of traced topics */
+#define MQTTA_TRACE_DEFAULT_TOPICS      4096
+/** Default for the maximum number of sources per topic */
+#define MQTTA_TRACE_DEFAULT_SOURCES     64
+
+/**
+ * \brief Latency statistics of one topic
+ *
+ * Latencies are in microseconds, percentiles are exact to 1/8 of their
+ * order of magnitude.
+ */
+struct mqtta_trace_stats {
+    uint64_t count;
+    /** number of gaps in the sequence, and messages missing in them */
+    uint64_t gaps;
+    uint64_t lost;
+    /** messages with a sequence number that was already seen */
+    uint64_t duplicates;
+
+    uint64_t min_us;
+    uint64_t max_us;
+    double mean_us;
+    uint64_t p50_us;
+    uint64_t p90_us;
+    uint64_t p99_us;
+};
+
+/**
+ * \brief Enable tracing.
+ *
+ * Also done on MQTT setup if `mosqagent.trace` is configured.
+ *
+ * \param source name in the stamps, `NULL` for the client name
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_trace(struct mosqagent *agent, const char *source);
+
+/**
+ * \brief Limit the number of traced topics and sources per topic.
+ *
+ * Also done on MQTT setup if `mosqagent.trace.max_topics` or `max_sources`
+ * are configured. Topics and sources already traced are kept.
+ *
+ * \param max_topics maximum number of topics, 0 for
+ *                   `MQTTA_TRACE_DEFAULT_TOPICS`
+ * \param max_sources maximum number of sources per topic, 0 for
+ *                    `MQTTA_TRACE_DEFAULT_SOURCES`
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`EINVAL` if tracing
+ *          is not enabled).
+ */
+int mqtta_trace_limit(struct mosqagent *agent,
+                      unsigned int max_topics,
+                      unsigned int max_sources);
+
+/**
+ * \brief Get the number of messages over the limits.
+ *
+ * Counts messages on topics over the topic limit, which were not stamped
+ * or recorded, and received messages of sources over the source limit,
+ * whose sequence was not checked.
+ */
+uint64_t mqtta_trace_overflow(const struct mosqagent *agent);
+
+/**
+ * \brief Get the latency statistics of a received topic.
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`ENOENT` if no traced
+ *          message was received on the topic).
+ */
+int mqtta_trace_stats(const struct mosqagent *agent,
+                      const char *topic,
+                      struct mqtta_trace_stats *stats);
+
+typedef void (*mqtta_trace_stats_callback)(const char *topic,
+                                           const struct mqtta_trace_stats *stats,
+                                           void *data);
+
+/**
+ * \brief Call back with the statistics of each received topic.
+ */
+void mqtta_trace_foreach(const struct mosqagent *agent,
+                         mqtta_trace_stats_callback callback,
+                         void *data);
+
+/**
+ * \brief Write the recorded loop spans as Chrome trace JSON.
+ *
+ * Only the last MQTTA_TRACE_SPANS spans are kept. The trace is also
+ * written on close if `mosqagent.trace.dump` is configured.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mqtta_trace_dump(const struct mosqagent *agent, const char *path);
@@ -14,12 +14,31 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 
 #define MQTTA_ERR_CONFIG_READ_FAILED        1
 #define MQTTA_ERR_CONFIG_NO_CLIENTNAME      2
+#define MQTTA_ERR_CONFIG_INVALID            3
 
 struct mosqagent_idle_list;
+struct mosqagent_sub_list;
+struct mqtta_timer_wheel;
+struct mqtta_ratelimit;
+struct mqtta_recorder;
+struct mqtta_rpc;
+struct mqtta_local;
+struct mqtta_trace;
+struct mqtta_message_ref;
+struct mqtta_lanes;
+struct mqtta_loop;
+struct mqtta_watchdog;
+struct mqtta_tls;
+struct mqtta_streams;
+struct mqtta_topics;
+struct mqtta_tasks;
+struct mqtta_histogram;
 struct mosqagent_config;
 
 
@@ -36,8 +55,8 @@ struct mosqagent_config;
  * pointers of if clean-up is handled somewhere else.
  *
  * \note The de-allocator is also responsible for cleaning up the pointed-to
- * memory. The pendant for `malloc`-created objects would be a pointer to
- * `free`.
+ * memory. The pendant for `mqtta_malloc`-created objects would be a pointer
+ * to `mqtta_free`, for `malloc`-created objects to `free`.
  */
 typedef void (mqtta_mo_deallocator)(void*);
 
@@ -75,8 +94,8 @@ void* mqtta_mo_ptr(const struct mqtta_memory_object *mo);
  *
  * \note Provding a `NULL` de-allocator is equivalent to not transferring
  *       ownership, i.e. the memory object will not be freed.
- * \note Provide `free` as the standard de-allocator for `malloc`-created
- *       objects.
+ * \note Provide `mqtta_free` as the standard de-allocator for objects
+ *       from `mqtta_malloc`.
  */
 struct mqtta_memory_object* mqtta_mo_move(struct mqtta_memory_object *mo,
                                           void *ptr,
@@ -111,21 +130,245 @@ struct mqtta_memory_object* mqtta_mo_set(struct mqtta_memory_object *mo,
 void mqtta_mo_free(struct mqtta_memory_object *mo);
 
 
+/**
+ * \brief Allocator interface
+ *
+ * All heap memory of the library is taken from an allocator: an agent's
+ * objects from the agent's allocator, everything else (e.g. messages from
+ * `mqtta_create_message`) from the global one. Both default to `malloc`.
+ *
+ * Sizes are passed back on `realloc` and `free`, so an allocator does not
+ * have to track them. `realloc` may be `NULL`, the library then allocates,
+ * copies and frees instead. An allocator must stay valid until all its
+ * memory has been freed.
+ */
+struct mqtta_allocator {
+    void* (*alloc)(void *ctx, size_t size);
+    void* (*realloc)(void *ctx, void *ptr, size_t old_size, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+};
+
+/**
+ * \brief Set the global allocator.
+ *
+ * Memory is always returned to the allocator it came from, so this may be
+ * called at any time, but not concurrently with other library calls.
+ *
+ * \param allocator the allocator, `NULL` for `malloc`
+ */
+void mqtta_set_allocator(const struct mqtta_allocator *allocator);
+
+const struct mqtta_allocator* mqtta_get_allocator(void);
+
+/**
+ * \brief Allocate memory from an allocator.
+ *
+ * \param allocator the allocator, `NULL` for the global one
+ *
+ * \returns the memory or `NULL` with errno set.
+ */
+void* mqtta_malloc(const struct mqtta_allocator *allocator, size_t size);
+
+/**
+ * \brief Allocate zeroed memory for `n` elements from an allocator.
+ */
+void* mqtta_calloc(const struct mqtta_allocator *allocator,
+                   size_t n,
+                   size_t size);
+
+/**
+ * \brief Copy a string to memory from an allocator.
+ */
+char* mqtta_strdup(const struct mqtta_allocator *allocator, const char *s);
+
+/**
+ * \brief Resize memory from `mqtta_malloc`, keeping its allocator.
+ *
+ * \returns the memory or `NULL` with errno set, `ptr` is still valid then.
+ */
+void* mqtta_realloc(void *ptr, size_t size);
+
+/**
+ * \brief Free memory from `mqtta_malloc` (or `NULL`).
+ *
+ * Usable as de-allocator for memory objects.
+ */
+void mqtta_free(void *ptr);
+
+/**
+ * \brief Allocator that counts the live bytes of a parent allocator
+ *
+ * Give each agent its own accounting allocator to see its memory use. The
+ * counters include a small per-allocation overhead and are updated
+ * atomically, so messages may be released from other threads.
+ */
+struct mqtta_accounting {
+    /** The allocator to hand to the library */
+    struct mqtta_allocator allocator;
+
+    const struct mqtta_allocator *parent;
+    /** Limit for the live bytes, 0 for none */
+    size_t cap;
+
+    size_t live;
+    size_t peak;
+    /** Allocations refused because of the cap */
+    unsigned long refused;
+};
+
+/**
+ * \brief Initialize an accounting allocator.
+ *
+ * \param parent the allocator that provides the memory, `NULL` for `malloc`
+ * \param cap limit for the live bytes, 0 for none; allocations beyond fail
+ *            with `ENOMEM`
+ */
+void mqtta_accounting_init(struct mqtta_accounting *accounting,
+                           const struct mqtta_allocator *parent,
+                           size_t cap);
+
+
+/**
+ * \brief What an idle call has left to do
+ */
+enum mqtta_idle_status {
+    /** Nothing until the next loop iteration */
+    MQTTA_IDLE_DONE = 0,
+    /** More work pending: call again right after a non-blocking poll of
+     *  the network */
+    MQTTA_IDLE_YIELD,
+    /** The call failed, `error` has the errno */
+    MQTTA_IDLE_ERROR,
+};
+
+/**
+ * \brief Result of an idle call, `NULL` is the same as done.
+ */
+struct mosqagent_result {
+    enum mqtta_idle_status status;
+    int error;
+};
+
+/**
+ * \brief Connection statistics of an agent
+ *
+ * The agent is ready when the broker has acknowledged its subscriptions
+ * after a connect, or right away if the broker resumed its session.
+ */
+struct mqtta_connection_stats {
+    /** Successful connects, including the first one */
+    unsigned long connects;
+    /** Connects where the broker resumed the session, without a restore */
+    unsigned long resumed;
+    /** SUBSCRIBE packets sent */
+    unsigned long subscribe_packets;
+    /** Subscriptions the broker refused */
+    unsigned long refused;
+    bool ready;
+    /** Time to ready of the last connect in µs, from the loss of the
+     *  connection (or the MQTT setup) */
+    uint64_t ready_us;
+    /** Part of `ready_us` after the connect acknowledgement */
+    uint64_t restore_us;
+};
+
 struct mosqagent {
+    /** Allocator for everything the agent owns */
+    const struct mqtta_allocator *allocator;
+
     struct mqtta_memory_object config_mo;
 
     struct mosqagent_idle_list *idle;
 
+    struct mosqagent_sub_list *subs;
+
+    struct mqtta_timer_wheel *timers;
+
+    struct mqtta_ratelimit *limiter;
+
+    struct mqtta_lanes *lanes;
+
+    struct mqtta_recorder *recorder;
+
+    struct mqtta_rpc *rpc;
+
+    struct mqtta_local *local;
+
+    struct mqtta_trace *trace;
+
+    struct mqtta_loop *loop;
+
+    struct mqtta_tls *tls;
+
+    struct mqtta_streams *streams;
+
+    struct mqtta_topics *topics;
+
+    struct mqtta_tasks *tasks;
+
     struct mosquitto *mosq;
+    bool connected;
+    /**
+     * Message id of the publish in progress and whether the client already
+     * reported it complete, see `mqtta_publish_mid`
+     */
+    const int *publishing_mid;
+    bool published_early;
+
+    struct mqtta_connection_stats connection;
+    /** monotonic ns of the connection loss and of the last connect */
+    uint64_t down_ns;
+    uint64_t connect_ns;
+
+    struct mqtta_watchdog *watchdog;
+    /** Returned by `mosqagent_idle_result` */
+    struct mosqagent_result result;
 
     void *priv_data;
 };
 
+/**
+ * \brief Priority of an outgoing message
+ *
+ * With priority lanes in place, outgoing messages wait in one queue per
+ * priority while the connection is congested or down, and the queues are
+ * written to the socket highest priority first.
+ */
+enum mqtta_priority {
+    /** Priority of the topic (see `mosqagent_add_priority`), else normal */
+    MQTTA_PRIORITY_DEFAULT = 0,
+    MQTTA_PRIORITY_CRITICAL,
+    MQTTA_PRIORITY_HIGH,
+    MQTTA_PRIORITY_NORMAL,
+    MQTTA_PRIORITY_LOW,
+};
+
+#define MQTTA_PRIORITY_LANES    4
+
 struct mqtta_message {
     char* topic;
     char* payload;
     int qos;
     bool retain;
+    /** Payload length without the terminating `\0`, used for sending */
+    int payloadlen;
+    /** Outbound priority lane, ignored without lanes */
+    enum mqtta_priority priority;
+    /**
+     * Time to live in ms, 0 for the topic's (see `mosqagent_add_expiry`) or
+     * none. Sent as MQTT v5 message expiry interval, rounded up to seconds.
+     * Like an expiry rule, a time to live switches the agent to priority
+     * lanes, so the message expires in the agent while it waits.
+     */
+    unsigned int ttl_ms;
+    /**
+     * MQTT v5 properties of a received message, `NULL` otherwise. Opaque,
+     * evaluated by the library, e.g. in `mqtta_respond`.
+     */
+    const void *properties;
+    /** Library internal: sharing of a received message, see retain */
+    struct mqtta_message_ref *ref;
 };
 
 struct mqtta_message* mqtta_create_message(const char* topic,
@@ -133,6 +376,17 @@ struct mqtta_message* mqtta_create_message(const char* topic,
                                            int qos,
                                            bool retain);
 
+/**
+ * \brief Send a message.
+ *
+ * The message is not taken over, the caller still has to dispose of it.
+ * With rate limits or priority lanes in place the message may be copied and
+ * sent later, or dropped.
+ *
+ * \returns 0 on success or if the message has been queued, -1 with errno
+ *          set on failure (`EAGAIN` if dropped by a rate limit or a lane
+ *          budget) or a mosquitto error code.
+ */
 int mqtta_send_message(struct mosqagent* agent,
                        struct mqtta_message *msg);
 
@@ -156,10 +410,181 @@ struct mqtta_message_list* mqtta_message_list_remove(struct mqtta_message_list*
 struct mqtta_message_list* mqtta_message_list_dispose(struct mqtta_message_list* list);
 
 
-struct mosqagent_result {
+/**
+ * \brief What to do with a message that exceeds its rate limit
+ */
+enum mqtta_rate_policy {
+    /** Discard the message */
+    MQTTA_RATE_DROP,
+    /** Queue the message and send it when tokens are available */
+    MQTTA_RATE_DELAY,
+    /** Keep only the latest pending message per topic */
+    MQTTA_RATE_COALESCE,
+};
+
+/**
+ * \brief Token bucket rate limit
+ *
+ * Sending a message takes one token, tokens are refilled at `rate` per
+ * second up to `burst`.
+ */
+struct mqtta_rate_limit {
+    /** Topic filter, `NULL` for the agent-wide limit */
+    char* filter;
+    /** Messages per second */
+    double rate;
+    /** Bucket size, at least 1 */
+    unsigned int burst;
+    enum mqtta_rate_policy policy;
+};
+
+/**
+ * \brief Priority of the messages on matching topics
+ */
+struct mqtta_priority_rule {
+    char* filter;
+    enum mqtta_priority priority;
+};
+
+/**
+ * \brief Settings of a priority lane
+ */
+struct mqtta_lane_config {
+    /** Bytes the lane may hold, 0 for no limit */
+    size_t budget;
+    /** Make room by dropping the oldest messages, not the new one */
+    bool drop_oldest;
+};
+
+/**
+ * \brief Time to live of the messages on matching topics
+ */
+struct mqtta_expiry_rule {
+    char* filter;
+    unsigned int ttl_ms;
+    bool latest_only;
+};
+
+/**
+ * \brief How `mosqagent_idle` waits for the network
+ */
+enum mqtta_loop_mode {
+    /** Block until the socket is ready, up to 100 ms */
+    MQTTA_LOOP_BLOCKING = 0,
+    /** Poll the socket and the local ring without blocking */
+    MQTTA_LOOP_BUSY_POLL,
+};
+
+struct mqtta_loop_config {
+    enum mqtta_loop_mode mode;
+    /**
+     * Busy poll: block again after this long without messages or timers,
+     * 0 to spin all the time
+     */
+    unsigned int spin_us;
+    /** CPU to pin the calling thread to, -1 for none */
+    int cpu;
+    /** SCHED_FIFO priority (1 to 99) of the calling thread, 0 for none */
+    int fifo_priority;
+};
+
+/**
+ * \brief TLS settings of the broker connection
+ *
+ * Either `cafile` or `capath` for certificates, or `psk` with `identity`
+ * must be set. All other fields may be `NULL`.
+ */
+struct mqtta_tls_config {
+    /** CA certificates to verify the broker, file or hashed directory */
+    char* cafile;
+    char* capath;
+    /** Client certificate and key, both in PEM format */
+    char* certfile;
+    char* keyfile;
+    /** Pre-shared key in hex and its identity, instead of certificates */
+    char* psk;
+    char* identity;
+    /** TLS version, e.g. "tlsv1.3", and OpenSSL cipher list */
+    char* version;
+    char* ciphers;
+    /** Do not check the broker's host name, for testing only */
+    bool insecure;
+    /**
+     * File that keeps the last TLS session across restarts, so the first
+     * connect may resume it, may be `NULL`. Sessions are always kept in
+     * memory for reconnects.
+     */
+    char* session_cache;
+};
+
+/**
+ * \brief TLS handshake statistics of an agent
+ */
+struct mqtta_tls_stats {
+    /** Completed handshakes and how many of them resumed a session */
+    uint64_t handshakes;
+    uint64_t resumed;
+    /** Duration of the last handshake, and of all of them together */
+    uint64_t last_us;
+    uint64_t total_us;
+    /** Sessions handed out by the broker, e.g. TLS 1.3 tickets */
+    uint64_t sessions;
+};
+
+/** Longest topic name kept in the top list, longer ones are cut */
+#define MQTTA_TOPICS_NAME_LEN   128
+
+/**
+ * \brief Settings of the topic tracking, zero values select the defaults
+ */
+struct mqtta_topics_config {
+    /**
+     * Counters per row of the Count-Min sketch, rounded up to a power of
+     * two of at least 16, default 1024
+     */
+    unsigned int width;
+    /** Rows of the sketch, at most 8, default 4 */
+    unsigned int depth;
+    /** Length of the top list, at most 256, default 16 */
+    unsigned int top;
+    /** HyperLogLog precision in bits, 4 to 16, default 12 (1.6% error) */
+    unsigned int precision;
+    /** Count payload bytes instead of messages */
+    bool bytes;
+    /** Topic to publish snapshots on as JSON, may be `NULL` */
+    char* publish;
+    /** Snapshot interval, default 10 s */
+    unsigned int interval_ms;
+    /** Start over after each published snapshot */
+    bool reset;
+};
+
+/**
+ * \brief A topic of the top list with its estimated count
+ */
+struct mqtta_topic_count {
+    char topic[MQTTA_TOPICS_NAME_LEN];
+    uint64_t count;
+};
 
+/**
+ * \brief Topic tracking statistics of an agent
+ */
+struct mqtta_topics_stats {
+    /** Messages (or payload bytes) counted */
+    uint64_t total;
+    /** Estimated number of distinct topics */
+    uint64_t distinct;
+    /**
+     * Overestimate bound of the counts: an estimate exceeds the true count
+     * by more than this with a probability of at most e^-depth
+     */
+    uint64_t error;
 };
 
+/** MQTT v5 session expiry interval of a session that never expires */
+#define MQTTA_SESSION_EXPIRY_NEVER  0xFFFFFFFFu
+
 /**
  * \brief The agent's configuration settings
  */
@@ -167,6 +592,51 @@ struct mosqagent_config {
     char* client_name;
     char* host;
     int port;
+    /** MQTT protocol version (3, 4 or 5), defaults to 5 */
+    int protocol_version;
+    /**
+     * MQTT v5 session expiry interval in s, 0 for a session that does not
+     * expire. The broker keeps subscriptions and QoS 1 and 2 messages this
+     * long after a disconnect, like the persistent session of older versions.
+     */
+    unsigned int session_expiry;
+    /** TLS from `mosqagent.broker.tls`, may be `NULL` */
+    struct mqtta_tls_config *tls;
+    /** Consumer group for shared subscriptions, may be `NULL` */
+    char* share_group;
+    /** Rate limits from `mosqagent.ratelimit`, applied on MQTT setup */
+    struct mqtta_rate_limit *rate_limits;
+    int rate_limit_count;
+    /** Priority lanes from `mosqagent.priority`, set up if `lanes` is set */
+    bool lanes;
+    struct mqtta_lane_config lane[MQTTA_PRIORITY_LANES];
+    struct mqtta_priority_rule *priority_rules;
+    int priority_rule_count;
+    /** Topic expiry from `mosqagent.expiry`, enables the lanes */
+    struct mqtta_expiry_rule *expiry_rules;
+    int expiry_rule_count;
+    /** Loop mode from `mosqagent.loop`, may be `NULL` */
+    struct mqtta_loop_config *loop;
+    /** Topic tracking from `mosqagent.topics`, may be `NULL` */
+    struct mqtta_topics_config *topics;
+    /** Loop deadline in ms from `mosqagent.watchdog`, 0 for none */
+    unsigned int watchdog_ms;
+    /** Record log file from `mosqagent.record`, may be `NULL` */
+    char* record_file;
+    /** Local group from `mosqagent.local`, may be `NULL` */
+    char* local_group;
+    char** local_topics;
+    int local_topic_count;
+    bool local_mirror;
+    /**
+     * Tracing from `mosqagent.trace`, with optional source, dump file and
+     * limits (0 for the defaults)
+     */
+    bool trace;
+    char* trace_source;
+    char* trace_dump;
+    unsigned int trace_max_topics;
+    unsigned int trace_max_sources;
 };
 
 /**
@@ -203,6 +673,8 @@ void mqtta_move_configuration(struct mosqagent *agent,
  * Ownership is not relevant for this function!
  *
  * \note Call this on stack pointers.
+ * \note The fields are freed with `mqtta_free`, so they must come from
+ *       `mqtta_malloc` (as with `mqtta_load_configuration`).
  */
 void mqtta_dispose_configuration(struct mosqagent_config *config);
 
@@ -211,7 +683,8 @@ void mqtta_dispose_configuration(struct mosqagent_config *config);
  *
  * Frees the __char*__ fields and then the struct itself.
  *
- * \warning Only use with heap objects where a call to __free__ is safe!
+ * \warning Only use with heap objects where a call to __mqtta_free__ is
+ *          safe!
  */
 void mqtta_configuration_deallocator(void *config);
 
@@ -223,6 +696,15 @@ typedef struct mosqagent_result* (*mosqagent_idle_call)(struct mosqagent*);
 
 struct mosqagent* mosqagent_init_agent(void *priv_data);
 
+/**
+ * \brief Create an agent that takes its memory from an allocator.
+ *
+ * The agent and everything it allocates, from subscriptions to retained
+ * messages, come from `allocator` (`NULL` for the global one at this time).
+ */
+struct mosqagent* mosqagent_init_agent_with(void *priv_data,
+                                            const struct mqtta_allocator *allocator);
+
 int mosqagent_setup_mqtt(struct mosqagent *agent);
 
 int mosqagent_close_agent(struct mosqagent *agent);
@@ -232,8 +714,499 @@ void* mosqagent_get_private_data(const struct mosqagent *agent);
 int mosqagent_add_idle_call(struct mosqagent *agent,
                             mosqagent_idle_call call);
 
+/**
+ * \brief Add an idle call with a time budget.
+ *
+ * Each call is timed in CPU time of the agent thread and its duration
+ * recorded in a histogram; calls that use more than the budget are counted
+ * as overruns. Time the thread waits, e.g. in blocking I/O or preempted on
+ * a busy machine, is not charged to the call; stalls in wall time are
+ * what the watchdog reports. The name also shows up in watchdog reports.
+ *
+ * \param name name of the call, copied
+ * \param budget_us time budget per call, 0 to only measure
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_add_idle_call_budget(struct mosqagent *agent,
+                                   mosqagent_idle_call call,
+                                   const char *name,
+                                   unsigned int budget_us);
+
+/**
+ * \brief Statistics of an idle call with a budget
+ */
+struct mqtta_idle_stats {
+    unsigned int budget_us;
+    unsigned long calls;
+    /** Calls that used more CPU time than the budget */
+    unsigned long overruns;
+    unsigned long yields;
+    unsigned long errors;
+    /** CPU time of the calls in ns, see mqtta-histogram.h; owned by the
+     *  agent */
+    const struct mqtta_histogram *durations;
+};
+
+/**
+ * \brief Get the statistics of an idle call added with a budget.
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`ENOENT` if there is
+ *          no such call).
+ */
+int mosqagent_idle_stats(const struct mosqagent *agent,
+                         const char *name,
+                         struct mqtta_idle_stats *stats);
+
+/**
+ * \brief Result for an idle call to return.
+ *
+ * The result is kept in the agent and valid until the next call. With
+ * `MQTTA_IDLE_ERROR` the error is taken from errno.
+ */
+struct mosqagent_result* mosqagent_idle_result(struct mosqagent *agent,
+                                               enum mqtta_idle_status status);
+
+/**
+ * \brief Run one iteration of the agent loop: timers, idle calls and the
+ *        network.
+ *
+ * \returns 0 on success, a mosquitto error code from the network, or -1
+ *          with errno set if an idle call failed.
+ */
 int mosqagent_idle(struct mosqagent *agent);
 
+/**
+ * \brief Handler for a stalled agent loop.
+ *
+ * Called from the watchdog thread while the loop is still stuck, so it
+ * must not use the agent beyond reading its configuration.
+ *
+ * \param running what the loop is running: the name of an idle call, the
+ *                subscription of a message handler, "timers" or "network";
+ *                a copy that is valid during the call
+ * \param stalled_ms time since the loop completed its last iteration
+ */
+typedef void (*mqtta_stall_handler)(struct mosqagent *agent,
+                                    const char *running,
+                                    unsigned long stalled_ms,
+                                    void *handler_data);
+
+/**
+ * \brief Watch the agent loop from a thread of its own.
+ *
+ * If `mosqagent_idle` does not complete an iteration within the deadline,
+ * the handler is called once for the stall. The deadline should be well
+ * above the 100 ms a blocking loop waits for the network. Agents with their
+ * own loop call `mosqagent_watchdog_iteration` instead.
+ *
+ * Also done on MQTT setup if `mosqagent.watchdog` is configured.
+ *
+ * \param deadline_ms deadline for an iteration, 0 to stop watching
+ * \param handler the handler, `NULL` to log the stall to syslog
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_watchdog(struct mosqagent *agent,
+                       unsigned int deadline_ms,
+                       mqtta_stall_handler handler,
+                       void *handler_data);
+
+/**
+ * \brief Tell the watchdog that the loop completed an iteration.
+ *
+ * Called by `mosqagent_idle`, only needed for agents with their own loop.
+ * Without a watchdog this does nothing.
+ */
+void mosqagent_watchdog_iteration(struct mosqagent *agent);
+
+/**
+ * \brief Set the loop mode of the agent.
+ *
+ * With busy polling, `mosqagent_idle` returns without blocking and should
+ * be called in a tight loop, which takes a whole core. With `spin_us` set,
+ * it falls back to blocking after that long without work and spins again
+ * with the next message.
+ *
+ * CPU affinity and the real-time scheduler are applied to the calling
+ * thread right away, so call this from the thread that runs the agent.
+ * SCHED_FIFO needs `CAP_SYS_NICE`.
+ *
+ * Also done on MQTT setup if `mosqagent.loop` is configured.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_set_loop(struct mosqagent *agent,
+                       const struct mqtta_loop_config *config);
+
+/**
+ * \brief Connect to the broker with TLS.
+ *
+ * The settings are copied and take effect with the next connect. The
+ * sessions the broker hands out are kept, so reconnects use an abbreviated
+ * handshake; with `session_cache` set, the last session is also written
+ * to that file and resumed after a restart. The file holds key material
+ * and is created readable for the owner only. Session resumption needs
+ * the library to be built with OpenSSL, as libmosquitto is.
+ *
+ * Also done on MQTT setup if `mosqagent.broker.tls` is configured.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_set_tls(struct mosqagent *agent,
+                      const struct mqtta_tls_config *config);
+
+/**
+ * \brief Get the TLS handshake statistics, all 0 without TLS or OpenSSL.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_tls_stats(const struct mosqagent *agent,
+                        struct mqtta_tls_stats *stats);
+
+/**
+ * \brief Track the topics of received messages.
+ *
+ * Each message that is dispatched updates a Count-Min sketch with a top
+ * list of the busiest topics and a HyperLogLog estimate of the number of
+ * distinct topics. Memory is fixed by the settings, the update costs a
+ * hash of the topic and a few counters. With `publish` set, a snapshot is
+ * published periodically:
+ *
+ *     {"total":..,"distinct":..,"error":..,"top":[{"topic":"..","count":..},..]}
+ *
+ * Also done on MQTT setup if `mosqagent.topics` is configured. Tracking
+ * again starts over with the new settings.
+ *
+ * \param config the settings, `NULL` for the defaults
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_track_topics(struct mosqagent *agent,
+                           const struct mqtta_topics_config *config);
+
+/**
+ * \brief Get the topic statistics, all 0 without tracking.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_topic_stats(const struct mosqagent *agent,
+                          struct mqtta_topics_stats *stats);
+
+/**
+ * \brief Get the busiest topics, highest count first.
+ *
+ * \param top where to copy the topics to
+ * \param n the size of top
+ *
+ * \returns the number of topics copied, -1 with errno set on failure.
+ */
+int mosqagent_top_topics(const struct mosqagent *agent,
+                         struct mqtta_topic_count *top,
+                         unsigned int n);
+
+/**
+ * \brief Estimate the count of any topic, 0 without tracking.
+ */
+uint64_t mosqagent_topic_estimate(const struct mosqagent *agent,
+                                  const char *topic);
+
+/**
+ * \brief Start the topic tracking over.
+ */
+void mosqagent_reset_topics(struct mosqagent *agent);
+
+
+/**
+ * \brief Handler for incoming messages on a subscription.
+ *
+ * The message is a read-only view on the receive buffer: topic and payload
+ * are not copied and only valid during the call. All handlers of a message
+ * see the same buffer. The handler must not dispose of the message, use
+ * `mqtta_message_retain` to keep it.
+ *
+ * \param handler_data the pointer provided on subscription
+ */
+typedef void (*mosqagent_message_handler)(struct mosqagent *agent,
+                                          const struct mqtta_message *msg,
+                                          void *handler_data);
+
+/**
+ * \brief Keep a received message beyond its handler.
+ *
+ * libmosquitto frees the receive buffer when the message callback returns,
+ * so keeping a message needs one copy. It is made by the first retain of a
+ * received message; further retains, also from other handlers of the same
+ * message, only take a reference on that copy. Messages that were not
+ * received, and their properties, are copied on each call.
+ *
+ * The retained message is read-only, without properties and `\0`-terminated
+ * after the payload. Release it with `mqtta_mo_free`, also from another
+ * thread.
+ *
+ * \param mo is set to the retained message and its de-allocator
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mqtta_message_retain(const struct mqtta_message *msg,
+                         struct mqtta_memory_object *mo);
+
+/**
+ * \brief Subscribe to a topic filter.
+ *
+ * The subscription is kept by the agent and sent to the broker on each
+ * connect, so it may be added before `mosqagent_setup_mqtt` is called. On a
+ * reconnect, all subscriptions are restored with one SUBSCRIBE per QoS
+ * level, or not at all if the broker resumed the session and has them
+ * already.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_subscribe(struct mosqagent *agent,
+                        const char *filter,
+                        int qos,
+                        mosqagent_message_handler handler,
+                        void *handler_data);
+
+/**
+ * \brief Get the connection statistics, e.g. the time to ready after a
+ *        reconnect.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_connection_stats(const struct mosqagent *agent,
+                               struct mqtta_connection_stats *stats);
+
+/**
+ * \brief Subscribe to a topic filter as member of a consumer group.
+ *
+ * The broker is subscribed with `$share/<group>/<filter>` (MQTT v5 shared
+ * subscription), so each matching message is delivered to only one agent of
+ * the group. Run several identical agents with the same group to split the
+ * load of a topic between them.
+ *
+ * If `group` is `NULL`, the `mosqagent.share_group` setting from the
+ * configuration is used.
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`EINVAL` if there is
+ *          no valid group name).
+ */
+int mosqagent_subscribe_shared(struct mosqagent *agent,
+                               const char *group,
+                               const char *filter,
+                               int qos,
+                               mosqagent_message_handler handler,
+                               void *handler_data);
+
+/**
+ * \brief Remove the subscriptions of a handler.
+ *
+ * All subscriptions added with this handler and handler data are removed,
+ * plain and shared. The broker is unsubscribed from a filter when no other
+ * subscription of the agent uses it. Must not be called from a message
+ * handler.
+ *
+ * \returns 0 on success, -1 with errno set otherwise (`ENOENT` if there was
+ *          no such subscription).
+ */
+int mosqagent_unsubscribe(struct mosqagent *agent,
+                          mosqagent_message_handler handler,
+                          void *handler_data);
+
+/**
+ * \brief Get a subscription as it is sent to the broker.
+ *
+ * Shared subscriptions have their `$share/<group>/` prefix here.
+ *
+ * \param index position in the order the subscriptions were added
+ *
+ * \returns the subscription, `NULL` with errno set if there is none.
+ */
+const char* mosqagent_subscription(const struct mosqagent *agent,
+                                   unsigned int index);
+
+/**
+ * \brief Deliver a message to all matching subscription handlers.
+ *
+ * This is called for each message received from the broker, but may also
+ * be used to feed messages from other sources into the agent.
+ *
+ * Handlers get topic and payload as passed. Like libmosquitto, callers
+ * should provide a `\0` after the payload for handlers that treat it as a
+ * string.
+ *
+ * \returns the number of handlers called, -1 with errno set on error.
+ */
+int mqtta_dispatch_message(struct mosqagent *agent,
+                           const char *topic,
+                           const void *payload,
+                           int payloadlen,
+                           int qos,
+                           bool retain);
+
+
+/**
+ * \brief Add a token bucket rate limit for outgoing messages.
+ *
+ * A message has to pass the limit of the first rule with a matching filter
+ * and the agent-wide limit. Rules are checked in the order they were added
+ * and may be added while messages are sent.
+ *
+ * \param filter topic filter or `NULL` to set the agent-wide limit
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_add_rate_limit(struct mosqagent *agent,
+                             const char *filter,
+                             double rate,
+                             unsigned int burst,
+                             enum mqtta_rate_policy policy);
+
+/**
+ * \brief Number of messages waiting for rate limit tokens.
+ */
+unsigned int mosqagent_rate_limited_pending(const struct mosqagent *agent);
+
+
+/**
+ * \brief Statistics of a priority lane
+ */
+struct mqtta_lane_stats {
+    /** messages and bytes waiting */
+    unsigned int queued;
+    size_t bytes;
+    /** messages handed to the MQTT client */
+    uint64_t sent;
+    /** messages dropped for the budget */
+    uint64_t dropped;
+    /** messages that expired while waiting */
+    uint64_t expired;
+    /** messages replaced by a newer one on the same topic */
+    uint64_t replaced;
+};
+
+/**
+ * \brief Set up a priority lane for outgoing messages.
+ *
+ * The first lane or priority rule switches the agent to priority lanes:
+ * messages that pass the rate limits are only handed to the MQTT client
+ * while it has nothing left to write, otherwise they wait in the lane of
+ * their priority. Waiting messages are sent from `mosqagent_idle`, highest
+ * priority first. Lanes that were not set up have no budget.
+ *
+ * \param budget bytes the lane may hold (topic and payload plus a small
+ *               overhead), 0 for no limit
+ * \param drop_oldest if the budget is exhausted drop the oldest messages
+ *                    instead of the new one
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_set_lane(struct mosqagent *agent,
+                       enum mqtta_priority priority,
+                       size_t budget,
+                       bool drop_oldest);
+
+/**
+ * \brief Set the priority of messages with the default priority on topics
+ *        matching a filter.
+ *
+ * Rules are checked in the order they were added.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_add_priority(struct mosqagent *agent,
+                           const char *filter,
+                           enum mqtta_priority priority);
+
+/**
+ * \brief Set the time to live of messages on topics matching a filter.
+ *
+ * Waiting messages are dropped when their time to live has passed, the
+ * broker gets the remaining time as MQTT v5 message expiry interval. Like
+ * a priority rule, this switches the agent to priority lanes, so messages
+ * wait in the agent instead of the MQTT client during a disconnect.
+ * Rules are checked in the order they were added.
+ *
+ * \param ttl_ms time to live for messages without their own, 0 for none
+ * \param latest_only keep only the newest waiting message per topic
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_add_expiry(struct mosqagent *agent,
+                         const char *filter,
+                         unsigned int ttl_ms,
+                         bool latest_only);
+
+/**
+ * \brief Get the statistics of a priority lane.
+ *
+ * \returns 0 on success, -1 with errno set otherwise.
+ */
+int mosqagent_lane_stats(const struct mosqagent *agent,
+                         enum mqtta_priority priority,
+                         struct mqtta_lane_stats *stats);
+
+/**
+ * \brief Send waiting messages while the MQTT client can take them.
+ *
+ * Called by `mosqagent_idle`, only needed for agents with their own loop.
+ *
+ * \returns the number of messages sent.
+ */
+int mosqagent_flush_lanes(struct mosqagent *agent);
+
+
+struct mqtta_timer;
+
+/**
+ * \brief Timer callback
+ *
+ * \param timer_data the pointer provided when the timer was added
+ */
+typedef void (*mqtta_timer_callback)(struct mosqagent *agent,
+                                     void *timer_data);
+
+/**
+ * \brief Get a monotonic time stamp in milliseconds.
+ */
+uint64_t mqtta_now_ms(void);
+
+/**
+ * \brief Add a timer to the agent.
+ *
+ * Timers are run from `mosqagent_idle`, before the idle calls. Resolution is
+ * one millisecond, but a timer can not fire before the agent loop comes
+ * around, so expect the loop period as additional delay.
+ *
+ * \param delay_ms time until the first expiry
+ * \param interval_ms period for repeating timers, 0 for a one-shot timer
+ *
+ * \returns a timer handle or `NULL` with errno set. The handle of a one-shot
+ *          timer becomes invalid after the timer has fired.
+ */
+struct mqtta_timer* mosqagent_add_timer(struct mosqagent *agent,
+                                        unsigned int delay_ms,
+                                        unsigned int interval_ms,
+                                        mqtta_timer_callback callback,
+                                        void *timer_data);
+
+/**
+ * \brief Cancel and free a timer.
+ *
+ * Safe to call from the timer's own callback.
+ */
+void mosqagent_cancel_timer(struct mosqagent *agent,
+                            struct mqtta_timer *timer);
+
+/**
+ * \brief Run all expired timers.
+ *
+ * Called by `mosqagent_idle`, only needed for agents with their own loop.
+ *
+ * \returns the number of timers fired.
+ */
+int mosqagent_run_timers(struct mosqagent *agent);
+
 const char* mosqagent_strerror(int mosq_errno);
 
 const char* mqtta_version( void );
@@ -34,10 +34,33 @@ int mqtt_init(const char* clientname,
   return 0;
 }
 
+int mqtt_set_protocol(struct mosquitto *mosq,
+                      const int version)
+{
+  int ret;
+
+  ret = mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, version);
+  if (ret)
+    syslog(LOG_ERR, "MQTT cannot set protocol version %d: %s",
+		version,
+		mosquitto_strerror(ret));
+
+  return ret;
+}
+
 int mqtt_connect(struct mosquitto *mosq,
                  const char* host,
 		 const int port,
 		 const int retries)
+{
+  return mqtt_connect_v5(mosq, host, port, retries, NULL);
+}
+
+int mqtt_connect_v5(struct mosquitto *mosq,
+                    const char* host,
+		    const int port,
+		    const int retries,
+		    const mosquitto_property *props)
 {
   int ret;
   int tries = retries ? retries : -1;
@@ -45,7 +68,7 @@ int mqtt_connect(struct mosquitto *mosq,
 
   // try until we're successful
   while (tries) {
-    ret = mosquitto_connect(mosq, host, port, 30);
+    ret = mosquitto_connect_bind_v5(mosq, host, port, 30, NULL, props);
 
     if (ret == MOSQ_ERR_SUCCESS) {
       ret = 0; // finished
@@ -83,10 +106,16 @@ int mqtt_connect(struct mosquitto *mosq,
 }
 
 int mqtt_loop(struct mosquitto *mosq)
+{
+  return mqtt_loop_wait(mosq, 100);
+}
+
+int mqtt_loop_wait(struct mosquitto *mosq,
+                   const int timeout)
 {
   int ret;
   ret = mosquitto_loop(mosq,
-		       100, /* timeout */
+		       timeout,
 		       1    /* maxpackets, 1 for future compat */
 		      );
 
@@ -97,6 +126,27 @@ int mqtt_loop(struct mosquitto *mosq)
   return ret;
 }
 
+int mqtt_loop_events(struct mosquitto *mosq,
+                     const bool readable,
+                     const bool writable)
+{
+  int ret = MOSQ_ERR_SUCCESS;
+
+  // for loops that wait on the socket themselves
+  if (readable)
+    ret = mosquitto_loop_read(mosq, 1);
+  if (!ret && writable)
+    ret = mosquitto_loop_write(mosq, 1);
+  if (!ret)
+    ret = mosquitto_loop_misc(mosq);
+
+  // if failed, try to reconnect
+  if (ret)
+    mosquitto_reconnect(mosq);
+
+  return ret;
+}
+
 int mqtt_close(struct mosquitto *mosq)
 {
     int ret;
@@ -127,3 +177,143 @@ int mqtt_publish(struct mosquitto *mosq,
 
   return ret == MOSQ_ERR_SUCCESS ? 0 : ret;
 }
+
+int mqtt_publish_v5(struct mosquitto *mosq,
+		    int* mid,
+		    const char* topic,
+		    int payloadlen,
+		    const void* payload,
+		    int qos,
+		    bool retain,
+		    const mosquitto_property *props)
+{
+  int ret;
+
+  ret = mosquitto_publish_v5(mosq,
+			     mid,
+			     topic,
+			     payloadlen, payload,
+			     qos,
+			     retain,
+			     props);
+
+  return ret == MOSQ_ERR_SUCCESS ? 0 : ret;
+}
+
+int mqtt_subscribe(struct mosquitto *mosq,
+		   int* mid,
+		   const char* sub,
+		   int qos)
+{
+  int ret;
+
+  ret = mosquitto_subscribe(mosq, mid, sub, qos);
+
+  if (ret)
+    syslog(LOG_ERR, "MQTT error on subscribe to %s: %d (%s)",
+		sub,
+		ret,
+		mosquitto_strerror(ret));
+
+  return ret == MOSQ_ERR_SUCCESS ? 0 : ret;
+}
+
+int mqtt_subscribe_multiple(struct mosquitto *mosq,
+			    int* mid,
+			    int count,
+			    char *const *const subs,
+			    int qos)
+{
+  int ret;
+
+  ret = mosquitto_subscribe_multiple(mosq, mid, count, subs, qos, 0, NULL);
+
+  if (ret)
+    syslog(LOG_ERR, "MQTT error on subscribe to %d topics: %d (%s)",
+		count,
+		ret,
+		mosquitto_strerror(ret));
+
+  return ret == MOSQ_ERR_SUCCESS ? 0 : ret;
+}
+
+int mqtt_unsubscribe(struct mosquitto *mosq,
+		     int* mid,
+		     const char* sub)
+{
+  int ret;
+
+  ret = mosquitto_unsubscribe(mosq, mid, sub);
+
+  if (ret)
+    syslog(LOG_ERR, "MQTT error on unsubscribe from %s: %d (%s)",
+		sub,
+		ret,
+		mosquitto_strerror(ret));
+
+  return ret == MOSQ_ERR_SUCCESS ? 0 : ret;
+}
+
+int mqtt_set_tls(struct mosquitto *mosq,
+		 const char* cafile,
+		 const char* capath,
+		 const char* certfile,
+		 const char* keyfile,
+		 const char* version,
+		 const char* ciphers,
+		 bool insecure)
+{
+  int ret;
+
+  ret = mosquitto_tls_set(mosq, cafile, capath, certfile, keyfile, NULL);
+  if (!ret)
+    ret = mosquitto_tls_opts_set(mosq,
+				 1,	/* SSL_VERIFY_PEER */
+				 version,
+				 ciphers);
+  if (!ret)
+    ret = mosquitto_tls_insecure_set(mosq, insecure);
+
+  if (ret)
+    syslog(LOG_ERR, "MQTT error on TLS setup: %d (%s)",
+		ret,
+		mosquitto_strerror(ret));
+
+  return ret == MOSQ_ERR_SUCCESS ? 0 : ret;
+}
+
+int mqtt_set_tls_psk(struct mosquitto *mosq,
+		     const char* psk,
+		     const char* identity,
+		     const char* ciphers)
+{
+  int ret;
+
+  ret = mosquitto_tls_psk_set(mosq, psk, identity, ciphers);
+
+  if (ret)
+    syslog(LOG_ERR, "MQTT error on TLS-PSK setup for %s: %d (%s)",
+		identity,
+		ret,
+		mosquitto_strerror(ret));
+
+  return ret == MOSQ_ERR_SUCCESS ? 0 : ret;
+}
+
+int mqtt_set_ssl_ctx(struct mosquitto *mosq,
+		     void *ssl_ctx)
+{
+  int ret;
+
+  // keep the TLS settings above on top of the context
+  ret = mosquitto_void_option(mosq, MOSQ_OPT_SSL_CTX, ssl_ctx);
+  if (!ret)
+    ret = mosquitto_int_option(mosq, MOSQ_OPT_SSL_CTX_WITH_DEFAULTS, 1);
+
+  if (ret)
+    syslog(LOG_ERR, "MQTT cannot set the TLS context: %d (%s)",
+		ret,
+		mosquitto_strerror(ret));
+
+  return ret == MOSQ_ERR_SUCCESS ? 0 : ret;
+}
@@ -0,0 +1,517 @@
+/*
+ * Windowed aggregation of numeric message streams
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta-aggregate.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Percentile sketch: log-linear buckets for each sign plus one for zero,
+ * ordered by value. As in the HDR histogram, each power of two is split
+ * into 16 buckets, so a bucket's midpoint is within 3.2% of any value in
+ * it. The index is taken from the exponent and the top mantissa bits of
+ * the double. 768 buckets per sign cover magnitudes 2^-24 (6e-8) to 2^24
+ * (1.7e7), values outside are clamped to the outermost buckets.
+ */
+#define SKETCH_SUB_BITS     4
+#define SKETCH_MIN_EXP      -24
+#define SKETCH_HALF         (48 << SKETCH_SUB_BITS)
+#define SKETCH_ZERO         SKETCH_HALF
+#define SKETCH_BUCKETS      (2 * SKETCH_HALF + 1)
+#define SKETCH_SHIFT        (52 - SKETCH_SUB_BITS)
+#define SKETCH_OFFSET       ((uint64_t)(1023 + SKETCH_MIN_EXP) << SKETCH_SUB_BITS)
+
+/* Samples are buffered and folded into the pane in batches. */
+#define BATCH_SIZE          64
+
+#define SERIES_HASH_SIZE    128
+
+#define DEFAULT_SUFFIX      "/aggregate"
+
+struct pane {
+    unsigned long count;
+    double sum;
+    double min;
+    double max;
+    uint32_t bucket[SKETCH_BUCKETS];
+};
+
+struct series {
+    struct series *next;
+    char *topic;
+    double last;
+
+    /*
+     * Pending samples in structure-of-arrays layout, so that the folding
+     * loops run over contiguous values and can be vectorised.
+     */
+    unsigned int pending;
+    double value[BATCH_SIZE];
+    uint16_t index[BATCH_SIZE];
+
+    /* ring of panes, `head` is the one currently filled */
+    unsigned int head;
+    struct pane pane[];
+};
+
+struct mqtta_aggregator {
+    struct mosqagent *agent;
+    struct mqtta_aggregate_config config;
+    char *suffix;
+
+    unsigned int panes;
+    struct mqtta_timer *timer;
+
+    unsigned int topics;
+    unsigned int max_topics;
+    struct series *series[SERIES_HASH_SIZE];
+};
+
+static uint16_t sketch_index(const double v)
+{
+    if (v == 0.0)
+        return SKETCH_ZERO;
+
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+
+    // exponent and mantissa bits below the sign, biased exponent first
+    const uint64_t e = (bits & ~((uint64_t)1 << 63)) >> SKETCH_SHIFT;
+    unsigned int k;
+    if (e < SKETCH_OFFSET)
+        k = 0;
+    else if (e - SKETCH_OFFSET >= SKETCH_HALF)
+        k = SKETCH_HALF - 1;
+    else
+        k = e - SKETCH_OFFSET;
+
+    return v > 0 ? SKETCH_ZERO + 1 + k : SKETCH_ZERO - 1 - k;
+}
+
+static double sketch_value(const unsigned int idx)
+{
+    if (idx == SKETCH_ZERO)
+        return 0.0;
+
+    const uint64_t k = idx > SKETCH_ZERO ? idx - SKETCH_ZERO - 1
+                                         : SKETCH_ZERO - 1 - idx;
+
+    // the bucket's lower bound with the next mantissa bit set
+    const uint64_t bits = ((k + SKETCH_OFFSET) << SKETCH_SHIFT)
+                        | ((uint64_t)1 << (SKETCH_SHIFT - 1));
+    double mid;
+    memcpy(&mid, &bits, sizeof(mid));
+
+    return idx > SKETCH_ZERO ? mid : -mid;
+}
+
+static unsigned int topic_hash(const char *topic)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    while (*topic) {
+        h ^= (unsigned char)*topic++;
+        h *= 16777619u;
+    }
+
+    return h % SERIES_HASH_SIZE;
+}
+
+static void pane_clear(struct pane *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->min = INFINITY;
+    p->max = -INFINITY;
+}
+
+/*
+ * Fold the pending samples into the current pane.
+ */
+static void series_flush(struct series *s)
+{
+    const unsigned int n = s->pending;
+    if (!n)
+        return;
+
+    struct pane *p = &s->pane[s->head];
+    double sum = 0.0;
+    double min = p->min;
+    double max = p->max;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        const double v = s->value[i];
+        sum += v;
+        min = v < min ? v : min;
+        max = v > max ? v : max;
+    }
+
+    for (i = 0; i < n; i++)
+        s->index[i] = sketch_index(s->value[i]);
+
+    for (i = 0; i < n; i++)
+        p->bucket[s->index[i]]++;
+
+    p->count += n;
+    p->sum += sum;
+    p->min = min;
+    p->max = max;
+
+    s->pending = 0;
+}
+
+static double percentile(const uint32_t *bucket,
+                         const unsigned long count,
+                         const double q)
+{
+    const double rank = q * (count - 1);
+    unsigned long seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < SKETCH_BUCKETS; i++) {
+        seen += bucket[i];
+        if (seen > rank)
+            return sketch_value(i);
+    }
+
+    return sketch_value(SKETCH_BUCKETS - 1);
+}
+
+static void series_summarize(struct series *s,
+                             const unsigned int panes,
+                             struct mqtta_aggregate *result)
+{
+    uint32_t merged[SKETCH_BUCKETS];
+    double sum = 0.0;
+    unsigned int i, j;
+
+    series_flush(s);
+
+    memset(result, 0, sizeof(*result));
+    memset(merged, 0, sizeof(merged));
+    result->min = INFINITY;
+    result->max = -INFINITY;
+
+    for (j = 0; j < panes; j++) {
+        const struct pane *p = &s->pane[j];
+        if (!p->count)
+            continue;
+
+        result->count += p->count;
+        sum += p->sum;
+        if (p->min < result->min)
+            result->min = p->min;
+        if (p->max > result->max)
+            result->max = p->max;
+
+        for (i = 0; i < SKETCH_BUCKETS; i++)
+            merged[i] += p->bucket[i];
+    }
+
+    if (!result->count)
+        return;
+
+    result->mean = sum / result->count;
+    result->last = s->last;
+
+    // the sketch is approximate, but min and max are exact
+    result->p50 = fmin(fmax(percentile(merged, result->count, 0.50), result->min), result->max);
+    result->p90 = fmin(fmax(percentile(merged, result->count, 0.90), result->min), result->max);
+    result->p99 = fmin(fmax(percentile(merged, result->count, 0.99), result->min), result->max);
+}
+
+static struct series* series_lookup(struct mqtta_aggregator *agg,
+                                    const char *topic,
+                                    const bool create)
+{
+    const unsigned int h = topic_hash(topic);
+
+    struct series *s;
+    for (s = agg->series[h]; s; s = s->next)
+        if (!strcmp(s->topic, topic))
+            return s;
+
+    if (!create) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    if (agg->topics >= agg->max_topics) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    s = mqtta_malloc(agg->agent->allocator,
+                     sizeof(*s) + agg->panes * sizeof(struct pane));
+    if (!s) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    s->topic = mqtta_strdup(agg->agent->allocator, topic);
+    if (!s->topic) {
+        mqtta_free(s);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    s->last = 0.0;
+    s->pending = 0;
+    s->head = 0;
+
+    unsigned int j;
+    for (j = 0; j < agg->panes; j++)
+        pane_clear(&s->pane[j]);
+
+    s->next = agg->series[h];
+    agg->series[h] = s;
+    agg->topics++;
+
+    return s;
+}
+
+int mqtta_aggregator_add(struct mqtta_aggregator *agg,
+                         const char *topic,
+                         const double value)
+{
+    if (!agg || !topic || !isfinite(value)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct series *s = series_lookup(agg, topic, true);
+    if (!s)
+        return -1;
+
+    if (s->pending == BATCH_SIZE)
+        series_flush(s);
+
+    s->value[s->pending++] = value;
+    s->last = value;
+
+    return 0;
+}
+
+int mqtta_aggregator_peek(struct mqtta_aggregator *agg,
+                          const char *topic,
+                          struct mqtta_aggregate *result)
+{
+    if (!agg || !topic || !result) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct series *s = series_lookup(agg, topic, false);
+    if (!s)
+        return -1;
+
+    series_summarize(s, agg->panes, result);
+
+    return 0;
+}
+
+static void publish_result(struct mqtta_aggregator *agg,
+                           const char *topic,
+                           const struct mqtta_aggregate *r)
+{
+    char payload[256];
+    const int payloadlen = snprintf(payload, sizeof(payload),
+        "{\"count\":%lu,\"min\":%.6g,\"max\":%.6g,\"mean\":%.6g,\"last\":%.6g,"
+        "\"p50\":%.6g,\"p90\":%.6g,\"p99\":%.6g}",
+        r->count, r->min, r->max, r->mean, r->last, r->p50, r->p90, r->p99);
+
+    const size_t topiclen = strlen(topic) + strlen(agg->suffix) + 1;
+    char *result_topic = mqtta_malloc(agg->agent->allocator, topiclen);
+    if (!result_topic)
+        return;
+    snprintf(result_topic, topiclen, "%s%s", topic, agg->suffix);
+
+    struct mqtta_message msg = {
+        .topic = result_topic,
+        .payload = payload,
+        .payloadlen = payloadlen,
+        .qos = agg->config.qos,
+        .retain = agg->config.retain,
+    };
+    mqtta_send_message(agg->agent, &msg);
+
+    mqtta_free(result_topic);
+}
+
+void mqtta_aggregator_close_window(struct mqtta_aggregator *agg)
+{
+    if (!agg)
+        return;
+
+    unsigned int h;
+    for (h = 0; h < SERIES_HASH_SIZE; h++) {
+        struct series **p = &agg->series[h];
+        while (*p) {
+            struct series *s = *p;
+            struct mqtta_aggregate result;
+            series_summarize(s, agg->panes, &result);
+
+            // a topic without values for a whole window is forgotten
+            if (!result.count) {
+                *p = s->next;
+                agg->topics--;
+                mqtta_free(s->topic);
+                mqtta_free(s);
+                continue;
+            }
+
+            if (agg->config.callback)
+                agg->config.callback(agg->agent, s->topic, &result,
+                                     agg->config.callback_data);
+            if (!agg->config.no_publish)
+                publish_result(agg, s->topic, &result);
+
+            // the oldest pane drops out of the window
+            s->head = (s->head + 1) % agg->panes;
+            pane_clear(&s->pane[s->head]);
+
+            p = &s->next;
+        }
+    }
+}
+
+static void window_timer(struct mosqagent *agent, void *timer_data)
+{
+    (void) agent; /* unused */
+
+    mqtta_aggregator_close_window(timer_data);
+}
+
+static void value_handler(struct mosqagent *agent,
+                          const struct mqtta_message *msg,
+                          void *handler_data)
+{
+    char buf[64];
+    char *end;
+
+    (void) agent; /* unused */
+
+    // the payload is a view on the receive buffer, parse a terminated copy
+    if (msg->payloadlen >= (int)sizeof(buf))
+        return;
+    memcpy(buf, msg->payload, msg->payloadlen);
+    buf[msg->payloadlen] = '\0';
+
+    errno = 0;
+    const double value = strtod(buf, &end);
+
+    // skip payloads that are not a plain number, strtod takes "nan" and "inf"
+    if ((end == buf) || errno || !isfinite(value))
+        return;
+    while (isspace((unsigned char)*end))
+        end++;
+    if (*end)
+        return;
+
+    mqtta_aggregator_add(handler_data, msg->topic, value);
+}
+
+struct mqtta_aggregator* mqtta_aggregator_create(struct mosqagent *agent,
+                                                 const struct mqtta_aggregate_config *config)
+{
+    if (!agent || !config || !config->filter || !config->window_ms) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    unsigned int panes = 1;
+    unsigned int interval = config->window_ms;
+
+    if (config->type == MQTTA_WINDOW_SLIDING) {
+        if (!config->slide_ms || (config->window_ms % config->slide_ms)) {
+            errno = EINVAL;
+            goto fail;
+        }
+        panes = config->window_ms / config->slide_ms;
+        interval = config->slide_ms;
+    }
+
+    if (panes > MQTTA_AGGREGATE_MAX_PANES) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    struct mqtta_aggregator *agg;
+    agg = mqtta_calloc(agent->allocator, 1, sizeof(*agg));
+    if (!agg) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    agg->agent = agent;
+    agg->config = *config;
+    agg->panes = panes;
+    agg->max_topics = config->max_topics ? config->max_topics
+                                         : MQTTA_AGGREGATE_DEFAULT_TOPICS;
+
+    const char *suffix = config->suffix ? config->suffix : DEFAULT_SUFFIX;
+    agg->suffix = mqtta_strdup(agent->allocator, suffix);
+    if (!agg->suffix) {
+        errno = ENOMEM;
+        goto fail_with_agg;
+    }
+
+    // the caller's strings need not outlive this call
+    agg->config.filter = NULL;
+    agg->config.suffix = agg->suffix;
+
+    agg->timer = mosqagent_add_timer(agent, interval, interval,
+                                     window_timer, agg);
+    if (!agg->timer)
+        goto fail_with_suffix;
+
+    if (mosqagent_subscribe(agent, config->filter, config->qos,
+                            value_handler, agg))
+        goto fail_with_timer;
+
+    return agg;
+
+fail_with_timer:
+    mosqagent_cancel_timer(agent, agg->timer);
+
+fail_with_suffix:
+    mqtta_free(agg->suffix);
+
+fail_with_agg:
+    mqtta_free(agg);
+
+fail:
+    return NULL;
+}
+
+void mqtta_aggregator_dispose(struct mqtta_aggregator *agg)
+{
+    if (!agg)
+        return;
+
+    mosqagent_cancel_timer(agg->agent, agg->timer);
+    mosqagent_unsubscribe(agg->agent, value_handler, agg);
+
+    unsigned int h;
+    for (h = 0; h < SERIES_HASH_SIZE; h++) {
+        struct series *s = agg->series[h];
+        while (s) {
+            struct series *next = s->next;
+            mqtta_free(s->topic);
+            mqtta_free(s);
+            s = next;
+        }
+    }
+
+    mqtta_free(agg->suffix);
+    mqtta_free(agg);
+}
@@ -0,0 +1,258 @@
+/*
+ * Pluggable allocators
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Each allocation starts with its allocator and size, so that memory can be
+ * freed without knowing where it came from, e.g. by a memory object's
+ * de-allocator.
+ */
+union header {
+    struct {
+        const struct mqtta_allocator *allocator;
+        size_t size;
+    } h;
+    /* keep the user part aligned like malloc does */
+    long double align_ld;
+    long long align_ll;
+    void *align_p;
+};
+
+static void* libc_alloc(void *ctx, const size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void* libc_realloc(void *ctx, void *ptr,
+                          const size_t old_size, const size_t size)
+{
+    (void)ctx;
+    (void)old_size;
+    return realloc(ptr, size);
+}
+
+static void libc_free(void *ctx, void *ptr, const size_t size)
+{
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+static const struct mqtta_allocator libc_allocator = {
+    .alloc = libc_alloc,
+    .realloc = libc_realloc,
+    .free = libc_free,
+    .ctx = NULL,
+};
+
+static const struct mqtta_allocator *global_allocator = &libc_allocator;
+
+void mqtta_set_allocator(const struct mqtta_allocator *allocator)
+{
+    global_allocator = allocator ? allocator : &libc_allocator;
+}
+
+const struct mqtta_allocator* mqtta_get_allocator(void)
+{
+    return global_allocator;
+}
+
+/*
+ * Resize on an allocator, by copying if it has no realloc.
+ */
+static void* raw_realloc(const struct mqtta_allocator *a,
+                         void *ptr,
+                         const size_t old_size,
+                         const size_t size)
+{
+    if (a->realloc)
+        return a->realloc(a->ctx, ptr, old_size, size);
+
+    void *p = a->alloc(a->ctx, size);
+    if (!p)
+        return NULL;
+
+    memcpy(p, ptr, old_size < size ? old_size : size);
+    a->free(a->ctx, ptr, old_size);
+
+    return p;
+}
+
+void* mqtta_malloc(const struct mqtta_allocator *allocator, const size_t size)
+{
+    const struct mqtta_allocator *a = allocator ? allocator : global_allocator;
+
+    if (size > SIZE_MAX - sizeof(union header)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    union header *hdr = a->alloc(a->ctx, sizeof(*hdr) + size);
+    if (!hdr) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    hdr->h.allocator = a;
+    hdr->h.size = size;
+
+    return hdr + 1;
+}
+
+void* mqtta_calloc(const struct mqtta_allocator *allocator,
+                   const size_t n,
+                   const size_t size)
+{
+    if (size && (n > SIZE_MAX / size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *p = mqtta_malloc(allocator, n * size);
+    if (p)
+        memset(p, 0, n * size);
+
+    return p;
+}
+
+char* mqtta_strdup(const struct mqtta_allocator *allocator, const char *s)
+{
+    const size_t len = strlen(s) + 1; // plus \0
+
+    char *copy = mqtta_malloc(allocator, len);
+    if (copy)
+        memcpy(copy, s, len);
+
+    return copy;
+}
+
+void* mqtta_realloc(void *ptr, const size_t size)
+{
+    if (!ptr)
+        return mqtta_malloc(NULL, size);
+
+    if (size > SIZE_MAX - sizeof(union header)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    union header *hdr = (union header*)ptr - 1;
+    const struct mqtta_allocator *a = hdr->h.allocator;
+
+    hdr = raw_realloc(a, hdr,
+                      sizeof(*hdr) + hdr->h.size,
+                      sizeof(*hdr) + size);
+    if (!hdr) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    hdr->h.size = size;
+
+    return hdr + 1;
+}
+
+void mqtta_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    union header *hdr = (union header*)ptr - 1;
+    const struct mqtta_allocator *a = hdr->h.allocator;
+
+    a->free(a->ctx, hdr, sizeof(*hdr) + hdr->h.size);
+}
+
+
+/*
+ * Take bytes from the budget, false if that exceeds the cap.
+ */
+static bool account(struct mqtta_accounting *acc, const size_t size)
+{
+    const size_t live = __atomic_add_fetch(&acc->live, size, __ATOMIC_RELAXED);
+
+    if (acc->cap && (live > acc->cap)) {
+        __atomic_sub_fetch(&acc->live, size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&acc->refused, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    size_t peak = __atomic_load_n(&acc->peak, __ATOMIC_RELAXED);
+    while ((live > peak) &&
+           !__atomic_compare_exchange_n(&acc->peak, &peak, live, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    return true;
+}
+
+static void* accounting_alloc(void *ctx, const size_t size)
+{
+    struct mqtta_accounting *acc = ctx;
+
+    if (!account(acc, size))
+        return NULL;
+
+    void *p = acc->parent->alloc(acc->parent->ctx, size);
+    if (!p)
+        __atomic_sub_fetch(&acc->live, size, __ATOMIC_RELAXED);
+
+    return p;
+}
+
+static void* accounting_realloc(void *ctx, void *ptr,
+                                const size_t old_size, const size_t size)
+{
+    struct mqtta_accounting *acc = ctx;
+
+    if ((size > old_size) && !account(acc, size - old_size))
+        return NULL;
+
+    void *p = raw_realloc(acc->parent, ptr, old_size, size);
+
+    // on failure the old block is kept
+    if (!p && (size > old_size))
+        __atomic_sub_fetch(&acc->live, size - old_size, __ATOMIC_RELAXED);
+    if (p && (size < old_size))
+        __atomic_sub_fetch(&acc->live, old_size - size, __ATOMIC_RELAXED);
+
+    return p;
+}
+
+static void accounting_free(void *ctx, void *ptr, const size_t size)
+{
+    struct mqtta_accounting *acc = ctx;
+
+    acc->parent->free(acc->parent->ctx, ptr, size);
+    __atomic_sub_fetch(&acc->live, size, __ATOMIC_RELAXED);
+}
+
+void mqtta_accounting_init(struct mqtta_accounting *accounting,
+                           const struct mqtta_allocator *parent,
+                           const size_t cap)
+{
+    if (!accounting)
+        return;
+
+    accounting->allocator.alloc = accounting_alloc;
+    accounting->allocator.realloc = accounting_realloc;
+    accounting->allocator.free = accounting_free;
+    accounting->allocator.ctx = accounting;
+
+    accounting->parent = parent ? parent : &libc_allocator;
+    accounting->cap = cap;
+    accounting->live = 0;
+    accounting->peak = 0;
+    accounting->refused = 0;
+}
@@ -0,0 +1,1181 @@
+/*
+ * Append-only message archive
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta-archive.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "mqtt-tools/mqtta.h"
+#include "mqtta-build.h"
+
+#ifdef MQTTA_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#define ARCHIVE_MAGIC           "MQTTALOG"
+#define ARCHIVE_VERSION         1
+#define BLOCK_MAGIC             "MQLB"
+
+#define CODEC_NONE              0
+#define CODEC_DEFLATE           1
+
+#define DEFAULT_PARTITION_S     3600
+#define DEFAULT_BLOCK_SIZE      (64 * 1024)
+#define DEFAULT_COMMIT_MS       1000
+#define DEFAULT_COMMIT_BYTES    (4 * 1024 * 1024)
+#define DEFAULT_QUEUE_SIZE      (8 * 1024 * 1024)
+#define DEFAULT_LEVEL           6
+
+#define NS_PER_S                1000000000ull
+
+#define ALIGN8(n)               (((n) + 7) & ~(size_t)7)
+
+/*
+ * A partition file starts with this header, followed by the blocks.
+ */
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    /** start of the partition, CLOCK_REALTIME in nanoseconds */
+    uint64_t start_ns;
+    uint64_t length_ns;
+};
+
+/*
+ * Followed by `size` stored bytes, which are `raw_size` bytes after
+ * decompression:
+ *
+ *   uint32 topic count
+ *   per topic: uint16 length, topic, `\0`
+ *   per message: uint64 time stamp, uint32 topic index, uint32 payload
+ *                length, uint8 QoS, uint8 retain, payload, `\0`
+ *
+ * Numbers are in host byte order and not aligned.
+ */
+struct block_header {
+    char magic[4];
+    uint32_t size;
+    uint32_t raw_size;
+    uint32_t count;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint8_t codec;
+    uint8_t reserved[3];
+    /** FNV-1a of the stored bytes */
+    uint32_t checksum;
+};
+
+#define MESSAGE_HEADER_SIZE     (8 + 4 + 4 + 1 + 1)
+
+/*
+ * Queue entry, aligned to 8 bytes and followed by topic, `\0` and payload.
+ * An entry with topiclen WRAP only fills the queue up to its end.
+ */
+struct entry {
+    uint32_t size;
+    uint32_t topiclen;
+    uint64_t timestamp_ns;
+    uint32_t payloadlen;
+    uint8_t qos;
+    uint8_t retain;
+    uint16_t reserved;
+};
+
+#define WRAP                    UINT32_MAX
+
+struct buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/* offset is the topic's position in the dictionary plus 1, 0 if empty */
+struct dict_slot {
+    uint32_t hash;
+    uint32_t index;
+    uint32_t offset;
+};
+
+/*
+ * The block being filled by the writer thread.
+ */
+struct block {
+    struct buffer dict;
+    uint32_t topics;
+    struct dict_slot *slot;
+    uint32_t slot_mask;
+
+    struct buffer msgs;
+    uint32_t count;
+    uint64_t first_ns;
+    uint64_t last_ns;
+};
+
+struct mqtta_archive {
+    struct mqtta_archive_config config;
+    char *dir;
+
+    /* single producer, single consumer queue */
+    char *queue;
+    size_t queue_size;
+    uint64_t head;
+    uint64_t tail;
+    uint32_t sleeping;
+    int event_fd;
+    bool closing;
+
+    pthread_t thread;
+
+    /* writer thread only */
+    int fd;
+    uint64_t partition_ns;
+    struct block block;
+    struct buffer raw;
+    struct buffer out;
+    size_t uncommitted;
+    bool dirty;
+    uint64_t last_commit_ms;
+    int error;
+
+    struct mqtta_archive_stats stats;
+};
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+static uint32_t fnv1a(const void *data, const size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t hash = 2166136261u;
+
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int buffer_reserve(struct buffer *buf, const size_t len)
+{
+    if (buf->len + len <= buf->cap)
+        return 0;
+
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + len)
+        cap *= 2;
+
+    char *data = mqtta_realloc(buf->data, cap);
+    if (!data)
+        return -1;
+
+    buf->data = data;
+    buf->cap = cap;
+
+    return 0;
+}
+
+static int buffer_append(struct buffer *buf, const void *data, const size_t len)
+{
+    if (buffer_reserve(buf, len))
+        return -1;
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return 0;
+}
+
+static void buffer_free(struct buffer *buf)
+{
+    mqtta_free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+/*
+ * Keep the first error for close.
+ */
+static void set_error(struct mqtta_archive *a, const int error)
+{
+    if (!a->error)
+        a->error = error;
+}
+
+
+/*
+ * Topic dictionary
+ */
+
+static int grow_dict(struct block *b)
+{
+    const uint32_t size = b->slot ? 2 * (b->slot_mask + 1) : 256;
+
+    struct dict_slot *slot = mqtta_calloc(NULL, size, sizeof(*slot));
+    if (!slot)
+        return -1;
+
+    uint32_t i;
+    for (i = 0; b->slot && (i <= b->slot_mask); i++) {
+        const struct dict_slot *s = &b->slot[i];
+        if (!s->offset)
+            continue;
+
+        uint32_t j = s->hash & (size - 1);
+        while (slot[j].offset)
+            j = (j + 1) & (size - 1);
+        slot[j] = *s;
+    }
+
+    mqtta_free(b->slot);
+    b->slot = slot;
+    b->slot_mask = size - 1;
+
+    return 0;
+}
+
+/*
+ * Index of the topic in the block's dictionary, added if needed.
+ */
+static int64_t topic_index(struct block *b, const char *topic, const uint16_t len)
+{
+    if ((!b->slot || (2 * (b->topics + 1) > b->slot_mask + 1)) && grow_dict(b))
+        return -1;
+
+    const uint32_t hash = fnv1a(topic, len);
+    uint32_t i = hash & b->slot_mask;
+
+    for (; b->slot[i].offset; i = (i + 1) & b->slot_mask) {
+        const struct dict_slot *s = &b->slot[i];
+        if (s->hash != hash)
+            continue;
+
+        const char *entry = b->dict.data + s->offset - 1;
+        uint16_t entry_len;
+        memcpy(&entry_len, entry, sizeof(entry_len));
+        if ((entry_len == len) && !memcmp(entry + sizeof(entry_len), topic, len))
+            return s->index;
+    }
+
+    const uint32_t offset = b->dict.len;
+    if (buffer_reserve(&b->dict, sizeof(len) + len + 1))
+        return -1;
+    buffer_append(&b->dict, &len, sizeof(len));
+    buffer_append(&b->dict, topic, len);
+    buffer_append(&b->dict, "", 1);
+
+    b->slot[i].hash = hash;
+    b->slot[i].index = b->topics;
+    b->slot[i].offset = offset + 1;
+
+    return b->topics++;
+}
+
+static void reset_block(struct block *b)
+{
+    if (b->slot)
+        memset(b->slot, 0, (b->slot_mask + 1) * sizeof(*b->slot));
+    b->dict.len = 0;
+    b->topics = 0;
+    b->msgs.len = 0;
+    b->count = 0;
+}
+
+
+/*
+ * Partition files
+ */
+
+static int write_all(const int fd, const struct iovec *iov, const int iovcnt)
+{
+    size_t total = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    const ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0)
+        // errno is already set
+        return -1;
+
+    // a short write on a regular file means the disk is full
+    if ((size_t)n != total) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Cut off the blocks at the end of the file that were not written
+ * completely. The pages of a torn write may reach the disk in any order, so
+ * a block only counts with its checksum.
+ */
+static int recover(const int fd, const off_t size, const uint32_t header_size)
+{
+    off_t offset = header_size;
+    struct block_header bh;
+
+    const char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        // errno is already set
+        return -1;
+
+    while (offset + (off_t)sizeof(bh) <= size) {
+        memcpy(&bh, map + offset, sizeof(bh));
+        if (memcmp(bh.magic, BLOCK_MAGIC, sizeof(bh.magic)) ||
+            (offset + (off_t)sizeof(bh) + bh.size > size) ||
+            (fnv1a(map + offset + sizeof(bh), bh.size) != bh.checksum))
+            break;
+
+        offset += sizeof(bh) + bh.size;
+    }
+
+    munmap((void*)map, size);
+
+    if ((offset < size) && ftruncate(fd, offset))
+        // errno is already set
+        return -1;
+
+    return 0;
+}
+
+static int open_partition(struct mqtta_archive *a, const uint64_t start_ns)
+{
+    const time_t start = start_ns / NS_PER_S;
+    struct tm tm;
+    char name[32];
+    gmtime_r(&start, &tm);
+    strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &tm);
+
+    const size_t len = strlen(a->dir) + strlen(name) +
+                       strlen(MQTTA_ARCHIVE_SUFFIX) + 2; // plus / and \0
+    char *path = mqtta_malloc(NULL, len);
+    if (!path)
+        return -1;
+    snprintf(path, len, "%s/%s%s", a->dir, name, MQTTA_ARCHIVE_SUFFIX);
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    mqtta_free(path);
+    if (fd < 0)
+        // errno is already set
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st))
+        goto fail;
+
+    if (st.st_size) {
+        struct file_header fh;
+        if ((pread(fd, &fh, sizeof(fh), 0) != sizeof(fh)) ||
+            memcmp(fh.magic, ARCHIVE_MAGIC, sizeof(fh.magic))) {
+            errno = EBADMSG;
+            goto fail;
+        }
+
+        if (recover(fd, st.st_size, fh.header_size))
+            goto fail;
+    } else {
+        const struct file_header fh = {
+            .magic = ARCHIVE_MAGIC,
+            .version = ARCHIVE_VERSION,
+            .header_size = sizeof(fh),
+            .start_ns = start_ns,
+            .length_ns = a->config.partition_s * NS_PER_S,
+        };
+        const struct iovec iov = { (void*)&fh, sizeof(fh) };
+        if (write_all(fd, &iov, 1))
+            goto fail;
+    }
+
+    a->fd = fd;
+    return 0;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/*
+ * Compress the block and append it to the partition.
+ */
+static int seal_block(struct mqtta_archive *a)
+{
+    struct block *b = &a->block;
+    if (!b->count)
+        return 0;
+
+    int ret = -1;
+
+    a->raw.len = 0;
+    if (buffer_reserve(&a->raw, sizeof(uint32_t) + b->dict.len + b->msgs.len))
+        goto out;
+    buffer_append(&a->raw, &b->topics, sizeof(b->topics));
+    buffer_append(&a->raw, b->dict.data, b->dict.len);
+    buffer_append(&a->raw, b->msgs.data, b->msgs.len);
+
+    struct block_header bh = {
+        .magic = BLOCK_MAGIC,
+        .size = a->raw.len,
+        .raw_size = a->raw.len,
+        .count = b->count,
+        .first_ns = b->first_ns,
+        .last_ns = b->last_ns,
+        .codec = CODEC_NONE,
+    };
+    const char *stored = a->raw.data;
+
+#ifdef MQTTA_WITH_ZLIB
+    if (a->config.level > 0) {
+        uLongf size = compressBound(a->raw.len);
+        a->out.len = 0;
+        if (buffer_reserve(&a->out, size))
+            goto out;
+
+        // keep the block uncompressed if that does not help
+        if ((compress2((Bytef*)a->out.data, &size,
+                       (const Bytef*)a->raw.data, a->raw.len,
+                       a->config.level) == Z_OK) &&
+            (size < a->raw.len)) {
+            bh.size = size;
+            bh.codec = CODEC_DEFLATE;
+            stored = a->out.data;
+        }
+    }
+#endif
+
+    bh.checksum = fnv1a(stored, bh.size);
+
+    if (a->fd < 0) {
+        errno = EBADF;
+        goto out;
+    }
+
+    const struct iovec iov[2] = {
+        { &bh, sizeof(bh) },
+        { (void*)stored, bh.size },
+    };
+    if (write_all(a->fd, iov, 2))
+        goto out;
+
+    __atomic_add_fetch(&a->stats.written, b->count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&a->stats.blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&a->stats.bytes, sizeof(bh) + bh.size, __ATOMIC_RELAXED);
+    a->uncommitted += sizeof(bh) + bh.size;
+    ret = 0;
+
+out:
+    if (ret)
+        set_error(a, errno);
+    // a block that could not be written is lost
+    reset_block(b);
+    return ret;
+}
+
+/*
+ * Write the open block and sync the partition.
+ */
+static void commit(struct mqtta_archive *a)
+{
+    seal_block(a);
+
+    if ((a->fd >= 0) && a->uncommitted) {
+        if (fdatasync(a->fd))
+            set_error(a, errno);
+        __atomic_add_fetch(&a->stats.commits, 1, __ATOMIC_RELAXED);
+    }
+
+    a->uncommitted = 0;
+    a->dirty = false;
+    a->last_commit_ms = mqtta_now_ms();
+}
+
+static void switch_partition(struct mqtta_archive *a, const uint64_t start_ns)
+{
+    if (a->fd >= 0) {
+        commit(a);
+        close(a->fd);
+        a->fd = -1;
+    }
+
+    a->partition_ns = start_ns;
+    if (open_partition(a, start_ns))
+        set_error(a, errno);
+}
+
+static void append(struct mqtta_archive *a, const struct entry *e)
+{
+    const uint64_t length_ns = a->config.partition_s * NS_PER_S;
+    const uint64_t start_ns = e->timestamp_ns - e->timestamp_ns % length_ns;
+
+    // after a clock step back the message stays in the current partition
+    if (start_ns > a->partition_ns)
+        switch_partition(a, start_ns);
+
+    struct block *b = &a->block;
+    const char *topic = (const char*)(e + 1);
+    const char *payload = topic + e->topiclen + 1;
+
+    const int64_t index = topic_index(b, topic, e->topiclen);
+    const uint32_t idx = index;
+    if ((index < 0) ||
+        buffer_reserve(&b->msgs, MESSAGE_HEADER_SIZE + e->payloadlen + 1)) {
+        set_error(a, ENOMEM);
+        return;
+    }
+
+    buffer_append(&b->msgs, &e->timestamp_ns, sizeof(e->timestamp_ns));
+    buffer_append(&b->msgs, &idx, sizeof(idx));
+    buffer_append(&b->msgs, &e->payloadlen, sizeof(e->payloadlen));
+    buffer_append(&b->msgs, &e->qos, sizeof(e->qos));
+    buffer_append(&b->msgs, &e->retain, sizeof(e->retain));
+    buffer_append(&b->msgs, payload, e->payloadlen + 1);
+
+    if (!b->count || (e->timestamp_ns < b->first_ns))
+        b->first_ns = e->timestamp_ns;
+    if (!b->count || (e->timestamp_ns > b->last_ns))
+        b->last_ns = e->timestamp_ns;
+    b->count++;
+    a->dirty = true;
+
+    if (b->dict.len + b->msgs.len >= a->config.block_size)
+        seal_block(a);
+}
+
+/*
+ * Move the queued messages into blocks.
+ */
+static unsigned int drain(struct mqtta_archive *a)
+{
+    const size_t mask = a->queue_size - 1;
+    const uint64_t head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+    unsigned int n = 0;
+
+    while (a->tail != head) {
+        const struct entry *e = (const struct entry*)(a->queue + (a->tail & mask));
+        if (e->topiclen != WRAP) {
+            append(a, e);
+            n++;
+        }
+
+        // the space can be used again
+        __atomic_store_n(&a->tail, a->tail + e->size, __ATOMIC_RELEASE);
+    }
+
+    return n;
+}
+
+static void wait_queue(struct mqtta_archive *a, const int timeout)
+{
+    // pairs with the producer checking `sleeping` after moving the head
+    __atomic_store_n(&a->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    if ((__atomic_load_n(&a->head, __ATOMIC_SEQ_CST) == a->tail) &&
+        !__atomic_load_n(&a->closing, __ATOMIC_SEQ_CST)) {
+        struct pollfd pfd = { .fd = a->event_fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) > 0) {
+            uint64_t value;
+            if (read(a->event_fd, &value, sizeof(value)) < 0)
+                set_error(a, errno);
+        }
+    }
+
+    __atomic_store_n(&a->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void* writer(void *arg)
+{
+    struct mqtta_archive *a = arg;
+
+    a->last_commit_ms = mqtta_now_ms();
+
+    for (;;) {
+        // checked first, so that the last messages are drained below
+        const bool closing = __atomic_load_n(&a->closing, __ATOMIC_ACQUIRE);
+        const unsigned int n = drain(a);
+
+        const uint64_t since = mqtta_now_ms() - a->last_commit_ms;
+        if (a->dirty &&
+            (closing || (since >= a->config.commit_ms) ||
+             (a->uncommitted >= a->config.commit_bytes)))
+            commit(a);
+
+        if (closing && !n)
+            break;
+
+        if (!n)
+            wait_queue(a, a->dirty ? (int)(a->config.commit_ms - since) : -1);
+    }
+
+    return NULL;
+}
+
+struct mqtta_archive* mqtta_archive_open(const struct mqtta_archive_config *config)
+{
+    if (!config || !config->dir ||
+        (config->level < -1) || (config->level > 9)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct mqtta_archive *a = mqtta_calloc(NULL, 1, sizeof(*a));
+    if (!a)
+        return NULL;
+
+    a->fd = -1;
+    a->event_fd = -1;
+
+    a->config = *config;
+    if (!a->config.partition_s)
+        a->config.partition_s = DEFAULT_PARTITION_S;
+    if (!a->config.block_size)
+        a->config.block_size = DEFAULT_BLOCK_SIZE;
+    if (!a->config.commit_ms)
+        a->config.commit_ms = DEFAULT_COMMIT_MS;
+    if (!a->config.commit_bytes)
+        a->config.commit_bytes = DEFAULT_COMMIT_BYTES;
+    if (!a->config.queue_size)
+        a->config.queue_size = DEFAULT_QUEUE_SIZE;
+    if (!a->config.level)
+        a->config.level = DEFAULT_LEVEL;
+
+    a->dir = mqtta_strdup(NULL, config->dir);
+    if (!a->dir)
+        goto fail;
+    a->config.dir = a->dir;
+
+    struct stat st;
+    if (stat(a->dir, &st))
+        // errno is already set
+        goto fail;
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        goto fail;
+    }
+
+    // a power of two, so that positions wrap with a mask
+    a->queue_size = 64;
+    while (a->queue_size < a->config.queue_size)
+        a->queue_size *= 2;
+    a->queue = mqtta_malloc(NULL, a->queue_size);
+    if (!a->queue)
+        goto fail;
+
+    a->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (a->event_fd < 0)
+        // errno is already set
+        goto fail;
+
+    const int err = pthread_create(&a->thread, NULL, writer, a);
+    if (err) {
+        errno = err;
+        goto fail;
+    }
+
+    return a;
+
+fail:
+    if (a->event_fd >= 0)
+        close(a->event_fd);
+    mqtta_free(a->queue);
+    mqtta_free(a->dir);
+    mqtta_free(a);
+    return NULL;
+}
+
+int mqtta_archive_write(struct mqtta_archive *archive,
+                        uint64_t timestamp_ns,
+                        const char *topic,
+                        const void *payload,
+                        const int payloadlen,
+                        const int qos,
+                        const bool retain)
+{
+    if (!archive || !topic || (payloadlen < 0) || (payloadlen && !payload) ||
+        (qos < 0) || (qos > 2) || (strlen(topic) > UINT16_MAX)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_archive *a = archive;
+    const size_t topiclen = strlen(topic);
+    const size_t size = ALIGN8(sizeof(struct entry) + topiclen + 1 +
+                               payloadlen);
+
+    if (size > a->queue_size / 2) {
+        __atomic_add_fetch(&a->stats.dropped, 1, __ATOMIC_RELAXED);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (!timestamp_ns)
+        timestamp_ns = realtime_ns();
+
+    uint64_t head = a->head;
+    const uint64_t tail = __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE);
+    const size_t pos = head & (a->queue_size - 1);
+    const size_t to_end = a->queue_size - pos;
+    const size_t pad = (to_end < size) ? to_end : 0;
+
+    if (head + pad + size - tail > a->queue_size) {
+        __atomic_add_fetch(&a->stats.dropped, 1, __ATOMIC_RELAXED);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (pad) {
+        struct entry *w = (struct entry*)(a->queue + pos);
+        w->size = pad;
+        w->topiclen = WRAP;
+        head += pad;
+    }
+
+    struct entry *e = (struct entry*)(a->queue + (head & (a->queue_size - 1)));
+    e->size = size;
+    e->topiclen = topiclen;
+    e->timestamp_ns = timestamp_ns;
+    e->payloadlen = payloadlen;
+    e->qos = qos;
+    e->retain = retain;
+
+    char *data = (char*)(e + 1);
+    memcpy(data, topic, topiclen + 1);
+    if (payloadlen)
+        memcpy(data + topiclen + 1, payload, payloadlen);
+    data[topiclen + 1 + payloadlen] = '\0';
+
+    // pairs with the writer setting `sleeping` before checking the queue
+    __atomic_store_n(&a->head, head + size, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&a->sleeping, __ATOMIC_SEQ_CST)) {
+        const uint64_t one = 1;
+        if (write(a->event_fd, &one, sizeof(one)) < 0) {
+            // the counter is full, so the writer is awake anyway
+        }
+    }
+
+    return 0;
+}
+
+void mqtta_archive_stats(const struct mqtta_archive *archive,
+                         struct mqtta_archive_stats *stats)
+{
+    if (!archive || !stats)
+        return;
+
+    const struct mqtta_archive_stats *s = &archive->stats;
+    stats->written = __atomic_load_n(&s->written, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&s->dropped, __ATOMIC_RELAXED);
+    stats->blocks = __atomic_load_n(&s->blocks, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    stats->commits = __atomic_load_n(&s->commits, __ATOMIC_RELAXED);
+}
+
+int mqtta_archive_close(struct mqtta_archive *archive,
+                        struct mqtta_archive_stats *stats)
+{
+    if (!archive) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_archive *a = archive;
+
+    __atomic_store_n(&a->closing, true, __ATOMIC_SEQ_CST);
+    const uint64_t one = 1;
+    if (write(a->event_fd, &one, sizeof(one)) < 0) {
+        // the counter is full, so the writer is awake anyway
+    }
+    pthread_join(a->thread, NULL);
+
+    // the writer has committed everything
+    mqtta_archive_stats(a, stats);
+
+    if (a->fd >= 0)
+        close(a->fd);
+    close(a->event_fd);
+
+    const int error = a->error;
+
+    buffer_free(&a->block.dict);
+    buffer_free(&a->block.msgs);
+    mqtta_free(a->block.slot);
+    buffer_free(&a->raw);
+    buffer_free(&a->out);
+    mqtta_free(a->queue);
+    mqtta_free(a->dir);
+    mqtta_free(a);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Reader
+ */
+
+struct mqtta_archive_reader {
+    char *dir;
+    struct dirent **files;
+    int nfiles;
+    int file;
+
+    uint64_t from_ns;
+    uint64_t to_ns;
+
+    const char *map;
+    size_t map_size;
+    size_t offset;
+
+    /* the current block */
+    const char *raw;
+    size_t raw_size;
+    size_t cursor;
+    uint32_t left;
+    struct buffer inflated;
+    const char **topic;
+    uint32_t topic_cap;
+    uint32_t topics;
+};
+
+static int is_partition(const struct dirent *d)
+{
+    const size_t len = strlen(d->d_name);
+    const size_t suffix = strlen(MQTTA_ARCHIVE_SUFFIX);
+
+    return (len > suffix) &&
+           !strcmp(d->d_name + len - suffix, MQTTA_ARCHIVE_SUFFIX);
+}
+
+static void unmap(struct mqtta_archive_reader *r)
+{
+    if (r->map)
+        munmap((void*)r->map, r->map_size);
+    r->map = NULL;
+    r->left = 0;
+}
+
+/*
+ * Map the next partition that overlaps the time range.
+ *
+ * \returns 1 if a partition was mapped, 0 at the end and -1 on error.
+ */
+static int next_file(struct mqtta_archive_reader *r)
+{
+    unmap(r);
+
+    while (++r->file < r->nfiles) {
+        const size_t len = strlen(r->dir) + strlen(r->files[r->file]->d_name) + 2;
+        char path[len];
+        snprintf(path, len, "%s/%s", r->dir, r->files[r->file]->d_name);
+
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            // errno is already set
+            return -1;
+
+        struct stat st;
+        if (fstat(fd, &st)) {
+            close(fd);
+            return -1;
+        }
+
+        // empty or just being created
+        if ((size_t)st.st_size < sizeof(struct file_header)) {
+            close(fd);
+            continue;
+        }
+
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            // errno is already set
+            return -1;
+
+        struct file_header fh;
+        memcpy(&fh, map, sizeof(fh));
+        if (memcmp(fh.magic, ARCHIVE_MAGIC, sizeof(fh.magic)) ||
+            (fh.header_size < sizeof(fh)) ||
+            (fh.header_size > (size_t)st.st_size)) {
+            munmap(map, st.st_size);
+            errno = EBADMSG;
+            return -1;
+        }
+
+        if ((fh.start_ns > r->to_ns) ||
+            (fh.start_ns + fh.length_ns <= r->from_ns)) {
+            munmap(map, st.st_size);
+            continue;
+        }
+
+        r->map = map;
+        r->map_size = st.st_size;
+        r->offset = fh.header_size;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Decompress a block and read its dictionary.
+ */
+static int load_block(struct mqtta_archive_reader *r,
+                      const struct block_header *bh,
+                      const char *stored)
+{
+    if (fnv1a(stored, bh->size) != bh->checksum) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (bh->codec == CODEC_NONE) {
+        if (bh->raw_size != bh->size) {
+            errno = EBADMSG;
+            return -1;
+        }
+        r->raw = stored;
+    } else if (bh->codec == CODEC_DEFLATE) {
+#ifdef MQTTA_WITH_ZLIB
+        r->inflated.len = 0;
+        if (buffer_reserve(&r->inflated, bh->raw_size))
+            return -1;
+
+        uLongf size = bh->raw_size;
+        if ((uncompress((Bytef*)r->inflated.data, &size,
+                        (const Bytef*)stored, bh->size) != Z_OK) ||
+            (size != bh->raw_size)) {
+            errno = EBADMSG;
+            return -1;
+        }
+        r->raw = r->inflated.data;
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    } else {
+        errno = EBADMSG;
+        return -1;
+    }
+    r->raw_size = bh->raw_size;
+
+    uint32_t topics;
+    if (r->raw_size < sizeof(topics)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    memcpy(&topics, r->raw, sizeof(topics));
+    size_t cursor = sizeof(topics);
+
+    if (topics > r->topic_cap) {
+        const char **topic = mqtta_realloc(r->topic, topics * sizeof(*topic));
+        if (!topic)
+            return -1;
+        r->topic = topic;
+        r->topic_cap = topics;
+    }
+
+    uint32_t i;
+    for (i = 0; i < topics; i++) {
+        uint16_t len;
+        if (cursor + sizeof(len) > r->raw_size) {
+            errno = EBADMSG;
+            return -1;
+        }
+        memcpy(&len, r->raw + cursor, sizeof(len));
+        cursor += sizeof(len);
+
+        if ((cursor + len + 1 > r->raw_size) || r->raw[cursor + len]) {
+            errno = EBADMSG;
+            return -1;
+        }
+        r->topic[i] = r->raw + cursor;
+        cursor += len + 1;
+    }
+
+    r->topics = topics;
+    r->cursor = cursor;
+    r->left = bh->count;
+
+    return 0;
+}
+
+/*
+ * Load the next block of the partition that overlaps the time range.
+ *
+ * \returns 1 if a block was loaded, 0 at the end of the partition and -1 on
+ *          error.
+ */
+static int next_block(struct mqtta_archive_reader *r)
+{
+    struct block_header bh;
+
+    while (r->offset + sizeof(bh) <= r->map_size) {
+        memcpy(&bh, r->map + r->offset, sizeof(bh));
+
+        // a block that is still being written ends the partition
+        if (memcmp(bh.magic, BLOCK_MAGIC, sizeof(bh.magic)) ||
+            (r->offset + sizeof(bh) + bh.size > r->map_size))
+            return 0;
+
+        const char *stored = r->map + r->offset + sizeof(bh);
+        r->offset += sizeof(bh) + bh.size;
+
+        if ((bh.last_ns < r->from_ns) || (bh.first_ns > r->to_ns))
+            continue;
+
+        if (load_block(r, &bh, stored))
+            // errno is already set
+            return -1;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+struct mqtta_archive_reader* mqtta_archive_reader_open(const char *dir,
+                                                       const uint64_t from_ns,
+                                                       const uint64_t to_ns)
+{
+    if (!dir || (from_ns > to_ns)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct mqtta_archive_reader *r = mqtta_calloc(NULL, 1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->dir = mqtta_strdup(NULL, dir);
+    if (!r->dir) {
+        mqtta_free(r);
+        return NULL;
+    }
+
+    // the names sort by partition start
+    r->nfiles = scandir(dir, &r->files, is_partition, alphasort);
+    if (r->nfiles < 0) {
+        const int err = errno;
+        mqtta_free(r->dir);
+        mqtta_free(r);
+        errno = err;
+        return NULL;
+    }
+
+    r->file = -1;
+    r->from_ns = from_ns;
+    r->to_ns = to_ns;
+
+    return r;
+}
+
+int mqtta_archive_reader_next(struct mqtta_archive_reader *reader,
+                              struct mqtta_archive_record *record)
+{
+    if (!reader || !record) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_archive_reader *r = reader;
+
+    for (;;) {
+        while (r->left) {
+            r->left--;
+
+            uint64_t timestamp_ns;
+            uint32_t index;
+            uint32_t payloadlen;
+            const char *p = r->raw + r->cursor;
+
+            if (r->cursor + MESSAGE_HEADER_SIZE > r->raw_size) {
+                errno = EBADMSG;
+                return -1;
+            }
+            memcpy(&timestamp_ns, p, sizeof(timestamp_ns));
+            memcpy(&index, p + 8, sizeof(index));
+            memcpy(&payloadlen, p + 12, sizeof(payloadlen));
+
+            const size_t end = r->cursor + MESSAGE_HEADER_SIZE + payloadlen;
+            if ((index >= r->topics) || (payloadlen > INT32_MAX) ||
+                (end + 1 > r->raw_size) || r->raw[end]) {
+                errno = EBADMSG;
+                return -1;
+            }
+            r->cursor = end + 1;
+
+            if ((timestamp_ns < r->from_ns) || (timestamp_ns > r->to_ns))
+                continue;
+
+            record->timestamp_ns = timestamp_ns;
+            record->qos = p[16];
+            record->retain = p[17];
+            record->topic = r->topic[index];
+            record->payload = p + MESSAGE_HEADER_SIZE;
+            record->payloadlen = payloadlen;
+
+            return 1;
+        }
+
+        const int block = r->map ? next_block(r) : 0;
+        if (block < 0)
+            // errno is already set
+            return -1;
+        if (block)
+            continue;
+
+        const int file = next_file(r);
+        if (file <= 0)
+            return file;
+    }
+}
+
+void mqtta_archive_reader_close(struct mqtta_archive_reader *reader)
+{
+    if (!reader)
+        return;
+
+    unmap(reader);
+
+    int i;
+    // allocated by scandir
+    for (i = 0; i < reader->nfiles; i++)
+        free(reader->files[i]);
+    free(reader->files);
+
+    buffer_free(&reader->inflated);
+    mqtta_free(reader->topic);
+    mqtta_free(reader->dir);
+    mqtta_free(reader);
+}
@@ -0,0 +1,334 @@
+/*
+ * High dynamic range histograms
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta-histogram.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt-tools/mqtta.h"
+
+/* Reporting steps of the percentile distribution per half distance to 100 % */
+#define TICKS_PER_HALF      5
+
+/*
+ * The counts are indexed as in HdrHistogram: bucket 0 holds the values
+ * below sub_bucket_count << unit_magnitude linearly, each further bucket
+ * covers twice the range with half of the sub-buckets (the lower half is
+ * already covered by the bucket before).
+ */
+struct mqtta_histogram {
+    uint64_t lowest;
+    uint64_t highest;
+    int digits;
+
+    int unit_magnitude;
+    int sub_bucket_half_count_magnitude;
+    int32_t sub_bucket_count;
+    int32_t sub_bucket_half_count;
+    uint64_t sub_bucket_mask;
+    int bucket_count;
+    int counts_len;
+
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    /* for mean and standard deviation */
+    double sum;
+    double sum_squares;
+
+    uint64_t counts[];
+};
+
+static int log2_floor(const uint64_t v)
+{
+    return 63 - __builtin_clzll(v);
+}
+
+static int bucket_index(const struct mqtta_histogram *h, const uint64_t v)
+{
+    const int pow2ceiling = 64 - __builtin_clzll(v | h->sub_bucket_mask);
+
+    return pow2ceiling - h->unit_magnitude -
+           (h->sub_bucket_half_count_magnitude + 1);
+}
+
+static int32_t sub_bucket_index(const struct mqtta_histogram *h,
+                                const uint64_t v,
+                                const int bucket)
+{
+    return (int32_t)(v >> (bucket + h->unit_magnitude));
+}
+
+static int counts_index(const struct mqtta_histogram *h, const uint64_t v)
+{
+    const int bucket = bucket_index(h, v);
+    const int32_t sub = sub_bucket_index(h, v, bucket);
+
+    return ((bucket + 1) << h->sub_bucket_half_count_magnitude) +
+           (sub - h->sub_bucket_half_count);
+}
+
+static uint64_t value_at_index(const struct mqtta_histogram *h, const int i)
+{
+    int bucket = (i >> h->sub_bucket_half_count_magnitude) - 1;
+    int32_t sub = (i & (h->sub_bucket_half_count - 1)) +
+                  h->sub_bucket_half_count;
+    if (bucket < 0) {
+        sub -= h->sub_bucket_half_count;
+        bucket = 0;
+    }
+
+    return (uint64_t)sub << (bucket + h->unit_magnitude);
+}
+
+static uint64_t highest_equivalent(const struct mqtta_histogram *h,
+                                   const uint64_t v)
+{
+    const int bucket = bucket_index(h, v);
+    const int32_t sub = sub_bucket_index(h, v, bucket);
+    const int adjusted = (sub >= h->sub_bucket_count) ? bucket + 1 : bucket;
+    const uint64_t lowest = (uint64_t)sub << (bucket + h->unit_magnitude);
+
+    return lowest + (1ull << (h->unit_magnitude + adjusted)) - 1;
+}
+
+static int buckets_needed(const uint64_t highest,
+                          const int32_t sub_bucket_count,
+                          const int unit_magnitude)
+{
+    uint64_t untrackable = (uint64_t)sub_bucket_count << unit_magnitude;
+    int buckets = 1;
+
+    while (untrackable <= highest) {
+        if (untrackable > (UINT64_MAX >> 2))
+            return buckets + 1;
+        untrackable <<= 1;
+        buckets++;
+    }
+
+    return buckets;
+}
+
+struct mqtta_histogram* mqtta_histogram_create(const uint64_t lowest,
+                                               const uint64_t highest,
+                                               const int digits)
+{
+    if ((lowest < 1) || (highest < 2 * lowest) ||
+        (digits < 1) || (digits > 5)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const uint64_t largest_single_unit = 2 * (uint64_t)pow(10, digits);
+    const int sub_bucket_count_magnitude =
+        log2_floor(largest_single_unit - 1) + 1;
+    const int half_magnitude = sub_bucket_count_magnitude - 1;
+    const int unit_magnitude = log2_floor(lowest);
+
+    if (unit_magnitude + half_magnitude > 61) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const int32_t sub_bucket_count = 1 << (half_magnitude + 1);
+    const int bucket_count = buckets_needed(highest, sub_bucket_count,
+                                            unit_magnitude);
+    const int counts_len = (bucket_count + 1) * (sub_bucket_count / 2);
+
+    struct mqtta_histogram *h;
+    h = mqtta_calloc(NULL, 1, sizeof(*h) + counts_len * sizeof(uint64_t));
+    if (!h)
+        return NULL;
+
+    h->lowest = lowest;
+    h->highest = highest;
+    h->digits = digits;
+    h->unit_magnitude = unit_magnitude;
+    h->sub_bucket_half_count_magnitude = half_magnitude;
+    h->sub_bucket_count = sub_bucket_count;
+    h->sub_bucket_half_count = sub_bucket_count / 2;
+    h->sub_bucket_mask = (uint64_t)(sub_bucket_count - 1) << unit_magnitude;
+    h->bucket_count = bucket_count;
+    h->counts_len = counts_len;
+    h->min = UINT64_MAX;
+
+    return h;
+}
+
+void mqtta_histogram_destroy(struct mqtta_histogram *histogram)
+{
+    mqtta_free(histogram);
+}
+
+void mqtta_histogram_record(struct mqtta_histogram *h, uint64_t value)
+{
+    if (value > h->highest)
+        value = h->highest;
+
+    h->counts[counts_index(h, value)]++;
+    h->total++;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->sum += value;
+    h->sum_squares += (double)value * value;
+}
+
+int mqtta_histogram_add(struct mqtta_histogram *dst,
+                        const struct mqtta_histogram *src)
+{
+    if ((dst->lowest != src->lowest) ||
+        (dst->highest != src->highest) ||
+        (dst->digits != src->digits)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < dst->counts_len; i++)
+        dst->counts[i] += src->counts[i];
+
+    dst->total += src->total;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->sum += src->sum;
+    dst->sum_squares += src->sum_squares;
+
+    return 0;
+}
+
+void mqtta_histogram_reset(struct mqtta_histogram *h)
+{
+    memset(h->counts, 0, h->counts_len * sizeof(*h->counts));
+    h->total = 0;
+    h->min = UINT64_MAX;
+    h->max = 0;
+    h->sum = 0.0;
+    h->sum_squares = 0.0;
+}
+
+uint64_t mqtta_histogram_count(const struct mqtta_histogram *h)
+{
+    return h->total;
+}
+
+uint64_t mqtta_histogram_min(const struct mqtta_histogram *h)
+{
+    return h->total ? h->min : 0;
+}
+
+uint64_t mqtta_histogram_max(const struct mqtta_histogram *h)
+{
+    return h->max;
+}
+
+double mqtta_histogram_mean(const struct mqtta_histogram *h)
+{
+    return h->total ? h->sum / h->total : 0.0;
+}
+
+static double stddev(const struct mqtta_histogram *h)
+{
+    if (!h->total)
+        return 0.0;
+
+    const double mean = h->sum / h->total;
+    const double variance = h->sum_squares / h->total - mean * mean;
+
+    return variance > 0.0 ? sqrt(variance) : 0.0;
+}
+
+uint64_t mqtta_histogram_value_at(const struct mqtta_histogram *h,
+                                  double percentile)
+{
+    if (!h->total)
+        return 0;
+
+    if (percentile < 0.0)
+        percentile = 0.0;
+    if (percentile > 100.0)
+        percentile = 100.0;
+
+    uint64_t wanted = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (wanted < 1)
+        wanted = 1;
+
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < h->counts_len; i++) {
+        seen += h->counts[i];
+        if (seen >= wanted) {
+            const uint64_t v = highest_equivalent(h, value_at_index(h, i));
+            return v < h->max ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+int mqtta_histogram_print(const struct mqtta_histogram *h,
+                          FILE *file,
+                          const double scale)
+{
+    if (!h || !file || (scale <= 0.0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fprintf(file, "%12s %14s %10s %14s\n\n",
+            "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    double level = 0.0;
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; (i < h->counts_len) && (seen < h->total); i++) {
+        if (!h->counts[i])
+            continue;
+        seen += h->counts[i];
+
+        uint64_t v = highest_equivalent(h, value_at_index(h, i));
+        if (v > h->max)
+            v = h->max;
+        const double reached = 100.0 * seen / h->total;
+
+        // each level up to the one reached, the last one only once
+        while (level <= reached) {
+            fprintf(file, "%12.3f %2.12f %10llu %14.2f\n",
+                    v / scale, level / 100.0, (unsigned long long)seen,
+                    1.0 / (1.0 - level / 100.0));
+            if (seen == h->total)
+                break;
+
+            const int half_distances =
+                (int)floor(log2(100.0 / (100.0 - level))) + 1;
+            level += 100.0 / (TICKS_PER_HALF * pow(2.0, half_distances));
+        }
+    }
+
+    fprintf(file, "%12.3f %2.12f %10llu\n",
+            h->max / scale, 1.0, (unsigned long long)h->total);
+
+    fprintf(file, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+            mqtta_histogram_mean(h) / scale, stddev(h) / scale);
+    fprintf(file, "#[Max     = %12.3f, Total count    = %12llu]\n",
+            h->max / scale, (unsigned long long)h->total);
+    fprintf(file, "#[Buckets = %12d, SubBuckets     = %12d]\n",
+            h->bucket_count, h->sub_bucket_count);
+
+    if (ferror(file)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,536 @@
+/*
+ * Priority lanes for outgoing messages
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <mosquitto.h>
+
+#include "mqtta-private.h"
+
+/* Initial number of buckets of a latest-only index, doubled when the load
+ * exceeds 1 */
+#define LATEST_BUCKETS  16
+
+struct queued {
+    struct queued *next;
+    struct mqtta_message *msg;
+    size_t size;
+    /* monotonic ms, 0 for no expiry */
+    uint64_t expires;
+
+    /* in the latest-only index of the lane, by topic hash */
+    bool indexed;
+    uint32_t hash;
+    struct queued *chain;
+};
+
+struct lane {
+    struct queued *head;
+    struct queued *tail;
+
+    size_t budget;
+    bool drop_oldest;
+
+    /* waiting latest-only messages by topic, allocated on first use */
+    struct queued **latest;
+    unsigned int latest_mask;
+    unsigned int latest_count;
+
+    struct mqtta_lane_stats stats;
+};
+
+struct rule {
+    struct rule *next;
+    char *filter;
+    enum mqtta_priority priority;
+    unsigned int ttl_ms;
+    bool latest_only;
+};
+
+struct mqtta_lanes {
+    /* index 0 is the critical lane */
+    struct lane lane[MQTTA_PRIORITY_LANES];
+    unsigned int queued;
+
+    struct rule *priority_rules;
+    struct rule *expiry_rules;
+};
+
+static bool valid_priority(const enum mqtta_priority priority)
+{
+    return (priority >= MQTTA_PRIORITY_CRITICAL) &&
+           (priority <= MQTTA_PRIORITY_LOW);
+}
+
+static struct mqtta_lanes* get_lanes(struct mosqagent *agent)
+{
+    if (!agent->lanes)
+        agent->lanes = mqtta_calloc(agent->allocator, 1, sizeof(*agent->lanes));
+
+    return agent->lanes;
+}
+
+static const struct rule* match_rule(const struct rule *r, const char *topic)
+{
+    for (; r; r = r->next) {
+        bool match = false;
+        mosquitto_topic_matches_sub(r->filter, topic, &match);
+        if (match)
+            return r;
+    }
+
+    return NULL;
+}
+
+static struct lane* lane_of(struct mqtta_lanes *l,
+                            const struct mqtta_message *msg)
+{
+    enum mqtta_priority priority = msg->priority;
+
+    if (!valid_priority(priority)) {
+        const struct rule *r = match_rule(l->priority_rules, msg->topic);
+        priority = r ? r->priority : MQTTA_PRIORITY_NORMAL;
+    }
+
+    return &l->lane[priority - MQTTA_PRIORITY_CRITICAL];
+}
+
+unsigned int mqtta_lanes_ttl(const struct mosqagent *agent,
+                             const struct mqtta_message *msg)
+{
+    if (msg->ttl_ms || !agent->lanes)
+        return msg->ttl_ms;
+
+    const struct rule *r = match_rule(agent->lanes->expiry_rules, msg->topic);
+    return r ? r->ttl_ms : 0;
+}
+
+static bool latest_only(const struct mqtta_lanes *l,
+                        const struct mqtta_message *msg)
+{
+    const struct rule *r = match_rule(l->expiry_rules, msg->topic);
+    return r && r->latest_only;
+}
+
+/*
+ * Is a message waiting in this or a higher lane?
+ */
+static bool waiting(const struct mqtta_lanes *l, const struct lane *lane)
+{
+    const struct lane *i;
+    for (i = l->lane; i <= lane; i++)
+        if (i->head)
+            return true;
+
+    return false;
+}
+
+static uint32_t topic_hash(const char *topic)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *topic; topic++) {
+        hash ^= (unsigned char)*topic;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Find the slot of the waiting latest-only message on a topic, or the end
+ * of its chain.
+ */
+static struct queued** find_latest(struct lane *lane,
+                                   const char *topic,
+                                   const uint32_t hash)
+{
+    struct queued **q = &lane->latest[hash & lane->latest_mask];
+    while (*q && (((*q)->hash != hash) || strcmp((*q)->msg->topic, topic)))
+        q = &(*q)->chain;
+
+    return q;
+}
+
+/*
+ * Make room for one more message in the latest-only index.
+ */
+static int reserve_latest(struct mosqagent *agent, struct lane *lane)
+{
+    if (lane->latest && (lane->latest_count <= lane->latest_mask))
+        return 0;
+
+    const unsigned int size = lane->latest ? 2 * (lane->latest_mask + 1)
+                                           : LATEST_BUCKETS;
+    struct queued **latest = mqtta_calloc(agent->allocator, size,
+                                          sizeof(*latest));
+    if (!latest)
+        // errno is already set
+        return -1;
+
+    if (lane->latest) {
+        unsigned int i;
+        for (i = 0; i <= lane->latest_mask; i++) {
+            struct queued *q = lane->latest[i];
+            while (q) {
+                struct queued *next = q->chain;
+                q->chain = latest[q->hash & (size - 1)];
+                latest[q->hash & (size - 1)] = q;
+                q = next;
+            }
+        }
+        mqtta_free(lane->latest);
+    }
+
+    lane->latest = latest;
+    lane->latest_mask = size - 1;
+
+    return 0;
+}
+
+static struct queued* dequeue(struct mqtta_lanes *l, struct lane *lane)
+{
+    struct queued *q = lane->head;
+
+    if (q->indexed) {
+        struct queued **slot = find_latest(lane, q->msg->topic, q->hash);
+        *slot = q->chain;
+        lane->latest_count--;
+    }
+
+    lane->head = q->next;
+    if (!lane->head)
+        lane->tail = NULL;
+
+    lane->stats.queued--;
+    lane->stats.bytes -= q->size;
+    l->queued--;
+
+    return q;
+}
+
+static void drop(struct queued *q)
+{
+    mqtta_dispose_message(q->msg);
+    mqtta_free(q);
+}
+
+static bool expired(const struct queued *q, const uint64_t now)
+{
+    return q->expires && (q->expires <= now);
+}
+
+static int enqueue(struct mosqagent *agent,
+                   struct lane *lane,
+                   const struct mqtta_message *msg,
+                   const unsigned int ttl_ms)
+{
+    struct mqtta_lanes *l = agent->lanes;
+
+    const uint64_t now = mqtta_now_ms();
+    const size_t size = sizeof(struct queued) + sizeof(*msg) +
+                        strlen(msg->topic) + msg->payloadlen + 2;
+
+    // latest only: the new message takes the place of the waiting one
+    const bool latest = latest_only(l, msg);
+    const uint32_t hash = latest ? topic_hash(msg->topic) : 0;
+    if (latest && reserve_latest(agent, lane))
+        return -1;
+
+    struct mqtta_message *copy;
+    copy = mqtta_copy_message(agent->allocator,
+                              msg->topic, msg->payload, msg->payloadlen,
+                              msg->qos, msg->retain);
+    if (!copy)
+        return -1;
+
+    struct queued *q = latest ? *find_latest(lane, msg->topic, hash) : NULL;
+    if (q) {
+        mqtta_dispose_message(q->msg);
+        q->msg = copy;
+        lane->stats.bytes += size - q->size;
+        q->size = size;
+        q->expires = ttl_ms ? now + ttl_ms : 0;
+        lane->stats.replaced++;
+        return 0;
+    }
+
+    // expired messages go first
+    while (lane->head && expired(lane->head, now)) {
+        drop(dequeue(l, lane));
+        lane->stats.expired++;
+    }
+
+    if (lane->budget) {
+        while (lane->drop_oldest && lane->head &&
+               (lane->stats.bytes + size > lane->budget)) {
+            drop(dequeue(l, lane));
+            lane->stats.dropped++;
+        }
+
+        if (lane->stats.bytes + size > lane->budget) {
+            mqtta_dispose_message(copy);
+            lane->stats.dropped++;
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    q = mqtta_malloc(agent->allocator, sizeof(*q));
+    if (!q) {
+        mqtta_dispose_message(copy);
+        return -1;
+    }
+
+    q->msg = copy;
+    q->next = NULL;
+    q->size = size;
+    q->expires = ttl_ms ? now + ttl_ms : 0;
+
+    q->indexed = latest;
+    q->hash = hash;
+    q->chain = NULL;
+    if (latest) {
+        *find_latest(lane, copy->topic, hash) = q;
+        lane->latest_count++;
+    }
+
+    if (lane->tail)
+        lane->tail->next = q;
+    else
+        lane->head = q;
+    lane->tail = q;
+
+    lane->stats.queued++;
+    lane->stats.bytes += size;
+    l->queued++;
+
+    return 0;
+}
+
+/*
+ * Can the client take a message without queueing it?
+ */
+static bool writable(const struct mosqagent *agent)
+{
+    return agent->connected && !mosquitto_want_write(agent->mosq);
+}
+
+int mqtta_lanes_send(struct mosqagent *agent,
+                     const struct mqtta_message *msg)
+{
+    struct mqtta_lanes *l = agent->lanes;
+    // a message with a time to live switches to lanes, so that it waits
+    // and expires in the agent instead of the MQTT client
+    if (!l && msg->ttl_ms) {
+        l = get_lanes(agent);
+        if (!l)
+            // errno is already set
+            return -1;
+    }
+    if (!l)
+        return mqtta_publish_now(agent, msg);
+
+    struct lane *lane = lane_of(l, msg);
+    const unsigned int ttl_ms = mqtta_lanes_ttl(agent, msg);
+
+    // keep the order within the lane
+    if (waiting(l, lane) || !writable(agent))
+        return enqueue(agent, lane, msg, ttl_ms);
+
+    lane->stats.sent++;
+    if (ttl_ms == msg->ttl_ms)
+        return mqtta_publish_now(agent, msg);
+
+    // the topic's time to live goes to the broker as well
+    struct mqtta_message m = *msg;
+    m.ttl_ms = ttl_ms;
+    return mqtta_publish_now(agent, &m);
+}
+
+int mosqagent_flush_lanes(struct mosqagent *agent)
+{
+    if (!agent || !agent->lanes)
+        return 0;
+
+    struct mqtta_lanes *l = agent->lanes;
+    int sent = 0;
+
+    while (l->queued && writable(agent)) {
+        struct lane *lane = l->lane;
+        while (!lane->head)
+            lane++;
+
+        struct queued *q = lane->head;
+        const uint64_t now = mqtta_now_ms();
+        if (expired(q, now)) {
+            drop(dequeue(l, lane));
+            lane->stats.expired++;
+            continue;
+        }
+
+        // the broker gets the remaining time
+        q->msg->ttl_ms = q->expires ? q->expires - now : 0;
+
+        errno = 0;
+        const int ret = mqtta_publish_now(agent, q->msg);
+        // keep the message for the next connection or a full local ring
+        if ((ret == MOSQ_ERR_NO_CONN) || ((ret < 0) && (errno == EAGAIN)))
+            break;
+
+        drop(dequeue(l, lane));
+        if (ret) {
+            lane->stats.dropped++;
+        } else {
+            lane->stats.sent++;
+            ++sent;
+        }
+    }
+
+    return sent;
+}
+
+int mosqagent_set_lane(struct mosqagent *agent,
+                       const enum mqtta_priority priority,
+                       const size_t budget,
+                       const bool drop_oldest)
+{
+    if (!agent || !valid_priority(priority)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_lanes *l = get_lanes(agent);
+    if (!l)
+        return -1;
+
+    struct lane *lane = &l->lane[priority - MQTTA_PRIORITY_CRITICAL];
+    lane->budget = budget;
+    lane->drop_oldest = drop_oldest;
+
+    return 0;
+}
+
+/*
+ * Append a rule for a topic filter to a list.
+ */
+static struct rule* add_rule(struct mosqagent *agent,
+                             struct rule **list,
+                             const char *filter)
+{
+    struct rule *r = mqtta_calloc(agent->allocator, 1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->filter = mqtta_strdup(agent->allocator, filter);
+    if (!r->filter) {
+        mqtta_free(r);
+        return NULL;
+    }
+
+    while (*list)
+        list = &(*list)->next;
+    *list = r;
+
+    return r;
+}
+
+static void free_rules(struct rule *r)
+{
+    while (r) {
+        struct rule *next = r->next;
+        mqtta_free(r->filter);
+        mqtta_free(r);
+        r = next;
+    }
+}
+
+int mosqagent_add_priority(struct mosqagent *agent,
+                           const char *filter,
+                           const enum mqtta_priority priority)
+{
+    if (!agent || !filter || !valid_priority(priority) ||
+        (mosquitto_sub_topic_check(filter) != MOSQ_ERR_SUCCESS)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_lanes *l = get_lanes(agent);
+    if (!l)
+        return -1;
+
+    struct rule *r = add_rule(agent, &l->priority_rules, filter);
+    if (!r)
+        return -1;
+    r->priority = priority;
+
+    return 0;
+}
+
+int mosqagent_add_expiry(struct mosqagent *agent,
+                         const char *filter,
+                         const unsigned int ttl_ms,
+                         const bool latest_only)
+{
+    if (!agent || !filter ||
+        (mosquitto_sub_topic_check(filter) != MOSQ_ERR_SUCCESS)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_lanes *l = get_lanes(agent);
+    if (!l)
+        return -1;
+
+    struct rule *r = add_rule(agent, &l->expiry_rules, filter);
+    if (!r)
+        return -1;
+    r->ttl_ms = ttl_ms;
+    r->latest_only = latest_only;
+
+    return 0;
+}
+
+int mosqagent_lane_stats(const struct mosqagent *agent,
+                         const enum mqtta_priority priority,
+                         struct mqtta_lane_stats *stats)
+{
+    if (!agent || !valid_priority(priority) || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (agent->lanes)
+        *stats = agent->lanes->lane[priority - MQTTA_PRIORITY_CRITICAL].stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+
+    return 0;
+}
+
+void mqtta_free_lanes(struct mosqagent *agent)
+{
+    struct mqtta_lanes *l = agent->lanes;
+    if (!l)
+        return;
+
+    int i;
+    for (i = 0; i < MQTTA_PRIORITY_LANES; i++) {
+        while (l->lane[i].head)
+            drop(dequeue(l, &l->lane[i]));
+        mqtta_free(l->lane[i].latest);
+    }
+
+    free_rules(l->priority_rules);
+    free_rules(l->expiry_rules);
+
+    mqtta_free(l);
+    agent->lanes = NULL;
+}
@@ -0,0 +1,716 @@
+/*
+ * Shared-memory transport between agents on one host
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta-local.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <mosquitto.h>
+
+#include "mqtt-tools/mosqhelper.h"
+#include "mqtta-private.h"
+
+#define LOCAL_VERSION       2
+/* The directory is being set up by its creator. */
+#define LOCAL_VERSION_INIT  UINT32_MAX
+#define LOCAL_GROUP_LEN     64
+
+#define RING_MASK           (MQTTA_LOCAL_RING_SIZE - 1)
+/* Larger messages go through the broker. */
+#define RECORD_MAX          (MQTTA_LOCAL_RING_SIZE / 4)
+/* Marks the unused end of the ring before a wrap. */
+#define RECORD_PAD          0xffff
+
+/*
+ * Shared memory layouts. All members of a group must use the same
+ * version of this file.
+ */
+
+struct local_member {
+    /** process of the member, 0 for a free slot */
+    int32_t pid;
+    /** changed each time the slot is taken */
+    uint32_t incarnation;
+    uint32_t topic_count;
+    char topic[MQTTA_LOCAL_MAX_TOPICS][MQTTA_LOCAL_TOPIC_LEN];
+};
+
+struct local_directory {
+    uint32_t version;
+    pthread_mutex_t lock;
+    /** changed with each change of the members or their topics */
+    uint32_t generation;
+    struct local_member member[MQTTA_LOCAL_MAX_MEMBERS];
+};
+
+/*
+ * Multi-producer, single-consumer byte ring. Producers serialise on the
+ * lock, the consumer only moves the tail. Producer and consumer fields are
+ * on separate cache lines.
+ */
+struct local_ring {
+    pthread_mutex_t lock;
+    uint64_t head;
+    /** set by the consumer while it waits for a wake-up */
+    uint32_t sleeping;
+    uint64_t dropped;
+    uint8_t pad0[64];
+
+    uint64_t tail;
+    uint8_t pad1[56];
+
+    uint8_t data[MQTTA_LOCAL_RING_SIZE];
+};
+
+/*
+ * Record header, followed by topic and payload, each with a terminating \0,
+ * padded to 8 bytes. A padding record may be only 8 bytes long, so it
+ * must be recognised by `size` and `topiclen`.
+ */
+struct local_record {
+    uint32_t size;
+    uint16_t topiclen;
+    uint8_t qos;
+    uint8_t retain;
+    uint32_t payloadlen;
+    uint32_t reserved;
+};
+
+/* Process-local view of another member */
+struct local_peer {
+    bool active;
+    uint32_t incarnation;
+    struct local_ring *ring;
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    uint32_t topic_count;
+    char topic[MQTTA_LOCAL_MAX_TOPICS][MQTTA_LOCAL_TOPIC_LEN];
+};
+
+struct mqtta_local {
+    char group[LOCAL_GROUP_LEN];
+    bool mirror;
+
+    struct local_directory *dir;
+    int slot;
+    struct local_ring *ring;
+    /** bound to the member's wake-up address */
+    int wake_fd;
+    /** unbound, for sending wake-ups */
+    int send_fd;
+
+    uint32_t generation;
+    bool peers_valid;
+    struct local_peer peer[MQTTA_LOCAL_MAX_MEMBERS];
+};
+
+/*
+ * Set up a lock in shared memory that survives the death of its holder.
+ */
+static int shm_lock_init(pthread_mutex_t *lock)
+{
+    pthread_mutexattr_t attr;
+
+    int err = pthread_mutexattr_init(&attr);
+    if (err)
+        return err;
+
+    err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (!err)
+        err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (!err)
+        err = pthread_mutex_init(lock, &attr);
+
+    pthread_mutexattr_destroy(&attr);
+    return err;
+}
+
+static void shm_lock(pthread_mutex_t *lock)
+{
+    // A member died while holding the lock. The data it protects is valid
+    // after each store: a ring's head only moves after the record is
+    // complete, and a half-written directory entry belongs to a dead
+    // member, whose slot is taken over anyway.
+    if (pthread_mutex_lock(lock) == EOWNERDEAD)
+        pthread_mutex_consistent(lock);
+}
+
+static void shm_unlock(pthread_mutex_t *lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+static void ring_name(char *buf, const size_t len,
+                      const char *group, const int slot)
+{
+    snprintf(buf, len, "%s%s.%d", MQTTA_LOCAL_SHM_PREFIX, group, slot);
+}
+
+static socklen_t wake_address(struct sockaddr_un *addr,
+                              const char *group, const int slot)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    // abstract namespace: leading \0, not terminated
+    const int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                             "mqtta.%s.%d", group, slot);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static void* map_shm(const char *name, const size_t size, const int flags)
+{
+    const int fd = shm_open(name, O_RDWR | flags, 0660);
+    if (fd < 0)
+        return NULL;
+
+    if ((flags & O_CREAT) && ftruncate(fd, size)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+static bool member_alive(const struct local_member *m)
+{
+    return m->pid && !((kill(m->pid, 0) < 0) && (errno == ESRCH));
+}
+
+/*
+ * Update the view on the other members if the directory has changed.
+ */
+static void refresh_peers(struct mqtta_local *local)
+{
+    struct local_directory *dir = local->dir;
+
+    if (local->peers_valid &&
+        (__atomic_load_n(&dir->generation, __ATOMIC_ACQUIRE) == local->generation))
+        return;
+
+    int i;
+
+    shm_lock(&dir->lock);
+    for (i = 0; i < MQTTA_LOCAL_MAX_MEMBERS; i++) {
+        const struct local_member *m = &dir->member[i];
+        struct local_peer *p = &local->peer[i];
+
+        if (p->ring && (!m->pid || (p->incarnation != m->incarnation))) {
+            munmap(p->ring, sizeof(*p->ring));
+            p->ring = NULL;
+        }
+
+        p->active = (m->pid != 0);
+        p->incarnation = m->incarnation;
+        p->topic_count = m->topic_count;
+        memcpy(p->topic, m->topic, sizeof(p->topic));
+    }
+    local->generation = dir->generation;
+    shm_unlock(&dir->lock);
+
+    // map the new rings outside the lock
+    for (i = 0; i < MQTTA_LOCAL_MAX_MEMBERS; i++) {
+        struct local_peer *p = &local->peer[i];
+        if (!p->active || p->ring)
+            continue;
+
+        if (i == local->slot) {
+            p->ring = local->ring;
+        } else {
+            char name[NAME_MAX];
+            ring_name(name, sizeof(name), local->group, i);
+            p->ring = map_shm(name, sizeof(*p->ring), 0);
+        }
+
+        // a member that has just left
+        if (!p->ring)
+            p->active = false;
+        else
+            p->addrlen = wake_address(&p->addr, local->group, i);
+    }
+
+    local->peers_valid = true;
+}
+
+static bool peer_matches(const struct local_peer *p, const char *topic)
+{
+    uint32_t i;
+
+    for (i = 0; i < p->topic_count; i++) {
+        bool match = false;
+        mosquitto_topic_matches_sub(p->topic[i], topic, &match);
+        if (match)
+            return true;
+    }
+
+    return false;
+}
+
+static uint32_t record_size(const struct mqtta_message *msg)
+{
+    const size_t size = sizeof(struct local_record) +
+                        strlen(msg->topic) + 1 + msg->payloadlen + 1;
+
+    return (size + 7) & ~(size_t)7;
+}
+
+/*
+ * Append a message to a ring.
+ *
+ * \returns 1 if the consumer has to be woken up, 0 if not, -1 if the ring
+ *          is full.
+ */
+static int ring_write(struct local_ring *ring,
+                       const struct mqtta_message *msg,
+                       const uint32_t size)
+{
+    shm_lock(&ring->lock);
+
+    uint64_t head = ring->head;
+    const uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    const uint32_t contiguous = MQTTA_LOCAL_RING_SIZE - (head & RING_MASK);
+    const uint32_t skip = (size > contiguous) ? contiguous : 0;
+
+    if (head + skip + size - tail > MQTTA_LOCAL_RING_SIZE) {
+        ring->dropped++;
+        shm_unlock(&ring->lock);
+        return -1;
+    }
+
+    if (skip) {
+        struct local_record *pad = (void*)&ring->data[head & RING_MASK];
+        pad->size = skip;
+        pad->topiclen = RECORD_PAD;
+        head += skip;
+    }
+
+    struct local_record *r = (void*)&ring->data[head & RING_MASK];
+    const size_t topiclen = strlen(msg->topic);
+    char *topic = (char*)(r + 1);
+    char *payload = topic + topiclen + 1;
+
+    r->size = size;
+    r->topiclen = topiclen;
+    r->qos = msg->qos;
+    r->retain = msg->retain;
+    r->payloadlen = msg->payloadlen;
+    memcpy(topic, msg->topic, topiclen + 1);
+    if (msg->payloadlen)
+        memcpy(payload, msg->payload, msg->payloadlen);
+    payload[msg->payloadlen] = '\0';
+
+    // pairs with the consumer setting `sleeping` before checking the ring
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_SEQ_CST);
+    const int wake = __atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST) ? 1 : 0;
+
+    shm_unlock(&ring->lock);
+
+    return wake;
+}
+
+/*
+ * Publish to the broker with the group marker, so that the members do not
+ * receive the message twice.
+ */
+static int mirror(struct mosqagent *agent, const struct mqtta_message *msg)
+{
+    if (!agent->mosq) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    // without v5 the copy can not be marked, see mqtta-local.h
+    mosquitto_property *props = NULL;
+    if (mqtta_is_v5(agent) &&
+        mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY,
+                                           MQTTA_LOCAL_PROPERTY,
+                                           agent->local->group)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    const int ret = mqtt_publish_v5(agent->mosq, NULL,
+                                    msg->topic,
+                                    msg->payloadlen, msg->payload,
+                                    msg->qos,
+                                    msg->retain,
+                                    props);
+    mosquitto_property_free_all(&props);
+
+    return ret;
+}
+
+int mqtta_local_publish(struct mosqagent *agent,
+                        const struct mqtta_message *msg,
+                        bool *handled)
+{
+    struct mqtta_local *local = agent->local;
+
+    refresh_peers(local);
+
+    const uint32_t size = record_size(msg);
+    *handled = (size <= RECORD_MAX) &&
+               (strlen(msg->topic) < RECORD_PAD) &&
+               peer_matches(&local->peer[local->slot], msg->topic);
+    if (!*handled)
+        return 0;
+
+    bool full = false;
+    int i;
+    for (i = 0; i < MQTTA_LOCAL_MAX_MEMBERS; i++) {
+        struct local_peer *p = &local->peer[i];
+        if (!p->active || !peer_matches(p, msg->topic))
+            continue;
+
+        const int ret = ring_write(p->ring, msg, size);
+        if (ret < 0)
+            full = true;
+        else if (ret && (i != local->slot))
+            sendto(local->send_fd, "", 1, MSG_DONTWAIT,
+                   (struct sockaddr*)&p->addr, p->addrlen);
+    }
+
+    const int ret = local->mirror ? mirror(agent, msg) : 0;
+
+    // QoS 0 may be lost, the others are for the sender to try again
+    if (!ret && full && msg->qos) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return ret;
+}
+
+bool mqtta_local_is_echo(struct mosqagent *agent,
+                         const char *topic,
+                         const mosquitto_property *props)
+{
+    struct mqtta_local *local = agent->local;
+    if (!local || !props)
+        return false;
+
+    bool marked = false;
+    char *name = NULL;
+    char *value = NULL;
+
+    const mosquitto_property *p;
+    p = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY,
+                                            &name, &value, false);
+    while (p && !marked) {
+        marked = !strcmp(name, MQTTA_LOCAL_PROPERTY) &&
+                 !strcmp(value, local->group);
+        free(name);
+        free(value);
+        name = value = NULL;
+
+        if (!marked)
+            p = mosquitto_property_read_string_pair(p, MQTT_PROP_USER_PROPERTY,
+                                                    &name, &value, true);
+    }
+
+    if (!marked)
+        return false;
+
+    // delivered through the ring if it is a local topic here as well
+    refresh_peers(local);
+    return peer_matches(&local->peer[local->slot], topic);
+}
+
+int mosqagent_local_poll(struct mosqagent *agent)
+{
+    if (!agent) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!agent->local)
+        return 0;
+
+    struct local_ring *ring = agent->local->ring;
+    uint64_t tail = ring->tail;
+    const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    while (tail != head) {
+        const struct local_record *r = (void*)&ring->data[tail & RING_MASK];
+        const uint32_t size = r->size;
+
+        if (r->topiclen != RECORD_PAD) {
+            const char *topic = (const char*)(r + 1);
+
+            // handlers read straight from the ring
+            mqtta_dispatch_message(agent,
+                                   topic,
+                                   topic + r->topiclen + 1, r->payloadlen,
+                                   r->qos,
+                                   r->retain);
+            ++count;
+        }
+
+        tail += size;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return count;
+}
+
+int mqtta_local_wait(struct mosqagent *agent, int timeout)
+{
+    struct mqtta_local *local = agent->local;
+    struct local_ring *ring = local->ring;
+
+    struct pollfd fds[2] = {
+        { .fd = local->wake_fd, .events = POLLIN },
+        { .fd = agent->mosq ? mosquitto_socket(agent->mosq) : -1,
+          .events = POLLIN },
+    };
+    if (agent->mosq && mosquitto_want_write(agent->mosq))
+        fds[1].events |= POLLOUT;
+
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail)
+        timeout = 0;
+
+    poll(fds, 2, timeout);
+
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+
+    if (fds[0].revents & POLLIN) {
+        char buf[64];
+        while (recv(local->wake_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+            ;
+    }
+
+    mosqagent_local_poll(agent);
+
+    if (!agent->mosq)
+        return 0;
+
+    return mqtt_loop_events(agent->mosq,
+                            fds[1].revents & (POLLIN | POLLERR | POLLHUP),
+                            fds[1].revents & POLLOUT);
+}
+
+int mosqagent_local_join(struct mosqagent *agent,
+                         const char *group,
+                         const bool mirror)
+{
+    if (!agent || !group || !strlen(group) ||
+        (strlen(group) >= LOCAL_GROUP_LEN) || strpbrk(group, "/+#")) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (agent->local) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    struct mqtta_local *local = mqtta_calloc(agent->allocator, 1, sizeof(*local));
+    if (!local) {
+        errno = ENOMEM;
+        return -1;
+    }
+    strcpy(local->group, group);
+    local->mirror = mirror;
+    local->slot = -1;
+    local->wake_fd = -1;
+    local->send_fd = -1;
+
+    char name[NAME_MAX];
+    snprintf(name, sizeof(name), "%s%s", MQTTA_LOCAL_SHM_PREFIX, group);
+
+    // a new directory is all zeros, which is an empty group
+    local->dir = map_shm(name, sizeof(*local->dir), O_CREAT);
+    if (!local->dir)
+        goto fail;
+
+    // the first member sets up the lock, the others wait for it
+    uint32_t version = 0;
+    if (__atomic_compare_exchange_n(&local->dir->version, &version,
+                                    LOCAL_VERSION_INIT, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        const int err = shm_lock_init(&local->dir->lock);
+        if (err) {
+            __atomic_store_n(&local->dir->version, 0, __ATOMIC_RELEASE);
+            errno = err;
+            goto fail;
+        }
+        version = LOCAL_VERSION;
+        __atomic_store_n(&local->dir->version, version, __ATOMIC_RELEASE);
+    }
+    while (version == LOCAL_VERSION_INIT) {
+        sched_yield();
+        version = __atomic_load_n(&local->dir->version, __ATOMIC_ACQUIRE);
+    }
+    if (version != LOCAL_VERSION) {
+        errno = EPROTO;
+        goto fail;
+    }
+
+    local->wake_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    local->send_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ((local->wake_fd < 0) || (local->send_fd < 0))
+        goto fail;
+
+    struct local_directory *dir = local->dir;
+    int i;
+
+    shm_lock(&dir->lock);
+
+    // free slots and those of crashed members
+    for (i = 0; i < MQTTA_LOCAL_MAX_MEMBERS; i++)
+        if (!member_alive(&dir->member[i]))
+            break;
+    if (i == MQTTA_LOCAL_MAX_MEMBERS) {
+        shm_unlock(&dir->lock);
+        errno = EBUSY;
+        goto fail;
+    }
+
+    // a fresh ring, a crashed member may have left one behind
+    ring_name(name, sizeof(name), group, i);
+    shm_unlink(name);
+    local->ring = map_shm(name, sizeof(*local->ring), O_CREAT | O_EXCL);
+
+    struct sockaddr_un addr;
+    const socklen_t addrlen = wake_address(&addr, group, i);
+
+    // the others only see the ring after the directory update below
+    int lock_err = 0;
+    if (local->ring && (lock_err = shm_lock_init(&local->ring->lock))) {
+        shm_unlock(&dir->lock);
+        errno = lock_err;
+        goto fail;
+    }
+
+    if (!local->ring ||
+        bind(local->wake_fd, (struct sockaddr*)&addr, addrlen)) {
+        const int err = errno;
+        shm_unlock(&dir->lock);
+        errno = err;
+        goto fail;
+    }
+
+    struct local_member *m = &dir->member[i];
+    m->pid = getpid();
+    m->incarnation++;
+    m->topic_count = 0;
+    dir->generation++;
+    local->slot = i;
+
+    shm_unlock(&dir->lock);
+
+    agent->local = local;
+    return 0;
+
+fail:
+    if (local->ring) {
+        munmap(local->ring, sizeof(*local->ring));
+        shm_unlink(name);
+    }
+    if (local->wake_fd >= 0)
+        close(local->wake_fd);
+    if (local->send_fd >= 0)
+        close(local->send_fd);
+    if (local->dir)
+        munmap(local->dir, sizeof(*local->dir));
+    mqtta_free(local);
+
+    return -1;
+}
+
+int mosqagent_local_topic(struct mosqagent *agent,
+                          const char *filter)
+{
+    if (!agent || !agent->local || !filter ||
+        (strlen(filter) >= MQTTA_LOCAL_TOPIC_LEN) ||
+        (mosquitto_sub_topic_check(filter) != MOSQ_ERR_SUCCESS)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_local *local = agent->local;
+    struct local_directory *dir = local->dir;
+    struct local_member *m = &dir->member[local->slot];
+
+    shm_lock(&dir->lock);
+
+    if (m->topic_count == MQTTA_LOCAL_MAX_TOPICS) {
+        shm_unlock(&dir->lock);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    strcpy(m->topic[m->topic_count], filter);
+    m->topic_count++;
+    dir->generation++;
+
+    shm_unlock(&dir->lock);
+
+    return 0;
+}
+
+uint64_t mosqagent_local_dropped(const struct mosqagent *agent)
+{
+    if (!agent || !agent->local)
+        return 0;
+
+    return __atomic_load_n(&agent->local->ring->dropped, __ATOMIC_RELAXED);
+}
+
+void mqtta_free_local(struct mosqagent *agent)
+{
+    struct mqtta_local *local = agent->local;
+    if (!local)
+        return;
+
+    struct local_directory *dir = local->dir;
+
+    shm_lock(&dir->lock);
+    dir->member[local->slot].pid = 0;
+    dir->member[local->slot].topic_count = 0;
+    dir->generation++;
+    shm_unlock(&dir->lock);
+
+    int i;
+    for (i = 0; i < MQTTA_LOCAL_MAX_MEMBERS; i++)
+        if (local->peer[i].ring && (i != local->slot))
+            munmap(local->peer[i].ring, sizeof(*local->peer[i].ring));
+
+    // the directory stays, it is shared by all members over time
+    char name[NAME_MAX];
+    ring_name(name, sizeof(name), local->group, local->slot);
+    munmap(local->ring, sizeof(*local->ring));
+    shm_unlink(name);
+
+    close(local->wake_fd);
+    close(local->send_fd);
+    munmap(dir, sizeof(*dir));
+
+    mqtta_free(local);
+    agent->local = NULL;
+}
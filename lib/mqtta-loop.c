@@ -0,0 +1,164 @@
+/*
+ * Loop modes: blocking and busy polling
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#define _GNU_SOURCE
+
+#include "mqtt-tools/mqtta.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include <mosquitto.h>
+
+#include "mqtt-tools/mosqhelper.h"
+#include "mqtt-tools/mqtta-local.h"
+#include "mqtta-private.h"
+
+struct mqtta_loop {
+    struct mqtta_loop_config config;
+
+    /* messages dispatched, counted by mqtta_loop_work */
+    uint64_t work;
+    uint64_t seen;
+    uint64_t last_work_us;
+};
+
+static uint64_t now_us(void)
+{
+    // vDSO, no system call
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Pin the calling thread and switch it to the real-time scheduler.
+ */
+static int apply_scheduling(const struct mqtta_loop_config *config)
+{
+    if (config->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(config->cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            // errno is already set
+            return -1;
+    }
+
+    if (config->fifo_priority) {
+        const struct sched_param param = {
+            .sched_priority = config->fifo_priority,
+        };
+        if (sched_setscheduler(0, SCHED_FIFO, &param))
+            // errno is already set
+            return -1;
+    }
+
+    return 0;
+}
+
+int mosqagent_set_loop(struct mosqagent *agent,
+                       const struct mqtta_loop_config *config)
+{
+    if (!agent || !config ||
+        (config->mode < MQTTA_LOOP_BLOCKING) ||
+        (config->mode > MQTTA_LOOP_BUSY_POLL) ||
+        (config->cpu >= CPU_SETSIZE) ||
+        (config->fifo_priority < 0) || (config->fifo_priority > 99)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (apply_scheduling(config))
+        // errno is already set
+        return -1;
+
+    if (!agent->loop) {
+        agent->loop = mqtta_calloc(agent->allocator, 1, sizeof(*agent->loop));
+        if (!agent->loop)
+            return -1;
+    }
+
+    agent->loop->config = *config;
+    agent->loop->last_work_us = now_us();
+
+    return 0;
+}
+
+void mqtta_loop_work(struct mosqagent *agent)
+{
+    if (agent->loop)
+        agent->loop->work++;
+}
+
+/*
+ * Wait for the socket (and the local ring) up to the default period.
+ */
+static int wait_network(struct mosqagent *agent)
+{
+    return agent->local ? mqtta_local_wait(agent, 100)
+                        : mqtt_loop(agent->mosq);
+}
+
+/*
+ * Handle whatever the socket and the local ring have, without blocking.
+ * libmosquitto reads from its non-blocking socket, so a read without data
+ * returns right away.
+ */
+static int poll_network(struct mosqagent *agent)
+{
+    if (agent->local && (mosqagent_local_poll(agent) > 0) && agent->loop)
+        agent->loop->work++;
+
+    if (!agent->mosq)
+        return 0;
+
+    return mqtt_loop_events(agent->mosq, true,
+                            mosquitto_want_write(agent->mosq));
+}
+
+int mqtta_loop_network(struct mosqagent *agent,
+                       const bool work,
+                       const bool pending)
+{
+    struct mqtta_loop *loop = agent->loop;
+
+    // reconnects are paced by the blocking loop
+    if (agent->mosq && !agent->connected)
+        return wait_network(agent);
+
+    // idle calls have more to do, in any mode
+    if (pending) {
+        if (loop)
+            loop->last_work_us = now_us();
+        return poll_network(agent);
+    }
+
+    if (!loop || (loop->config.mode == MQTTA_LOOP_BLOCKING))
+        return wait_network(agent);
+
+    const uint64_t now = now_us();
+    if (work || (loop->work != loop->seen)) {
+        loop->seen = loop->work;
+        loop->last_work_us = now;
+    }
+
+    // nothing to do for a while, block until the next event
+    if (loop->config.spin_us &&
+        (now - loop->last_work_us > loop->config.spin_us))
+        return wait_network(agent);
+
+    return poll_network(agent);
+}
+
+void mqtta_free_loop(struct mosqagent *agent)
+{
+    mqtta_free(agent->loop);
+    agent->loop = NULL;
+}
@@ -0,0 +1,285 @@
+/*******************************************************************//**
+ * \file		mqtta-private.h
+ *
+ * \brief		Library internal functions shared between modules.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+#include "mqtt-tools/mqtta.h"
+
+#include <mosquitto.h>
+
+/**
+ * \brief Cancel and free all timers of the agent.
+ */
+void mqtta_free_timers(struct mosqagent *agent);
+
+/**
+ * \brief Create a message and deep-copy the values.
+ *
+ * Unlike mqtta_create_message this accepts empty and binary payloads.
+ *
+ * \param allocator the allocator, `NULL` for the global one
+ */
+struct mqtta_message* mqtta_copy_message(const struct mqtta_allocator *allocator,
+                                         const char *topic,
+                                         const void *payload,
+                                         int payloadlen,
+                                         int qos,
+                                         bool retain);
+
+/**
+ * \brief Hand a message to the MQTT client, bypassing all send limits.
+ */
+int mqtta_publish_now(struct mosqagent *agent,
+                      const struct mqtta_message *msg);
+
+/**
+ * \brief Like mqtta_publish_now, with MQTT v5 properties.
+ */
+int mqtta_publish_props(struct mosqagent *agent,
+                        const struct mqtta_message *msg,
+                        const mosquitto_property *props);
+
+/**
+ * \brief Check if the agent is configured for MQTT v5, which properties
+ *        need.
+ */
+bool mqtta_is_v5(const struct mosqagent *agent);
+
+/**
+ * \brief Like mqtta_publish_props, with the message id of the client.
+ *
+ * \param mid is set to the message id, or 0 if the message was delivered
+ *            in the local group or the client has completed it already
+ */
+int mqtta_publish_mid(struct mosqagent *agent,
+                      const struct mqtta_message *msg,
+                      const mosquitto_property *props,
+                      int *mid);
+
+/**
+ * \brief Dispatch a received message with its MQTT v5 properties.
+ */
+int mqtta_dispatch_props(struct mosqagent *agent,
+                         const char *topic,
+                         const void *payload,
+                         int payloadlen,
+                         int qos,
+                         bool retain,
+                         const mosquitto_property *props);
+
+/**
+ * \brief Check a message against the agent's rate limits.
+ *
+ * \returns 1 if the message may be sent now, 0 if it has been queued and
+ *          -1 with errno set if it has been dropped.
+ */
+int mqtta_ratelimit_admit(struct mosqagent *agent,
+                          const struct mqtta_message *msg);
+
+/**
+ * \brief Free rate limits and all pending messages.
+ */
+void mqtta_free_ratelimit(struct mosqagent *agent);
+
+/**
+ * \brief Send a message through its priority lane.
+ *
+ * Without lanes this is mqtta_publish_now.
+ *
+ * \returns 0 if sent or queued, -1 with errno set or a mosquitto error code.
+ */
+int mqtta_lanes_send(struct mosqagent *agent,
+                     const struct mqtta_message *msg);
+
+/**
+ * \brief Time to live of a message in ms, from the message or its topic.
+ */
+unsigned int mqtta_lanes_ttl(const struct mosqagent *agent,
+                             const struct mqtta_message *msg);
+
+/**
+ * \brief Free the priority lanes and all waiting messages.
+ */
+void mqtta_free_lanes(struct mosqagent *agent);
+
+/**
+ * \brief Handle the network in the agent's loop mode.
+ *
+ * \param work whether the loop had timers or messages to send
+ * \param pending whether idle calls want to run again right away; the
+ *                network is polled without blocking then
+ */
+int mqtta_loop_network(struct mosqagent *agent, bool work, bool pending);
+
+/**
+ * \brief Count a dispatched message for the busy poll.
+ */
+void mqtta_loop_work(struct mosqagent *agent);
+
+void mqtta_free_loop(struct mosqagent *agent);
+
+/**
+ * \brief Tell the watchdog what the loop is running; the name is copied.
+ */
+void mqtta_watchdog_enter(struct mosqagent *agent, const char *running);
+
+/**
+ * \brief Tell the watchdog that the loop completed an iteration.
+ */
+void mqtta_watchdog_iteration(struct mosqagent *agent);
+
+/**
+ * \brief Stop the watchdog thread.
+ */
+void mqtta_free_watchdog(struct mosqagent *agent);
+
+/**
+ * \brief Hand the agent's TLS settings to the MQTT client.
+ */
+int mqtta_tls_apply(struct mosqagent *agent);
+
+/**
+ * \brief Free the TLS settings and the kept session.
+ */
+void mqtta_free_tls(struct mosqagent *agent);
+
+/**
+ * \brief Complete the stream chunk with this message id.
+ */
+void mqtta_stream_published(struct mosqagent *agent, int mid);
+
+/**
+ * \brief Fail the streams that lost chunks with the connection.
+ */
+void mqtta_stream_disconnected(struct mosqagent *agent);
+
+/**
+ * \brief Cancel all streams.
+ */
+void mqtta_free_streams(struct mosqagent *agent);
+
+/**
+ * \brief Wake the task that waits for the message with this id.
+ */
+void mqtta_task_published(struct mosqagent *agent, int mid);
+
+/**
+ * \brief Fail the waits for QoS 0 messages lost with the connection.
+ */
+void mqtta_task_disconnected(struct mosqagent *agent);
+
+/**
+ * \brief Run all tasks to their end and free the stacks.
+ */
+void mqtta_free_tasks(struct mosqagent *agent);
+
+/**
+ * \brief Count a received message in the topic tracking.
+ */
+void mqtta_topics_count(struct mosqagent *agent,
+                        const char *topic,
+                        int payloadlen);
+
+/**
+ * \brief Cancel the snapshot timer and free the topic tracking.
+ */
+void mqtta_free_topics(struct mosqagent *agent);
+
+/**
+ * \brief Cancel all pending requests and free the RPC state.
+ */
+void mqtta_free_rpc(struct mosqagent *agent);
+
+/**
+ * \brief Deliver a message to the local group if it is on a local topic.
+ *
+ * \param handled is set if the message was delivered locally; in that
+ *                case it has also been mirrored to the broker if configured
+ *
+ * \returns the result of the mirror publish, 0 if not mirrored, or -1 with
+ *          errno `EAGAIN` if a ring was full for a message with QoS 1 or 2;
+ *          the members with space have it already.
+ */
+int mqtta_local_publish(struct mosqagent *agent,
+                        const struct mqtta_message *msg,
+                        bool *handled);
+
+/**
+ * \brief Check for a mirrored message that was already delivered locally.
+ */
+bool mqtta_local_is_echo(struct mosqagent *agent,
+                         const char *topic,
+                         const mosquitto_property *props);
+
+/**
+ * \brief Wait for the broker connection and the local ring, then service
+ *        both.
+ */
+int mqtta_local_wait(struct mosqagent *agent, int timeout);
+
+/**
+ * \brief Leave the local group.
+ */
+void mqtta_free_local(struct mosqagent *agent);
+
+enum mqtta_span {
+    MQTTA_SPAN_TIMERS,
+    MQTTA_SPAN_IDLE,
+    MQTTA_SPAN_NETWORK,
+    MQTTA_SPAN_DISPATCH,
+};
+
+/**
+ * \brief Start time for a loop span.
+ *
+ * \returns a time stamp, 0 if tracing is disabled.
+ */
+uint64_t mqtta_trace_begin(const struct mosqagent *agent);
+
+/**
+ * \brief Record a loop span from `start_ns` until now.
+ *
+ * \returns the end time as start of the next span, 0 if tracing is
+ *          disabled.
+ */
+uint64_t mqtta_trace_span(struct mosqagent *agent,
+                          enum mqtta_span kind,
+                          uint64_t start_ns);
+
+/**
+ * \brief Copy the properties of an outgoing message and add the trace
+ *        stamps.
+ *
+ * \returns 0 on success, -1 with errno set otherwise. The stamped list has
+ *          to be freed by the caller, it is `NULL` if the topic is over
+ *          the trace limit.
+ */
+int mqtta_trace_stamp(struct mosqagent *agent,
+                      const char *topic,
+                      const mosquitto_property *props,
+                      mosquitto_property **stamped);
+
+/**
+ * \brief Record latency and sequence of a received message.
+ */
+void mqtta_trace_receive(struct mosqagent *agent,
+                         const char *topic,
+                         const mosquitto_property *props);
+
+/**
+ * \brief Set the file for the trace dump on close.
+ */
+int mqtta_trace_set_dump(struct mosqagent *agent, const char *path);
+
+/**
+ * \brief Write the dump if configured and free the trace data.
+ */
+void mqtta_free_trace(struct mosqagent *agent);
@@ -0,0 +1,564 @@
+/*
+ * Token bucket rate limiting for outgoing messages
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mosquitto.h>
+
+#include "mqtta-private.h"
+
+/* Upper bound of delayed messages per topic */
+#define QUEUE_MAX           64
+
+#define TABLE_INITIAL_SIZE  64
+
+struct bucket {
+    double rate;
+    double burst;
+    double tokens;
+    uint64_t refilled;
+};
+
+struct rule {
+    struct rule *next;
+    char *filter;
+    enum mqtta_rate_policy policy;
+    struct bucket bucket;
+};
+
+struct pending {
+    struct pending *next;
+    struct mqtta_message *msg;
+    /* monotonic ms, 0 for no expiry */
+    uint64_t expires;
+};
+
+/*
+ * Per-topic state. Topics that match a rule or have delayed messages are
+ * interned here, with the matching rule resolved on first use. Entries
+ * without delayed messages are only a cache and are dropped before the
+ * table grows, so the table follows the active topics.
+ */
+struct topic_state {
+    char *topic;
+    struct rule *rule;
+
+    struct pending *head;
+    struct pending *tail;
+    unsigned int queued;
+
+    /* list of topics with pending messages */
+    struct topic_state *next_pending;
+    bool is_pending;
+};
+
+struct slot {
+    uint32_t hash;
+    struct topic_state *state;
+};
+
+struct mqtta_ratelimit {
+    const struct mqtta_allocator *allocator;
+
+    struct rule *rules;
+
+    bool agent_limited;
+    enum mqtta_rate_policy agent_policy;
+    struct bucket agent_bucket;
+
+    /* open addressing, linear probing, at most half full */
+    struct slot *table;
+    uint32_t size;
+    uint32_t used;
+
+    struct topic_state *pending;
+    unsigned int pending_messages;
+
+    struct mqtta_timer *timer;
+};
+
+static uint32_t topic_hash(const char *topic)
+{
+    // FNV-1a, 0 marks an empty slot
+    uint32_t h = 2166136261u;
+    while (*topic) {
+        h ^= (unsigned char)*topic++;
+        h *= 16777619u;
+    }
+
+    return h ? h : 1;
+}
+
+static void bucket_init(struct bucket *b, const double rate,
+                        const unsigned int burst)
+{
+    b->rate = rate;
+    b->burst = burst;
+    b->tokens = burst;
+    b->refilled = mqtta_now_ms();
+}
+
+static void bucket_refill(struct bucket *b, const uint64_t now)
+{
+    if (now <= b->refilled)
+        return;
+
+    b->tokens += (now - b->refilled) * b->rate / 1000.0;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->refilled = now;
+}
+
+/* milliseconds until the bucket has a token */
+static double bucket_wait(const struct bucket *b)
+{
+    return b->tokens >= 1.0 ? 0.0 : (1.0 - b->tokens) * 1000.0 / b->rate;
+}
+
+static struct mqtta_ratelimit* limiter_get(struct mosqagent *agent)
+{
+    if (agent->limiter)
+        return agent->limiter;
+
+    struct mqtta_ratelimit *l;
+    l = mqtta_calloc(agent->allocator, 1, sizeof(*l));
+    if (!l)
+        return NULL;
+    l->allocator = agent->allocator;
+
+    l->table = mqtta_calloc(l->allocator, TABLE_INITIAL_SIZE, sizeof(*l->table));
+    if (!l->table) {
+        mqtta_free(l);
+        return NULL;
+    }
+    l->size = TABLE_INITIAL_SIZE;
+
+    agent->limiter = l;
+
+    return l;
+}
+
+static struct rule* match_rule(const struct mqtta_ratelimit *l,
+                               const char *topic)
+{
+    struct rule *r;
+    for (r = l->rules; r; r = r->next) {
+        bool match = false;
+        mosquitto_topic_matches_sub(r->filter, topic, &match);
+        if (match)
+            return r;
+    }
+
+    return NULL;
+}
+
+static void free_topic(struct topic_state *ts)
+{
+    while (ts->head) {
+        struct pending *p = ts->head;
+        ts->head = p->next;
+        mqtta_dispose_message(p->msg);
+        mqtta_free(p);
+    }
+    mqtta_free(ts->topic);
+    mqtta_free(ts);
+}
+
+/*
+ * Move the entries into a new table, without those that have no delayed
+ * messages if `sweep` is set.
+ */
+static int table_rehash(struct mqtta_ratelimit *l,
+                        const uint32_t size,
+                        const bool sweep)
+{
+    struct slot *table = mqtta_calloc(l->allocator, size, sizeof(*table));
+    if (!table)
+        return -1;
+
+    uint32_t i;
+    for (i = 0; i < l->size; i++) {
+        if (!l->table[i].hash)
+            continue;
+
+        if (sweep && !l->table[i].state->head) {
+            free_topic(l->table[i].state);
+            l->used--;
+            continue;
+        }
+
+        uint32_t j = l->table[i].hash & (size - 1);
+        while (table[j].hash)
+            j = (j + 1) & (size - 1);
+        table[j] = l->table[i];
+    }
+
+    mqtta_free(l->table);
+    l->table = table;
+    l->size = size;
+
+    return 0;
+}
+
+static struct topic_state* topic_find(const struct mqtta_ratelimit *l,
+                                      const char *topic,
+                                      const uint32_t hash)
+{
+    uint32_t i = hash & (l->size - 1);
+    while (l->table[i].hash) {
+        if ((l->table[i].hash == hash) &&
+            !strcmp(l->table[i].state->topic, topic))
+            return l->table[i].state;
+        i = (i + 1) & (l->size - 1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Add a topic that is not in the table yet.
+ */
+static struct topic_state* topic_intern(struct mqtta_ratelimit *l,
+                                        const char *topic,
+                                        const uint32_t hash,
+                                        struct rule *rule)
+{
+    // idle topics make room first, then the table grows
+    if ((2 * (l->used + 1) > l->size) && table_rehash(l, l->size, true))
+        return NULL;
+    if ((2 * (l->used + 1) > l->size) && table_rehash(l, 2 * l->size, false))
+        return NULL;
+
+    uint32_t i = hash & (l->size - 1);
+    while (l->table[i].hash)
+        i = (i + 1) & (l->size - 1);
+
+    struct topic_state *ts;
+    ts = mqtta_calloc(l->allocator, 1, sizeof(*ts));
+    if (!ts)
+        return NULL;
+
+    ts->topic = mqtta_strdup(l->allocator, topic);
+    if (!ts->topic) {
+        mqtta_free(ts);
+        return NULL;
+    }
+    ts->rule = rule;
+
+    l->table[i].hash = hash;
+    l->table[i].state = ts;
+    l->used++;
+
+    return ts;
+}
+
+/*
+ * Take a token from the rule's and the agent's bucket, if both have one.
+ */
+static bool take_token(struct mqtta_ratelimit *l,
+                       struct rule *rule,
+                       const uint64_t now)
+{
+    struct bucket *tb = rule ? &rule->bucket : NULL;
+
+    if (tb) {
+        bucket_refill(tb, now);
+        if (tb->tokens < 1.0)
+            return false;
+    }
+
+    if (l->agent_limited) {
+        bucket_refill(&l->agent_bucket, now);
+        if (l->agent_bucket.tokens < 1.0)
+            return false;
+        l->agent_bucket.tokens -= 1.0;
+    }
+
+    if (tb)
+        tb->tokens -= 1.0;
+
+    return true;
+}
+
+static double topic_wait(const struct mqtta_ratelimit *l,
+                         const struct topic_state *ts)
+{
+    double wait = ts->rule ? bucket_wait(&ts->rule->bucket) : 0.0;
+
+    if (l->agent_limited) {
+        const double agent_wait = bucket_wait(&l->agent_bucket);
+        if (agent_wait > wait)
+            wait = agent_wait;
+    }
+
+    return wait;
+}
+
+static void drain_timer(struct mosqagent *agent, void *timer_data);
+
+static void arm_timer(struct mosqagent *agent)
+{
+    struct mqtta_ratelimit *l = agent->limiter;
+
+    if (l->timer || !l->pending)
+        return;
+
+    double wait = -1.0;
+    const struct topic_state *ts;
+    for (ts = l->pending; ts; ts = ts->next_pending) {
+        const double w = topic_wait(l, ts);
+        if ((wait < 0.0) || (w < wait))
+            wait = w;
+    }
+
+    // round up, so that the token is there when the timer fires
+    l->timer = mosqagent_add_timer(agent, (unsigned int)wait + 1, 0,
+                                   drain_timer, NULL);
+}
+
+static void drain_timer(struct mosqagent *agent, void *timer_data)
+{
+    struct mqtta_ratelimit *l = agent->limiter;
+    const uint64_t now = mqtta_now_ms();
+
+    (void) timer_data; /* unused */
+
+    // one-shot timer, the handle is gone after this call
+    l->timer = NULL;
+
+    struct topic_state **link = &l->pending;
+    while (*link) {
+        struct topic_state *ts = *link;
+
+        while (ts->head) {
+            struct pending *p = ts->head;
+
+            // expired messages are dropped without taking a token
+            const bool stale = p->expires && (p->expires <= now);
+            if (!stale && !take_token(l, ts->rule, now))
+                break;
+
+            ts->head = p->next;
+            if (!ts->head)
+                ts->tail = NULL;
+            ts->queued--;
+            l->pending_messages--;
+
+            if (!stale) {
+                p->msg->ttl_ms = p->expires ? p->expires - now : 0;
+                mqtta_lanes_send(agent, p->msg);
+            }
+            mqtta_dispose_message(p->msg);
+            mqtta_free(p);
+        }
+
+        if (ts->head) {
+            link = &ts->next_pending;
+        } else {
+            *link = ts->next_pending;
+            ts->next_pending = NULL;
+            ts->is_pending = false;
+        }
+    }
+
+    arm_timer(agent);
+}
+
+static int enqueue(struct mosqagent *agent,
+                   struct topic_state *ts,
+                   const struct mqtta_message *msg,
+                   const enum mqtta_rate_policy policy)
+{
+    struct mqtta_ratelimit *l = agent->limiter;
+
+    if ((policy == MQTTA_RATE_DELAY) && (ts->queued >= QUEUE_MAX)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    struct mqtta_message *copy;
+    copy = mqtta_copy_message(l->allocator,
+                              msg->topic, msg->payload, msg->payloadlen,
+                              msg->qos, msg->retain);
+    if (!copy)
+        return -1;
+    copy->priority = msg->priority;
+
+    const unsigned int ttl_ms = mqtta_lanes_ttl(agent, msg);
+    const uint64_t expires = ttl_ms ? mqtta_now_ms() + ttl_ms : 0;
+
+    // coalesce: replace the pending message
+    if ((policy == MQTTA_RATE_COALESCE) && ts->head) {
+        mqtta_dispose_message(ts->tail->msg);
+        ts->tail->msg = copy;
+        ts->tail->expires = expires;
+        return 0;
+    }
+
+    struct pending *p;
+    p = mqtta_malloc(l->allocator, sizeof(*p));
+    if (!p) {
+        mqtta_dispose_message(copy);
+        errno = ENOMEM;
+        return -1;
+    }
+    p->next = NULL;
+    p->msg = copy;
+    p->expires = expires;
+
+    if (ts->tail)
+        ts->tail->next = p;
+    else
+        ts->head = p;
+    ts->tail = p;
+    ts->queued++;
+    l->pending_messages++;
+
+    if (!ts->is_pending) {
+        ts->is_pending = true;
+        ts->next_pending = l->pending;
+        l->pending = ts;
+    }
+
+    arm_timer(agent);
+
+    return 0;
+}
+
+int mqtta_ratelimit_admit(struct mosqagent *agent,
+                          const struct mqtta_message *msg)
+{
+    struct mqtta_ratelimit *l = agent->limiter;
+
+    if (!l || (!l->rules && !l->agent_limited))
+        return 1;
+
+    const uint32_t hash = topic_hash(msg->topic);
+    struct topic_state *ts = topic_find(l, msg->topic, hash);
+    struct rule *rule = ts ? ts->rule : match_rule(l, msg->topic);
+
+    if (!rule && !l->agent_limited)
+        return 1;
+
+    // keep the order behind already delayed messages
+    if (!(ts && ts->head) && take_token(l, rule, mqtta_now_ms())) {
+        // remember the rule, topics with only the agent-wide limit are
+        // interned when they have to wait; only a cache, so a failure
+        // does not stop the message
+        if (!ts && rule)
+            topic_intern(l, msg->topic, hash, rule);
+        return 1;
+    }
+
+    const enum mqtta_rate_policy policy = rule ? rule->policy
+                                               : l->agent_policy;
+    if (policy == MQTTA_RATE_DROP) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (!ts) {
+        ts = topic_intern(l, msg->topic, hash, rule);
+        if (!ts) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    return enqueue(agent, ts, msg, policy);
+}
+
+int mosqagent_add_rate_limit(struct mosqagent *agent,
+                             const char *filter,
+                             const double rate,
+                             const unsigned int burst,
+                             const enum mqtta_rate_policy policy)
+{
+    if (!agent || !(rate > 0.0) || !burst ||
+        (filter && mosquitto_sub_topic_check(filter))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_ratelimit *l = limiter_get(agent);
+    if (!l) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (!filter) {
+        l->agent_limited = true;
+        l->agent_policy = policy;
+        bucket_init(&l->agent_bucket, rate, burst);
+        return 0;
+    }
+
+    struct rule *r;
+    r = mqtta_calloc(l->allocator, 1, sizeof(*r));
+    if (!r) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    r->filter = mqtta_strdup(l->allocator, filter);
+    if (!r->filter) {
+        mqtta_free(r);
+        errno = ENOMEM;
+        return -1;
+    }
+    r->policy = policy;
+    bucket_init(&r->bucket, rate, burst);
+
+    struct rule **tail = &l->rules;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = r;
+
+    // resolve the interned topics again, the new rule may match some
+    uint32_t i;
+    for (i = 0; i < l->size; i++)
+        if (l->table[i].hash)
+            l->table[i].state->rule = match_rule(l, l->table[i].state->topic);
+
+    return 0;
+}
+
+unsigned int mosqagent_rate_limited_pending(const struct mosqagent *agent)
+{
+    return (agent && agent->limiter) ? agent->limiter->pending_messages : 0;
+}
+
+void mqtta_free_ratelimit(struct mosqagent *agent)
+{
+    struct mqtta_ratelimit *l = agent->limiter;
+    if (!l)
+        return;
+
+    if (l->timer)
+        mosqagent_cancel_timer(agent, l->timer);
+
+    uint32_t i;
+    for (i = 0; i < l->size; i++) {
+        if (l->table[i].state)
+            free_topic(l->table[i].state);
+    }
+    mqtta_free(l->table);
+
+    while (l->rules) {
+        struct rule *r = l->rules;
+        l->rules = r->next;
+        mqtta_free(r->filter);
+        mqtta_free(r);
+    }
+
+    mqtta_free(l);
+    agent->limiter = NULL;
+}
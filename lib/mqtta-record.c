@@ -0,0 +1,547 @@
+/*
+ * Binary traffic recorder and reader
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta-record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mqtta-private.h"
+
+#define RECORD_MAGIC        "MQTTAREC"
+#define RECORD_VERSION      1
+
+#define RECORD_MESSAGE      1
+#define RECORD_INDEX        2
+
+/* The file grows in steps of this size while writing. */
+#define GROW_SIZE           (4 * 1024 * 1024)
+
+#define ALIGN8(n)           (((n) + 7) & ~(size_t)7)
+
+/*
+ * All records start at 8-byte boundaries with their size (a multiple of 8,
+ * including the header) and type. A size of 0 marks the end of the log.
+ */
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t created_ns;
+    /** offset of the latest index block, 0 if none */
+    uint64_t last_index;
+};
+
+struct record_header {
+    uint32_t size;
+    uint32_t type;
+};
+
+/* followed by topic, `\0`, payload, `\0` */
+struct message_record {
+    struct record_header h;
+    uint64_t timestamp_ns;
+    uint8_t direction;
+    uint8_t qos;
+    uint8_t retain;
+    uint8_t reserved;
+    uint32_t topiclen;
+    uint32_t payloadlen;
+    uint32_t reserved2;
+};
+
+/* index of the messages written since the previous index block */
+struct index_record {
+    struct record_header h;
+    uint64_t prev_index;
+    uint64_t first_ns;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t offset[];
+};
+
+struct mqtta_recorder {
+    int fd;
+    char *map;
+    size_t map_size;
+    size_t offset;
+
+    uint32_t pending;
+    uint64_t pending_first_ns;
+    uint64_t pending_offset[MQTTA_RECORD_INDEX_INTERVAL];
+};
+
+struct mqtta_record_reader {
+    int fd;
+    const char *map;
+    size_t size;
+    size_t offset;
+};
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int recorder_map(struct mqtta_recorder *rec, const size_t size)
+{
+    // the old map stays in place until the new one exists, so a failure
+    // leaves the recorder as it was
+    if (ftruncate(rec->fd, size))
+        return -1;
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, rec->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    if (rec->map)
+        munmap(rec->map, rec->map_size);
+    rec->map = map;
+    rec->map_size = size;
+
+    return 0;
+}
+
+static int recorder_reserve(struct mqtta_recorder *rec, const size_t len)
+{
+    // keep room for the end marker
+    const size_t need = rec->offset + len + sizeof(struct record_header);
+    if (need <= rec->map_size)
+        return 0;
+
+    return recorder_map(rec, ALIGN8(need) + GROW_SIZE);
+}
+
+/*
+ * Find the end of an existing log and the messages not yet indexed.
+ */
+static int recorder_scan(struct mqtta_recorder *rec)
+{
+    const struct file_header *fh = (const struct file_header*)rec->map;
+    if (memcmp(fh->magic, RECORD_MAGIC, sizeof(fh->magic)) ||
+        (fh->version != RECORD_VERSION)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t pos = fh->header_size;
+    while (pos + sizeof(struct record_header) <= rec->map_size) {
+        const struct record_header *h = (const void*)(rec->map + pos);
+        if (!h->size || (pos + h->size > rec->map_size))
+            break;
+
+        if (h->type == RECORD_MESSAGE) {
+            if (rec->pending < MQTTA_RECORD_INDEX_INTERVAL) {
+                if (!rec->pending)
+                    rec->pending_first_ns =
+                        ((const struct message_record*)h)->timestamp_ns;
+                rec->pending_offset[rec->pending++] = pos;
+            }
+        } else if (h->type == RECORD_INDEX) {
+            rec->pending = 0;
+        }
+
+        pos += h->size;
+    }
+    rec->offset = pos;
+
+    return 0;
+}
+
+static struct mqtta_recorder* recorder_open(const struct mqtta_allocator *allocator,
+                                           const char *path)
+{
+    if (!path) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct mqtta_recorder *rec;
+    rec = mqtta_calloc(allocator, 1, sizeof(*rec));
+    if (!rec) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    rec->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (rec->fd < 0)
+        goto fail_with_rec;
+
+    struct stat st;
+    if (fstat(rec->fd, &st))
+        goto fail_with_fd;
+
+    if (st.st_size) {
+        if (recorder_map(rec, st.st_size) || recorder_scan(rec))
+            goto fail_with_fd;
+    } else {
+        if (recorder_map(rec, GROW_SIZE))
+            goto fail_with_fd;
+
+        struct file_header *fh = (struct file_header*)rec->map;
+        memcpy(fh->magic, RECORD_MAGIC, sizeof(fh->magic));
+        fh->version = RECORD_VERSION;
+        fh->header_size = sizeof(*fh);
+        fh->created_ns = realtime_ns();
+        fh->last_index = 0;
+        rec->offset = sizeof(*fh);
+    }
+
+    return rec;
+
+fail_with_fd:
+    if (rec->map)
+        munmap(rec->map, rec->map_size);
+    close(rec->fd);
+
+fail_with_rec:
+    mqtta_free(rec);
+    return NULL;
+}
+
+struct mqtta_recorder* mqtta_recorder_open(const char *path)
+{
+    return recorder_open(NULL, path);
+}
+
+/*
+ * Publish a record by setting its size last, after the content is in place.
+ */
+static void record_commit(struct mqtta_recorder *rec,
+                          struct record_header *h,
+                          const uint32_t size,
+                          const uint32_t type)
+{
+    h->type = type;
+    __atomic_store_n(&h->size, size, __ATOMIC_RELEASE);
+    rec->offset += size;
+}
+
+static int write_index(struct mqtta_recorder *rec)
+{
+    const size_t size = sizeof(struct index_record)
+                      + rec->pending * sizeof(uint64_t);
+
+    if (recorder_reserve(rec, size))
+        return -1;
+
+    struct file_header *fh = (struct file_header*)rec->map;
+    struct index_record *ir = (struct index_record*)(rec->map + rec->offset);
+    const size_t pos = rec->offset;
+
+    ir->prev_index = fh->last_index;
+    ir->first_ns = rec->pending_first_ns;
+    ir->count = rec->pending;
+    ir->reserved = 0;
+    memcpy(ir->offset, rec->pending_offset, rec->pending * sizeof(uint64_t));
+
+    record_commit(rec, &ir->h, size, RECORD_INDEX);
+    fh->last_index = pos;
+    rec->pending = 0;
+
+    return 0;
+}
+
+int mqtta_recorder_write(struct mqtta_recorder *rec,
+                         const enum mqtta_record_direction direction,
+                         const char *topic,
+                         const void *payload,
+                         const int payloadlen,
+                         const int qos,
+                         const bool retain)
+{
+    if (!rec || !topic || (payloadlen < 0) || (payloadlen && !payload)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const size_t topiclen = strlen(topic);
+    const size_t size = ALIGN8(sizeof(struct message_record)
+                               + topiclen + 1 + payloadlen + 1);
+
+    if (recorder_reserve(rec, size))
+        return -1;
+
+    const size_t pos = rec->offset;
+    struct message_record *mr = (struct message_record*)(rec->map + pos);
+    char *data = (char*)(mr + 1);
+
+    mr->timestamp_ns = realtime_ns();
+    mr->direction = direction;
+    mr->qos = qos;
+    mr->retain = retain;
+    mr->reserved = 0;
+    mr->topiclen = topiclen;
+    mr->payloadlen = payloadlen;
+    mr->reserved2 = 0;
+
+    memcpy(data, topic, topiclen + 1);
+    data += topiclen + 1;
+    if (payloadlen)
+        memcpy(data, payload, payloadlen);
+    data[payloadlen] = '\0';
+
+    if (!rec->pending)
+        rec->pending_first_ns = mr->timestamp_ns;
+    rec->pending_offset[rec->pending++] = pos;
+
+    record_commit(rec, &mr->h, size, RECORD_MESSAGE);
+
+    if (rec->pending == MQTTA_RECORD_INDEX_INTERVAL)
+        return write_index(rec);
+
+    return 0;
+}
+
+void mqtta_recorder_close(struct mqtta_recorder *rec)
+{
+    if (!rec)
+        return;
+
+    if (rec->map) {
+        msync(rec->map, rec->offset, MS_SYNC);
+        munmap(rec->map, rec->map_size);
+        // drop the pre-allocated space, readers stop at the zero size
+        // marker if this fails
+        if (ftruncate(rec->fd, rec->offset)) {
+            /* nothing to do */
+        }
+    }
+
+    close(rec->fd);
+    mqtta_free(rec);
+}
+
+int mosqagent_record(struct mosqagent *agent, const char *path)
+{
+    if (!agent || !path) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_recorder *rec = recorder_open(agent->allocator, path);
+    if (!rec)
+        return -1;
+
+    mqtta_recorder_close(agent->recorder);
+    agent->recorder = rec;
+
+    return 0;
+}
+
+struct mqtta_record_reader* mqtta_record_reader_open(const char *path)
+{
+    struct mqtta_record_reader *reader;
+    reader = mqtta_calloc(NULL, 1, sizeof(*reader));
+    if (!reader) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0)
+        goto fail_with_reader;
+
+    struct stat st;
+    if (fstat(reader->fd, &st))
+        goto fail_with_fd;
+
+    if ((size_t)st.st_size < sizeof(struct file_header)) {
+        errno = EINVAL;
+        goto fail_with_fd;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if (map == MAP_FAILED)
+        goto fail_with_fd;
+    reader->map = map;
+    reader->size = st.st_size;
+
+    const struct file_header *fh = map;
+    if (memcmp(fh->magic, RECORD_MAGIC, sizeof(fh->magic)) ||
+        (fh->version != RECORD_VERSION) ||
+        (fh->header_size > reader->size)) {
+        errno = EINVAL;
+        goto fail_with_map;
+    }
+    reader->offset = fh->header_size;
+
+    // sequential access, let the kernel read ahead
+    madvise(map, reader->size, MADV_SEQUENTIAL);
+
+    return reader;
+
+fail_with_map:
+    munmap(map, st.st_size);
+
+fail_with_fd:
+    close(reader->fd);
+
+fail_with_reader:
+    mqtta_free(reader);
+    return NULL;
+}
+
+static const struct record_header* reader_record(const struct mqtta_record_reader *reader,
+                                                 const size_t pos)
+{
+    if (pos + sizeof(struct record_header) > reader->size)
+        return NULL;
+
+    const struct record_header *h = (const void*)(reader->map + pos);
+    if (!h->size)
+        return NULL;
+
+    if ((h->size < sizeof(*h)) || (h->size & 7) || (pos + h->size > reader->size)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return h;
+}
+
+int mqtta_record_reader_next(struct mqtta_record_reader *reader,
+                             struct mqtta_record *record)
+{
+    if (!reader || !record) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+        errno = 0;
+        const struct record_header *h = reader_record(reader, reader->offset);
+        if (!h)
+            return errno ? -1 : 0;
+
+        reader->offset += h->size;
+
+        if (h->type != RECORD_MESSAGE)
+            continue;
+
+        const struct message_record *mr = (const void*)h;
+        if (sizeof(*mr) + mr->topiclen + mr->payloadlen + 2 > h->size) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        const char *data = (const char*)(mr + 1);
+        record->timestamp_ns = mr->timestamp_ns;
+        record->direction = mr->direction;
+        record->qos = mr->qos;
+        record->retain = mr->retain;
+        record->topic = data;
+        record->payload = data + mr->topiclen + 1;
+        record->payloadlen = mr->payloadlen;
+
+        return 1;
+    }
+}
+
+static const struct index_record* reader_index(const struct mqtta_record_reader *reader,
+                                               const uint64_t pos)
+{
+    if (!pos)
+        return NULL;
+
+    const struct record_header *h = reader_record(reader, pos);
+    if (!h || (h->type != RECORD_INDEX))
+        return NULL;
+
+    const struct index_record *ir = (const void*)h;
+    if (sizeof(*ir) + ir->count * sizeof(uint64_t) > h->size)
+        return NULL;
+
+    return ir;
+}
+
+int mqtta_record_reader_seek(struct mqtta_record_reader *reader,
+                             const uint64_t timestamp_ns)
+{
+    if (!reader) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const struct file_header *fh = (const void*)reader->map;
+
+    // walk the index chain back to the interval that contains the time
+    size_t start = fh->header_size;
+    const struct index_record *ir = reader_index(reader, fh->last_index);
+    while (ir) {
+        if (ir->count && (ir->first_ns <= timestamp_ns)) {
+            start = ir->offset[0];
+            break;
+        }
+        ir = reader_index(reader, ir->prev_index);
+    }
+
+    // then scan forward
+    reader->offset = start;
+    for (;;) {
+        const size_t pos = reader->offset;
+        struct mqtta_record record;
+
+        const int ret = mqtta_record_reader_next(reader, &record);
+        if (ret <= 0)
+            return ret;
+
+        if (record.timestamp_ns >= timestamp_ns) {
+            reader->offset = pos;
+            return 0;
+        }
+    }
+}
+
+unsigned long mqtta_record_reader_count(const struct mqtta_record_reader *reader)
+{
+    if (!reader)
+        return 0;
+
+    const struct file_header *fh = (const void*)reader->map;
+    unsigned long count = 0;
+
+    // indexed messages
+    size_t tail = fh->header_size;
+    const struct index_record *ir = reader_index(reader, fh->last_index);
+    if (ir)
+        tail = fh->last_index + ir->h.size;
+    while (ir) {
+        count += ir->count;
+        ir = reader_index(reader, ir->prev_index);
+    }
+
+    // messages after the last index block
+    const struct record_header *h;
+    while ((h = reader_record(reader, tail))) {
+        if (h->type == RECORD_MESSAGE)
+            count++;
+        tail += h->size;
+    }
+
+    return count;
+}
+
+void mqtta_record_reader_close(struct mqtta_record_reader *reader)
+{
+    if (!reader)
+        return;
+
+    munmap((void*)reader->map, reader->size);
+    close(reader->fd);
+    mqtta_free(reader);
+}
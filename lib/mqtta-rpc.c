@@ -0,0 +1,396 @@
+/*
+ * Request/response calls with MQTT v5 correlation data
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta-rpc.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+
+#include "mqtta-private.h"
+
+/* Initial number of hash buckets, doubled when the load exceeds 1 */
+#define PENDING_BUCKETS     64
+
+/* Correlation ids are 64 bit counters, sent in network byte order. */
+#define CORRELATION_LEN     8
+
+struct pending {
+    struct pending *next;
+    uint64_t id;
+    struct mqtta_timer *timeout;
+    mqtta_response_callback callback;
+    void *ctx;
+};
+
+struct mqtta_rpc {
+    const struct mqtta_allocator *allocator;
+
+    char *response_topic;
+    uint64_t next_id;
+
+    /*
+     * Ids are handed out sequentially, so the low bits are a perfect hash
+     * and the chains stay short without mixing.
+     */
+    struct pending **bucket;
+    unsigned int mask;
+    unsigned int count;
+};
+
+static void encode_id(uint8_t *buf, uint64_t id)
+{
+    int i;
+    for (i = CORRELATION_LEN - 1; i >= 0; i--) {
+        buf[i] = id & 0xff;
+        id >>= 8;
+    }
+}
+
+static uint64_t decode_id(const uint8_t *buf)
+{
+    uint64_t id = 0;
+    int i;
+    for (i = 0; i < CORRELATION_LEN; i++)
+        id = (id << 8) | buf[i];
+
+    return id;
+}
+
+static struct pending** find_pending(struct mqtta_rpc *rpc, const uint64_t id)
+{
+    struct pending **p = &rpc->bucket[id & rpc->mask];
+    while (*p && ((*p)->id != id))
+        p = &(*p)->next;
+
+    return p;
+}
+
+static int grow_table(struct mqtta_rpc *rpc)
+{
+    const unsigned int size = 2 * (rpc->mask + 1);
+
+    struct pending **bucket = mqtta_calloc(rpc->allocator, size, sizeof(*bucket));
+    if (!bucket) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    unsigned int i;
+    for (i = 0; i <= rpc->mask; i++) {
+        struct pending *p = rpc->bucket[i];
+        while (p) {
+            struct pending *next = p->next;
+            p->next = bucket[p->id & (size - 1)];
+            bucket[p->id & (size - 1)] = p;
+            p = next;
+        }
+    }
+
+    mqtta_free(rpc->bucket);
+    rpc->bucket = bucket;
+    rpc->mask = size - 1;
+
+    return 0;
+}
+
+/*
+ * Publish with properties and map client errors to errno.
+ */
+static int publish(struct mosqagent *agent,
+                   const struct mqtta_message *msg,
+                   const mosquitto_property *props)
+{
+    const int ret = mqtta_publish_props(agent, msg, props);
+    if (ret <= 0)
+        return ret;
+
+    errno = (ret == MOSQ_ERR_NO_CONN) ? ENOTCONN : EIO;
+    return -1;
+}
+
+static void on_response(struct mosqagent *agent,
+                        const struct mqtta_message *msg,
+                        void *handler_data)
+{
+    struct mqtta_rpc *rpc = handler_data;
+
+    void *data = NULL;
+    uint16_t len = 0;
+    mosquitto_property_read_binary(msg->properties, MQTT_PROP_CORRELATION_DATA,
+                                   &data, &len, false);
+    if (!data)
+        return;
+
+    // anyone may publish to the response topic, check before decoding
+    if (len != CORRELATION_LEN) {
+        free(data);
+        return;
+    }
+
+    const uint64_t id = decode_id(data);
+    free(data);
+
+    // responses after the timeout are dropped
+    struct pending **pp = find_pending(rpc, id);
+    struct pending *p = *pp;
+    if (!p)
+        return;
+
+    *pp = p->next;
+    --rpc->count;
+
+    mosqagent_cancel_timer(agent, p->timeout);
+    p->callback(agent, 0, msg, p->ctx);
+    mqtta_free(p);
+}
+
+static void on_timeout(struct mosqagent *agent, void *timer_data)
+{
+    struct pending *p = timer_data;
+    struct mqtta_rpc *rpc = agent->rpc;
+
+    struct pending **pp = find_pending(rpc, p->id);
+    *pp = p->next;
+    --rpc->count;
+
+    // the one-shot timer is released after the callback
+    p->callback(agent, ETIMEDOUT, NULL, p->ctx);
+    mqtta_free(p);
+}
+
+/*
+ * Set up the pending table and subscribe to the response topic with the
+ * first request.
+ */
+static struct mqtta_rpc* get_rpc(struct mosqagent *agent, const int qos)
+{
+    if (agent->rpc)
+        return agent->rpc;
+
+    struct mqtta_rpc *rpc = mqtta_calloc(agent->allocator, 1, sizeof(*rpc));
+    if (!rpc)
+        goto fail;
+    rpc->allocator = agent->allocator;
+
+    rpc->bucket = mqtta_calloc(rpc->allocator, PENDING_BUCKETS,
+                               sizeof(*rpc->bucket));
+    if (!rpc->bucket)
+        goto fail_with_rpc;
+    rpc->mask = PENDING_BUCKETS - 1;
+
+    // unguessable start, so that stale responses of an earlier run miss
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rpc->next_id = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^
+                   ((uint64_t)getpid() << 16) ^ (uintptr_t)rpc;
+
+    const struct mosqagent_config *config = mqtta_get_configuration(agent);
+    const char *name = config && config->client_name
+                     ? config->client_name
+                     : "agent";
+
+    const size_t len = strlen(MQTTA_RPC_TOPIC_PREFIX) + strlen(name) + 18;
+    rpc->response_topic = mqtta_malloc(rpc->allocator, len);
+    if (!rpc->response_topic)
+        goto fail_with_bucket;
+    snprintf(rpc->response_topic, len, "%s%s/%08x",
+             MQTTA_RPC_TOPIC_PREFIX, name, (unsigned)(rpc->next_id >> 16));
+
+    // a client name with wildcards is no valid topic
+    if (mosquitto_pub_topic_check(rpc->response_topic) != MOSQ_ERR_SUCCESS) {
+        errno = EINVAL;
+        goto fail_with_topic;
+    }
+
+    if (mosqagent_subscribe(agent, rpc->response_topic, qos, on_response, rpc))
+        // errno is already set
+        goto fail_with_topic;
+
+    agent->rpc = rpc;
+    return rpc;
+
+fail_with_topic:
+    mqtta_free(rpc->response_topic);
+
+fail_with_bucket:
+    mqtta_free(rpc->bucket);
+
+fail_with_rpc:
+    mqtta_free(rpc);
+
+fail:
+    if (!errno)
+        errno = ENOMEM;
+    return NULL;
+}
+
+int mqtta_request(struct mosqagent *agent,
+                  const char *topic,
+                  const void *payload,
+                  const int payloadlen,
+                  const int qos,
+                  const unsigned int timeout_ms,
+                  mqtta_response_callback callback,
+                  void *ctx)
+{
+    if (!agent || !topic || !callback || !timeout_ms ||
+        (payloadlen < 0) || (payloadlen && !payload) ||
+        (qos < 0) || (qos > 2)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    errno = 0;
+    struct mqtta_rpc *rpc = get_rpc(agent, qos);
+    if (!rpc)
+        return -1;
+
+    if ((rpc->count > rpc->mask) && grow_table(rpc))
+        return -1;
+
+    struct pending *p = mqtta_malloc(rpc->allocator, sizeof(*p));
+    if (!p) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    p->id = rpc->next_id++;
+    p->callback = callback;
+    p->ctx = ctx;
+
+    uint8_t correlation[CORRELATION_LEN];
+    encode_id(correlation, p->id);
+
+    mosquitto_property *props = NULL;
+    if (mosquitto_property_add_string(&props, MQTT_PROP_RESPONSE_TOPIC,
+                                      rpc->response_topic) ||
+        mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA,
+                                      correlation, CORRELATION_LEN)) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    const struct mqtta_message msg = {
+        .topic = (char*)topic,
+        .payload = (char*)payload,
+        .payloadlen = payloadlen,
+        .qos = qos,
+    };
+    if (publish(agent, &msg, props))
+        // errno is already set
+        goto fail;
+
+    p->timeout = mosqagent_add_timer(agent, timeout_ms, 0, on_timeout, p);
+    if (!p->timeout)
+        // errno is already set; a late response is simply dropped
+        goto fail;
+
+    struct pending **bucket = &rpc->bucket[p->id & rpc->mask];
+    p->next = *bucket;
+    *bucket = p;
+    ++rpc->count;
+
+    mosquitto_property_free_all(&props);
+    return 0;
+
+fail:
+    mosquitto_property_free_all(&props);
+    mqtta_free(p);
+    return -1;
+}
+
+int mqtta_respond(struct mosqagent *agent,
+                  const struct mqtta_message *request,
+                  const void *payload,
+                  const int payloadlen,
+                  const int qos)
+{
+    if (!agent || !request ||
+        (payloadlen < 0) || (payloadlen && !payload) ||
+        (qos < 0) || (qos > 2)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *response_topic = NULL;
+    mosquitto_property_read_string(request->properties, MQTT_PROP_RESPONSE_TOPIC,
+                                   &response_topic, false);
+    if (!response_topic) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *correlation = NULL;
+    uint16_t len = 0;
+    mosquitto_property_read_binary(request->properties, MQTT_PROP_CORRELATION_DATA,
+                                   &correlation, &len, false);
+
+    int ret = -1;
+
+    mosquitto_property *props = NULL;
+    if (correlation &&
+        mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA,
+                                      correlation, len)) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    const struct mqtta_message msg = {
+        .topic = response_topic,
+        .payload = (char*)payload,
+        .payloadlen = payloadlen,
+        .qos = qos,
+    };
+    ret = publish(agent, &msg, props);
+
+out:
+    mosquitto_property_free_all(&props);
+    // property values are allocated by libmosquitto
+    free(correlation);
+    free(response_topic);
+
+    return ret;
+}
+
+unsigned int mqtta_requests_pending(const struct mosqagent *agent)
+{
+    return (agent && agent->rpc) ? agent->rpc->count : 0;
+}
+
+void mqtta_free_rpc(struct mosqagent *agent)
+{
+    struct mqtta_rpc *rpc = agent->rpc;
+    if (!rpc)
+        return;
+
+    // the pending table is dropped first, callbacks can not see it anymore
+    agent->rpc = NULL;
+
+    unsigned int i;
+    for (i = 0; i <= rpc->mask; i++) {
+        struct pending *p = rpc->bucket[i];
+        while (p) {
+            struct pending *next = p->next;
+
+            mosqagent_cancel_timer(agent, p->timeout);
+            p->callback(agent, ECANCELED, NULL, p->ctx);
+            mqtta_free(p);
+
+            p = next;
+        }
+    }
+
+    mqtta_free(rpc->bucket);
+    mqtta_free(rpc->response_topic);
+    mqtta_free(rpc);
+}
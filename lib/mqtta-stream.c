@@ -0,0 +1,875 @@
+/*
+ * Chunked streaming of large payloads, and their reassembly
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta-stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <mosquitto.h>
+
+#include "mqtta-private.h"
+
+#define STREAM_MAGIC            "MQCH"
+#define STREAM_VERSION          1
+
+#define DEFAULT_CHUNK_SIZE      (64 * 1024)
+#define DEFAULT_WINDOW          16
+/* MQTT limits a payload to 256 MiB */
+#define MAX_CHUNK_SIZE          ((256u << 20) - MQTTA_STREAM_HEADER_SIZE)
+
+/*
+ * Chunk header, all numbers in network byte order:
+ *
+ *   0  magic "MQCH"
+ *   4  version
+ *   5  flags, 0
+ *   6  header size
+ *   8  stream id
+ *  16  object size
+ *  24  chunk size, of all chunks but the last
+ *  28  sequence number
+ *  32  CRC-32C of the chunk data
+ *  36  CRC-32C of the object in the last chunk, else 0
+ */
+struct chunk_header {
+    uint64_t id;
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t seq;
+    uint32_t crc;
+    uint32_t object_crc;
+};
+
+struct stream {
+    struct stream *next;
+    uint64_t id;
+    char *topic;
+    int qos;
+
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t chunks;
+    /** Next chunk to send and number of completed chunks */
+    uint32_t seq;
+    uint32_t completed;
+    /** CRC-32C of the data sent so far */
+    uint32_t crc;
+
+    /** Header and data of the next chunk */
+    uint8_t *buf;
+    size_t filled;
+    bool ready;
+
+    /** Message ids of the chunks in flight, 0 for a free slot */
+    int *mid;
+    unsigned int window;
+    unsigned int in_flight;
+
+    /** Source, a mapped file or a producer */
+    const uint8_t *map;
+    mqtta_stream_producer producer;
+
+    mqtta_stream_callback callback;
+    void *ctx;
+};
+
+struct mqtta_streams {
+    const struct mqtta_allocator *allocator;
+    struct stream *list;
+    unsigned int count;
+    uint64_t next_id;
+};
+
+/*
+ * CRC-32C (Castagnoli), byte-wise with a table.
+ */
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+    uint32_t i;
+    for (i = 0; i < 256; i++) {
+        uint32_t c = i;
+        int k;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    pthread_once(&crc_once, crc_init);
+
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    int i;
+    for (i = 3; i >= 0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static void put64(uint8_t *p, const uint64_t v)
+{
+    put32(p, v >> 32);
+    put32(p + 4, v & 0xffffffff);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+static void encode_header(uint8_t *p, const struct chunk_header *h)
+{
+    memcpy(p, STREAM_MAGIC, 4);
+    p[4] = STREAM_VERSION;
+    p[5] = 0;
+    p[6] = MQTTA_STREAM_HEADER_SIZE >> 8;
+    p[7] = MQTTA_STREAM_HEADER_SIZE & 0xff;
+    put64(p + 8, h->id);
+    put64(p + 16, h->size);
+    put32(p + 24, h->chunk_size);
+    put32(p + 28, h->seq);
+    put32(p + 32, h->crc);
+    put32(p + 36, h->object_crc);
+}
+
+static int decode_header(const uint8_t *p, const size_t len,
+                         struct chunk_header *h)
+{
+    if ((len < MQTTA_STREAM_HEADER_SIZE) ||
+        memcmp(p, STREAM_MAGIC, 4) ||
+        (p[4] != STREAM_VERSION) ||
+        ((((unsigned)p[6] << 8) | p[7]) != MQTTA_STREAM_HEADER_SIZE)) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    h->id = get64(p + 8);
+    h->size = get64(p + 16);
+    h->chunk_size = get32(p + 24);
+    h->seq = get32(p + 28);
+    h->crc = get32(p + 32);
+    h->object_crc = get32(p + 36);
+
+    return 0;
+}
+
+static uint32_t chunk_count(const uint64_t size, const uint32_t chunk_size)
+{
+    // an empty object is one empty chunk
+    return size ? (size + chunk_size - 1) / chunk_size : 1;
+}
+
+static size_t chunk_len(const uint64_t size,
+                        const uint32_t chunk_size,
+                        const uint32_t seq)
+{
+    const uint64_t offset = (uint64_t)seq * chunk_size;
+    const uint64_t rest = size - offset;
+
+    return rest < chunk_size ? rest : chunk_size;
+}
+
+
+/*
+ * Sender
+ */
+
+static void free_stream(struct stream *s)
+{
+    if (s->map && s->size)
+        munmap((void*)s->map, s->size);
+    mqtta_free(s->mid);
+    mqtta_free(s->buf);
+    mqtta_free(s->topic);
+    mqtta_free(s);
+}
+
+/*
+ * Remove the stream from the agent and call back.
+ */
+static void finish(struct mosqagent *agent, struct stream *s, const int status)
+{
+    struct mqtta_streams *streams = agent->streams;
+
+    struct stream **pp = &streams->list;
+    while (*pp != s)
+        pp = &(*pp)->next;
+    *pp = s->next;
+    --streams->count;
+
+    s->callback(agent, s->id, status, s->ctx);
+    free_stream(s);
+}
+
+/*
+ * Read the next chunk from the source and put the header in front.
+ *
+ * \returns 1 if the chunk is ready, 0 if the producer has no data yet, -1
+ *          with errno set if the producer failed.
+ */
+static int fill_chunk(struct mosqagent *agent, struct stream *s)
+{
+    const size_t len = chunk_len(s->size, s->chunk_size, s->seq);
+    uint8_t *data = s->buf + MQTTA_STREAM_HEADER_SIZE;
+
+    if (s->map) {
+        memcpy(data, s->map + (uint64_t)s->seq * s->chunk_size, len);
+        s->filled = len;
+    }
+
+    while (s->filled < len) {
+        const ssize_t n = s->producer(agent, data + s->filled,
+                                      len - s->filled, s->ctx);
+        if (n < 0)
+            // errno is set by the producer
+            return -1;
+        if (!n)
+            return 0;
+        s->filled += ((size_t)n < len - s->filled) ? (size_t)n
+                                                   : len - s->filled;
+    }
+
+    s->crc = crc32c(s->crc, data, len);
+
+    const struct chunk_header h = {
+        .id = s->id,
+        .size = s->size,
+        .chunk_size = s->chunk_size,
+        .seq = s->seq,
+        .crc = crc32c(0, data, len),
+        .object_crc = (s->seq == s->chunks - 1) ? s->crc : 0,
+    };
+    encode_header(s->buf, &h);
+    s->ready = true;
+
+    return 1;
+}
+
+static void complete_chunk(struct mosqagent *agent, struct stream *s)
+{
+    if (++s->completed == s->chunks)
+        finish(agent, s, 0);
+}
+
+/*
+ * Send chunks of one stream while the window is open, at most a window
+ * per call so that other work in the loop is not held up.
+ *
+ * \returns 1 if the stream could send more right away, 0 otherwise.
+ */
+static int pump(struct mosqagent *agent, struct stream *s)
+{
+    unsigned int sent = 0;
+
+    while ((s->seq < s->chunks) && (s->in_flight < s->window)) {
+        if (sent == s->window)
+            return 1;
+
+        if (!s->ready) {
+            const int ret = fill_chunk(agent, s);
+            if (ret < 0) {
+                finish(agent, s, errno ? errno : EIO);
+                return 0;
+            }
+            if (!ret)
+                return 0;
+        }
+
+        const struct mqtta_message msg = {
+            .topic = s->topic,
+            .payload = (char*)s->buf,
+            .payloadlen = MQTTA_STREAM_HEADER_SIZE + s->filled,
+            .qos = s->qos,
+        };
+        int mid = 0;
+        errno = 0;
+        const int ret = mqtta_publish_mid(agent, &msg, NULL, &mid);
+
+        // try again with the next loop
+        if ((ret == MOSQ_ERR_NO_CONN) || ((ret < 0) && (errno == ENOTCONN)))
+            return 0;
+        if (ret) {
+            finish(agent, s, (ret < 0) && errno ? errno : EIO);
+            return 0;
+        }
+
+        s->seq++;
+        s->filled = 0;
+        s->ready = false;
+        sent++;
+
+        // delivered in the local group or written by the client already
+        if (!mid) {
+            const bool last = (s->completed + 1 == s->chunks);
+            complete_chunk(agent, s);
+            if (last)
+                return 0;
+            continue;
+        }
+
+        unsigned int i;
+        for (i = 0; s->mid[i]; i++)
+            ;
+        s->mid[i] = mid;
+        s->in_flight++;
+    }
+
+    return 0;
+}
+
+static struct mosqagent_result* send_streams(struct mosqagent *agent)
+{
+    struct mqtta_streams *streams = agent->streams;
+    bool more = false;
+
+    struct stream *s = streams ? streams->list : NULL;
+    while (s) {
+        // the stream may complete and be freed
+        struct stream *next = s->next;
+        if (pump(agent, s))
+            more = true;
+        s = next;
+    }
+
+    return more ? mosqagent_idle_result(agent, MQTTA_IDLE_YIELD) : NULL;
+}
+
+static struct mqtta_streams* get_streams(struct mosqagent *agent)
+{
+    if (agent->streams)
+        return agent->streams;
+
+    struct mqtta_streams *streams = mqtta_calloc(agent->allocator, 1,
+                                                 sizeof(*streams));
+    if (!streams)
+        // errno is already set
+        return NULL;
+    streams->allocator = agent->allocator;
+
+    // unlikely to repeat across restarts, so that the receivers can tell
+    // a new stream from the rest of an old one
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    streams->next_id = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^
+                       ((uint64_t)getpid() << 16) ^ (uintptr_t)streams;
+
+    if (mosqagent_add_idle_call_budget(agent, send_streams, "streams", 0)) {
+        mqtta_free(streams);
+        // errno is already set
+        return NULL;
+    }
+
+    agent->streams = streams;
+    return streams;
+}
+
+static struct stream* create_stream(struct mosqagent *agent,
+                                    const char *topic,
+                                    const uint64_t size,
+                                    const struct mqtta_stream_config *config)
+{
+    const size_t chunk_size = (config && config->chunk_size)
+                            ? config->chunk_size
+                            : DEFAULT_CHUNK_SIZE;
+    const unsigned int window = (config && config->window)
+                              ? config->window
+                              : DEFAULT_WINDOW;
+    const int qos = config ? config->qos : 0;
+
+    if ((chunk_size > MAX_CHUNK_SIZE) || (qos < 0) || (qos > 2) ||
+        (size / chunk_size >= UINT32_MAX) ||
+        (mosquitto_pub_topic_check(topic) != MOSQ_ERR_SUCCESS)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct mqtta_streams *streams = get_streams(agent);
+    if (!streams)
+        return NULL;
+
+    struct stream *s = mqtta_calloc(streams->allocator, 1, sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->topic = mqtta_strdup(streams->allocator, topic);
+    s->buf = mqtta_malloc(streams->allocator,
+                          MQTTA_STREAM_HEADER_SIZE + chunk_size);
+    s->mid = mqtta_calloc(streams->allocator, window, sizeof(*s->mid));
+    if (!s->topic || !s->buf || !s->mid) {
+        free_stream(s);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (!++streams->next_id)
+        ++streams->next_id;
+    s->id = streams->next_id;
+    s->qos = qos;
+    s->size = size;
+    s->chunk_size = chunk_size;
+    s->chunks = chunk_count(size, chunk_size);
+    s->window = window;
+
+    return s;
+}
+
+static void start_stream(struct mosqagent *agent,
+                         struct stream *s,
+                         mqtta_stream_callback callback,
+                         void *ctx,
+                         uint64_t *id)
+{
+    s->callback = callback;
+    s->ctx = ctx;
+
+    // appended, so that streams are sent in the order of their start
+    struct stream **pp = &agent->streams->list;
+    while (*pp)
+        pp = &(*pp)->next;
+    *pp = s;
+    agent->streams->count++;
+
+    if (id)
+        *id = s->id;
+}
+
+int mqtta_stream_file(struct mosqagent *agent,
+                      const char *topic,
+                      const char *path,
+                      const struct mqtta_stream_config *config,
+                      mqtta_stream_callback callback,
+                      void *ctx,
+                      uint64_t *id)
+{
+    if (!agent || !topic || !path || !callback) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        // errno is already set
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st))
+        goto fail_with_fd;
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        goto fail_with_fd;
+    }
+
+    struct stream *s = create_stream(agent, topic, st.st_size, config);
+    if (!s)
+        goto fail_with_fd;
+
+    // an empty file can not be mapped
+    static const uint8_t empty;
+    s->map = &empty;
+    if (s->size) {
+        void *map = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            s->map = NULL;
+            free_stream(s);
+            goto fail_with_fd;
+        }
+        madvise(map, s->size, MADV_SEQUENTIAL);
+        s->map = map;
+    }
+    close(fd);
+
+    start_stream(agent, s, callback, ctx, id);
+
+    return 0;
+
+fail_with_fd:
+    {
+        const int err = errno;
+        close(fd);
+        errno = err;
+    }
+    return -1;
+}
+
+int mqtta_stream_produce(struct mosqagent *agent,
+                         const char *topic,
+                         const uint64_t size,
+                         mqtta_stream_producer producer,
+                         const struct mqtta_stream_config *config,
+                         mqtta_stream_callback callback,
+                         void *ctx,
+                         uint64_t *id)
+{
+    if (!agent || !topic || !producer || !callback) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct stream *s = create_stream(agent, topic, size, config);
+    if (!s)
+        // errno is already set
+        return -1;
+    s->producer = producer;
+
+    start_stream(agent, s, callback, ctx, id);
+
+    return 0;
+}
+
+int mqtta_stream_cancel(struct mosqagent *agent, const uint64_t id)
+{
+    if (!agent) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct stream *s = agent->streams ? agent->streams->list : NULL;
+    while (s && (s->id != id))
+        s = s->next;
+    if (!s) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // chunks in flight are still delivered
+    finish(agent, s, ECANCELED);
+
+    return 0;
+}
+
+unsigned int mqtta_streams_pending(const struct mosqagent *agent)
+{
+    return (agent && agent->streams) ? agent->streams->count : 0;
+}
+
+void mqtta_stream_published(struct mosqagent *agent, const int mid)
+{
+    struct stream *s = agent->streams ? agent->streams->list : NULL;
+    for (; s; s = s->next) {
+        unsigned int i;
+        for (i = 0; i < s->window; i++)
+            if (s->mid[i] == mid)
+                break;
+        if (i == s->window)
+            continue;
+
+        s->mid[i] = 0;
+        s->in_flight--;
+        complete_chunk(agent, s);
+        return;
+    }
+}
+
+void mqtta_stream_disconnected(struct mosqagent *agent)
+{
+    struct stream *s = agent->streams ? agent->streams->list : NULL;
+    while (s) {
+        struct stream *next = s->next;
+
+        // libmosquitto only keeps QoS 1 and 2 messages for the reconnect
+        if (!s->qos && s->in_flight)
+            finish(agent, s, ECONNRESET);
+
+        s = next;
+    }
+}
+
+void mqtta_free_streams(struct mosqagent *agent)
+{
+    struct mqtta_streams *streams = agent->streams;
+    if (!streams)
+        return;
+
+    while (streams->list)
+        finish(agent, streams->list, ECANCELED);
+
+    mqtta_free(streams);
+    agent->streams = NULL;
+}
+
+
+/*
+ * Reassembly
+ */
+
+struct mqtta_reassembly {
+    /** The target, a buffer of the caller or the mapped file */
+    uint8_t *data;
+    /** The size of the buffer or the largest file */
+    size_t capacity;
+
+    char *path;
+    char *part;
+    int fd;
+
+    uint64_t id;
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t chunks;
+    uint32_t received;
+    uint32_t object_crc;
+    bool complete;
+
+    /** One bit per received chunk */
+    uint8_t *seen;
+};
+
+struct mqtta_reassembly* mqtta_reassembly_buffer(void *buf,
+                                                 const size_t capacity)
+{
+    if (!buf && capacity) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct mqtta_reassembly *r = mqtta_calloc(NULL, 1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->data = buf;
+    r->capacity = capacity;
+    r->fd = -1;
+
+    return r;
+}
+
+struct mqtta_reassembly* mqtta_reassembly_file(const char *path,
+                                               const size_t max_size)
+{
+    if (!path) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct mqtta_reassembly *r = mqtta_calloc(NULL, 1, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->capacity = max_size;
+    r->fd = -1;
+
+    const size_t len = strlen(path);
+    r->path = mqtta_strdup(NULL, path);
+    r->part = mqtta_malloc(NULL, len + 6);
+    if (!r->path || !r->part) {
+        mqtta_reassembly_destroy(r);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(r->part, path, len);
+    memcpy(r->part + len, ".part", 6);
+
+    return r;
+}
+
+/*
+ * Set up the target with the first chunk of a stream.
+ */
+static int start_object(struct mqtta_reassembly *r,
+                        const struct chunk_header *h)
+{
+    const uint32_t chunks = chunk_count(h->size, h->chunk_size);
+
+    // the size is the sender's word, also for the file
+    if (h->size > r->capacity) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (r->path) {
+        r->fd = open(r->part, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (r->fd < 0)
+            // errno is already set
+            return -1;
+
+        if (ftruncate(r->fd, h->size))
+            goto fail_with_file;
+
+        if (h->size) {
+            void *map = mmap(NULL, h->size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, r->fd, 0);
+            if (map == MAP_FAILED)
+                goto fail_with_file;
+            r->data = map;
+        }
+    }
+
+    r->seen = mqtta_calloc(NULL, (chunks + 7) / 8, 1);
+    if (!r->seen)
+        goto fail_with_file;
+
+    r->id = h->id;
+    r->size = h->size;
+    r->chunk_size = h->chunk_size;
+    r->chunks = chunks;
+
+    return 0;
+
+fail_with_file:
+    if (r->fd >= 0) {
+        const int err = errno;
+        if (r->data && h->size)
+            munmap(r->data, h->size);
+        r->data = NULL;
+        close(r->fd);
+        unlink(r->part);
+        r->fd = -1;
+        errno = err;
+    }
+    return -1;
+}
+
+/*
+ * Check the object and move the file into place.
+ */
+static int finish_object(struct mqtta_reassembly *r)
+{
+    const uint8_t empty = 0;
+    const uint8_t *data = r->size ? r->data : &empty;
+
+    if (crc32c(0, data, r->size) != r->object_crc) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (r->path) {
+        if (r->size && msync(r->data, r->size, MS_SYNC))
+            // errno is already set
+            return -1;
+        if (r->size)
+            munmap(r->data, r->size);
+        r->data = NULL;
+        close(r->fd);
+        r->fd = -1;
+
+        if (rename(r->part, r->path))
+            // errno is already set
+            return -1;
+    }
+
+    r->complete = true;
+
+    return 1;
+}
+
+int mqtta_reassembly_feed(struct mqtta_reassembly *r,
+                          const void *payload,
+                          const size_t len)
+{
+    if (!r || (!payload && len)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct chunk_header h;
+    if (decode_header(payload, len, &h))
+        // errno is already set
+        return -1;
+
+    // the same limits as for sending, so the chunk count fits
+    if (!h.chunk_size || (h.chunk_size > MAX_CHUNK_SIZE) ||
+        (h.size / h.chunk_size >= UINT32_MAX) ||
+        (h.seq >= chunk_count(h.size, h.chunk_size))) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (!r->id) {
+        if (start_object(r, &h))
+            // errno is already set
+            return -1;
+    } else if (h.id != r->id) {
+        errno = ESTALE;
+        return -1;
+    } else if ((h.size != r->size) || (h.chunk_size != r->chunk_size)) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    const uint8_t *data = (const uint8_t*)payload + MQTTA_STREAM_HEADER_SIZE;
+    const size_t data_len = len - MQTTA_STREAM_HEADER_SIZE;
+    if ((data_len != chunk_len(r->size, r->chunk_size, h.seq)) ||
+        (crc32c(0, data, data_len) != h.crc)) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    uint8_t *seen = &r->seen[h.seq / 8];
+    const uint8_t bit = 1 << (h.seq % 8);
+    if (r->complete || (*seen & bit))
+        return 0;
+
+    if (data_len)
+        memcpy(r->data + (uint64_t)h.seq * r->chunk_size, data, data_len);
+    *seen |= bit;
+    if (h.seq == r->chunks - 1)
+        r->object_crc = h.object_crc;
+
+    if (++r->received < r->chunks)
+        return 0;
+
+    return finish_object(r);
+}
+
+void mqtta_reassembly_status(const struct mqtta_reassembly *r,
+                             struct mqtta_reassembly_status *status)
+{
+    if (!r || !status)
+        return;
+
+    status->id = r->id;
+    status->size = r->size;
+    status->chunks = r->chunks;
+    status->received = r->received;
+    status->complete = r->complete;
+}
+
+void mqtta_reassembly_destroy(struct mqtta_reassembly *r)
+{
+    if (!r)
+        return;
+
+    // an incomplete file is not kept
+    if (r->fd >= 0) {
+        if (r->data && r->size)
+            munmap(r->data, r->size);
+        close(r->fd);
+        unlink(r->part);
+    }
+
+    mqtta_free(r->seen);
+    mqtta_free(r->path);
+    mqtta_free(r->part);
+    mqtta_free(r);
+}
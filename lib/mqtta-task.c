@@ -0,0 +1,754 @@
+/*
+ * Tasks on their own stacks, switched with ucontext
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta-task.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <mosquitto.h>
+
+#include "mqtt-tools/mqtta-rpc.h"
+#include "mqtta-private.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define TASK_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define TASK_ASAN
+#endif
+#endif
+
+#ifdef TASK_ASAN
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#define DEFAULT_POOL        64
+#define MIN_STACK_SIZE      (16 * 1024)
+/* waiting publishes by message id */
+#define PUBLISH_BUCKETS     64
+
+enum task_state {
+    TASK_READY,
+    TASK_RUNNING,
+    TASK_WAITING,
+    TASK_DONE,
+};
+
+struct task {
+    struct mosqagent *agent;
+    /** ready queue or pool */
+    struct task *next;
+    /** all started tasks */
+    struct task *prev_started;
+    struct task *next_started;
+
+    ucontext_t context;
+    /** mapping with the guard page, and the stack above it */
+    void *mapping;
+    void *stack;
+    size_t stack_size;
+
+    enum task_state state;
+    /** result of the last wait */
+    int status;
+
+    mqtta_task_function function;
+    mosqagent_message_handler handler;
+    void *data;
+    /** retained message of a subscription task */
+    struct mqtta_memory_object message;
+
+    /** sleep or publish timeout */
+    struct mqtta_timer *timer;
+    /** publish in flight, in a bucket of the waiting publishes */
+    int mid;
+    int qos;
+    struct task *next_publish;
+    struct mqtta_memory_object *response;
+};
+
+struct task_sub {
+    struct task_sub *next;
+    mosqagent_message_handler handler;
+    void *handler_data;
+};
+
+struct mqtta_tasks {
+    size_t stack_size;
+    unsigned int pool;
+
+    struct task *free;
+    unsigned int pooled;
+
+    struct task *ready;
+    struct task **ready_tail;
+
+    struct task *started;
+    unsigned int count;
+
+    struct task *publishing[PUBLISH_BUCKETS];
+
+    struct task_sub *subs;
+
+    /** the running task and the context of the agent loop */
+    struct task *current;
+    ucontext_t main;
+#ifdef TASK_ASAN
+    const void *main_bottom;
+    size_t main_size;
+#endif
+
+    bool closing;
+};
+
+static size_t page_size(void)
+{
+    const long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? (size_t)size : 4096;
+}
+
+static void enqueue(struct mqtta_tasks *tasks, struct task *t)
+{
+    t->state = TASK_READY;
+    t->next = NULL;
+    *tasks->ready_tail = t;
+    tasks->ready_tail = &t->next;
+}
+
+static void unlink_publish(struct mqtta_tasks *tasks, struct task *t)
+{
+    struct task **pp = &tasks->publishing[t->mid % PUBLISH_BUCKETS];
+    while (*pp != t)
+        pp = &(*pp)->next_publish;
+    *pp = t->next_publish;
+    t->mid = 0;
+}
+
+/*
+ * End the wait of a task and queue it for the next pass.
+ */
+static void wake(struct mosqagent *agent, struct task *t, const int status)
+{
+    if (t->state != TASK_WAITING)
+        return;
+
+    if (t->timer) {
+        mosqagent_cancel_timer(agent, t->timer);
+        t->timer = NULL;
+    }
+    if (t->mid)
+        unlink_publish(agent->tasks, t);
+
+    t->status = status;
+    enqueue(agent->tasks, t);
+}
+
+/*
+ * Switch from the task back to the agent loop.
+ */
+static void switch_to_main(struct mqtta_tasks *tasks, struct task *t)
+{
+#ifdef TASK_ASAN
+    void *fake_stack = NULL;
+    // a finished task does not come back
+    __sanitizer_start_switch_fiber(t->state == TASK_DONE ? NULL : &fake_stack,
+                                   tasks->main_bottom, tasks->main_size);
+#endif
+    swapcontext(&t->context, &tasks->main);
+#ifdef TASK_ASAN
+    __sanitizer_finish_switch_fiber(fake_stack,
+                                    &tasks->main_bottom, &tasks->main_size);
+#endif
+}
+
+static void task_main(const unsigned int high, const unsigned int low)
+{
+    // makecontext only passes int arguments
+    struct task *t = (struct task*)(uintptr_t)(((uint64_t)high << 32) | low);
+    struct mosqagent *agent = t->agent;
+
+#ifdef TASK_ASAN
+    __sanitizer_finish_switch_fiber(NULL, &agent->tasks->main_bottom,
+                                    &agent->tasks->main_size);
+#endif
+
+    if (t->handler) {
+        t->handler(agent, mqtta_mo_ptr(&t->message), t->data);
+        mqtta_mo_free(&t->message);
+    } else
+        t->function(agent, t->data);
+
+    t->state = TASK_DONE;
+    switch_to_main(agent->tasks, t);
+}
+
+static void free_task(struct task *t)
+{
+    munmap(t->mapping, t->stack_size + page_size());
+    mqtta_free(t);
+}
+
+/*
+ * Take a task from the pool or map a new stack, and prepare its context.
+ */
+static struct task* create_task(struct mosqagent *agent)
+{
+    struct mqtta_tasks *tasks = agent->tasks;
+    struct task *t = tasks->free;
+
+    if (t) {
+        tasks->free = t->next;
+        tasks->pooled--;
+    } else {
+        t = mqtta_malloc(agent->allocator, sizeof(*t));
+        if (!t)
+            // errno is already set
+            return NULL;
+
+        const size_t guard = page_size();
+        t->stack_size = tasks->stack_size;
+        t->mapping = mmap(NULL, guard + t->stack_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (t->mapping == MAP_FAILED) {
+            mqtta_free(t);
+            errno = ENOMEM;
+            return NULL;
+        }
+        // the stack grows down into the guard page
+        if (mprotect(t->mapping, guard, PROT_NONE)) {
+            const int err = errno;
+            munmap(t->mapping, guard + t->stack_size);
+            mqtta_free(t);
+            errno = err;
+            return NULL;
+        }
+        t->stack = (char*)t->mapping + guard;
+
+        // a pooled task has the context it was switched out with
+        if (getcontext(&t->context)) {
+            const int err = errno;
+            free_task(t);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    t->context.uc_stack.ss_sp = t->stack;
+    t->context.uc_stack.ss_size = t->stack_size;
+    t->context.uc_link = NULL;
+
+    const uint64_t p = (uintptr_t)t;
+    makecontext(&t->context, (void (*)(void))task_main, 2,
+                (unsigned int)(p >> 32), (unsigned int)p);
+
+    t->agent = agent;
+    t->status = 0;
+    t->function = NULL;
+    t->handler = NULL;
+    t->data = NULL;
+    mqtta_mo_move(&t->message, NULL, NULL);
+    t->timer = NULL;
+    t->mid = 0;
+    t->qos = 0;
+    t->next_publish = NULL;
+    t->response = NULL;
+
+    return t;
+}
+
+/*
+ * Keep the stack of a task for the next one, or unmap it.
+ */
+static void release_task(struct mqtta_tasks *tasks, struct task *t)
+{
+    if ((tasks->pooled < tasks->pool) && (t->stack_size == tasks->stack_size)) {
+        t->next = tasks->free;
+        tasks->free = t;
+        tasks->pooled++;
+    } else
+        free_task(t);
+}
+
+static void start_task(struct mqtta_tasks *tasks, struct task *t)
+{
+    t->prev_started = NULL;
+    t->next_started = tasks->started;
+    if (tasks->started)
+        tasks->started->prev_started = t;
+    tasks->started = t;
+    tasks->count++;
+
+    enqueue(tasks, t);
+}
+
+static void finish_task(struct mqtta_tasks *tasks, struct task *t)
+{
+    if (t->prev_started)
+        t->prev_started->next_started = t->next_started;
+    else
+        tasks->started = t->next_started;
+    if (t->next_started)
+        t->next_started->prev_started = t->prev_started;
+    tasks->count--;
+
+    release_task(tasks, t);
+}
+
+static void resume(struct mqtta_tasks *tasks, struct task *t)
+{
+    t->state = TASK_RUNNING;
+    tasks->current = t;
+
+#ifdef TASK_ASAN
+    void *fake_stack = NULL;
+    __sanitizer_start_switch_fiber(&fake_stack, t->stack, t->stack_size);
+#endif
+    swapcontext(&tasks->main, &t->context);
+#ifdef TASK_ASAN
+    __sanitizer_finish_switch_fiber(fake_stack, NULL, NULL);
+#endif
+
+    tasks->current = NULL;
+
+    if (t->state == TASK_DONE)
+        finish_task(tasks, t);
+}
+
+/*
+ * Run the tasks that are ready, those that become ready meanwhile wait for
+ * the next pass.
+ */
+static bool run_ready(struct mqtta_tasks *tasks)
+{
+    struct task *t = tasks->ready;
+    tasks->ready = NULL;
+    tasks->ready_tail = &tasks->ready;
+
+    while (t) {
+        struct task *next = t->next;
+        resume(tasks, t);
+        t = next;
+    }
+
+    return tasks->ready != NULL;
+}
+
+static struct mosqagent_result* run_tasks(struct mosqagent *agent)
+{
+    struct mqtta_tasks *tasks = agent->tasks;
+
+    // not from a task that runs the loop
+    if (!tasks || tasks->current)
+        return NULL;
+
+    return run_ready(tasks)
+           ? mosqagent_idle_result(agent, MQTTA_IDLE_YIELD)
+           : NULL;
+}
+
+static struct mqtta_tasks* get_tasks(struct mosqagent *agent)
+{
+    if (agent->tasks)
+        return agent->tasks;
+
+    struct mqtta_tasks *tasks = mqtta_calloc(agent->allocator, 1,
+                                             sizeof(*tasks));
+    if (!tasks)
+        // errno is already set
+        return NULL;
+    tasks->stack_size = MQTTA_TASK_STACK_SIZE;
+    tasks->pool = DEFAULT_POOL;
+    tasks->ready_tail = &tasks->ready;
+
+    if (mosqagent_add_idle_call_budget(agent, run_tasks, "tasks", 0)) {
+        mqtta_free(tasks);
+        // errno is already set
+        return NULL;
+    }
+
+    agent->tasks = tasks;
+    return tasks;
+}
+
+/*
+ * The running task of the agent, for a wait.
+ */
+static struct task* current_task(const struct mosqagent *agent)
+{
+    struct task *t = (agent && agent->tasks) ? agent->tasks->current : NULL;
+
+    if (!t) {
+        errno = EPERM;
+        return NULL;
+    }
+    if (agent->tasks->closing) {
+        errno = ECANCELED;
+        return NULL;
+    }
+
+    return t;
+}
+
+/*
+ * Switch to the agent loop until the task is woken.
+ */
+static int suspend(struct task *t)
+{
+    switch_to_main(t->agent->tasks, t);
+
+    if (t->status) {
+        errno = t->status;
+        return -1;
+    }
+
+    return 0;
+}
+
+int mqtta_task_configure(struct mosqagent *agent,
+                         const struct mqtta_task_config *config)
+{
+    if (!agent || !config) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const size_t page = page_size();
+    size_t stack_size = config->stack_size
+                      ? config->stack_size
+                      : MQTTA_TASK_STACK_SIZE;
+    if ((stack_size < MIN_STACK_SIZE) || (stack_size > SIZE_MAX / 2)) {
+        errno = EINVAL;
+        return -1;
+    }
+    stack_size = (stack_size + page - 1) / page * page;
+
+    if (agent->tasks && agent->tasks->count) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    struct mqtta_tasks *tasks = get_tasks(agent);
+    if (!tasks)
+        // errno is already set
+        return -1;
+
+    tasks->stack_size = stack_size;
+    tasks->pool = config->pool ? config->pool : DEFAULT_POOL;
+
+    // the pooled stacks may have the old size
+    while (tasks->free) {
+        struct task *t = tasks->free;
+        tasks->free = t->next;
+        free_task(t);
+    }
+    tasks->pooled = 0;
+
+    return 0;
+}
+
+int mqtta_task_spawn(struct mosqagent *agent,
+                     mqtta_task_function function,
+                     void *data)
+{
+    if (!agent || !function) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_tasks *tasks = get_tasks(agent);
+    if (!tasks)
+        // errno is already set
+        return -1;
+    if (tasks->closing) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    struct task *t = create_task(agent);
+    if (!t)
+        // errno is already set
+        return -1;
+    t->function = function;
+    t->data = data;
+
+    start_task(tasks, t);
+    return 0;
+}
+
+static void start_message_task(struct mosqagent *agent,
+                               const struct mqtta_message *msg,
+                               void *handler_data)
+{
+    struct task_sub *sub = handler_data;
+    struct mqtta_tasks *tasks = agent->tasks;
+
+    if (tasks->closing)
+        return;
+
+    struct task *t = create_task(agent);
+    if (!t)
+        return;
+
+    if (mqtta_message_retain(msg, &t->message)) {
+        release_task(tasks, t);
+        return;
+    }
+    t->handler = sub->handler;
+    t->data = sub->handler_data;
+
+    start_task(tasks, t);
+}
+
+int mqtta_task_subscribe(struct mosqagent *agent,
+                         const char *filter,
+                         const int qos,
+                         mosqagent_message_handler handler,
+                         void *handler_data)
+{
+    if (!agent || !handler) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_tasks *tasks = get_tasks(agent);
+    if (!tasks)
+        // errno is already set
+        return -1;
+
+    struct task_sub *sub = mqtta_malloc(agent->allocator, sizeof(*sub));
+    if (!sub)
+        // errno is already set
+        return -1;
+    sub->handler = handler;
+    sub->handler_data = handler_data;
+
+    if (mosqagent_subscribe(agent, filter, qos, start_message_task, sub)) {
+        const int err = errno;
+        mqtta_free(sub);
+        errno = err;
+        return -1;
+    }
+
+    sub->next = tasks->subs;
+    tasks->subs = sub;
+    return 0;
+}
+
+int mqtta_task_yield(struct mosqagent *agent)
+{
+    struct task *t = current_task(agent);
+    if (!t)
+        // errno is already set
+        return -1;
+
+    enqueue(agent->tasks, t);
+    return suspend(t);
+}
+
+static void on_wait_timer(struct mosqagent *agent, void *timer_data)
+{
+    struct task *t = timer_data;
+
+    // the one-shot timer is released after the callback
+    t->timer = NULL;
+    wake(agent, t, t->mid ? ETIMEDOUT : 0);
+}
+
+int mqtta_task_sleep(struct mosqagent *agent, const unsigned int ms)
+{
+    if (!ms)
+        return mqtta_task_yield(agent);
+
+    struct task *t = current_task(agent);
+    if (!t)
+        // errno is already set
+        return -1;
+
+    t->timer = mosqagent_add_timer(agent, ms, 0, on_wait_timer, t);
+    if (!t->timer)
+        // errno is already set
+        return -1;
+
+    t->state = TASK_WAITING;
+    return suspend(t);
+}
+
+int mqtta_task_publish(struct mosqagent *agent,
+                       const struct mqtta_message *msg,
+                       const unsigned int timeout_ms)
+{
+    struct task *t = current_task(agent);
+    if (!t)
+        // errno is already set
+        return -1;
+
+    if (!msg || !msg->topic || (msg->payloadlen < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the timer can only fire from the agent loop, after the suspend
+    if (timeout_ms) {
+        t->timer = mosqagent_add_timer(agent, timeout_ms, 0,
+                                       on_wait_timer, t);
+        if (!t->timer)
+            // errno is already set
+            return -1;
+    }
+
+    int mid = 0;
+    errno = 0;
+    const int ret = mqtta_publish_mid(agent, msg, NULL, &mid);
+    if (ret > 0)
+        errno = (ret == MOSQ_ERR_NO_CONN) ? ENOTCONN : EIO;
+
+    // failed, or delivered in the local group or written already
+    if (ret || !mid) {
+        const int err = errno;
+        if (t->timer)
+            mosqagent_cancel_timer(agent, t->timer);
+        t->timer = NULL;
+        errno = err;
+        return ret ? -1 : 0;
+    }
+
+    struct mqtta_tasks *tasks = agent->tasks;
+    t->mid = mid;
+    t->qos = msg->qos;
+    t->next_publish = tasks->publishing[mid % PUBLISH_BUCKETS];
+    tasks->publishing[mid % PUBLISH_BUCKETS] = t;
+
+    t->state = TASK_WAITING;
+    return suspend(t);
+}
+
+static void on_task_response(struct mosqagent *agent,
+                             int status,
+                             const struct mqtta_message *response,
+                             void *ctx)
+{
+    struct task *t = ctx;
+
+    if (!status && t->response &&
+        mqtta_message_retain(response, t->response))
+        status = errno;
+
+    wake(agent, t, status);
+}
+
+int mqtta_task_request(struct mosqagent *agent,
+                       const char *topic,
+                       const void *payload,
+                       const int payloadlen,
+                       const int qos,
+                       const unsigned int timeout_ms,
+                       struct mqtta_memory_object *response)
+{
+    if (response)
+        mqtta_mo_move(response, NULL, NULL);
+
+    struct task *t = current_task(agent);
+    if (!t)
+        // errno is already set
+        return -1;
+
+    t->response = response;
+    // the response may in theory arrive before the request returns
+    t->state = TASK_WAITING;
+    if (mqtta_request(agent, topic, payload, payloadlen, qos, timeout_ms,
+                      on_task_response, t)) {
+        t->state = TASK_RUNNING;
+        t->response = NULL;
+        // errno is already set
+        return -1;
+    }
+
+    const int ret = suspend(t);
+    t->response = NULL;
+    return ret;
+}
+
+bool mqtta_in_task(const struct mosqagent *agent)
+{
+    return agent && agent->tasks && agent->tasks->current;
+}
+
+unsigned int mqtta_tasks_pending(const struct mosqagent *agent)
+{
+    return (agent && agent->tasks) ? agent->tasks->count : 0;
+}
+
+void mqtta_task_published(struct mosqagent *agent, const int mid)
+{
+    struct mqtta_tasks *tasks = agent->tasks;
+    if (!tasks)
+        return;
+
+    struct task *t;
+    for (t = tasks->publishing[mid % PUBLISH_BUCKETS]; t; t = t->next_publish)
+        if (t->mid == mid) {
+            wake(agent, t, 0);
+            return;
+        }
+}
+
+void mqtta_task_disconnected(struct mosqagent *agent)
+{
+    struct mqtta_tasks *tasks = agent->tasks;
+    if (!tasks)
+        return;
+
+    // QoS 0 messages that were not written are gone, the others are sent
+    // again after the reconnect
+    unsigned int i;
+    for (i = 0; i < PUBLISH_BUCKETS; i++) {
+        struct task *t = tasks->publishing[i];
+        while (t) {
+            struct task *next = t->next_publish;
+            if (!t->qos)
+                wake(agent, t, ECONNRESET);
+            t = next;
+        }
+    }
+}
+
+void mqtta_free_tasks(struct mosqagent *agent)
+{
+    struct mqtta_tasks *tasks = agent->tasks;
+    if (!tasks)
+        return;
+
+    // run all tasks to their end, their waits fail from now on
+    tasks->closing = true;
+    while (tasks->started) {
+        struct task *t;
+        for (t = tasks->started; t; t = t->next_started)
+            wake(agent, t, ECANCELED);
+        run_ready(tasks);
+    }
+
+    while (tasks->free) {
+        struct task *t = tasks->free;
+        tasks->free = t->next;
+        free_task(t);
+    }
+
+    while (tasks->subs) {
+        struct task_sub *sub = tasks->subs;
+        tasks->subs = sub->next;
+        mqtta_free(sub);
+    }
+
+    agent->tasks = NULL;
+    mqtta_free(tasks);
+}
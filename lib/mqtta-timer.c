@@ -0,0 +1,211 @@
+/*
+ * Agent timers on a hashed timer wheel
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mqtta-private.h"
+
+/*
+ * One slot per millisecond tick; timers further out than the wheel span
+ * simply stay in their slot for more rounds.
+ */
+#define WHEEL_SLOTS 256
+#define WHEEL_MASK  (WHEEL_SLOTS - 1)
+
+struct mqtta_timer {
+    struct mqtta_timer *next;
+    struct mqtta_timer **pprev;
+
+    uint64_t expires;
+    unsigned int interval;
+    bool cancelled;
+
+    mqtta_timer_callback callback;
+    void *timer_data;
+};
+
+struct mqtta_timer_wheel {
+    struct mqtta_timer *slot[WHEEL_SLOTS];
+    /** expired timers waiting for their callback */
+    struct mqtta_timer *expired;
+    /** the timer whose callback is currently running */
+    struct mqtta_timer *firing;
+    /** last processed tick */
+    uint64_t current;
+};
+
+uint64_t mqtta_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_link(struct mqtta_timer **head, struct mqtta_timer *t)
+{
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void timer_unlink(struct mqtta_timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void timer_schedule(struct mqtta_timer_wheel *wheel,
+                           struct mqtta_timer *t)
+{
+    // overdue timers are picked up with the next tick
+    const uint64_t tick = t->expires > wheel->current
+                        ? t->expires
+                        : wheel->current + 1;
+
+    timer_link(&wheel->slot[tick & WHEEL_MASK], t);
+}
+
+struct mqtta_timer* mosqagent_add_timer(struct mosqagent *agent,
+                                        const unsigned int delay_ms,
+                                        const unsigned int interval_ms,
+                                        mqtta_timer_callback callback,
+                                        void *timer_data)
+{
+    if (!agent || !callback) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // the wheel is only created for agents that use timers
+    if (!agent->timers) {
+        agent->timers = mqtta_calloc(agent->allocator, 1, sizeof(*agent->timers));
+        if (!agent->timers) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        agent->timers->current = mqtta_now_ms();
+    }
+
+    struct mqtta_timer *t;
+    t = mqtta_malloc(agent->allocator, sizeof(*t));
+    if (!t) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    t->expires = mqtta_now_ms() + delay_ms;
+    t->interval = interval_ms;
+    t->cancelled = false;
+    t->callback = callback;
+    t->timer_data = timer_data;
+
+    timer_schedule(agent->timers, t);
+
+    return t;
+}
+
+void mosqagent_cancel_timer(struct mosqagent *agent,
+                            struct mqtta_timer *timer)
+{
+    if (!agent || !agent->timers || !timer)
+        return;
+
+    // freed by mosqagent_run_timers when the callback returns
+    if (timer == agent->timers->firing) {
+        timer->cancelled = true;
+        return;
+    }
+
+    timer_unlink(timer);
+    mqtta_free(timer);
+}
+
+int mosqagent_run_timers(struct mosqagent *agent)
+{
+    if (!agent || !agent->timers)
+        return 0;
+
+    struct mqtta_timer_wheel *wheel = agent->timers;
+
+    const uint64_t now = mqtta_now_ms();
+    if (now <= wheel->current)
+        return 0;
+
+    // after a long pause one round covers all slots
+    uint64_t ticks = now - wheel->current;
+    if (ticks > WHEEL_SLOTS)
+        ticks = WHEEL_SLOTS;
+
+    // collect first, callbacks may add or cancel timers
+    uint64_t i;
+    for (i = 1; i <= ticks; i++) {
+        struct mqtta_timer *t = wheel->slot[(wheel->current + i) & WHEEL_MASK];
+
+        while (t) {
+            struct mqtta_timer *next = t->next;
+
+            if (t->expires <= now) {
+                timer_unlink(t);
+                timer_link(&wheel->expired, t);
+            }
+
+            t = next;
+        }
+    }
+    wheel->current = now;
+
+    int fired = 0;
+    while (wheel->expired) {
+        struct mqtta_timer *t = wheel->expired;
+        timer_unlink(t);
+
+        wheel->firing = t;
+        t->callback(agent, t->timer_data);
+        wheel->firing = NULL;
+        ++fired;
+
+        if (t->interval && !t->cancelled) {
+            t->expires += t->interval;
+            // do not try to catch up on missed periods
+            if (t->expires <= now)
+                t->expires = now + t->interval;
+            timer_schedule(wheel, t);
+        } else {
+            mqtta_free(t);
+        }
+    }
+
+    return fired;
+}
+
+void mqtta_free_timers(struct mosqagent *agent)
+{
+    if (!agent->timers)
+        return;
+
+    int i;
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        while (agent->timers->slot[i]) {
+            struct mqtta_timer *t = agent->timers->slot[i];
+            timer_unlink(t);
+            mqtta_free(t);
+        }
+    }
+
+    mqtta_free(agent->timers);
+    agent->timers = NULL;
+}
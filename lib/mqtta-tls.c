@@ -0,0 +1,360 @@
+/*
+ * TLS for the broker connection, with session resumption
+ *
+ * libmosquitto does the TLS handshake. If the library is built with
+ * OpenSSL, the agent hands it an SSL context of its own that keeps the
+ * sessions the broker sends, offers the last one on the next connect and
+ * times the handshakes.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta.h"
+#include "mqtt-tools/mosqhelper.h"
+#include "mqtta-build.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef MQTTA_WITH_OPENSSL
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#endif
+
+#include "mqtta-private.h"
+
+struct mqtta_tls {
+    const struct mqtta_allocator *allocator;
+    struct mqtta_tls_config config;
+    struct mqtta_tls_stats stats;
+
+#ifdef MQTTA_WITH_OPENSSL
+    SSL_CTX *ctx;
+    /** The last session from the broker, offered on the next connect */
+    SSL_SESSION *session;
+    /** Start of the running handshake, 0 if none */
+    uint64_t start_ns;
+#endif
+};
+
+#ifdef MQTTA_WITH_OPENSSL
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Read the session of a previous run, if it can still be resumed.
+ */
+static void load_session(struct mqtta_tls *tls)
+{
+    FILE *f = fopen(tls->config.session_cache, "r");
+    if (!f)
+        return;
+
+    SSL_SESSION *session = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+    fclose(f);
+    if (!session)
+        return;
+
+    const long expires = SSL_SESSION_get_time(session) +
+                         SSL_SESSION_get_timeout(session);
+    if (!SSL_SESSION_is_resumable(session) || (expires <= time(NULL))) {
+        SSL_SESSION_free(session);
+        return;
+    }
+
+    tls->session = session;
+}
+
+/*
+ * Replace the session file, readable for the owner only.
+ */
+static void store_session(struct mqtta_tls *tls)
+{
+    const char *path = tls->config.session_cache;
+    const size_t len = strlen(path);
+
+    char *tmp = mqtta_malloc(tls->allocator, len + 5);
+    if (!tmp)
+        return;
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    FILE *f = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    if (!f) {
+        if (fd >= 0)
+            close(fd);
+        goto fail;
+    }
+
+    const int written = PEM_write_SSL_SESSION(f, tls->session);
+    if ((fclose(f) == EOF) || !written)
+        goto fail;
+
+    if (rename(tmp, path))
+        goto fail;
+
+    mqtta_free(tmp);
+    return;
+
+fail:
+    syslog(LOG_WARNING, "mqtta: cannot write the TLS session to %s", path);
+    unlink(tmp);
+    mqtta_free(tmp);
+}
+
+/*
+ * Keep a new session from the broker, with TLS 1.3 after the handshake.
+ */
+static int new_session(SSL *ssl, SSL_SESSION *session)
+{
+    struct mqtta_tls *tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    if (!tls)
+        return 0;
+
+    if (tls->session)
+        SSL_SESSION_free(tls->session);
+    // returning 1 takes over the reference
+    tls->session = session;
+    tls->stats.sessions++;
+
+    if (tls->config.session_cache)
+        store_session(tls);
+
+    return 1;
+}
+
+static void handshake_info(const SSL *ssl, int where, int ret)
+{
+    struct mqtta_tls *tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    (void) ret; /* unused */
+
+    if (!tls)
+        return;
+
+    if (where & SSL_CB_HANDSHAKE_START) {
+        // libmosquitto creates the connection and starts the handshake in
+        // one go, so the session can only be offered from here, before
+        // the ClientHello is written
+        if (tls->session && SSL_in_before(ssl) && !SSL_get_session(ssl))
+            SSL_set_session((SSL*)ssl, tls->session);
+        tls->start_ns = monotonic_ns();
+    }
+
+    if ((where & SSL_CB_HANDSHAKE_DONE) && tls->start_ns) {
+        const uint64_t us = (monotonic_ns() - tls->start_ns) / 1000;
+        tls->start_ns = 0;
+
+        tls->stats.handshakes++;
+        if (SSL_session_reused((SSL*)ssl))
+            tls->stats.resumed++;
+        tls->stats.last_us = us;
+        tls->stats.total_us += us;
+    }
+}
+
+static int create_context(struct mqtta_tls *tls)
+{
+    tls->ctx = SSL_CTX_new(TLS_client_method());
+    if (!tls->ctx) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    SSL_CTX_set_app_data(tls->ctx, tls);
+    // libmosquitto does not look into a session cache, sessions are only
+    // kept by the callback
+    SSL_CTX_set_session_cache_mode(tls->ctx,
+                                   SSL_SESS_CACHE_CLIENT |
+                                   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls->ctx, new_session);
+    SSL_CTX_set_info_callback(tls->ctx, handshake_info);
+
+    if (tls->config.session_cache)
+        load_session(tls);
+
+    return 0;
+}
+
+#endif
+
+static int copy_string(const struct mqtta_allocator *allocator,
+                       const char *s,
+                       char **copy)
+{
+    *copy = NULL;
+    if (!s)
+        return 0;
+
+    *copy = mqtta_strdup(allocator, s);
+    // errno is already set
+    return *copy ? 0 : -1;
+}
+
+static int copy_config(struct mqtta_tls *tls,
+                       const struct mqtta_tls_config *config)
+{
+    const struct mqtta_allocator *a = tls->allocator;
+    struct mqtta_tls_config *c = &tls->config;
+
+    c->insecure = config->insecure;
+
+    if (copy_string(a, config->cafile, &c->cafile) ||
+        copy_string(a, config->capath, &c->capath) ||
+        copy_string(a, config->certfile, &c->certfile) ||
+        copy_string(a, config->keyfile, &c->keyfile) ||
+        copy_string(a, config->psk, &c->psk) ||
+        copy_string(a, config->identity, &c->identity) ||
+        copy_string(a, config->version, &c->version) ||
+        copy_string(a, config->ciphers, &c->ciphers) ||
+        copy_string(a, config->session_cache, &c->session_cache))
+        // errno is already set
+        return -1;
+
+    return 0;
+}
+
+static void free_config(struct mqtta_tls_config *c)
+{
+    mqtta_free(c->cafile);
+    mqtta_free(c->capath);
+    mqtta_free(c->certfile);
+    mqtta_free(c->keyfile);
+    mqtta_free(c->psk);
+    mqtta_free(c->identity);
+    mqtta_free(c->version);
+    mqtta_free(c->ciphers);
+    mqtta_free(c->session_cache);
+}
+
+int mosqagent_set_tls(struct mosqagent *agent,
+                      const struct mqtta_tls_config *config)
+{
+    // certificates or a pre-shared key, not both
+    const bool certs = config && (config->cafile || config->capath);
+    const bool psk = config && config->psk;
+    if (!agent || (certs == psk) || (psk && !config->identity)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mqtta_free_tls(agent);
+
+    struct mqtta_tls *tls = mqtta_calloc(agent->allocator, 1, sizeof(*tls));
+    if (!tls)
+        // errno is already set
+        return -1;
+    tls->allocator = agent->allocator;
+    agent->tls = tls;
+
+    if (copy_config(tls, config))
+        goto fail;
+
+#ifdef MQTTA_WITH_OPENSSL
+    if (create_context(tls))
+        goto fail;
+#endif
+
+    // before setup the settings are applied with the first connect
+    if (agent->mosq && mqtta_tls_apply(agent))
+        goto fail;
+
+    return 0;
+
+fail:
+    {
+        const int err = errno;
+        mqtta_free_tls(agent);
+        errno = err;
+    }
+    return -1;
+}
+
+int mqtta_tls_apply(struct mosqagent *agent)
+{
+    const struct mqtta_tls *tls = agent->tls;
+    const struct mqtta_tls_config *c = &tls->config;
+    int ret;
+
+    if (c->psk)
+        ret = mqtt_set_tls_psk(agent->mosq, c->psk, c->identity, c->ciphers);
+    else
+        ret = mqtt_set_tls(agent->mosq, c->cafile, c->capath,
+                           c->certfile, c->keyfile,
+                           c->version, c->ciphers, c->insecure);
+
+#ifdef MQTTA_WITH_OPENSSL
+    if (!ret)
+        ret = mqtt_set_ssl_ctx(agent->mosq, tls->ctx);
+#endif
+
+    switch (ret) {
+    case MOSQ_ERR_SUCCESS:
+        return 0;
+    case MOSQ_ERR_NOMEM:
+        errno = ENOMEM;
+        break;
+    case MOSQ_ERR_NOT_SUPPORTED:
+        // libmosquitto without TLS
+        errno = ENOTSUP;
+        break;
+    default:
+        errno = EINVAL;
+        break;
+    }
+
+    return -1;
+}
+
+int mosqagent_tls_stats(const struct mosqagent *agent,
+                        struct mqtta_tls_stats *stats)
+{
+    if (!agent || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (agent->tls)
+        *stats = agent->tls->stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+
+    return 0;
+}
+
+void mqtta_free_tls(struct mosqagent *agent)
+{
+    struct mqtta_tls *tls = agent->tls;
+    if (!tls)
+        return;
+
+#ifdef MQTTA_WITH_OPENSSL
+    if (tls->ctx) {
+        // libmosquitto holds its own reference and may still shut down a
+        // connection with it
+        SSL_CTX_set_app_data(tls->ctx, NULL);
+        SSL_CTX_sess_set_new_cb(tls->ctx, NULL);
+        SSL_CTX_set_info_callback(tls->ctx, NULL);
+        SSL_CTX_free(tls->ctx);
+    }
+    if (tls->session)
+        SSL_SESSION_free(tls->session);
+#endif
+
+    free_config(&tls->config);
+    mqtta_free(tls);
+    agent->tls = NULL;
+}
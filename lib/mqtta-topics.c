@@ -0,0 +1,576 @@
+/*
+ * Hot topics and topic cardinality of the received messages
+ *
+ * A Count-Min sketch with conservative update estimates the count of each
+ * topic, a min-heap keeps the topics with the highest estimates and a
+ * HyperLogLog estimates the number of distinct topics. All three are
+ * sized on setup and fed with one 64 bit hash of the topic.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtta-private.h"
+
+#define DEFAULT_WIDTH       1024
+#define DEFAULT_DEPTH       4
+#define DEFAULT_TOP         16
+#define DEFAULT_PRECISION   12
+#define DEFAULT_INTERVAL    10000
+
+#define MIN_WIDTH           16
+#define MAX_WIDTH           (1u << 24)
+#define MAX_DEPTH           8
+#define MAX_TOP             256
+
+struct top_entry {
+    /** estimate at the last update */
+    uint64_t count;
+    /** index of the topic's hash and name */
+    unsigned int slot;
+};
+
+struct mqtta_topics {
+    const struct mqtta_allocator *allocator;
+    struct mqtta_topics_config config;
+
+    /** log2 of the width */
+    unsigned int shift;
+    /** depth rows of width counters */
+    uint64_t *counters;
+    /** 2^precision HyperLogLog registers */
+    uint8_t *registers;
+
+    /** min-heap on count */
+    struct top_entry *heap;
+    unsigned int size;
+    /*
+     * Per slot, which stays with a topic while it is listed: the hashes
+     * are kept apart from the heap to be scanned quickly
+     */
+    uint64_t *hashes;
+    unsigned int *position;
+    char (*names)[MQTTA_TOPICS_NAME_LEN];
+
+    uint64_t total;
+
+    struct mqtta_timer *timer;
+};
+
+/*
+ * Hash eight bytes at a time, with the MurmurHash3 finalizer for the
+ * HyperLogLog, which needs well mixed bits.
+ */
+static uint64_t topic_hash(const char *topic, size_t len)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t h = len * k;
+    uint64_t w;
+
+    for (; len >= 8; topic += 8, len -= 8) {
+        memcpy(&w, topic, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+    }
+    // the rest with reads of fixed size, which overlap for 5 to 7 bytes
+    if (len >= 4) {
+        uint32_t lo, hi;
+        memcpy(&lo, topic, 4);
+        memcpy(&hi, topic + len - 4, 4);
+        h = (h ^ (((uint64_t)hi << 32) | lo)) * k;
+    } else if (len) {
+        const uint8_t *b = (const uint8_t*)topic;
+        h = (h ^ (b[0] | ((uint64_t)b[len / 2] << 8) |
+                  ((uint64_t)b[len - 1] << 16))) * k;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+/* Odd multipliers, one per row */
+static const uint64_t row_seed[MAX_DEPTH] = {
+    0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full,
+    0x165667b19e3779f9ull, 0xd6e8feb86659fd93ull,
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+/*
+ * The counter of a hash in a row, by multiply-shift: the rows must not
+ * share their collisions, which two halves of the hash combined per row
+ * would do with a narrow sketch.
+ */
+static inline uint64_t* counter(const struct mqtta_topics *t,
+                                uint64_t hash,
+                                unsigned int row)
+{
+    return &t->counters[((size_t)row << t->shift) +
+                        ((hash * row_seed[row]) >> (64 - t->shift))];
+}
+
+static uint64_t estimate(const struct mqtta_topics *t, uint64_t hash)
+{
+    uint64_t est = UINT64_MAX;
+
+    unsigned int i;
+    for (i = 0; i < t->config.depth; i++) {
+        const uint64_t c = *counter(t, hash, i);
+        if (c < est)
+            est = c;
+    }
+
+    return est;
+}
+
+static void swap(struct mqtta_topics *t, unsigned int i, unsigned int j)
+{
+    const struct top_entry e = t->heap[i];
+    t->heap[i] = t->heap[j];
+    t->heap[j] = e;
+
+    t->position[t->heap[i].slot] = i;
+    t->position[t->heap[j].slot] = j;
+}
+
+static void sift_up(struct mqtta_topics *t, unsigned int i)
+{
+    while (i) {
+        const unsigned int parent = (i - 1) / 2;
+        if (t->heap[parent].count <= t->heap[i].count)
+            break;
+        swap(t, parent, i);
+        i = parent;
+    }
+}
+
+static void sift_down(struct mqtta_topics *t, unsigned int i)
+{
+    for (;;) {
+        const unsigned int l = 2 * i + 1;
+        const unsigned int r = l + 1;
+        unsigned int min = i;
+
+        if ((l < t->size) && (t->heap[l].count < t->heap[min].count))
+            min = l;
+        if ((r < t->size) && (t->heap[r].count < t->heap[min].count))
+            min = r;
+        if (min == i)
+            break;
+
+        swap(t, min, i);
+        i = min;
+    }
+}
+
+static void set_name(struct mqtta_topics *t,
+                     unsigned int slot,
+                     const char *topic,
+                     size_t len)
+{
+    if (len >= MQTTA_TOPICS_NAME_LEN)
+        len = MQTTA_TOPICS_NAME_LEN - 1;
+    memcpy(t->names[slot], topic, len);
+    t->names[slot][len] = '\0';
+}
+
+static void update_top(struct mqtta_topics *t,
+                       const char *topic,
+                       size_t len,
+                       uint64_t hash,
+                       uint64_t est)
+{
+    // the estimate of a listed topic was at least the minimum, and grows
+    // with each update, so the long tail ends here
+    if ((t->size == t->config.top) && (est <= t->heap[0].count))
+        return;
+
+    unsigned int slot;
+    for (slot = 0; slot < t->size; slot++)
+        if (t->hashes[slot] == hash) {
+            const unsigned int i = t->position[slot];
+            t->heap[i].count = est;
+            sift_down(t, i);
+            return;
+        }
+
+    if (t->size < t->config.top) {
+        slot = t->size++;
+        t->heap[slot].count = est;
+        t->heap[slot].slot = slot;
+        t->hashes[slot] = hash;
+        t->position[slot] = slot;
+        set_name(t, slot, topic, len);
+        sift_up(t, slot);
+        return;
+    }
+
+    // replace the topic with the lowest count
+    slot = t->heap[0].slot;
+    t->heap[0].count = est;
+    t->hashes[slot] = hash;
+    set_name(t, slot, topic, len);
+    sift_down(t, 0);
+}
+
+void mqtta_topics_count(struct mosqagent *agent,
+                        const char *topic,
+                        int payloadlen)
+{
+    struct mqtta_topics *t = agent->topics;
+
+    const size_t len = strlen(topic);
+    const uint64_t hash = topic_hash(topic, len);
+    const uint64_t weight = t->config.bytes ? (uint64_t)payloadlen : 1;
+
+    t->total += weight;
+
+    // the first bits select the register, the position of the first set
+    // bit in the others is the rank
+    const unsigned int p = t->config.precision;
+    const uint8_t rank = __builtin_clzll((hash << p) | (1ull << (p - 1))) + 1;
+    uint8_t *reg = &t->registers[hash >> (64 - p)];
+    if (rank > *reg)
+        *reg = rank;
+
+    // conservative update: raise only the counters below the new estimate
+    uint64_t *c[MAX_DEPTH];
+    uint64_t est = UINT64_MAX;
+    unsigned int i;
+    for (i = 0; i < t->config.depth; i++) {
+        c[i] = counter(t, hash, i);
+        est = (*c[i] < est) ? *c[i] : est;
+    }
+    est += weight;
+    // without branches, the comparisons are random
+    for (i = 0; i < t->config.depth; i++)
+        *c[i] = (*c[i] < est) ? est : *c[i];
+
+    update_top(t, topic, len, hash, est);
+}
+
+static uint64_t distinct(const struct mqtta_topics *t)
+{
+    const unsigned int m = 1u << t->config.precision;
+
+    double sum = 0;
+    unsigned int zeros = 0;
+    unsigned int i;
+    for (i = 0; i < m; i++) {
+        sum += ldexp(1.0, -t->registers[i]);
+        if (!t->registers[i])
+            zeros++;
+    }
+
+    double alpha;
+    switch (m) {
+    case 16:
+        alpha = 0.673;
+        break;
+    case 32:
+        alpha = 0.697;
+        break;
+    case 64:
+        alpha = 0.709;
+        break;
+    default:
+        alpha = 0.7213 / (1.0 + 1.079 / m);
+        break;
+    }
+
+    double e = alpha * m * m / sum;
+    // linear counting while many registers are empty
+    if ((e <= 2.5 * m) && zeros)
+        e = m * log((double)m / zeros);
+
+    return llround(e);
+}
+
+static int compare_counts(const void *a, const void *b)
+{
+    const uint64_t ca = ((const struct mqtta_topic_count*)a)->count;
+    const uint64_t cb = ((const struct mqtta_topic_count*)b)->count;
+
+    return (ca < cb) - (ca > cb);
+}
+
+/*
+ * The listed topics with their current estimates, highest first.
+ */
+static unsigned int top_topics(const struct mqtta_topics *t,
+                               struct mqtta_topic_count *top,
+                               unsigned int n)
+{
+    unsigned int i;
+    for (i = 0; i < t->size; i++) {
+        memcpy(top[i].topic, t->names[t->heap[i].slot],
+               MQTTA_TOPICS_NAME_LEN);
+        top[i].count = estimate(t, t->hashes[t->heap[i].slot]);
+    }
+    qsort(top, t->size, sizeof(*top), compare_counts);
+
+    return (t->size < n) ? t->size : n;
+}
+
+static void get_stats(const struct mqtta_topics *t,
+                      struct mqtta_topics_stats *stats)
+{
+    stats->total = t->total;
+    stats->distinct = distinct(t);
+    stats->error = ceil(exp(1.0) * t->total / (double)(1u << t->shift));
+}
+
+static void reset(struct mqtta_topics *t)
+{
+    memset(t->counters, 0,
+           ((size_t)t->config.depth << t->shift) * sizeof(*t->counters));
+    memset(t->registers, 0, 1u << t->config.precision);
+    t->size = 0;
+    t->total = 0;
+}
+
+static char* append_json_string(char *p, const char *s)
+{
+    *p++ = '"';
+    for (; *s; s++) {
+        const unsigned char c = *s;
+        if ((c == '"') || (c == '\\')) {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            p += sprintf(p, "\\u%04x", c);
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+
+    return p;
+}
+
+static void publish_snapshot(struct mosqagent *agent, void *timer_data)
+{
+    struct mqtta_topics *t = timer_data;
+    const struct mqtta_allocator *a = t->allocator;
+
+    struct mqtta_topics_stats stats;
+    get_stats(t, &stats);
+
+    // each character may need an escape of 6
+    const size_t entry = MQTTA_TOPICS_NAME_LEN * 6 + 48;
+    char *payload = mqtta_malloc(a, 96 + t->size * entry);
+    struct mqtta_topic_count *top = mqtta_malloc(a, (t->size + 1) *
+                                                    sizeof(*top));
+    if (!payload || !top)
+        goto out;
+
+    char *p = payload;
+    p += sprintf(p, "{\"total\":%" PRIu64 ",\"distinct\":%" PRIu64
+                 ",\"error\":%" PRIu64 ",\"top\":[",
+                 stats.total, stats.distinct, stats.error);
+
+    const unsigned int n = top_topics(t, top, t->size);
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        p += sprintf(p, "%s{\"topic\":", i ? "," : "");
+        p = append_json_string(p, top[i].topic);
+        p += sprintf(p, ",\"count\":%" PRIu64 "}", top[i].count);
+    }
+    p += sprintf(p, "]}");
+
+    struct mqtta_message msg = {
+        .topic = t->config.publish,
+        .payload = payload,
+        .payloadlen = p - payload,
+    };
+    mqtta_send_message(agent, &msg);
+
+    if (t->config.reset)
+        reset(t);
+
+out:
+    mqtta_free(top);
+    mqtta_free(payload);
+}
+
+static int check_config(struct mqtta_topics_config *c)
+{
+    if (!c->width)
+        c->width = DEFAULT_WIDTH;
+    if (c->width < MIN_WIDTH)
+        c->width = MIN_WIDTH;
+    if (!c->depth)
+        c->depth = DEFAULT_DEPTH;
+    if (!c->top)
+        c->top = DEFAULT_TOP;
+    if (!c->precision)
+        c->precision = DEFAULT_PRECISION;
+    if (!c->interval_ms)
+        c->interval_ms = DEFAULT_INTERVAL;
+
+    if ((c->width > MAX_WIDTH) || (c->depth > MAX_DEPTH) ||
+        (c->top > MAX_TOP) || (c->precision < 4) || (c->precision > 16)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int mosqagent_track_topics(struct mosqagent *agent,
+                           const struct mqtta_topics_config *config)
+{
+    struct mqtta_topics_config c = { .width = 0 };
+    if (config)
+        c = *config;
+
+    if (!agent || check_config(&c)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mqtta_free_topics(agent);
+
+    struct mqtta_topics *t = mqtta_calloc(agent->allocator, 1, sizeof(*t));
+    if (!t)
+        // errno is already set
+        return -1;
+    t->allocator = agent->allocator;
+    agent->topics = t;
+
+    t->config = c;
+    t->config.publish = NULL;
+    if (c.publish) {
+        t->config.publish = mqtta_strdup(t->allocator, c.publish);
+        if (!t->config.publish)
+            goto fail;
+    }
+
+    while ((1u << t->shift) < c.width)
+        t->shift++;
+
+    t->counters = mqtta_calloc(t->allocator, (size_t)c.depth << t->shift,
+                               sizeof(*t->counters));
+    t->registers = mqtta_calloc(t->allocator, 1, 1u << c.precision);
+    t->heap = mqtta_calloc(t->allocator, c.top, sizeof(*t->heap));
+    t->hashes = mqtta_calloc(t->allocator, c.top, sizeof(*t->hashes));
+    t->position = mqtta_calloc(t->allocator, c.top, sizeof(*t->position));
+    t->names = mqtta_calloc(t->allocator, c.top, sizeof(*t->names));
+    if (!t->counters || !t->registers || !t->heap ||
+        !t->hashes || !t->position || !t->names)
+        goto fail;
+
+    if (c.publish) {
+        t->timer = mosqagent_add_timer(agent, c.interval_ms, c.interval_ms,
+                                       publish_snapshot, t);
+        if (!t->timer)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    {
+        const int err = errno;
+        mqtta_free_topics(agent);
+        errno = err;
+    }
+    return -1;
+}
+
+int mosqagent_topic_stats(const struct mosqagent *agent,
+                          struct mqtta_topics_stats *stats)
+{
+    if (!agent || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (agent->topics)
+        get_stats(agent->topics, stats);
+    else
+        memset(stats, 0, sizeof(*stats));
+
+    return 0;
+}
+
+int mosqagent_top_topics(const struct mosqagent *agent,
+                         struct mqtta_topic_count *top,
+                         unsigned int n)
+{
+    if (!agent || (n && !top)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const struct mqtta_topics *t = agent->topics;
+    if (!t || !t->size || !n)
+        return 0;
+
+    // sort all of them, the list is short
+    struct mqtta_topic_count *all = top;
+    if (n < t->size) {
+        all = mqtta_malloc(t->allocator, t->size * sizeof(*all));
+        if (!all)
+            // errno is already set
+            return -1;
+    }
+
+    const unsigned int count = top_topics(t, all, n);
+
+    if (all != top) {
+        memcpy(top, all, count * sizeof(*top));
+        mqtta_free(all);
+    }
+
+    return count;
+}
+
+uint64_t mosqagent_topic_estimate(const struct mosqagent *agent,
+                                  const char *topic)
+{
+    if (!agent || !agent->topics || !topic)
+        return 0;
+
+    return estimate(agent->topics, topic_hash(topic, strlen(topic)));
+}
+
+void mosqagent_reset_topics(struct mosqagent *agent)
+{
+    if (agent && agent->topics)
+        reset(agent->topics);
+}
+
+void mqtta_free_topics(struct mosqagent *agent)
+{
+    struct mqtta_topics *t = agent->topics;
+    if (!t)
+        return;
+
+    if (t->timer)
+        mosqagent_cancel_timer(agent, t->timer);
+
+    mqtta_free(t->config.publish);
+    mqtta_free(t->counters);
+    mqtta_free(t->registers);
+    mqtta_free(t->heap);
+    mqtta_free(t->hashes);
+    mqtta_free(t->position);
+    mqtta_free(t->names);
+    mqtta_free(t);
+    agent->topics = NULL;
+}
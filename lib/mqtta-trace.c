@@ -0,0 +1,669 @@
+/*
+ * End-to-end latency tracing with MQTT v5 user properties
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta-trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+
+#include "mqtta-private.h"
+
+/* Initial size of the topic table, which doubles with the topics. */
+#define TOPIC_HASH_SIZE     128
+
+/*
+ * Log-linear latency histogram: values below 16 us have their own bucket,
+ * above that each power of two is split into 8 buckets.
+ */
+#define HIST_SUB_BITS       3
+#define HIST_SUB            (1 << HIST_SUB_BITS)
+#define HIST_LINEAR         (2 * HIST_SUB)
+#define HIST_BUCKETS        (HIST_LINEAR + (64 - HIST_SUB_BITS - 1) * HIST_SUB)
+
+struct trace_source {
+    struct trace_source *next;
+    char *name;
+    uint64_t last_seq;
+};
+
+struct trace_topic {
+    struct trace_topic *next;
+    char *topic;
+    uint32_t hash;
+
+    /** sequence number of the last message sent */
+    uint64_t out_seq;
+
+    /* received messages */
+    struct trace_source *sources;
+    unsigned int source_count;
+    uint64_t count;
+    uint64_t gaps;
+    uint64_t lost;
+    uint64_t duplicates;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint64_t sum_us;
+    /** latency histogram, allocated with the first received message */
+    uint32_t *bucket;
+};
+
+struct trace_span {
+    uint64_t start_ns;
+    uint32_t duration_ns;
+    uint32_t kind;
+};
+
+struct mqtta_trace {
+    const struct mqtta_allocator *allocator;
+
+    char *source;
+    char *dump;
+
+    struct trace_topic **topic;
+    unsigned int mask;
+    unsigned int topics;
+
+    unsigned int max_topics;
+    unsigned int max_sources;
+    uint64_t overflow;
+
+    /** ring of the last spans */
+    struct trace_span *span;
+    uint64_t span_count;
+};
+
+static const char *span_name[] = {
+    [MQTTA_SPAN_TIMERS]     = "timers",
+    [MQTTA_SPAN_IDLE]       = "idle calls",
+    [MQTTA_SPAN_NETWORK]    = "network",
+    [MQTTA_SPAN_DISPATCH]   = "dispatch",
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static unsigned int hist_index(const uint64_t v)
+{
+    if (v < HIST_LINEAR)
+        return v;
+
+    const int msb = 63 - __builtin_clzll(v);
+    const unsigned int sub = (v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+
+    return HIST_LINEAR + (msb - HIST_SUB_BITS - 1) * HIST_SUB + sub;
+}
+
+/*
+ * Middle of a bucket's value range.
+ */
+static uint64_t hist_value(const unsigned int index)
+{
+    if (index < HIST_LINEAR)
+        return index;
+
+    const int msb = (index - HIST_LINEAR) / HIST_SUB + HIST_SUB_BITS + 1;
+    const uint64_t sub = (index - HIST_LINEAR) % HIST_SUB;
+    const uint64_t width = (uint64_t)1 << (msb - HIST_SUB_BITS);
+
+    return ((HIST_SUB + sub) << (msb - HIST_SUB_BITS)) + width / 2;
+}
+
+static uint32_t topic_hash(const char *topic)
+{
+    uint32_t h = 2166136261u;
+    while (*topic)
+        h = (h ^ (unsigned char)*topic++) * 16777619u;
+
+    return h;
+}
+
+static struct trace_topic* find_topic(const struct mqtta_trace *trace,
+                                      const char *topic)
+{
+    const uint32_t h = topic_hash(topic);
+
+    struct trace_topic *t = trace->topic[h & trace->mask];
+    while (t && ((t->hash != h) || strcmp(t->topic, topic)))
+        t = t->next;
+
+    return t;
+}
+
+static int grow_table(struct mqtta_trace *trace)
+{
+    const unsigned int size = 2 * (trace->mask + 1);
+
+    struct trace_topic **topic = mqtta_calloc(trace->allocator,
+                                              size, sizeof(*topic));
+    if (!topic) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    unsigned int i;
+    for (i = 0; i <= trace->mask; i++) {
+        struct trace_topic *t = trace->topic[i];
+        while (t) {
+            struct trace_topic *next = t->next;
+            t->next = topic[t->hash & (size - 1)];
+            topic[t->hash & (size - 1)] = t;
+            t = next;
+        }
+    }
+
+    mqtta_free(trace->topic);
+    trace->topic = topic;
+    trace->mask = size - 1;
+
+    return 0;
+}
+
+/*
+ * Find or add a topic, fails with ENOSPC if the topic limit is reached.
+ */
+static struct trace_topic* get_topic(struct mqtta_trace *trace,
+                                     const char *topic)
+{
+    struct trace_topic *t = find_topic(trace, topic);
+    if (t)
+        return t;
+
+    if (trace->topics >= trace->max_topics) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    if ((trace->topics > trace->mask) && grow_table(trace))
+        return NULL;
+
+    t = mqtta_calloc(trace->allocator, 1, sizeof(*t));
+    if (!t) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    t->topic = mqtta_strdup(trace->allocator, topic);
+    if (!t->topic) {
+        mqtta_free(t);
+        errno = ENOMEM;
+        return NULL;
+    }
+    t->hash = topic_hash(topic);
+    t->min_us = UINT64_MAX;
+
+    t->next = trace->topic[t->hash & trace->mask];
+    trace->topic[t->hash & trace->mask] = t;
+    trace->topics++;
+
+    return t;
+}
+
+int mosqagent_trace(struct mosqagent *agent, const char *source)
+{
+    if (!agent) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!source) {
+        const struct mosqagent_config *config = mqtta_get_configuration(agent);
+        source = config && config->client_name ? config->client_name : "agent";
+    }
+
+    struct mqtta_trace *trace = mqtta_calloc(agent->allocator, 1, sizeof(*trace));
+    if (!trace)
+        goto fail;
+    trace->allocator = agent->allocator;
+
+    trace->source = mqtta_strdup(trace->allocator, source);
+    if (!trace->source)
+        goto fail_with_trace;
+
+    trace->span = mqtta_malloc(trace->allocator,
+                               MQTTA_TRACE_SPANS * sizeof(*trace->span));
+    if (!trace->span)
+        goto fail_with_source;
+
+    trace->topic = mqtta_calloc(trace->allocator, TOPIC_HASH_SIZE,
+                                sizeof(*trace->topic));
+    if (!trace->topic)
+        goto fail_with_span;
+    trace->mask = TOPIC_HASH_SIZE - 1;
+
+    trace->max_topics = MQTTA_TRACE_DEFAULT_TOPICS;
+    trace->max_sources = MQTTA_TRACE_DEFAULT_SOURCES;
+
+    // replace an earlier setup
+    mqtta_free_trace(agent);
+    agent->trace = trace;
+
+    return 0;
+
+fail_with_span:
+    mqtta_free(trace->span);
+
+fail_with_source:
+    mqtta_free(trace->source);
+
+fail_with_trace:
+    mqtta_free(trace);
+
+fail:
+    errno = ENOMEM;
+    return -1;
+}
+
+int mqtta_trace_limit(struct mosqagent *agent,
+                      const unsigned int max_topics,
+                      const unsigned int max_sources)
+{
+    if (!agent || !agent->trace) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mqtta_trace *trace = agent->trace;
+    trace->max_topics = max_topics ? max_topics : MQTTA_TRACE_DEFAULT_TOPICS;
+    trace->max_sources = max_sources ? max_sources : MQTTA_TRACE_DEFAULT_SOURCES;
+
+    return 0;
+}
+
+uint64_t mqtta_trace_overflow(const struct mosqagent *agent)
+{
+    return agent && agent->trace ? agent->trace->overflow : 0;
+}
+
+int mqtta_trace_set_dump(struct mosqagent *agent, const char *path)
+{
+    struct mqtta_trace *trace = agent->trace;
+
+    char *dump = mqtta_strdup(trace->allocator, path);
+    if (!dump) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mqtta_free(trace->dump);
+    trace->dump = dump;
+
+    return 0;
+}
+
+uint64_t mqtta_trace_begin(const struct mosqagent *agent)
+{
+    return agent->trace ? monotonic_ns() : 0;
+}
+
+uint64_t mqtta_trace_span(struct mosqagent *agent,
+                          const enum mqtta_span kind,
+                          const uint64_t start_ns)
+{
+    struct mqtta_trace *trace = agent->trace;
+    if (!trace || !start_ns)
+        return 0;
+
+    const uint64_t now = monotonic_ns();
+
+    struct trace_span *s = &trace->span[trace->span_count++ % MQTTA_TRACE_SPANS];
+    s->start_ns = start_ns;
+    s->duration_ns = (now - start_ns > UINT32_MAX) ? UINT32_MAX
+                                                   : now - start_ns;
+    s->kind = kind;
+
+    return now;
+}
+
+int mqtta_trace_stamp(struct mosqagent *agent,
+                      const char *topic,
+                      const mosquitto_property *props,
+                      mosquitto_property **stamped)
+{
+    struct mqtta_trace *trace = agent->trace;
+
+    struct trace_topic *t = get_topic(trace, topic);
+    if (!t && (errno == ENOSPC)) {
+        // over the limit, send without stamps
+        trace->overflow++;
+        *stamped = NULL;
+        return 0;
+    }
+    if (!t)
+        // errno is already set
+        return -1;
+
+    char seq[24];
+    char ts[24];
+    snprintf(seq, sizeof(seq), "%" PRIu64, ++t->out_seq);
+    snprintf(ts, sizeof(ts), "%" PRIu64, realtime_ns());
+
+    *stamped = NULL;
+    if ((props && mosquitto_property_copy_all(stamped, props)) ||
+        mosquitto_property_add_string_pair(stamped, MQTT_PROP_USER_PROPERTY,
+                                           MQTTA_TRACE_SOURCE, trace->source) ||
+        mosquitto_property_add_string_pair(stamped, MQTT_PROP_USER_PROPERTY,
+                                           MQTTA_TRACE_SEQUENCE, seq) ||
+        mosquitto_property_add_string_pair(stamped, MQTT_PROP_USER_PROPERTY,
+                                           MQTTA_TRACE_TIMESTAMP, ts)) {
+        mosquitto_property_free_all(stamped);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Check the sequence number of a source on a topic.
+ */
+static void check_sequence(struct mqtta_trace *trace,
+                           struct trace_topic *t,
+                           const char *source,
+                           const uint64_t seq)
+{
+    struct trace_source *s = t->sources;
+    while (s && strcmp(s->name, source))
+        s = s->next;
+
+    if (!s) {
+        if (t->source_count >= trace->max_sources) {
+            trace->overflow++;
+            return;
+        }
+
+        s = mqtta_calloc(trace->allocator, 1, sizeof(*s));
+        if (!s)
+            return;
+        s->name = mqtta_strdup(trace->allocator, source);
+        if (!s->name) {
+            mqtta_free(s);
+            return;
+        }
+
+        s->next = t->sources;
+        t->sources = s;
+        t->source_count++;
+    } else if (seq == s->last_seq + 1) {
+        // in order
+    } else if (seq > s->last_seq) {
+        t->gaps++;
+        t->lost += seq - s->last_seq - 1;
+    } else if (seq == 1) {
+        // the source has been restarted
+    } else {
+        t->duplicates++;
+        return;
+    }
+
+    s->last_seq = seq;
+}
+
+void mqtta_trace_receive(struct mosqagent *agent,
+                         const char *topic,
+                         const mosquitto_property *props)
+{
+    const uint64_t now = realtime_ns();
+
+    char *source = NULL;
+    uint64_t seq = 0;
+    uint64_t ts = 0;
+
+    char *name;
+    char *value;
+    const mosquitto_property *p;
+    p = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY,
+                                            &name, &value, false);
+    while (p) {
+        if (!strcmp(name, MQTTA_TRACE_SOURCE) && !source) {
+            source = value;
+            value = NULL;
+        } else if (!strcmp(name, MQTTA_TRACE_SEQUENCE)) {
+            seq = strtoull(value, NULL, 10);
+        } else if (!strcmp(name, MQTTA_TRACE_TIMESTAMP)) {
+            ts = strtoull(value, NULL, 10);
+        }
+        free(name);
+        free(value);
+
+        p = mosquitto_property_read_string_pair(p, MQTT_PROP_USER_PROPERTY,
+                                                &name, &value, true);
+    }
+
+    if (!source || !seq || !ts)
+        goto out;
+
+    struct trace_topic *t = get_topic(agent->trace, topic);
+    if (!t) {
+        if (errno == ENOSPC)
+            agent->trace->overflow++;
+        goto out;
+    }
+
+    // topics that are only published need no histogram
+    if (!t->bucket) {
+        t->bucket = mqtta_calloc(agent->trace->allocator,
+                                 HIST_BUCKETS, sizeof(*t->bucket));
+        if (!t->bucket)
+            goto out;
+    }
+
+    // a clock behind the sender's counts as no latency
+    const uint64_t latency_us = now > ts ? (now - ts) / 1000 : 0;
+
+    t->count++;
+    t->sum_us += latency_us;
+    if (latency_us < t->min_us)
+        t->min_us = latency_us;
+    if (latency_us > t->max_us)
+        t->max_us = latency_us;
+    t->bucket[hist_index(latency_us)]++;
+
+    check_sequence(agent->trace, t, source, seq);
+
+out:
+    // property values are allocated by libmosquitto
+    free(source);
+}
+
+static uint64_t percentile(const struct trace_topic *t, const double q)
+{
+    const uint64_t rank = (uint64_t)(q * (t->count - 1));
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += t->bucket[i];
+        if (seen > rank)
+            break;
+    }
+
+    const uint64_t v = hist_value(i);
+    if (v < t->min_us)
+        return t->min_us;
+    if (v > t->max_us)
+        return t->max_us;
+
+    return v;
+}
+
+static void fill_stats(const struct trace_topic *t,
+                       struct mqtta_trace_stats *stats)
+{
+    stats->count = t->count;
+    stats->gaps = t->gaps;
+    stats->lost = t->lost;
+    stats->duplicates = t->duplicates;
+    stats->min_us = t->min_us;
+    stats->max_us = t->max_us;
+    stats->mean_us = (double)t->sum_us / t->count;
+    stats->p50_us = percentile(t, 0.50);
+    stats->p90_us = percentile(t, 0.90);
+    stats->p99_us = percentile(t, 0.99);
+}
+
+int mqtta_trace_stats(const struct mosqagent *agent,
+                      const char *topic,
+                      struct mqtta_trace_stats *stats)
+{
+    if (!agent || !topic || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const struct trace_topic *t;
+    t = agent->trace ? find_topic(agent->trace, topic) : NULL;
+    if (!t || !t->count) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    fill_stats(t, stats);
+
+    return 0;
+}
+
+void mqtta_trace_foreach(const struct mosqagent *agent,
+                         mqtta_trace_stats_callback callback,
+                         void *data)
+{
+    if (!agent || !agent->trace || !callback)
+        return;
+
+    unsigned int i;
+    for (i = 0; i <= agent->trace->mask; i++) {
+        const struct trace_topic *t;
+        for (t = agent->trace->topic[i]; t; t = t->next) {
+            if (!t->count)
+                continue;
+
+            struct mqtta_trace_stats stats;
+            fill_stats(t, &stats);
+            callback(t->topic, &stats, data);
+        }
+    }
+}
+
+static void print_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        const unsigned char c = *s;
+        if ((c == '"') || (c == '\\')) {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+int mqtta_trace_dump(const struct mosqagent *agent, const char *path)
+{
+    if (!agent || !agent->trace || !path) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const struct mqtta_trace *trace = agent->trace;
+
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+
+    const int pid = getpid();
+    const uint64_t count = trace->span_count < MQTTA_TRACE_SPANS
+                         ? trace->span_count
+                         : MQTTA_TRACE_SPANS;
+    uint64_t i;
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,"
+               "\"args\":{\"name\":", pid);
+    print_json_string(f, trace->source);
+    fprintf(f, "}}");
+
+    // oldest first
+    for (i = trace->span_count - count; i < trace->span_count; i++) {
+        const struct trace_span *s = &trace->span[i % MQTTA_TRACE_SPANS];
+
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"mqtta\",\"ph\":\"X\","
+                   "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1}",
+                span_name[s->kind],
+                s->start_ns / 1e3, s->duration_ns / 1e3,
+                pid);
+    }
+
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    if (fclose(f))
+        return -1;
+
+    return 0;
+}
+
+void mqtta_free_trace(struct mosqagent *agent)
+{
+    struct mqtta_trace *trace = agent->trace;
+    if (!trace)
+        return;
+
+    if (trace->dump)
+        mqtta_trace_dump(agent, trace->dump);
+
+    unsigned int i;
+    for (i = 0; i <= trace->mask; i++) {
+        struct trace_topic *t = trace->topic[i];
+        while (t) {
+            struct trace_topic *next = t->next;
+
+            struct trace_source *s = t->sources;
+            while (s) {
+                struct trace_source *snext = s->next;
+                mqtta_free(s->name);
+                mqtta_free(s);
+                s = snext;
+            }
+
+            mqtta_free(t->bucket);
+            mqtta_free(t->topic);
+            mqtta_free(t);
+            t = next;
+        }
+    }
+
+    mqtta_free(trace->topic);
+    mqtta_free(trace->span);
+    mqtta_free(trace->dump);
+    mqtta_free(trace->source);
+    mqtta_free(trace);
+
+    agent->trace = NULL;
+}
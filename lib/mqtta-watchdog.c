@@ -0,0 +1,231 @@
+/*
+ * Watchdog for stalled agent loops
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ */
+
+#include "mqtt-tools/mqtta.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "mqtta-private.h"
+
+/* Longer names are cut in reports */
+#define RUNNING_SIZE    128
+
+struct mqtta_watchdog {
+    struct mosqagent *agent;
+    unsigned int deadline_ms;
+    mqtta_stall_handler handler;
+    void *handler_data;
+
+    /* written by the loop, read by the watchdog thread */
+    uint64_t iterations;
+    /* a copy of the name, as the loop may free it while a report runs;
+     * odd sequence counts while the loop writes it */
+    unsigned int running_seq;
+    char running[RUNNING_SIZE];
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stop;
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void log_stall(struct mosqagent *agent,
+                      const char *running,
+                      const unsigned long stalled_ms,
+                      void *handler_data)
+{
+    const struct mosqagent_config *config = mqtta_get_configuration(agent);
+
+    (void) handler_data; /* unused */
+
+    syslog(LOG_WARNING, "mqtta: loop of %s stalled for %lu ms in %s",
+           (config && config->client_name) ? config->client_name : "agent",
+           stalled_ms,
+           running);
+}
+
+/*
+ * Read the name the loop has entered last, again if the loop changed it
+ * meanwhile.
+ */
+static void read_running(const struct mqtta_watchdog *w,
+                         char name[RUNNING_SIZE])
+{
+    unsigned int seq;
+
+    do {
+        seq = __atomic_load_n(&w->running_seq, __ATOMIC_ACQUIRE);
+
+        int i;
+        for (i = 0; i < RUNNING_SIZE; i++)
+            name[i] = __atomic_load_n(&w->running[i], __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) ||
+             (seq != __atomic_load_n(&w->running_seq, __ATOMIC_RELAXED)));
+
+    name[RUNNING_SIZE - 1] = '\0';
+}
+
+static void* watch(void *arg)
+{
+    struct mqtta_watchdog *w = arg;
+    const uint64_t deadline_ns = w->deadline_ms * 1000000ull;
+    // check four times per deadline
+    const uint64_t period_ns = deadline_ns / 4;
+
+    uint64_t seen = __atomic_load_n(&w->iterations, __ATOMIC_RELAXED);
+    uint64_t since = monotonic_ns();
+    bool reported = false;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        const uint64_t ns = until.tv_nsec + period_ns;
+        until.tv_sec += ns / 1000000000;
+        until.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&w->wake, &w->lock, &until);
+        if (w->stop)
+            break;
+
+        const uint64_t now = monotonic_ns();
+        const uint64_t iterations = __atomic_load_n(&w->iterations,
+                                                    __ATOMIC_RELAXED);
+        if (iterations != seen) {
+            seen = iterations;
+            since = now;
+            reported = false;
+            continue;
+        }
+
+        // once per stall
+        if (reported || (now - since < deadline_ns))
+            continue;
+        reported = true;
+
+        char running[RUNNING_SIZE];
+        read_running(w, running);
+        pthread_mutex_unlock(&w->lock);
+        w->handler(w->agent, running[0] ? running : "loop",
+                   (now - since) / 1000000, w->handler_data);
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+int mosqagent_watchdog(struct mosqagent *agent,
+                       const unsigned int deadline_ms,
+                       mqtta_stall_handler handler,
+                       void *handler_data)
+{
+    if (!agent) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mqtta_free_watchdog(agent);
+    if (!deadline_ms)
+        return 0;
+
+    struct mqtta_watchdog *w = mqtta_calloc(agent->allocator, 1, sizeof(*w));
+    if (!w)
+        // errno is already set
+        return -1;
+
+    w->agent = agent;
+    w->deadline_ms = deadline_ms;
+    w->handler = handler ? handler : log_stall;
+    w->handler_data = handler_data;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&w->lock, NULL);
+
+    const int ret = pthread_create(&w->thread, NULL, watch, w);
+    if (ret) {
+        pthread_cond_destroy(&w->wake);
+        pthread_mutex_destroy(&w->lock);
+        mqtta_free(w);
+        errno = ret;
+        return -1;
+    }
+
+    agent->watchdog = w;
+
+    return 0;
+}
+
+void mqtta_watchdog_enter(struct mosqagent *agent, const char *running)
+{
+    struct mqtta_watchdog *w = agent->watchdog;
+    if (!w)
+        return;
+
+    // only this thread writes, the watchdog thread retries on a change
+    const unsigned int seq = __atomic_load_n(&w->running_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->running_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    int i;
+    for (i = 0; (i < RUNNING_SIZE - 1) && running[i]; i++)
+        __atomic_store_n(&w->running[i], running[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&w->running[i], '\0', __ATOMIC_RELAXED);
+
+    __atomic_store_n(&w->running_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void mqtta_watchdog_iteration(struct mosqagent *agent)
+{
+    if (agent->watchdog)
+        __atomic_add_fetch(&agent->watchdog->iterations, 1, __ATOMIC_RELAXED);
+}
+
+void mosqagent_watchdog_iteration(struct mosqagent *agent)
+{
+    if (!agent || !agent->watchdog)
+        return;
+
+    mqtta_watchdog_iteration(agent);
+    // stalls outside of timers and handlers are reported for the loop
+    mqtta_watchdog_enter(agent, "");
+}
+
+void mqtta_free_watchdog(struct mosqagent *agent)
+{
+    struct mqtta_watchdog *w = agent->watchdog;
+    if (!w)
+        return;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    pthread_cond_destroy(&w->wake);
+    pthread_mutex_destroy(&w->lock);
+    mqtta_free(w);
+    agent->watchdog = NULL;
+}
@@ -8,15 +8,22 @@
 
 #include <errno.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <libconfig.h>
 
 #include <mosquitto.h>
 
 #include "mqtt-tools/mosqhelper.h"
+#include "mqtt-tools/mqtta-histogram.h"
+#include "mqtt-tools/mqtta-local.h"
+#include "mqtt-tools/mqtta-trace.h"
+#include "mqtt-tools/mqtta-record.h"
 #include "mqtta-build.h"
+#include "mqtta-private.h"
 
 
 void* mqtta_mo_ptr(const struct mqtta_memory_object *mo)
@@ -53,13 +60,76 @@ void mqtta_mo_free(struct mqtta_memory_object *mo)
 }
 
 
+/* Histogram range of the idle call durations: 1 ns to a minute */
+#define IDLE_HIST_HIGHEST   60000000000ull
+#define IDLE_HIST_DIGITS    2
+
 struct mosqagent_idle_list {
     struct mosqagent_idle_list *next;
     mosqagent_idle_call idle_call;
+    /** Name of a call with a budget, `NULL` for a plain call */
+    char *name;
+    uint64_t budget_ns;
+    struct mqtta_idle_stats stats;
+    struct mqtta_histogram *durations;
 };
 
 void mosqagent_clear_idle_list(struct mosqagent *agent);
 
+
+struct mosqagent_sub_list {
+    struct mosqagent_sub_list *next;
+    /** Subscription as sent to the broker, including a share prefix */
+    char *sub;
+    /** Topic filter part of `sub` for matching incoming topics */
+    const char *filter;
+    int qos;
+    mosqagent_message_handler handler;
+    void *handler_data;
+    /** Message id of the SUBSCRIBE waiting for its SUBACK, 0 for none */
+    int mid;
+    /** Acknowledged by the broker, part of the session */
+    bool in_session;
+};
+
+const char* mosqagent_subscription(const struct mosqagent *agent,
+                                   unsigned int index)
+{
+    if (!agent) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const struct mosqagent_sub_list *e;
+    for (e = agent->subs; e; e = e->next)
+        if (!index--)
+            return e->sub;
+
+    errno = ENOENT;
+    return NULL;
+}
+
+static void mosqagent_clear_sub_list(struct mosqagent *agent);
+
+
+struct mqtta_message_ref {
+    /** shared copy of the message, made by the first retain */
+    struct shared_message *shared;
+    /** allocator for the copy, `NULL` for the global one */
+    const struct mqtta_allocator *allocator;
+};
+
+/*
+ * Reference-counted copy of a message in a single allocation. The message
+ * refers to its own `ref`, so retaining a retained message only counts up.
+ */
+struct shared_message {
+    unsigned int refs;
+    struct mqtta_message_ref ref;
+    struct mqtta_message msg;
+    char data[];
+};
+
 /**
  * Create a message and deep-copy the parameter values.
  */
@@ -87,7 +157,7 @@ struct mqtta_message* mqtta_create_message(const char* topic,
 
     // create the struct
     struct mqtta_message *msg;
-    msg = malloc(sizeof(*msg));
+    msg = mqtta_malloc(NULL, sizeof(*msg));
 
     if (!msg) {
         errno = ENOMEM;
@@ -96,7 +166,7 @@ struct mqtta_message* mqtta_create_message(const char* topic,
 
     // copy topic and payload
     const int topiclen = strlen(topic) + 1; // plus \0
-    msg->topic = malloc(topiclen);
+    msg->topic = mqtta_malloc(NULL, topiclen);
     if (!msg->topic) {
         errno = ENOMEM;
         goto fail_with_msg;
@@ -104,7 +174,7 @@ struct mqtta_message* mqtta_create_message(const char* topic,
     strncpy(msg->topic, topic, topiclen);
 
     const int payloadlen = strlen(payload) + 1; // plus \0
-    msg->payload = malloc(payloadlen);
+    msg->payload = mqtta_malloc(NULL, payloadlen);
     if (!msg->payload) {
         errno = ENOMEM;
         goto fail_with_topic;
@@ -114,329 +184,1924 @@ struct mqtta_message* mqtta_create_message(const char* topic,
     // set the remaining parameters
     msg->qos = qos;
     msg->retain = retain;
+    msg->payloadlen = payloadlen - 1;
+    msg->priority = MQTTA_PRIORITY_DEFAULT;
+    msg->ttl_ms = 0;
+    msg->properties = NULL;
+    msg->ref = NULL;
 
     // done
     return msg;
 
 fail_with_topic:
-    free(msg->topic);
+    mqtta_free(msg->topic);
 
 fail_with_msg:
-    free(msg);
+    mqtta_free(msg);
 
 fail:
     return NULL;
 }
 
-void mqtta_dispose_message(struct mqtta_message *msg)
+bool mqtta_is_v5(const struct mosqagent *agent)
 {
-    if (!msg)
-        return;
-
-    // free memory for all message parts
-    free (msg->topic);
-    free(msg->payload);
-
-    free(msg);
+    const struct mosqagent_config *config = mqtta_get_configuration(agent);
+    return config && (config->protocol_version == 5);
 }
 
-/*
- * Destroy the internal configuration object, if ownership
- * is with the agent.
- */
-static void destroy_configuration(struct mosqagent *agent)
+int mqtta_publish_now(struct mosqagent *agent,
+                      const struct mqtta_message *msg)
 {
-    if (!agent)
-        return;
-
-    // call the de-allocator of the configuration mo
-    mqtta_mo_free(&agent->config_mo);
+    return mqtta_publish_props(agent, msg, NULL);
 }
 
-int mqtta_load_configuration(struct mosqagent *agent,
-                             const char* filepath)
+int mqtta_publish_props(struct mosqagent *agent,
+                        const struct mqtta_message *msg,
+                        const mosquitto_property *props)
 {
-    int ret = 0;
-
-    struct mosqagent_config *config;
-
-    config_t configuration;
-
-    const char* client_name;
-    const char* broker_host;
-
-    // Init the configuration struct from libconfig
-    config_init(&configuration);
-
-    /*
-     * Check this part first. Not finding the config file is the most likely
-     * failure and we'll fail this before reserving memory.
-     */
+    return mqtta_publish_mid(agent, msg, props, NULL);
+}
 
-    if (config_read_file(&configuration, filepath) == CONFIG_FALSE) {
-        fprintf(stderr, "Cannot read config file: %s\n", config_error_text(&configuration));
-        ret = MQTTA_ERR_CONFIG_READ_FAILED;
-        goto cleanup_with_configuration;
+int mqtta_publish_mid(struct mosqagent *agent,
+                      const struct mqtta_message *msg,
+                      const mosquitto_property *props,
+                      int *mid)
+{
+    if (mid)
+        *mid = 0;
+
+    // messages with properties need the broker
+    if (agent->local && !props) {
+        bool handled;
+        const int ret = mqtta_local_publish(agent, msg, &handled);
+
+        if (handled) {
+            if (agent->recorder)
+                mqtta_recorder_write(agent->recorder, MQTTA_RECORD_OUTBOUND,
+                                     msg->topic,
+                                     msg->payload, msg->payloadlen,
+                                     msg->qos,
+                                     msg->retain);
+            return ret;
+        }
     }
 
-    // Now create the memory object
-    config = malloc(sizeof(*config));
-    if (!config) {
-        ret = -ENOMEM;
-        goto cleanup_with_configuration;
+    if (!agent->mosq) {
+        errno = ENOTCONN;
+        return -1;
     }
 
-    // We have to find an agent name!
-    if (config_lookup_string(&configuration, "mosqagent.name", &client_name))
-    {
-        const int slen = strlen(client_name);
-        config->client_name = malloc(slen + 1);
-        strncpy(config->client_name, client_name, slen+1);
-        // ensure string termination
-        config->client_name[slen] = '\0';
-    } else {
-        ret = MQTTA_ERR_CONFIG_NO_CLIENTNAME;
-        goto fail_with_config_object;
+    if (agent->recorder)
+        mqtta_recorder_write(agent->recorder, MQTTA_RECORD_OUTBOUND,
+                             msg->topic,
+                             msg->payload, msg->payloadlen,
+                             msg->qos,
+                             msg->retain);
+
+    // MQTT v5 only, older protocols reject properties
+    mosquitto_property *expiry = NULL;
+    if (msg->ttl_ms && mqtta_is_v5(agent)) {
+        if ((props && mosquitto_property_copy_all(&expiry, props)) ||
+            mosquitto_property_add_int32(&expiry,
+                                         MQTT_PROP_MESSAGE_EXPIRY_INTERVAL,
+                                         (msg->ttl_ms + 999) / 1000)) {
+            mosquitto_property_free_all(&expiry);
+            errno = ENOMEM;
+            return -1;
+        }
+        props = expiry;
     }
 
-    // Host is optional
-    if (config_lookup_string(&configuration, "mosqagent.broker.host", &broker_host))
-    {
-        const int slen = strlen(broker_host);
-        config->host = malloc(slen + 1);
-        strncpy(config->host, broker_host, slen+1);
-        // ensure string termination
-        config->host[slen] = '\0';
-    } else {
-        printf("Host not found, using configuration default.");
-        // TODO should the warning be communicated and if yes, how?
+    // the stamps are user properties, also v5 only
+    mosquitto_property *stamped = NULL;
+    if (agent->trace && mqtta_is_v5(agent)) {
+        if (mqtta_trace_stamp(agent, msg->topic, props, &stamped)) {
+            // errno is already set
+            mosquitto_property_free_all(&expiry);
+            return -1;
+        }
+        if (stamped)
+            props = stamped;
     }
 
-    // Port is optional
-    config_lookup_int(&configuration, "mosqagent.broker.port", &config->port);
-
-    // If we got through to here, store configuration to agent.
-    // Destroy old config first.
-    destroy_configuration(agent);
-
-    // transfer ownership of the config object to the agent
-    mqtta_move_configuration(agent, config);
-
-    // standard cleanup
-    goto cleanup_with_configuration;
+    // Outside of a callback libmosquitto writes the message right away and
+    // reports a QoS 0 publish complete before the id is returned.
+    int local_mid = 0;
+    agent->publishing_mid = &local_mid;
+    agent->published_early = false;
 
+    const int ret = mqtt_publish_v5(agent->mosq, &local_mid,
+                                    msg->topic,
+                                    msg->payloadlen, msg->payload,
+                                    msg->qos,
+                                    msg->retain,
+                                    props);
 
-fail_with_config_object:
-    free(config);
+    agent->publishing_mid = NULL;
+    if (mid && !ret && !agent->published_early)
+        *mid = local_mid;
 
-cleanup_with_configuration:
-    config_destroy(&configuration);
+    mosquitto_property_free_all(&stamped);
+    mosquitto_property_free_all(&expiry);
 
     return ret;
 }
 
-void mqtta_set_configuration(struct mosqagent *agent,
-                            struct mosqagent_config* config)
+int mqtta_send_message(struct mosqagent* agent,
+                       struct mqtta_message *msg)
 {
-    if (agent)
-        mqtta_mo_set(&agent->config_mo, config);
-}
+    if (!agent || !msg || !msg->topic || (msg->payloadlen < 0)) {
+        errno = EINVAL;
+        goto fail;
+    }
 
-void mqtta_move_configuration(struct mosqagent *agent,
-                             struct mosqagent_config* config)
-{
-    if (agent)
-        mqtta_mo_move(&agent->config_mo, config,
-                      mqtta_configuration_deallocator);
+    int ret;
+
+    ret = mqtta_ratelimit_admit(agent, msg);
+    if (ret <= 0)
+        return ret;
+
+    ret = mqtta_lanes_send(agent, msg);
+
+    return ret;
+
+fail:
+    return -1;
 }
 
-void mqtta_dispose_configuration(struct mosqagent_config *config)
+void mqtta_dispose_message(struct mqtta_message *msg)
 {
-    if (!config)
+    if (!msg)
         return;
-    free(config->client_name);
-    free(config->host);
+
+    // free memory for all message parts
+    mqtta_free(msg->topic);
+    mqtta_free(msg->payload);
+
+    mqtta_free(msg);
 }
 
-void mqtta_configuration_deallocator(void* config)
+static struct shared_message* share_message(const struct mqtta_allocator *allocator,
+                                            const struct mqtta_message *msg)
 {
-    if (!config)
-        return;
+    const size_t topiclen = strlen(msg->topic) + 1; // plus \0
+    const size_t payloadlen = msg->payloadlen;
 
-    struct mosqagent_config *c = (struct mosqagent_config*)config;
+    struct shared_message *s;
+    s = mqtta_malloc(allocator, sizeof(*s) + topiclen + payloadlen + 1);
+    if (!s)
+        return NULL;
 
-    mqtta_dispose_configuration(c);
-    free(c);
+    s->refs = 1;
+    s->ref.shared = s;
+    s->ref.allocator = allocator;
+
+    s->msg.topic = s->data;
+    memcpy(s->msg.topic, msg->topic, topiclen);
+    s->msg.payload = s->data + topiclen;
+    if (payloadlen)
+        memcpy(s->msg.payload, msg->payload, payloadlen);
+    s->msg.payload[payloadlen] = '\0';
+
+    s->msg.payloadlen = payloadlen;
+    s->msg.qos = msg->qos;
+    s->msg.retain = msg->retain;
+    s->msg.priority = msg->priority;
+    s->msg.ttl_ms = msg->ttl_ms;
+    s->msg.properties = NULL;
+    s->msg.ref = &s->ref;
+
+    return s;
 }
 
-
-struct mosqagent_config* mqtta_get_configuration(const struct mosqagent *agent)
+static void release_shared(struct shared_message *s)
 {
-    return agent ? agent->config_mo.ptr : NULL;
+    if (!__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL))
+        mqtta_free(s);
 }
 
-struct mosqagent* mosqagent_init_agent(void *priv_data)
+/*
+ * De-allocator for retained messages
+ */
+static void release_message(void *msg)
 {
-    struct mosqagent *agent;
-
-    agent = malloc(sizeof(*agent));
-
-    if (!agent) {
-        errno = ENOMEM;
-        return NULL;
-    }
-
-    agent->idle = NULL;
-    agent->priv_data = priv_data;
-    mqtta_mo_move(&agent->config_mo, NULL, NULL);
-
-    return agent;
+    release_shared(((struct mqtta_message*)msg)->ref->shared);
 }
 
-int mosqagent_setup_mqtt(struct mosqagent *agent)
+int mqtta_message_retain(const struct mqtta_message *msg,
+                         struct mqtta_memory_object *mo)
 {
-    if (!agent || !mqtta_get_configuration(agent)) {
+    if (!msg || !msg->topic || (msg->payloadlen < 0) ||
+        (msg->payloadlen && !msg->payload) || !mo) {
         errno = EINVAL;
         return -1;
     }
 
-    struct mosqagent_config *config =
-        mqtta_get_configuration(agent);
-
+    struct mqtta_message_ref *ref = msg->ref;
+    struct shared_message *s;
 
-    if (mqtt_init(config->client_name,
-                &(agent->mosq),
-                agent)) {
-        // errno is already set
-        return -1;
+    if (ref && ref->shared) {
+        s = ref->shared;
+        __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+    } else {
+        s = share_message(ref ? ref->allocator : NULL, msg);
+        if (!s) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        // the dispatch keeps a reference for the next handlers
+        if (ref) {
+            ref->shared = s;
+            s->refs++;
+        }
     }
 
-    if (mqtt_connect(agent->mosq,
-                config->host,
-                config->port,
-                0)) {
-        // errno is already set
-        return -1;
-    }
+    mqtta_mo_move(mo, &s->msg, release_message);
 
     return 0;
 }
 
-int mosqagent_close_agent(struct mosqagent *agent)
+/*
+ * Destroy the internal configuration object, if ownership
+ * is with the agent.
+ */
+static void destroy_configuration(struct mosqagent *agent)
 {
     if (!agent)
-        return -EINVAL;
+        return;
 
-    mosqagent_clear_idle_list(agent);
+    // call the de-allocator of the configuration mo
+    mqtta_mo_free(&agent->config_mo);
+}
 
-    // clean-up MQTT
-    mqtt_close(agent->mosq);
+static bool lookup_number(const config_setting_t *setting,
+                          const char *name,
+                          double *value)
+{
+    int i;
 
-    destroy_configuration(agent);
+    if (config_setting_lookup_float(setting, name, value))
+        return true;
 
-    free(agent);
+    if (config_setting_lookup_int(setting, name, &i)) {
+        *value = i;
+        return true;
+    }
 
-    return 0;
+    return false;
 }
 
-void* mosqagent_get_private_data(const struct mosqagent *agent)
+/*
+ * Parse a rate limit group: rate, burst and policy.
+ */
+static int load_rate_limit(const config_setting_t *setting,
+                           struct mqtta_rate_limit *limit)
 {
-    return agent->priv_data;
+    const char *policy = "drop";
+    int burst = 1;
+
+    if (!lookup_number(setting, "rate", &limit->rate))
+        return -1;
+    config_setting_lookup_int(setting, "burst", &burst);
+    config_setting_lookup_string(setting, "policy", &policy);
+
+    if (burst < 1)
+        return -1;
+    limit->burst = burst;
+
+    if (!strcmp(policy, "drop"))
+        limit->policy = MQTTA_RATE_DROP;
+    else if (!strcmp(policy, "delay"))
+        limit->policy = MQTTA_RATE_DELAY;
+    else if (!strcmp(policy, "coalesce"))
+        limit->policy = MQTTA_RATE_COALESCE;
+    else
+        return -1;
+
+    return 0;
 }
 
-int mosqagent_add_idle_call(struct mosqagent *agent,
-                            mosqagent_idle_call call)
+/*
+ * Load the agent-wide limit from `mosqagent.ratelimit` and the topic limits
+ * from the list `mosqagent.ratelimit.topics`.
+ */
+static int load_rate_limits(const config_t *configuration,
+                            const struct mqtta_allocator *allocator,
+                            struct mosqagent_config *config)
 {
-    if (!agent || !call) {
-        errno = EINVAL;
-        goto fail;
-    }
-
-    // new entry
-    struct mosqagent_idle_list* entry;
+    const config_setting_t *ratelimit;
+    ratelimit = config_lookup(configuration, "mosqagent.ratelimit");
+    if (!ratelimit)
+        return 0;
+
+    const config_setting_t *topics;
+    topics = config_setting_get_member(ratelimit, "topics");
+
+    double rate;
+    const int has_agent_limit = lookup_number(ratelimit, "rate", &rate) ? 1 : 0;
+    const int count = has_agent_limit + (topics ? config_setting_length(topics) : 0);
+    if (!count)
+        return 0;
+
+    config->rate_limits = mqtta_calloc(allocator, count,
+                                       sizeof(*config->rate_limits));
+    if (!config->rate_limits)
+        return -1;
+    config->rate_limit_count = count;
 
-    entry = malloc(sizeof(*entry));
-    if (!entry) {
-        errno = ENOMEM;
-        goto fail;
-    }
+    int i = 0;
+    if (has_agent_limit && load_rate_limit(ratelimit, &config->rate_limits[i++]))
+        return -1;
 
-    // initialize the entry
-    entry->next = NULL;
-    entry->idle_call = call;
+    for (; i < count; i++) {
+        const config_setting_t *topic;
+        topic = config_setting_get_elem(topics, i - has_agent_limit);
 
+        const char *filter;
+        if (!config_setting_lookup_string(topic, "filter", &filter))
+            return -1;
 
-    // add to idle list
-    if (!agent->idle) {
-        // new idle list
-        agent->idle = entry;
-    } else {
-        // find tail
-        struct mosqagent_idle_list *e;
-        e = agent->idle;
-        while (e->next)
-            e = e->next;
+        config->rate_limits[i].filter = mqtta_strdup(allocator, filter);
+        if (!config->rate_limits[i].filter)
+            return -1;
 
-        // add new entry
-        e->next = entry;
+        if (load_rate_limit(topic, &config->rate_limits[i]))
+            return -1;
     }
 
     return 0;
+}
+
+/* Names of the priorities in the configuration, by lane */
+static const char * const priority_names[MQTTA_PRIORITY_LANES] = {
+    "critical", "high", "normal", "low",
+};
+
+static int parse_priority(const char *name, enum mqtta_priority *priority)
+{
+    int i;
+    for (i = 0; i < MQTTA_PRIORITY_LANES; i++)
+        if (!strcmp(name, priority_names[i])) {
+            *priority = MQTTA_PRIORITY_CRITICAL + i;
+            return 0;
+        }
 
-fail:
     return -1;
 }
 
-void mosqagent_clear_idle_list(struct mosqagent *agent)
+/*
+ * Load the priority lanes from `mosqagent.priority`: one group per lane
+ * with budget and drop policy, and the list of topic priorities.
+ */
+static int load_priority(const config_t *configuration,
+                         const struct mqtta_allocator *allocator,
+                         struct mosqagent_config *config)
 {
-    if (!agent)
-        return;
+    const config_setting_t *priority;
+    priority = config_lookup(configuration, "mosqagent.priority");
+    if (!priority)
+        return 0;
+    config->lanes = true;
+
+    int i;
+    for (i = 0; i < MQTTA_PRIORITY_LANES; i++) {
+        const config_setting_t *lane;
+        lane = config_setting_get_member(priority, priority_names[i]);
+        if (!lane)
+            continue;
+
+        int budget = 0;
+        int drop_oldest = 0;
+        config_setting_lookup_int(lane, "budget", &budget);
+        config_setting_lookup_bool(lane, "drop_oldest", &drop_oldest);
+        if (budget < 0)
+            return -1;
+
+        config->lane[i].budget = budget;
+        config->lane[i].drop_oldest = drop_oldest;
+    }
 
-    if (!agent->idle)
-        return;
+    const config_setting_t *topics;
+    topics = config_setting_get_member(priority, "topics");
+    const int count = topics ? config_setting_length(topics) : 0;
+    if (!count)
+        return 0;
 
-    struct mosqagent_idle_list *e;
-    e = agent->idle;
+    config->priority_rules = mqtta_calloc(allocator, count,
+                                          sizeof(*config->priority_rules));
+    if (!config->priority_rules)
+        return -1;
+    config->priority_rule_count = count;
 
-    while (e) {
-        struct mosqagent_idle_list *f;
+    for (i = 0; i < count; i++) {
+        const config_setting_t *topic = config_setting_get_elem(topics, i);
 
-        f = e;
-        e = e->next;
+        const char *filter;
+        const char *name;
+        if (!config_setting_lookup_string(topic, "filter", &filter) ||
+            !config_setting_lookup_string(topic, "priority", &name) ||
+            parse_priority(name, &config->priority_rules[i].priority))
+            return -1;
 
-        free(f);
+        config->priority_rules[i].filter = mqtta_strdup(allocator, filter);
+        if (!config->priority_rules[i].filter)
+            return -1;
     }
 
-    agent->idle = NULL;
+    return 0;
 }
 
-// TODO ignore the unused variable in GCC until res from idle calls is used
-#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
-int mosqagent_idle(struct mosqagent *agent)
+/*
+ * Load the topic expiry rules from the list `mosqagent.expiry`.
+ */
+static int load_expiry(const config_t *configuration,
+                       const struct mqtta_allocator *allocator,
+                       struct mosqagent_config *config)
 {
+    const config_setting_t *expiry;
+    expiry = config_lookup(configuration, "mosqagent.expiry");
+    const int count = expiry ? config_setting_length(expiry) : 0;
+    if (!count)
+        return 0;
+
+    config->expiry_rules = mqtta_calloc(allocator, count,
+                                        sizeof(*config->expiry_rules));
+    if (!config->expiry_rules)
+        return -1;
+    config->expiry_rule_count = count;
+
+    int i;
+    for (i = 0; i < count; i++) {
+        const config_setting_t *topic = config_setting_get_elem(expiry, i);
+
+        const char *filter;
+        int ttl = 0;
+        int latest_only = 0;
+        if (!config_setting_lookup_string(topic, "filter", &filter))
+            return -1;
+        config_setting_lookup_int(topic, "ttl", &ttl);
+        config_setting_lookup_bool(topic, "latest_only", &latest_only);
+        if (ttl < 0)
+            return -1;
+
+        config->expiry_rules[i].filter = mqtta_strdup(allocator, filter);
+        if (!config->expiry_rules[i].filter)
+            return -1;
+        config->expiry_rules[i].ttl_ms = ttl;
+        config->expiry_rules[i].latest_only = latest_only;
+    }
+
+    return 0;
+}
+
+/*
+ * Load the loop mode from `mosqagent.loop`: mode, spin period, CPU and
+ * real-time priority.
+ */
+static int load_loop(const config_t *configuration,
+                     const struct mqtta_allocator *allocator,
+                     struct mosqagent_config *config)
+{
+    const config_setting_t *loop;
+    loop = config_lookup(configuration, "mosqagent.loop");
+    if (!loop)
+        return 0;
+
+    config->loop = mqtta_malloc(allocator, sizeof(*config->loop));
+    if (!config->loop)
+        return -1;
+
+    const char *mode = "blocking";
+    int spin_us = 0;
+    config->loop->cpu = -1;
+    config->loop->fifo_priority = 0;
+
+    config_setting_lookup_string(loop, "mode", &mode);
+    config_setting_lookup_int(loop, "spin_us", &spin_us);
+    config_setting_lookup_int(loop, "cpu", &config->loop->cpu);
+    config_setting_lookup_int(loop, "fifo_priority",
+                              &config->loop->fifo_priority);
+
+    if (spin_us < 0)
+        return -1;
+    config->loop->spin_us = spin_us;
+
+    if (!strcmp(mode, "blocking"))
+        config->loop->mode = MQTTA_LOOP_BLOCKING;
+    else if (!strcmp(mode, "busy-poll"))
+        config->loop->mode = MQTTA_LOOP_BUSY_POLL;
+    else
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Load the topic tracking from `mosqagent.topics`.
+ */
+static int load_topics(const config_t *configuration,
+                       const struct mqtta_allocator *allocator,
+                       struct mosqagent_config *config)
+{
+    const config_setting_t *topics;
+    topics = config_lookup(configuration, "mosqagent.topics");
+    if (!topics)
+        return 0;
+
+    config->topics = mqtta_calloc(allocator, 1, sizeof(*config->topics));
+    if (!config->topics)
+        return -1;
+
+    int width = 0, depth = 0, top = 0, precision = 0, interval = 0;
+    int bytes = 0, reset = 0;
+    const char *publish;
+
+    config_setting_lookup_int(topics, "width", &width);
+    config_setting_lookup_int(topics, "depth", &depth);
+    config_setting_lookup_int(topics, "top", &top);
+    config_setting_lookup_int(topics, "precision", &precision);
+    config_setting_lookup_int(topics, "interval", &interval);
+    config_setting_lookup_bool(topics, "bytes", &bytes);
+    config_setting_lookup_bool(topics, "reset", &reset);
+
+    if ((width < 0) || (depth < 0) || (top < 0) ||
+        (precision < 0) || (interval < 0))
+        return -1;
+
+    config->topics->width = width;
+    config->topics->depth = depth;
+    config->topics->top = top;
+    config->topics->precision = precision;
+    config->topics->interval_ms = interval;
+    config->topics->bytes = bytes;
+    config->topics->reset = reset;
+
+    if (config_setting_lookup_string(topics, "publish", &publish)) {
+        config->topics->publish = mqtta_strdup(allocator, publish);
+        if (!config->topics->publish)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy an optional string setting.
+ */
+static int lookup_string(const config_setting_t *setting,
+                         const char *name,
+                         const struct mqtta_allocator *allocator,
+                         char **value)
+{
+    const char *s;
+    if (!config_setting_lookup_string(setting, name, &s))
+        return 0;
+
+    *value = mqtta_strdup(allocator, s);
+
+    return *value ? 0 : -1;
+}
+
+/*
+ * Load TLS from `mosqagent.broker.tls`: CA, client certificate and key or
+ * a pre-shared key, TLS version, ciphers and the session cache file.
+ */
+static int load_tls(const config_t *configuration,
+                    const struct mqtta_allocator *allocator,
+                    struct mosqagent_config *config)
+{
+    const config_setting_t *tls;
+    tls = config_lookup(configuration, "mosqagent.broker.tls");
+    if (!tls)
+        return 0;
+
+    config->tls = mqtta_calloc(allocator, 1, sizeof(*config->tls));
+    if (!config->tls)
+        return -1;
+
+    struct mqtta_tls_config *c = config->tls;
+    if (lookup_string(tls, "cafile", allocator, &c->cafile) ||
+        lookup_string(tls, "capath", allocator, &c->capath) ||
+        lookup_string(tls, "certfile", allocator, &c->certfile) ||
+        lookup_string(tls, "keyfile", allocator, &c->keyfile) ||
+        lookup_string(tls, "psk", allocator, &c->psk) ||
+        lookup_string(tls, "identity", allocator, &c->identity) ||
+        lookup_string(tls, "version", allocator, &c->version) ||
+        lookup_string(tls, "ciphers", allocator, &c->ciphers) ||
+        lookup_string(tls, "session_cache", allocator, &c->session_cache))
+        return -1;
+
+    int insecure = 0;
+    config_setting_lookup_bool(tls, "insecure", &insecure);
+    c->insecure = insecure;
+
+    // certificates or a pre-shared key, not both
+    const bool certs = c->cafile || c->capath;
+    const bool psk = c->psk;
+    if ((certs == psk) || (psk && !c->identity))
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Load the local group from `mosqagent.local`: group name, the list of
+ * local topics and the mirror flag.
+ */
+static int load_local(const config_t *configuration,
+                      const struct mqtta_allocator *allocator,
+                      struct mosqagent_config *config)
+{
+    const config_setting_t *local;
+    local = config_lookup(configuration, "mosqagent.local");
+    if (!local)
+        return 0;
+
+    const char *group;
+    if (!config_setting_lookup_string(local, "group", &group))
+        return -1;
+
+    config->local_group = mqtta_strdup(allocator, group);
+    if (!config->local_group)
+        return -1;
+
+    int mirror = 0;
+    config_setting_lookup_bool(local, "mirror", &mirror);
+    config->local_mirror = mirror;
+
+    const config_setting_t *topics;
+    topics = config_setting_get_member(local, "topics");
+    const int count = topics ? config_setting_length(topics) : 0;
+    if (!count)
+        return 0;
+
+    config->local_topics = mqtta_calloc(allocator, count,
+                                        sizeof(*config->local_topics));
+    if (!config->local_topics)
+        return -1;
+    config->local_topic_count = count;
+
+    int i;
+    for (i = 0; i < count; i++) {
+        const char *filter = config_setting_get_string_elem(topics, i);
+        if (!filter)
+            return -1;
+
+        config->local_topics[i] = mqtta_strdup(allocator, filter);
+        if (!config->local_topics[i])
+            return -1;
+    }
+
+    return 0;
+}
+
+int mqtta_load_configuration(struct mosqagent *agent,
+                             const char* filepath)
+{
+    int ret = 0;
+
+    struct mosqagent_config *config;
+
+    config_t configuration;
+
+    const char* client_name;
+    const char* broker_host;
+
+    // Init the configuration struct from libconfig
+    config_init(&configuration);
+
+    /*
+     * Check this part first. Not finding the config file is the most likely
+     * failure and we'll fail this before reserving memory.
+     */
+
+    if (config_read_file(&configuration, filepath) == CONFIG_FALSE) {
+        fprintf(stderr, "Cannot read config file: %s\n", config_error_text(&configuration));
+        ret = MQTTA_ERR_CONFIG_READ_FAILED;
+        goto cleanup_with_configuration;
+    }
+
+    // Now create the memory object
+    config = mqtta_calloc(agent->allocator, 1, sizeof(*config));
+    if (!config) {
+        ret = -ENOMEM;
+        goto cleanup_with_configuration;
+    }
+
+    // We have to find an agent name!
+    if (config_lookup_string(&configuration, "mosqagent.name", &client_name))
+    {
+        const int slen = strlen(client_name);
+        config->client_name = mqtta_malloc(agent->allocator, slen + 1);
+        strncpy(config->client_name, client_name, slen+1);
+        // ensure string termination
+        config->client_name[slen] = '\0';
+    } else {
+        ret = MQTTA_ERR_CONFIG_NO_CLIENTNAME;
+        goto fail_with_config_object;
+    }
+
+    // Host is optional
+    if (config_lookup_string(&configuration, "mosqagent.broker.host", &broker_host))
+    {
+        const int slen = strlen(broker_host);
+        config->host = mqtta_malloc(agent->allocator, slen + 1);
+        strncpy(config->host, broker_host, slen+1);
+        // ensure string termination
+        config->host[slen] = '\0';
+    } else {
+        printf("Host not found, using configuration default.");
+        // TODO should the warning be communicated and if yes, how?
+    }
+
+    // Port is optional
+    config_lookup_int(&configuration, "mosqagent.broker.port", &config->port);
+
+    // Protocol version is optional, MQTT v5 is needed for shared subscriptions
+    config->protocol_version = 5;
+    config_lookup_int(&configuration, "mosqagent.broker.protocol",
+                      &config->protocol_version);
+
+    // Session expiry is optional, by default the session is kept
+    int session_expiry = 0;
+    config_lookup_int(&configuration, "mosqagent.broker.session_expiry",
+                      &session_expiry);
+    if (session_expiry < 0) {
+        ret = MQTTA_ERR_CONFIG_INVALID;
+        goto fail_with_config_object;
+    }
+    config->session_expiry = session_expiry;
+
+    // TLS is optional
+    if (load_tls(&configuration, agent->allocator, config)) {
+        ret = MQTTA_ERR_CONFIG_INVALID;
+        goto fail_with_config_object;
+    }
+
+    // Consumer group is optional
+    const char* share_group;
+    config->share_group = NULL;
+    if (config_lookup_string(&configuration, "mosqagent.share_group", &share_group))
+    {
+        const int slen = strlen(share_group);
+        config->share_group = mqtta_malloc(agent->allocator, slen + 1);
+        strncpy(config->share_group, share_group, slen+1);
+        // ensure string termination
+        config->share_group[slen] = '\0';
+    }
+
+    // Recording is optional
+    const char* record_file;
+    if (config_lookup_string(&configuration, "mosqagent.record", &record_file))
+    {
+        const int slen = strlen(record_file);
+        config->record_file = mqtta_malloc(agent->allocator, slen + 1);
+        strncpy(config->record_file, record_file, slen+1);
+        // ensure string termination
+        config->record_file[slen] = '\0';
+    }
+
+    // Rate limits are optional
+    config->rate_limits = NULL;
+    config->rate_limit_count = 0;
+    if (load_rate_limits(&configuration, agent->allocator, config)) {
+        ret = MQTTA_ERR_CONFIG_INVALID;
+        goto fail_with_config_object;
+    }
+
+    // Priority lanes are optional
+    if (load_priority(&configuration, agent->allocator, config)) {
+        ret = MQTTA_ERR_CONFIG_INVALID;
+        goto fail_with_config_object;
+    }
+
+    // Message expiry is optional
+    if (load_expiry(&configuration, agent->allocator, config)) {
+        ret = MQTTA_ERR_CONFIG_INVALID;
+        goto fail_with_config_object;
+    }
+
+    // Loop mode is optional
+    if (load_loop(&configuration, agent->allocator, config)) {
+        ret = MQTTA_ERR_CONFIG_INVALID;
+        goto fail_with_config_object;
+    }
+
+    // Topic tracking is optional
+    if (load_topics(&configuration, agent->allocator, config)) {
+        ret = MQTTA_ERR_CONFIG_INVALID;
+        goto fail_with_config_object;
+    }
+
+    // Watchdog is optional
+    int watchdog_ms = 0;
+    config_lookup_int(&configuration, "mosqagent.watchdog", &watchdog_ms);
+    if (watchdog_ms < 0) {
+        ret = MQTTA_ERR_CONFIG_INVALID;
+        goto fail_with_config_object;
+    }
+    config->watchdog_ms = watchdog_ms;
+
+    // Tracing is optional
+    const config_setting_t *trace;
+    trace = config_lookup(&configuration, "mosqagent.trace");
+    if (trace) {
+        const char *s;
+
+        config->trace = true;
+        if (config_setting_lookup_string(trace, "source", &s)) {
+            const int slen = strlen(s);
+            config->trace_source = mqtta_malloc(agent->allocator, slen + 1);
+            strncpy(config->trace_source, s, slen+1);
+        }
+        if (config_setting_lookup_string(trace, "dump", &s)) {
+            const int slen = strlen(s);
+            config->trace_dump = mqtta_malloc(agent->allocator, slen + 1);
+            strncpy(config->trace_dump, s, slen+1);
+        }
+
+        int max_topics = 0;
+        int max_sources = 0;
+        config_setting_lookup_int(trace, "max_topics", &max_topics);
+        config_setting_lookup_int(trace, "max_sources", &max_sources);
+        if ((max_topics < 0) || (max_sources < 0)) {
+            ret = MQTTA_ERR_CONFIG_INVALID;
+            goto fail_with_config_object;
+        }
+        config->trace_max_topics = max_topics;
+        config->trace_max_sources = max_sources;
+    }
+
+    // Local group is optional
+    if (load_local(&configuration, agent->allocator, config)) {
+        ret = MQTTA_ERR_CONFIG_INVALID;
+        goto fail_with_config_object;
+    }
+
+    // If we got through to here, store configuration to agent.
+    // Destroy old config first.
+    destroy_configuration(agent);
+
+    // transfer ownership of the config object to the agent
+    mqtta_move_configuration(agent, config);
+
+    // standard cleanup
+    goto cleanup_with_configuration;
+
+
+fail_with_config_object:
+    mqtta_configuration_deallocator(config);
+
+cleanup_with_configuration:
+    config_destroy(&configuration);
+
+    return ret;
+}
+
+void mqtta_set_configuration(struct mosqagent *agent,
+                            struct mosqagent_config* config)
+{
+    if (agent)
+        mqtta_mo_set(&agent->config_mo, config);
+}
+
+void mqtta_move_configuration(struct mosqagent *agent,
+                             struct mosqagent_config* config)
+{
+    if (agent)
+        mqtta_mo_move(&agent->config_mo, config,
+                      mqtta_configuration_deallocator);
+}
+
+void mqtta_dispose_configuration(struct mosqagent_config *config)
+{
+    if (!config)
+        return;
+    mqtta_free(config->client_name);
+    mqtta_free(config->host);
+    mqtta_free(config->share_group);
+    mqtta_free(config->record_file);
+    mqtta_free(config->local_group);
+    mqtta_free(config->trace_source);
+    mqtta_free(config->trace_dump);
+
+    int i;
+    for (i = 0; i < config->rate_limit_count; i++)
+        mqtta_free(config->rate_limits[i].filter);
+    mqtta_free(config->rate_limits);
+
+    for (i = 0; i < config->priority_rule_count; i++)
+        mqtta_free(config->priority_rules[i].filter);
+    mqtta_free(config->priority_rules);
+
+    for (i = 0; i < config->expiry_rule_count; i++)
+        mqtta_free(config->expiry_rules[i].filter);
+    mqtta_free(config->expiry_rules);
+
+    mqtta_free(config->loop);
+
+    if (config->topics) {
+        mqtta_free(config->topics->publish);
+        mqtta_free(config->topics);
+    }
+
+    if (config->tls) {
+        mqtta_free(config->tls->cafile);
+        mqtta_free(config->tls->capath);
+        mqtta_free(config->tls->certfile);
+        mqtta_free(config->tls->keyfile);
+        mqtta_free(config->tls->psk);
+        mqtta_free(config->tls->identity);
+        mqtta_free(config->tls->version);
+        mqtta_free(config->tls->ciphers);
+        mqtta_free(config->tls->session_cache);
+        mqtta_free(config->tls);
+    }
+
+    for (i = 0; i < config->local_topic_count; i++)
+        mqtta_free(config->local_topics[i]);
+    mqtta_free(config->local_topics);
+}
+
+void mqtta_configuration_deallocator(void* config)
+{
+    if (!config)
+        return;
+
+    struct mosqagent_config *c = (struct mosqagent_config*)config;
+
+    mqtta_dispose_configuration(c);
+    mqtta_free(c);
+}
+
+
+struct mosqagent_config* mqtta_get_configuration(const struct mosqagent *agent)
+{
+    return agent ? agent->config_mo.ptr : NULL;
+}
+
+struct mosqagent* mosqagent_init_agent(void *priv_data)
+{
+    return mosqagent_init_agent_with(priv_data, NULL);
+}
+
+struct mosqagent* mosqagent_init_agent_with(void *priv_data,
+                                            const struct mqtta_allocator *allocator)
+{
+    struct mosqagent *agent;
+
+    // later changes of the global allocator do not affect the agent
+    if (!allocator)
+        allocator = mqtta_get_allocator();
+
+    agent = mqtta_malloc(allocator, sizeof(*agent));
+
+    if (!agent) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    agent->allocator = allocator;
+
+    agent->idle = NULL;
+    agent->subs = NULL;
+    agent->timers = NULL;
+    agent->limiter = NULL;
+    agent->lanes = NULL;
+    agent->recorder = NULL;
+    agent->rpc = NULL;
+    agent->local = NULL;
+    agent->trace = NULL;
+    agent->loop = NULL;
+    agent->tls = NULL;
+    agent->streams = NULL;
+    agent->topics = NULL;
+    agent->tasks = NULL;
+    agent->mosq = NULL;
+    agent->connected = false;
+    agent->publishing_mid = NULL;
+    agent->published_early = false;
+    memset(&agent->connection, 0, sizeof(agent->connection));
+    agent->down_ns = 0;
+    agent->connect_ns = 0;
+    agent->watchdog = NULL;
+    agent->result.status = MQTTA_IDLE_DONE;
+    agent->result.error = 0;
+    agent->priv_data = priv_data;
+    mqtta_mo_move(&agent->config_mo, NULL, NULL);
+
+    return agent;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * CPU time of the calling thread; time the agent thread is preempted or
+ * blocked does not count.
+ */
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Ready once all subscriptions of this connection have been acknowledged.
+ */
+static void check_ready(struct mosqagent *agent)
+{
+    struct mqtta_connection_stats *stats = &agent->connection;
+
+    if (!agent->connected || stats->ready)
+        return;
+
+    struct mosqagent_sub_list *e;
+    for (e = agent->subs; e; e = e->next)
+        if (e->mid)
+            return;
+
+    const uint64_t now = monotonic_ns();
+    stats->ready = true;
+    stats->ready_us = (now - agent->down_ns) / 1000;
+    stats->restore_us = (now - agent->connect_ns) / 1000;
+}
+
+/*
+ * Send the subscriptions that are not in the broker's session yet, with
+ * one SUBSCRIBE per QoS level.
+ */
+static int send_subscriptions(struct mosqagent *agent)
+{
+    int ret = 0;
+    int qos;
+
+    for (qos = 0; qos <= 2; qos++) {
+        struct mosqagent_sub_list *e;
+        int count = 0;
+        for (e = agent->subs; e; e = e->next)
+            if (!e->in_session && !e->mid && (e->qos == qos))
+                count++;
+        if (!count)
+            continue;
+
+        char **subs = mqtta_calloc(agent->allocator, count, sizeof(*subs));
+        if (!subs) {
+            ret = MOSQ_ERR_NOMEM;
+            break;
+        }
+
+        int i = 0;
+        for (e = agent->subs; e; e = e->next)
+            if (!e->in_session && !e->mid && (e->qos == qos))
+                subs[i++] = e->sub;
+
+        int mid = 0;
+        const int r = mqtt_subscribe_multiple(agent->mosq, &mid,
+                                              count, subs, qos);
+        mqtta_free(subs);
+
+        // keep the first error, but try the remaining QoS levels
+        if (r) {
+            if (!ret)
+                ret = r;
+            continue;
+        }
+        agent->connection.subscribe_packets++;
+
+        // the SUBACK has the granted QoS in this order
+        for (e = agent->subs; e; e = e->next)
+            if (!e->in_session && !e->mid && (e->qos == qos))
+                e->mid = mid;
+    }
+
+    check_ready(agent);
+
+    return ret;
+}
+
+static void on_connect(struct mosquitto *mosq, void *obj, int rc, int flags)
+{
+    struct mosqagent *agent = obj;
+
+    (void) mosq; /* unused */
+
+    agent->connected = (rc == 0);
+    if (!agent->connected)
+        return;
+
+    agent->connect_ns = monotonic_ns();
+    agent->connection.connects++;
+    agent->connection.ready = false;
+
+    // without the session the broker has forgotten all subscriptions
+    const bool session_present = flags & 1;
+    if (session_present)
+        agent->connection.resumed++;
+
+    struct mosqagent_sub_list *e;
+    for (e = agent->subs; e; e = e->next) {
+        e->mid = 0;
+        if (!session_present)
+            e->in_session = false;
+    }
+
+    send_subscriptions(agent);
+}
+
+static void on_subscribe(struct mosquitto *mosq, void *obj,
+                         int mid, int qos_count, const int *granted_qos)
+{
+    struct mosqagent *agent = obj;
+
+    (void) mosq; /* unused */
+
+    int i = 0;
+    struct mosqagent_sub_list *e;
+    for (e = agent->subs; e; e = e->next) {
+        if (e->mid != mid)
+            continue;
+
+        e->mid = 0;
+        // 0x80 and above are failure codes
+        e->in_session = (i < qos_count) && (granted_qos[i] < 0x80);
+        if (!e->in_session)
+            agent->connection.refused++;
+        i++;
+    }
+
+    check_ready(agent);
+}
+
+static void on_disconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+    struct mosqagent *agent = obj;
+
+    (void) mosq; /* unused */
+    (void) rc;   /* unused */
+
+    if (agent->connected)
+        agent->down_ns = monotonic_ns();
+    agent->connected = false;
+    agent->connection.ready = false;
+
+    // unacknowledged subscriptions may not have reached the broker
+    struct mosqagent_sub_list *e;
+    for (e = agent->subs; e; e = e->next)
+        e->mid = 0;
+
+    mqtta_stream_disconnected(agent);
+    mqtta_task_disconnected(agent);
+}
+
+static void on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+    struct mosqagent *agent = obj;
+
+    (void) mosq; /* unused */
+
+    // completed within mqtta_publish_mid
+    if (agent->publishing_mid && (*agent->publishing_mid == mid)) {
+        agent->published_early = true;
+        return;
+    }
+
+    mqtta_stream_published(agent, mid);
+    mqtta_task_published(agent, mid);
+}
+
+static void on_message(struct mosquitto *mosq, void *obj,
+                       const struct mosquitto_message *message,
+                       const mosquitto_property *props)
+{
+    (void) mosq; /* unused */
+
+    // mirrored by a local group member, already received through the ring
+    if (mqtta_local_is_echo(obj, message->topic, props))
+        return;
+
+    mqtta_dispatch_props(obj,
+                         message->topic,
+                         message->payload, message->payloadlen,
+                         message->qos,
+                         message->retain,
+                         props);
+}
+
+int mosqagent_setup_mqtt(struct mosqagent *agent)
+{
+    if (!agent || !mqtta_get_configuration(agent)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mosqagent_config *config =
+        mqtta_get_configuration(agent);
+
+
+    if (mqtt_init(config->client_name,
+                &(agent->mosq),
+                agent)) {
+        // errno is already set
+        return -1;
+    }
+
+    if (config->protocol_version &&
+        mqtt_set_protocol(agent->mosq, config->protocol_version)) {
+        // the client only refuses versions it does not know
+        errno = EINVAL;
+        return -1;
+    }
+
+    // TLS settings made before setup are applied now
+    if (config->tls) {
+        if (mosqagent_set_tls(agent, config->tls))
+            // errno is already set
+            return -1;
+    } else if (agent->tls && mqtta_tls_apply(agent)) {
+        // errno is already set
+        return -1;
+    }
+
+    if (config->record_file && mosqagent_record(agent, config->record_file))
+        // errno is already set
+        return -1;
+
+    int i;
+    for (i = 0; i < config->rate_limit_count; i++) {
+        const struct mqtta_rate_limit *rl = &config->rate_limits[i];
+        if (mosqagent_add_rate_limit(agent, rl->filter,
+                                     rl->rate, rl->burst, rl->policy))
+            // errno is already set
+            return -1;
+    }
+
+    if (config->lanes) {
+        for (i = 0; i < MQTTA_PRIORITY_LANES; i++)
+            if (mosqagent_set_lane(agent, MQTTA_PRIORITY_CRITICAL + i,
+                                   config->lane[i].budget,
+                                   config->lane[i].drop_oldest))
+                // errno is already set
+                return -1;
+
+        for (i = 0; i < config->priority_rule_count; i++) {
+            const struct mqtta_priority_rule *pr = &config->priority_rules[i];
+            if (mosqagent_add_priority(agent, pr->filter, pr->priority))
+                // errno is already set
+                return -1;
+        }
+    }
+
+    for (i = 0; i < config->expiry_rule_count; i++) {
+        const struct mqtta_expiry_rule *er = &config->expiry_rules[i];
+        if (mosqagent_add_expiry(agent, er->filter,
+                                 er->ttl_ms, er->latest_only))
+            // errno is already set
+            return -1;
+    }
+
+    if (config->loop && mosqagent_set_loop(agent, config->loop))
+        // errno is already set
+        return -1;
+
+    if (config->trace) {
+        if (mosqagent_trace(agent, config->trace_source))
+            // errno is already set
+            return -1;
+
+        if (mqtta_trace_limit(agent, config->trace_max_topics,
+                              config->trace_max_sources))
+            // errno is already set
+            return -1;
+
+        if (config->trace_dump &&
+            mqtta_trace_set_dump(agent, config->trace_dump))
+            // errno is already set
+            return -1;
+    }
+
+    if (config->local_group) {
+        if (mosqagent_local_join(agent, config->local_group,
+                                 config->local_mirror))
+            // errno is already set
+            return -1;
+
+        for (i = 0; i < config->local_topic_count; i++)
+            if (mosqagent_local_topic(agent, config->local_topics[i]))
+                // errno is already set
+                return -1;
+    }
+
+    if (config->topics && mosqagent_track_topics(agent, config->topics))
+        // errno is already set
+        return -1;
+
+    if (config->watchdog_ms &&
+        mosqagent_watchdog(agent, config->watchdog_ms, NULL, NULL))
+        // errno is already set
+        return -1;
+
+    mosquitto_connect_with_flags_callback_set(agent->mosq, on_connect);
+    mosquitto_subscribe_callback_set(agent->mosq, on_subscribe);
+    mosquitto_disconnect_callback_set(agent->mosq, on_disconnect);
+    mosquitto_publish_callback_set(agent->mosq, on_publish);
+    mosquitto_message_v5_callback_set(agent->mosq, on_message);
+
+    // the first time to ready includes the connect
+    agent->down_ns = monotonic_ns();
+
+    // without an expiry interval a v5 broker ends the session on disconnect
+    mosquitto_property *props = NULL;
+    if (mqtta_is_v5(agent) &&
+        mosquitto_property_add_int32(&props, MQTT_PROP_SESSION_EXPIRY_INTERVAL,
+                                     config->session_expiry
+                                     ? config->session_expiry
+                                     : MQTTA_SESSION_EXPIRY_NEVER)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    const int ret = mqtt_connect_v5(agent->mosq,
+                                    config->host,
+                                    config->port,
+                                    0,
+                                    props);
+    mosquitto_property_free_all(&props);
+    if (ret)
+        // errno is already set
+        return -1;
+
+    return 0;
+}
+
+int mosqagent_close_agent(struct mosqagent *agent)
+{
+    if (!agent)
+        return -EINVAL;
+
+    // the watchdog looks at the names of idle calls and subscriptions
+    mqtta_free_watchdog(agent);
+    mqtta_free_streams(agent);
+    mosqagent_clear_idle_list(agent);
+    mosqagent_clear_sub_list(agent);
+    mqtta_free_local(agent);
+    mqtta_free_rpc(agent);
+    // after the requests, which wake their tasks
+    mqtta_free_tasks(agent);
+    mqtta_free_trace(agent);
+    mqtta_free_topics(agent);
+    mqtta_free_ratelimit(agent);
+    mqtta_free_lanes(agent);
+    mqtta_free_timers(agent);
+    mqtta_free_loop(agent);
+    mqtta_free_tls(agent);
+    mqtta_recorder_close(agent->recorder);
+
+    // clean-up MQTT
+    if (agent->mosq)
+        mqtt_close(agent->mosq);
+
+    destroy_configuration(agent);
+
+    mqtta_free(agent);
+
+    return 0;
+}
+
+void* mosqagent_get_private_data(const struct mosqagent *agent)
+{
+    return agent->priv_data;
+}
+
+/*
+ * Append an idle call to the agent's list.
+ */
+static int add_idle_entry(struct mosqagent *agent,
+                          struct mosqagent_idle_list *entry)
+{
+    // add to idle list
+    if (!agent->idle) {
+        // new idle list
+        agent->idle = entry;
+    } else {
+        // find tail
+        struct mosqagent_idle_list *e;
+        e = agent->idle;
+        while (e->next)
+            e = e->next;
+
+        // add new entry
+        e->next = entry;
+    }
+
+    return 0;
+}
+
+int mosqagent_add_idle_call(struct mosqagent *agent,
+                            mosqagent_idle_call call)
+{
+    if (!agent || !call) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    // new entry
+    struct mosqagent_idle_list* entry;
+
+    entry = mqtta_calloc(agent->allocator, 1, sizeof(*entry));
+    if (!entry) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    // initialize the entry
+    entry->next = NULL;
+    entry->idle_call = call;
+
+    return add_idle_entry(agent, entry);
+
+fail:
+    return -1;
+}
+
+int mosqagent_add_idle_call_budget(struct mosqagent *agent,
+                                   mosqagent_idle_call call,
+                                   const char *name,
+                                   const unsigned int budget_us)
+{
+    if (!agent || !call || !name) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mosqagent_idle_list* entry;
+    entry = mqtta_calloc(agent->allocator, 1, sizeof(*entry));
+    if (!entry)
+        // errno is already set
+        return -1;
+
+    entry->next = NULL;
+    entry->idle_call = call;
+    entry->budget_ns = budget_us * 1000ull;
+    entry->stats.budget_us = budget_us;
+    entry->name = mqtta_strdup(agent->allocator, name);
+    entry->durations = mqtta_histogram_create(1, IDLE_HIST_HIGHEST,
+                                              IDLE_HIST_DIGITS);
+    if (!entry->name || !entry->durations) {
+        mqtta_free(entry->name);
+        mqtta_histogram_destroy(entry->durations);
+        mqtta_free(entry);
+        errno = ENOMEM;
+        return -1;
+    }
+    entry->stats.durations = entry->durations;
+
+    return add_idle_entry(agent, entry);
+}
+
+int mosqagent_idle_stats(const struct mosqagent *agent,
+                         const char *name,
+                         struct mqtta_idle_stats *stats)
+{
+    if (!agent || !name || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const struct mosqagent_idle_list *e;
+    for (e = agent->idle; e; e = e->next)
+        if (e->name && !strcmp(e->name, name)) {
+            *stats = e->stats;
+            return 0;
+        }
+
+    errno = ENOENT;
+    return -1;
+}
+
+struct mosqagent_result* mosqagent_idle_result(struct mosqagent *agent,
+                                               const enum mqtta_idle_status status)
+{
+    agent->result.status = status;
+    agent->result.error = (status == MQTTA_IDLE_ERROR) ? errno : 0;
+
+    return &agent->result;
+}
+
+void mosqagent_clear_idle_list(struct mosqagent *agent)
+{
+    if (!agent)
+        return;
+
+    if (!agent->idle)
+        return;
+
     struct mosqagent_idle_list *e;
     e = agent->idle;
 
-
     while (e) {
-        struct mosqagent_result *res;
-
-        res = e->idle_call(agent);
+        struct mosqagent_idle_list *f;
 
-        //TODO process idle call result, esp. check for errors
+        f = e;
         e = e->next;
 
+        mqtta_free(f->name);
+        mqtta_histogram_destroy(f->durations);
+        mqtta_free(f);
+    }
+
+    agent->idle = NULL;
+}
+
+/*
+ * Run an idle call, timed in CPU time if it has a budget.
+ */
+static const struct mosqagent_result* run_idle_call(struct mosqagent *agent,
+                                                    struct mosqagent_idle_list *e)
+{
+    mqtta_watchdog_enter(agent, e->name ? e->name : "idle call");
+
+    if (!e->durations)
+        return e->idle_call(agent);
+
+    const uint64_t start = thread_cpu_ns();
+    const struct mosqagent_result *res = e->idle_call(agent);
+    const uint64_t duration = thread_cpu_ns() - start;
+
+    mqtta_histogram_record(e->durations, duration);
+    e->stats.calls++;
+    if (e->budget_ns && (duration > e->budget_ns))
+        e->stats.overruns++;
+
+    return res;
+}
+
+int mosqagent_idle(struct mosqagent *agent)
+{
+    uint64_t span = mqtta_trace_begin(agent);
+
+    mqtta_watchdog_enter(agent, "timers");
+    int work = mosqagent_run_timers(agent);
+    span = mqtta_trace_span(agent, MQTTA_SPAN_TIMERS, span);
+
+    bool pending = false;
+    int error = 0;
+
+    struct mosqagent_idle_list *e;
+    for (e = agent->idle; e; e = e->next) {
+        const struct mosqagent_result *res = run_idle_call(agent, e);
+        if (!res)
+            continue;
+
+        switch (res->status) {
+        case MQTTA_IDLE_YIELD:
+            e->stats.yields++;
+            pending = true;
+            break;
+        case MQTTA_IDLE_ERROR:
+            e->stats.errors++;
+            // keep the first error
+            if (!error)
+                error = res->error ? res->error : EIO;
+            break;
+        default:
+            break;
+        }
     }
+    span = mqtta_trace_span(agent, MQTTA_SPAN_IDLE, span);
 
     int ret;
-    // call the mosquitto loop
-    // TODO only when idle calls had not critical errors
-    ret = mqtt_loop(agent->mosq);
+    // call the mosquitto loop, also after errors of idle calls
+    mqtta_watchdog_enter(agent, "network");
+    work += mosqagent_flush_lanes(agent);
+    ret = mqtta_loop_network(agent, work > 0, pending);
+    // the loop has written what it could, refill from the lanes
+    mosqagent_flush_lanes(agent);
+    mqtta_trace_span(agent, MQTTA_SPAN_NETWORK, span);
+
+    mqtta_watchdog_iteration(agent);
+
+    if (!ret && error) {
+        errno = error;
+        return -1;
+    }
 
-    // TODO return type based on errros from idle calls
     return ret;
 }
 
+/*
+ * Add a subscription to the agent's list and send it to the broker if
+ * already connected. Takes ownership of `sub`.
+ */
+static int add_subscription(struct mosqagent *agent,
+                            char *sub,
+                            const size_t filter_offset,
+                            const int qos,
+                            mosqagent_message_handler handler,
+                            void *handler_data)
+{
+    struct mosqagent_sub_list* entry;
+
+    entry = mqtta_malloc(agent->allocator, sizeof(*entry));
+    if (!entry) {
+        mqtta_free(sub);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    entry->next = NULL;
+    entry->sub = sub;
+    entry->filter = sub + filter_offset;
+    entry->qos = qos;
+    entry->handler = handler;
+    entry->handler_data = handler_data;
+    entry->mid = 0;
+    entry->in_session = false;
+
+    // add to the tail to keep the dispatch order
+    struct mosqagent_sub_list **tail = &agent->subs;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = entry;
+
+    // otherwise the subscription is sent on connect
+    if (agent->connected)
+        send_subscriptions(agent);
+
+    return 0;
+}
+
+static bool valid_subscription(struct mosqagent *agent,
+                               const char *filter,
+                               const int qos,
+                               mosqagent_message_handler handler)
+{
+    return agent && handler &&
+           filter && (mosquitto_sub_topic_check(filter) == MOSQ_ERR_SUCCESS) &&
+           (qos >= 0) && (qos <= 2);
+}
+
+int mosqagent_subscribe(struct mosqagent *agent,
+                        const char *filter,
+                        const int qos,
+                        mosqagent_message_handler handler,
+                        void *handler_data)
+{
+    if (!valid_subscription(agent, filter, qos, handler)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *sub = mqtta_strdup(agent->allocator, filter);
+    if (!sub) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return add_subscription(agent, sub, 0, qos, handler, handler_data);
+}
+
+int mosqagent_connection_stats(const struct mosqagent *agent,
+                               struct mqtta_connection_stats *stats)
+{
+    if (!agent || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = agent->connection;
+
+    return 0;
+}
+
+int mosqagent_subscribe_shared(struct mosqagent *agent,
+                               const char *group,
+                               const char *filter,
+                               const int qos,
+                               mosqagent_message_handler handler,
+                               void *handler_data)
+{
+    if (!valid_subscription(agent, filter, qos, handler)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // fall back to the configured consumer group
+    if (!group && mqtta_get_configuration(agent))
+        group = mqtta_get_configuration(agent)->share_group;
+
+    // the share name must be a single, non-wildcard topic level
+    if (!group || !strlen(group) || strpbrk(group, "/+#")) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    static const char prefix[] = "$share/";
+    const size_t filter_offset = strlen(prefix) + strlen(group) + 1;
+    const size_t len = filter_offset + strlen(filter) + 1; // plus \0
+
+    char *sub = mqtta_malloc(agent->allocator, len);
+    if (!sub) {
+        errno = ENOMEM;
+        return -1;
+    }
+    snprintf(sub, len, "%s%s/%s", prefix, group, filter);
+
+    return add_subscription(agent, sub, filter_offset,
+                            qos, handler, handler_data);
+}
+
+int mosqagent_unsubscribe(struct mosqagent *agent,
+                          mosqagent_message_handler handler,
+                          void *handler_data)
+{
+    if (!agent || !handler) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int removed = 0;
+    struct mosqagent_sub_list **p = &agent->subs;
+    while (*p) {
+        struct mosqagent_sub_list *e = *p;
+        if ((e->handler != handler) || (e->handler_data != handler_data)) {
+            p = &e->next;
+            continue;
+        }
+        *p = e->next;
+        removed++;
+
+        // the broker keeps a filter as long as another handler uses it
+        const struct mosqagent_sub_list *f;
+        for (f = agent->subs; f; f = f->next)
+            if (!strcmp(f->sub, e->sub))
+                break;
+        if (!f && agent->connected && (e->in_session || e->mid))
+            mqtt_unsubscribe(agent->mosq, NULL, e->sub);
+
+        mqtta_free(e->sub);
+        mqtta_free(e);
+    }
+
+    if (!removed) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // an unacknowledged subscription may have been the last one
+    check_ready(agent);
+
+    return 0;
+}
+
+static void mosqagent_clear_sub_list(struct mosqagent *agent)
+{
+    struct mosqagent_sub_list *e;
+    e = agent->subs;
+
+    while (e) {
+        struct mosqagent_sub_list *f;
+
+        f = e;
+        e = e->next;
+
+        mqtta_free(f->sub);
+        mqtta_free(f);
+    }
+
+    agent->subs = NULL;
+}
+
+struct mqtta_message* mqtta_copy_message(const struct mqtta_allocator *allocator,
+                                         const char *topic,
+                                         const void *payload,
+                                         const int payloadlen,
+                                         const int qos,
+                                         const bool retain)
+{
+    struct mqtta_message *msg;
+    msg = mqtta_malloc(allocator, sizeof(*msg));
+    if (!msg)
+        goto fail;
+
+    msg->topic = mqtta_strdup(allocator, topic);
+    if (!msg->topic)
+        goto fail_with_msg;
+
+    msg->payload = mqtta_malloc(allocator, payloadlen + 1); // plus \0
+    if (!msg->payload)
+        goto fail_with_topic;
+    if (payloadlen)
+        memcpy(msg->payload, payload, payloadlen);
+    msg->payload[payloadlen] = '\0';
+
+    msg->payloadlen = payloadlen;
+    msg->qos = qos;
+    msg->retain = retain;
+    msg->priority = MQTTA_PRIORITY_DEFAULT;
+    msg->ttl_ms = 0;
+    msg->properties = NULL;
+    msg->ref = NULL;
+
+    return msg;
+
+fail_with_topic:
+    mqtta_free(msg->topic);
+
+fail_with_msg:
+    mqtta_free(msg);
+
+fail:
+    errno = ENOMEM;
+    return NULL;
+}
+
+int mqtta_dispatch_message(struct mosqagent *agent,
+                           const char *topic,
+                           const void *payload,
+                           const int payloadlen,
+                           const int qos,
+                           const bool retain)
+{
+    return mqtta_dispatch_props(agent, topic, payload, payloadlen,
+                                qos, retain, NULL);
+}
+
+int mqtta_dispatch_props(struct mosqagent *agent,
+                         const char *topic,
+                         const void *payload,
+                         const int payloadlen,
+                         const int qos,
+                         const bool retain,
+                         const mosquitto_property *props)
+{
+    if (!agent || !topic || (payloadlen < 0) || (payloadlen && !payload)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (agent->recorder)
+        mqtta_recorder_write(agent->recorder, MQTTA_RECORD_INBOUND,
+                             topic, payload, payloadlen, qos, retain);
+
+    if (agent->trace && props)
+        mqtta_trace_receive(agent, topic, props);
+
+    if (agent->topics)
+        mqtta_topics_count(agent, topic, payloadlen);
+
+    const uint64_t span = mqtta_trace_begin(agent);
+    int called = 0;
+
+    // one view on the receive buffer for all handlers
+    struct mqtta_message_ref ref = {
+        .shared = NULL,
+        .allocator = agent->allocator,
+    };
+    const struct mqtta_message view = {
+        .topic = (char*)topic,
+        .payload = payload ? (char*)payload : "",
+        .payloadlen = payloadlen,
+        .qos = qos,
+        .retain = retain,
+        .properties = props,
+        .ref = &ref,
+    };
+
+    struct mosqagent_sub_list *e;
+    for (e = agent->subs; e; e = e->next) {
+        bool match = false;
+
+        // the broker sends the original topic, also for shared subscriptions
+        mosquitto_topic_matches_sub(e->filter, topic, &match);
+        if (!match)
+            continue;
+
+        mqtta_watchdog_enter(agent, e->sub);
+        e->handler(agent, &view, e->handler_data);
+
+        ++called;
+    }
+    mqtta_watchdog_enter(agent, "network");
+
+    // drop the dispatch's reference on a copy made by retain
+    if (ref.shared)
+        release_shared(ref.shared);
+
+    mqtta_trace_span(agent, MQTTA_SPAN_DISPATCH, span);
+    mqtta_loop_work(agent);
+
+    return called;
+}
+
 const char* mosqagent_strerror(int mosq_errno)
 {
     return mosquitto_strerror(mosq_errno);
@@ -0,0 +1,292 @@
+/*******************************************************************//**
+ * \file		mqtta-test-aggregate.c
+ *
+ * \brief		Unit tests for windowed aggregation.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-aggregate.h>
+
+struct collected {
+    int windows;
+    struct mqtta_aggregate last;
+};
+
+static void collect(struct mosqagent *agent,
+                    const char *topic,
+                    const struct mqtta_aggregate *result,
+                    void *callback_data)
+{
+    struct collected *c = callback_data;
+
+    (void) agent; /* unused */
+    (void) topic; /* unused */
+
+    c->windows++;
+    c->last = *result;
+}
+
+static void assert_near(const double value, const double expected)
+{
+    assert_true(fabs(value - expected) <= 0.05 * fabs(expected));
+}
+
+static void tumbling(void **state)
+{
+    struct collected c = { 0 };
+    struct mqtta_aggregate r;
+    int i;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    const struct mqtta_aggregate_config config = {
+        .filter = "sensor/#",
+        .type = MQTTA_WINDOW_TUMBLING,
+        .window_ms = 1000,
+        .no_publish = true,
+        .callback = collect,
+        .callback_data = &c,
+    };
+    struct mqtta_aggregator *agg = mqtta_aggregator_create(agent, &config);
+    assert_non_null(agg);
+
+    for (i = 1; i <= 1000; i++)
+        assert_int_equal(mqtta_aggregator_add(agg, "sensor/a", i), 0);
+
+    assert_int_equal(mqtta_aggregator_peek(agg, "sensor/a", &r), 0);
+    assert_int_equal(r.count, 1000);
+    assert_true(r.min == 1.0);
+    assert_true(r.max == 1000.0);
+    assert_true(r.mean == 500.5);
+    assert_true(r.last == 1000.0);
+    assert_near(r.p50, 500);
+    assert_near(r.p90, 900);
+    assert_near(r.p99, 990);
+
+    mqtta_aggregator_close_window(agg);
+    assert_int_equal(c.windows, 1);
+    assert_int_equal(c.last.count, 1000);
+
+    // next window starts empty and is not reported
+    assert_int_equal(mqtta_aggregator_peek(agg, "sensor/a", &r), 0);
+    assert_int_equal(r.count, 0);
+    mqtta_aggregator_close_window(agg);
+    assert_int_equal(c.windows, 1);
+
+    // and the idle topic has been dropped
+    assert_int_equal(mqtta_aggregator_peek(agg, "sensor/a", &r), -1);
+    assert_int_equal(errno, ENOENT);
+    assert_int_equal(mqtta_aggregator_peek(agg, "sensor/b", &r), -1);
+
+    mqtta_aggregator_dispose(agg);
+    mosqagent_close_agent(agent);
+}
+
+static void sliding(void **state)
+{
+    struct mqtta_aggregate r;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    const struct mqtta_aggregate_config config = {
+        .filter = "sensor/#",
+        .type = MQTTA_WINDOW_SLIDING,
+        .window_ms = 3000,
+        .slide_ms = 1000,
+        .no_publish = true,
+    };
+    struct mqtta_aggregator *agg = mqtta_aggregator_create(agent, &config);
+    assert_non_null(agg);
+
+    mqtta_aggregator_add(agg, "sensor/a", 10);
+    mqtta_aggregator_close_window(agg);
+    mqtta_aggregator_add(agg, "sensor/a", 20);
+    mqtta_aggregator_close_window(agg);
+    mqtta_aggregator_add(agg, "sensor/a", 30);
+
+    assert_int_equal(mqtta_aggregator_peek(agg, "sensor/a", &r), 0);
+    assert_int_equal(r.count, 3);
+    assert_true(r.mean == 20.0);
+
+    // the first slide drops out
+    mqtta_aggregator_close_window(agg);
+    assert_int_equal(mqtta_aggregator_peek(agg, "sensor/a", &r), 0);
+    assert_int_equal(r.count, 2);
+    assert_true(r.min == 20.0);
+    assert_true(r.mean == 25.0);
+
+    mqtta_aggregator_dispose(agg);
+    mosqagent_close_agent(agent);
+}
+
+static void messages(void **state)
+{
+    struct mqtta_aggregate r;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    const struct mqtta_aggregate_config config = {
+        .filter = "sensor/+",
+        .type = MQTTA_WINDOW_TUMBLING,
+        .window_ms = 1000,
+        .no_publish = true,
+    };
+    struct mqtta_aggregator *agg = mqtta_aggregator_create(agent, &config);
+    assert_non_null(agg);
+
+    mqtta_dispatch_message(agent, "sensor/t", "-1.5", 4, 0, false);
+    mqtta_dispatch_message(agent, "sensor/t", "2.5\n", 4, 0, false);
+    // not numbers
+    mqtta_dispatch_message(agent, "sensor/t", "on", 2, 0, false);
+    mqtta_dispatch_message(agent, "sensor/t", "3 V", 3, 0, false);
+    mqtta_dispatch_message(agent, "sensor/t", "", 0, 0, false);
+    // numbers to strtod, but not to the statistics
+    mqtta_dispatch_message(agent, "sensor/t", "nan", 3, 0, false);
+    mqtta_dispatch_message(agent, "sensor/t", "-inf", 4, 0, false);
+    mqtta_dispatch_message(agent, "sensor/t", "1e999", 5, 0, false);
+    assert_int_equal(mqtta_aggregator_add(agg, "sensor/t", INFINITY), -1);
+    assert_int_equal(errno, EINVAL);
+
+    assert_int_equal(mqtta_aggregator_peek(agg, "sensor/t", &r), 0);
+    assert_int_equal(r.count, 2);
+    assert_true(r.min == -1.5);
+    assert_true(r.max == 2.5);
+    assert_true(r.last == 2.5);
+
+    mqtta_aggregator_dispose(agg);
+    mosqagent_close_agent(agent);
+}
+
+static void magnitudes(void **state)
+{
+    const double values[] = { -2e6, -0.75, 1e-6, 3e-3, 1.0, 42.0, 1e7 };
+    struct mqtta_aggregate r;
+    char topic[32];
+    unsigned int i;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    const struct mqtta_aggregate_config config = {
+        .filter = "sensor/#",
+        .type = MQTTA_WINDOW_TUMBLING,
+        .window_ms = 1000,
+        .no_publish = true,
+    };
+    struct mqtta_aggregator *agg = mqtta_aggregator_create(agent, &config);
+    assert_non_null(agg);
+
+    // a spread around each value, so that the sketch has to place it
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        snprintf(topic, sizeof(topic), "sensor/%u", i);
+        int j;
+        for (j = 0; j < 100; j++)
+            mqtta_aggregator_add(agg, topic, values[i] * (0.9 + j * 0.002));
+
+        assert_int_equal(mqtta_aggregator_peek(agg, topic, &r), 0);
+        assert_near(r.p50, values[i]);
+    }
+
+    mqtta_aggregator_dispose(agg);
+    mosqagent_close_agent(agent);
+}
+
+static void bounded(void **state)
+{
+    struct mqtta_aggregate r;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    const struct mqtta_aggregate_config config = {
+        .filter = "sensor/+",
+        .type = MQTTA_WINDOW_TUMBLING,
+        .window_ms = 1000,
+        .max_topics = 2,
+        .no_publish = true,
+    };
+    struct mqtta_aggregator *agg = mqtta_aggregator_create(agent, &config);
+    assert_non_null(agg);
+
+    assert_int_equal(mqtta_aggregator_add(agg, "sensor/a", 1), 0);
+    assert_int_equal(mqtta_aggregator_add(agg, "sensor/b", 2), 0);
+    assert_int_equal(mqtta_aggregator_add(agg, "sensor/c", 3), -1);
+    assert_int_equal(errno, ENOSPC);
+
+    // b is idle for a window and makes room for c
+    mqtta_aggregator_close_window(agg);
+    assert_int_equal(mqtta_aggregator_add(agg, "sensor/a", 1), 0);
+    mqtta_aggregator_close_window(agg);
+    assert_int_equal(mqtta_aggregator_add(agg, "sensor/c", 3), 0);
+    assert_int_equal(mqtta_aggregator_peek(agg, "sensor/a", &r), 0);
+    assert_int_equal(mqtta_aggregator_peek(agg, "sensor/b", &r), -1);
+
+    // the subscription goes with the aggregator
+    assert_int_equal(mqtta_dispatch_message(agent, "sensor/a", "1", 1, 0, false), 1);
+    mqtta_aggregator_dispose(agg);
+    assert_null(mosqagent_subscription(agent, 0));
+    assert_int_equal(mqtta_dispatch_message(agent, "sensor/a", "1", 1, 0, false), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+static void invalid_windows(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    struct mqtta_aggregate_config config = {
+        .filter = "sensor/#",
+        .type = MQTTA_WINDOW_SLIDING,
+        .window_ms = 1000,
+        .slide_ms = 300,
+    };
+    assert_null(mqtta_aggregator_create(agent, &config));
+
+    config.slide_ms = 10;
+    assert_null(mqtta_aggregator_create(agent, &config));
+
+    mosqagent_close_agent(agent);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(tumbling),
+        cmocka_unit_test(sliding),
+        cmocka_unit_test(messages),
+        cmocka_unit_test(magnitudes),
+        cmocka_unit_test(bounded),
+        cmocka_unit_test(invalid_windows),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
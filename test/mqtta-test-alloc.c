@@ -0,0 +1,136 @@
+/*******************************************************************//**
+ * \file		mqtta-test-alloc.c
+ *
+ * \brief		Unit tests for the allocator hooks.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <mqtt-tools/mqtta.h>
+
+static void keep_handler(struct mosqagent *agent,
+                         const struct mqtta_message *msg,
+                         void *handler_data)
+{
+    (void) agent; /* unused */
+
+    assert_int_equal(mqtta_message_retain(msg, handler_data), 0);
+}
+
+static void nop_timer(struct mosqagent *agent, void *timer_data)
+{
+    (void) agent; /* unused */
+    (void) timer_data; /* unused */
+}
+
+static void agent_memory_is_accounted(void **state)
+{
+    (void) state; /* unused */
+
+    struct mqtta_accounting acc;
+    mqtta_accounting_init(&acc, NULL, 0);
+
+    struct mosqagent *agent = mosqagent_init_agent_with(NULL, &acc.allocator);
+    assert_non_null(agent);
+    assert_ptr_equal(agent->allocator, &acc.allocator);
+    const size_t empty = acc.live;
+    assert_true(empty >= sizeof(*agent));
+
+    struct mqtta_memory_object kept;
+    assert_int_equal(mosqagent_subscribe(agent, "alloc/#", 0,
+                                         keep_handler, &kept), 0);
+    assert_non_null(mosqagent_add_timer(agent, 1000, 1000, nop_timer, NULL));
+    assert_true(acc.live > empty);
+
+    // the retained copy of a received message is the agent's, too
+    const size_t subscribed = acc.live;
+    assert_int_equal(mqtta_dispatch_message(agent, "alloc/test", "kept", 4,
+                                            0, false), 1);
+    assert_true(acc.live > subscribed);
+
+    // the message outlives the agent
+    assert_int_equal(mosqagent_close_agent(agent), 0);
+    assert_true(acc.live > 0);
+    assert_string_equal(((struct mqtta_message*)mqtta_mo_ptr(&kept))->payload,
+                        "kept");
+
+    mqtta_mo_free(&kept);
+    assert_int_equal(acc.live, 0);
+    assert_true(acc.peak > subscribed);
+}
+
+static void cap_is_enforced(void **state)
+{
+    (void) state; /* unused */
+
+    struct mqtta_accounting acc;
+    mqtta_accounting_init(&acc, NULL, 4096);
+
+    struct mosqagent *agent = mosqagent_init_agent_with(NULL, &acc.allocator);
+    assert_non_null(agent);
+
+    struct mqtta_memory_object kept;
+    int i;
+    for (i = 0; i < 1000; i++)
+        if (mosqagent_subscribe(agent, "alloc/capped/topic", 0,
+                                keep_handler, &kept))
+            break;
+
+    assert_true(i < 1000);
+    assert_int_equal(errno, ENOMEM);
+    assert_true(acc.refused > 0);
+    assert_true(acc.peak <= 4096);
+
+    mosqagent_close_agent(agent);
+    assert_int_equal(acc.live, 0);
+}
+
+static void global_allocator_is_used(void **state)
+{
+    (void) state; /* unused */
+
+    struct mqtta_accounting acc;
+    mqtta_accounting_init(&acc, NULL, 0);
+    mqtta_set_allocator(&acc.allocator);
+
+    struct mqtta_message *msg;
+    msg = mqtta_create_message("alloc/global", "payload", 0, false);
+    assert_non_null(msg);
+    assert_true(acc.live > 0);
+
+    // memory goes back to its allocator, also after a switch
+    mqtta_set_allocator(NULL);
+    mqtta_dispose_message(msg);
+    assert_int_equal(acc.live, 0);
+
+    char *s = mqtta_malloc(&acc.allocator, 4);
+    assert_non_null(s);
+    memcpy(s, "abc", 4);
+    s = mqtta_realloc(s, 4096);
+    assert_non_null(s);
+    assert_string_equal(s, "abc");
+    assert_true(acc.live > 4096);
+
+    mqtta_free(s);
+    assert_int_equal(acc.live, 0);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(agent_memory_is_accounted),
+        cmocka_unit_test(cap_is_enforced),
+        cmocka_unit_test(global_allocator_is_used),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,271 @@
+/*******************************************************************//**
+ * \file		mqtta-test-archive.c
+ *
+ * \brief		Unit tests for the message archive.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <mqtt-tools/mqtta-archive.h>
+
+#include "mqtta-test-tmp.h"
+
+#define MESSAGES    10000
+#define TOPICS      7
+
+/* 2019-01-01 00:00:00 UTC */
+#define BASE_NS     (1546300800ull * 1000000000ull)
+/* one message per 10 ms, so the messages span two one-minute partitions */
+#define STEP_NS     (10ull * 1000000ull)
+
+static void write_messages(const char *dir, struct mqtta_archive_stats *stats)
+{
+    const struct mqtta_archive_config config = {
+        .dir = dir,
+        .partition_s = 60,
+        .block_size = 4096,
+    };
+    char topic[32];
+    char payload[32];
+    int i;
+
+    struct mqtta_archive *archive = mqtta_archive_open(&config);
+    assert_non_null(archive);
+
+    for (i = 0; i < MESSAGES; i++) {
+        snprintf(topic, sizeof(topic), "archive/sensor/%d", i % TOPICS);
+        const int len = snprintf(payload, sizeof(payload), "%d", i);
+
+        // the writer thread keeps up with this
+        while (mqtta_archive_write(archive, BASE_NS + i * STEP_NS,
+                                   topic, payload, len, i % 3, !(i % 2)))
+            usleep(1000);
+    }
+
+    assert_int_equal(mqtta_archive_close(archive, stats), 0);
+    assert_int_equal(stats->written, MESSAGES);
+}
+
+static void round_trip(void **state)
+{
+    const char *dir = *state;
+    struct mqtta_archive_stats stats;
+
+    write_messages(dir, &stats);
+
+    struct mqtta_archive_reader *reader;
+    reader = mqtta_archive_reader_open(dir, 0, UINT64_MAX);
+    assert_non_null(reader);
+
+    struct mqtta_archive_record record;
+    char expected[32];
+    int i = 0;
+    int ret;
+    while ((ret = mqtta_archive_reader_next(reader, &record)) > 0) {
+        assert_int_equal(record.timestamp_ns, BASE_NS + i * STEP_NS);
+        snprintf(expected, sizeof(expected), "archive/sensor/%d", i % TOPICS);
+        assert_string_equal(record.topic, expected);
+        snprintf(expected, sizeof(expected), "%d", i);
+        assert_string_equal(record.payload, expected);
+        assert_int_equal(record.payloadlen, strlen(expected));
+        assert_int_equal(record.qos, i % 3);
+        assert_int_equal(record.retain, !(i % 2));
+        i++;
+    }
+    assert_int_equal(ret, 0);
+    assert_int_equal(i, MESSAGES);
+
+    mqtta_archive_reader_close(reader);
+
+    // a partition per minute
+    int partitions = 0;
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while ((e = readdir(d)))
+        if (strstr(e->d_name, MQTTA_ARCHIVE_SUFFIX))
+            partitions++;
+    closedir(d);
+    assert_int_equal(partitions, 1 + (MESSAGES - 1) * STEP_NS / 60000000000ull);
+}
+
+static void time_range(void **state)
+{
+    const char *dir = *state;
+    struct mqtta_archive_stats stats;
+
+    write_messages(dir, &stats);
+    assert_int_equal(stats.dropped, 0);
+
+    // across the partition boundary at one minute
+    const int first = 5900;
+    const int last = 6100;
+    struct mqtta_archive_reader *reader;
+    reader = mqtta_archive_reader_open(dir,
+                                       BASE_NS + first * STEP_NS,
+                                       BASE_NS + last * STEP_NS);
+    assert_non_null(reader);
+
+    struct mqtta_archive_record record;
+    int i = first;
+    while (mqtta_archive_reader_next(reader, &record) > 0) {
+        assert_int_equal(record.timestamp_ns, BASE_NS + i * STEP_NS);
+        i++;
+    }
+    assert_int_equal(i, last + 1);
+
+    mqtta_archive_reader_close(reader);
+
+    // nothing before the archive
+    reader = mqtta_archive_reader_open(dir, 0, BASE_NS - 1);
+    assert_non_null(reader);
+    assert_int_equal(mqtta_archive_reader_next(reader, &record), 0);
+    mqtta_archive_reader_close(reader);
+}
+
+static void continue_partition(void **state)
+{
+    const char *dir = *state;
+    struct mqtta_archive_stats stats;
+
+    // the second run appends to the same partitions
+    write_messages(dir, &stats);
+    write_messages(dir, &stats);
+
+    struct mqtta_archive_reader *reader;
+    reader = mqtta_archive_reader_open(dir, BASE_NS, BASE_NS);
+    assert_non_null(reader);
+
+    struct mqtta_archive_record record;
+    int count = 0;
+    while (mqtta_archive_reader_next(reader, &record) > 0) {
+        assert_string_equal(record.payload, "0");
+        count++;
+    }
+    assert_int_equal(count, 2);
+
+    mqtta_archive_reader_close(reader);
+}
+
+static void full_queue(void **state)
+{
+    const char *dir = *state;
+    const struct mqtta_archive_config config = {
+        .dir = dir,
+        .queue_size = 4096,
+    };
+    char payload[3000];
+    int i;
+
+    memset(payload, 'x', sizeof(payload));
+
+    struct mqtta_archive *archive = mqtta_archive_open(&config);
+    assert_non_null(archive);
+
+    // too big for the queue at all
+    assert_int_equal(mqtta_archive_write(archive, 0, "archive/big",
+                                         payload, sizeof(payload),
+                                         0, false), -1);
+    assert_int_equal(errno, EMSGSIZE);
+
+    int failed = 0;
+    for (i = 0; i < 1000; i++)
+        if (mqtta_archive_write(archive, 0, "archive/fast",
+                                payload, 1000, 0, false))
+            failed++;
+
+    struct mqtta_archive_stats stats;
+    mqtta_archive_stats(archive, &stats);
+    assert_int_equal(stats.dropped, failed + 1);
+
+    assert_int_equal(mqtta_archive_close(archive, &stats), 0);
+    assert_int_equal(stats.written + stats.dropped, 1000 + 1);
+}
+
+static void torn_block(void **state)
+{
+    const char *dir = *state;
+    struct mqtta_archive_stats stats;
+    char last[256] = "";
+    char path[512];
+
+    write_messages(dir, &stats);
+
+    // the last partition
+    DIR *d = opendir(dir);
+    assert_non_null(d);
+    struct dirent *e;
+    while ((e = readdir(d)))
+        if (strstr(e->d_name, MQTTA_ARCHIVE_SUFFIX) &&
+            (strcmp(e->d_name, last) > 0))
+            snprintf(last, sizeof(last), "%s", e->d_name);
+    closedir(d);
+    snprintf(path, sizeof(path), "%s/%s", dir, last);
+
+    // a crash left garbage in the last block and half of another header
+    const int fd = open(path, O_RDWR);
+    assert_true(fd >= 0);
+    const off_t size = lseek(fd, 0, SEEK_END);
+    char c;
+    assert_int_equal(pread(fd, &c, 1, size - 8), 1);
+    c = ~c;
+    assert_int_equal(pwrite(fd, &c, 1, size - 8), 1);
+    assert_int_equal(pwrite(fd, "MQLB\x10\x00", 6, size), 6);
+    close(fd);
+
+    // the writer cuts both off when it continues the partition
+    const struct mqtta_archive_config config = {
+        .dir = dir,
+        .partition_s = 60,
+    };
+    struct mqtta_archive *archive = mqtta_archive_open(&config);
+    assert_non_null(archive);
+    assert_int_equal(mqtta_archive_write(archive, BASE_NS + MESSAGES * STEP_NS,
+                                         "archive/last", "last", 4,
+                                         0, false), 0);
+    assert_int_equal(mqtta_archive_close(archive, NULL), 0);
+
+    struct mqtta_archive_reader *reader;
+    reader = mqtta_archive_reader_open(dir, 0, UINT64_MAX);
+    assert_non_null(reader);
+
+    struct mqtta_archive_record record;
+    char topic[32] = "";
+    int count = 0;
+    int ret;
+    while ((ret = mqtta_archive_reader_next(reader, &record)) > 0) {
+        snprintf(topic, sizeof(topic), "%s", record.topic);
+        count++;
+    }
+    assert_int_equal(ret, 0);
+    assert_true(count < MESSAGES);
+    assert_string_equal(topic, "archive/last");
+
+    mqtta_archive_reader_close(reader);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(round_trip, mqtta_test_setup_dir, mqtta_test_teardown_dir),
+        cmocka_unit_test_setup_teardown(time_range, mqtta_test_setup_dir, mqtta_test_teardown_dir),
+        cmocka_unit_test_setup_teardown(continue_partition, mqtta_test_setup_dir, mqtta_test_teardown_dir),
+        cmocka_unit_test_setup_teardown(full_queue, mqtta_test_setup_dir, mqtta_test_teardown_dir),
+        cmocka_unit_test_setup_teardown(torn_block, mqtta_test_setup_dir, mqtta_test_teardown_dir),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
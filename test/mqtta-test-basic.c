@@ -16,8 +16,12 @@
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include <errno.h>
+
 #include <mqtt-tools/mqtta.h>
 
+#include "mqtta-test-tmp.h"
+
 #include "mqtta-build.h"
 
 static void version(void **state) {
@@ -31,9 +35,126 @@ static void version(void **state) {
     assert_string_equal(result, MQTTA_VERSION);
 }
 
+static void count_timer(struct mosqagent *agent, void *timer_data)
+{
+    (void) agent; /* unused */
+
+    (*(int*)timer_data)++;
+}
+
+static void timers(void **state) {
+    int once = 0;
+    int periodic = 0;
+    int cancelled = 0;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_non_null(mosqagent_add_timer(agent, 20, 0, count_timer, &once));
+    assert_non_null(mosqagent_add_timer(agent, 10, 10, count_timer, &periodic));
+    struct mqtta_timer *t;
+    t = mosqagent_add_timer(agent, 10, 0, count_timer, &cancelled);
+    assert_non_null(t);
+    mosqagent_cancel_timer(agent, t);
+
+    assert_int_equal(mosqagent_run_timers(agent), 0);
+
+    // missed periods are not caught up
+    mqtta_test_sleep_ms(25);
+    assert_int_equal(mosqagent_run_timers(agent), 2);
+    mqtta_test_sleep_ms(15);
+    assert_int_equal(mosqagent_run_timers(agent), 1);
+
+    assert_int_equal(once, 1);
+    assert_int_equal(periodic, 2);
+    assert_int_equal(cancelled, 0);
+
+    mosqagent_close_agent(agent);
+}
+
+static void ignore_handler(struct mosqagent *agent,
+                           const struct mqtta_message *msg,
+                           void *handler_data)
+{
+    (void) agent; /* unused */
+    (void) msg; /* unused */
+    (void) handler_data; /* unused */
+}
+
+static void connection_stats(void **state) {
+    struct mqtta_connection_stats stats;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_connection_stats(NULL, &stats), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mosqagent_connection_stats(agent, NULL), -1);
+
+    // subscriptions wait for the connect
+    assert_int_equal(mosqagent_subscribe(agent, "a/#", 0,
+                                         ignore_handler, NULL), 0);
+    assert_int_equal(mosqagent_subscribe(agent, "b/#", 1,
+                                         ignore_handler, NULL), 0);
+
+    assert_int_equal(mosqagent_connection_stats(agent, &stats), 0);
+    assert_int_equal(stats.connects, 0);
+    assert_int_equal(stats.subscribe_packets, 0);
+    assert_false(stats.ready);
+
+    mosqagent_close_agent(agent);
+}
+
+static void tls(void **state) {
+    struct mqtta_tls_stats stats;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    // certificates or a pre-shared key with identity
+    const struct mqtta_tls_config none = { .cafile = NULL };
+    const struct mqtta_tls_config both = {
+        .cafile = "ca.pem", .psk = "0123", .identity = "agent",
+    };
+    const struct mqtta_tls_config no_identity = { .psk = "0123" };
+    assert_int_equal(mosqagent_set_tls(agent, NULL), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mosqagent_set_tls(agent, &none), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mosqagent_set_tls(agent, &both), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mosqagent_set_tls(agent, &no_identity), -1);
+    assert_int_equal(errno, EINVAL);
+
+    // kept for the connect, without a session to resume yet
+    const struct mqtta_tls_config certs = {
+        .cafile = "ca.pem",
+        .session_cache = "/nonexistent/mqtta.session",
+    };
+    const struct mqtta_tls_config psk = { .psk = "0123", .identity = "agent" };
+    assert_int_equal(mosqagent_set_tls(agent, &certs), 0);
+    assert_int_equal(mosqagent_set_tls(agent, &psk), 0);
+
+    assert_int_equal(mosqagent_tls_stats(agent, NULL), -1);
+    assert_int_equal(mosqagent_tls_stats(agent, &stats), 0);
+    assert_int_equal(stats.handshakes, 0);
+    assert_int_equal(stats.resumed, 0);
+
+    mosqagent_close_agent(agent);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(version),
+        cmocka_unit_test(timers),
+        cmocka_unit_test(connection_stats),
+        cmocka_unit_test(tls),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
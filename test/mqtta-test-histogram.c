@@ -0,0 +1,167 @@
+/*******************************************************************//**
+ * \file		mqtta-test-histogram.c
+ *
+ * \brief		Unit tests for the high dynamic range histograms.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mqtt-tools/mqtta-histogram.h>
+
+/* 1 ns to an hour with three digits, as for latencies */
+#define LOWEST      1
+#define HIGHEST     3600000000000ull
+#define DIGITS      3
+
+static void invalid(void **state)
+{
+    (void) state; /* unused */
+
+    assert_null(mqtta_histogram_create(0, HIGHEST, DIGITS));
+    assert_int_equal(errno, EINVAL);
+    assert_null(mqtta_histogram_create(10, 15, DIGITS));
+    assert_null(mqtta_histogram_create(LOWEST, HIGHEST, 0));
+    assert_null(mqtta_histogram_create(LOWEST, HIGHEST, 6));
+}
+
+static void percentiles(void **state)
+{
+    (void) state; /* unused */
+
+    struct mqtta_histogram *h = mqtta_histogram_create(LOWEST, HIGHEST,
+                                                       DIGITS);
+    assert_non_null(h);
+    assert_int_equal(mqtta_histogram_value_at(h, 50.0), 0);
+
+    // 1 µs to 100 ms in µs steps
+    uint64_t v;
+    for (v = 1; v <= 100000; v++)
+        mqtta_histogram_record(h, v * 1000);
+
+    assert_int_equal(mqtta_histogram_count(h), 100000);
+    assert_int_equal(mqtta_histogram_min(h), 1000);
+    assert_int_equal(mqtta_histogram_max(h), 100000000);
+
+    // three significant digits
+    const double p[] = { 50.0, 90.0, 99.0, 99.9 };
+    unsigned int i;
+    for (i = 0; i < sizeof(p) / sizeof(*p); i++) {
+        const double expected = p[i] * 1000000.0;
+        const double actual = mqtta_histogram_value_at(h, p[i]);
+        assert_true(actual >= expected * 0.999);
+        assert_true(actual <= expected * 1.001);
+    }
+    assert_int_equal(mqtta_histogram_value_at(h, 100.0), 100000000);
+
+    const double mean = mqtta_histogram_mean(h);
+    assert_true((mean > 50000000.0 * 0.999) && (mean < 50001000.0 * 1.001));
+
+    // out of range values count as the highest
+    mqtta_histogram_record(h, HIGHEST * 2);
+    assert_int_equal(mqtta_histogram_max(h), HIGHEST);
+
+    mqtta_histogram_reset(h);
+    assert_int_equal(mqtta_histogram_count(h), 0);
+    assert_int_equal(mqtta_histogram_min(h), 0);
+
+    mqtta_histogram_destroy(h);
+}
+
+static void add(void **state)
+{
+    (void) state; /* unused */
+
+    struct mqtta_histogram *a = mqtta_histogram_create(LOWEST, HIGHEST, DIGITS);
+    struct mqtta_histogram *b = mqtta_histogram_create(LOWEST, HIGHEST, DIGITS);
+    struct mqtta_histogram *c = mqtta_histogram_create(LOWEST, HIGHEST, 2);
+    assert_non_null(a);
+    assert_non_null(b);
+    assert_non_null(c);
+
+    int i;
+    for (i = 0; i < 1000; i++) {
+        mqtta_histogram_record(a, 10);
+        mqtta_histogram_record(b, 1000000);
+    }
+
+    assert_int_equal(mqtta_histogram_add(a, b), 0);
+    assert_int_equal(mqtta_histogram_count(a), 2000);
+    assert_int_equal(mqtta_histogram_value_at(a, 25.0), 10);
+    assert_in_range(mqtta_histogram_value_at(a, 75.0), 999000, 1001000);
+
+    assert_int_equal(mqtta_histogram_add(a, c), -1);
+    assert_int_equal(errno, EINVAL);
+
+    mqtta_histogram_destroy(a);
+    mqtta_histogram_destroy(b);
+    mqtta_histogram_destroy(c);
+}
+
+static void print(void **state)
+{
+    (void) state; /* unused */
+
+    struct mqtta_histogram *h = mqtta_histogram_create(LOWEST, HIGHEST,
+                                                       DIGITS);
+    assert_non_null(h);
+
+    uint64_t v;
+    for (v = 1; v <= 10000; v++)
+        mqtta_histogram_record(h, v * 1000);
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    assert_non_null(f);
+    assert_int_equal(mqtta_histogram_print(h, f, 1000.0), 0);
+    fclose(f);
+
+    // header, rows from 0 % to 100 %, footer
+    assert_non_null(strstr(buf, "Value     Percentile TotalCount"));
+    assert_non_null(strstr(buf, "0.000000000000"));
+    assert_non_null(strstr(buf, "   10000.000 1.000000000000      10000\n"));
+    assert_non_null(strstr(buf, "Total count    =        10000]"));
+
+    // percentiles only grow
+    double last = -1.0;
+    int rows = 0;
+    char *line;
+    for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+        double value;
+        double percentile;
+        if ((line[0] == '#') ||
+            (sscanf(line, "%lf %lf", &value, &percentile) != 2))
+            continue;
+        assert_true(percentile >= last);
+        last = percentile;
+        rows++;
+    }
+    assert_true(rows > 50);
+    assert_true(last == 1.0);
+
+    free(buf);
+    mqtta_histogram_destroy(h);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(invalid),
+        cmocka_unit_test(percentiles),
+        cmocka_unit_test(add),
+        cmocka_unit_test(print),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,263 @@
+/*******************************************************************//**
+ * \file		mqtta-test-idle.c
+ *
+ * \brief		Unit tests for idle call budgets and the loop watchdog.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-histogram.h>
+#include <mqtt-tools/mqtta-local.h>
+
+#include "mqtta-test-tmp.h"
+
+struct state {
+    int calls;
+    int yields;
+    long sleep_ms;
+    long spin_ms;
+
+    char stalled_in[64];
+    unsigned long stalled_ms;
+    int stalls;
+};
+
+static uint64_t cpu_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct mosqagent_result* sleeping_call(struct mosqagent *agent)
+{
+    struct state *s = mosqagent_get_private_data(agent);
+
+    s->calls++;
+    mqtta_test_sleep_ms(s->sleep_ms);
+
+    // burn CPU time, which is what the budget is about
+    const uint64_t start = cpu_ms();
+    while (cpu_ms() - start < (uint64_t)s->spin_ms)
+        ;
+
+    return NULL;
+}
+
+static struct mosqagent_result* yielding_call(struct mosqagent *agent)
+{
+    struct state *s = mosqagent_get_private_data(agent);
+
+    s->calls++;
+    if (s->yields-- > 0)
+        return mosqagent_idle_result(agent, MQTTA_IDLE_YIELD);
+
+    return mosqagent_idle_result(agent, MQTTA_IDLE_DONE);
+}
+
+static struct mosqagent_result* failing_call(struct mosqagent *agent)
+{
+    errno = EPROTO;
+    return mosqagent_idle_result(agent, MQTTA_IDLE_ERROR);
+}
+
+static void budget(void **state)
+{
+    struct state s = { .sleep_ms = 0 };
+    struct mqtta_idle_stats stats;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(&s);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_add_idle_call_budget(agent, sleeping_call,
+                                                    NULL, 1000), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mosqagent_add_idle_call_budget(agent, sleeping_call,
+                                                    "sleeper", 10000), 0);
+
+    assert_int_equal(mosqagent_idle_stats(agent, "nobody", &stats), -1);
+    assert_int_equal(errno, ENOENT);
+
+    // within the budget, also while waiting, then over it
+    int i;
+    for (i = 0; i < 3; i++)
+        mosqagent_idle(agent);
+    s.sleep_ms = 50;
+    for (i = 0; i < 2; i++)
+        mosqagent_idle(agent);
+    s.sleep_ms = 0;
+    s.spin_ms = 50;
+    for (i = 0; i < 2; i++)
+        mosqagent_idle(agent);
+
+    assert_int_equal(mosqagent_idle_stats(agent, "sleeper", &stats), 0);
+    assert_int_equal(stats.budget_us, 10000);
+    assert_int_equal(stats.calls, 7);
+    assert_int_equal(stats.overruns, 2);
+    assert_int_equal(mqtta_histogram_count(stats.durations), 7);
+    assert_true(mqtta_histogram_max(stats.durations) >= 40000000);
+    assert_true(mqtta_histogram_value_at(stats.durations, 50.0) < 10000000);
+
+    mosqagent_close_agent(agent);
+}
+
+static void yield(void **state)
+{
+    const char *group = *state;
+    struct state s = { .yields = 10 };
+    struct mqtta_idle_stats stats;
+
+    // a local group makes the loop block for 100 ms without work
+
+    struct mosqagent *agent = mosqagent_init_agent(&s);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_local_join(agent, group, false), 0);
+    assert_int_equal(mosqagent_add_idle_call_budget(agent, yielding_call,
+                                                    "yielder", 0), 0);
+
+    // yields do not wait for the network
+    uint64_t start = now_ms();
+    int i;
+    for (i = 0; i < 10; i++)
+        mosqagent_idle(agent);
+    assert_true(now_ms() - start < 100);
+    assert_int_equal(s.calls, 10);
+
+    // without pending work the loop blocks again
+    mosqagent_idle(agent);
+    start = now_ms();
+    mosqagent_idle(agent);
+    assert_true(now_ms() - start >= 50);
+
+    assert_int_equal(mosqagent_idle_stats(agent, "yielder", &stats), 0);
+    assert_int_equal(stats.yields, 10);
+
+    mosqagent_close_agent(agent);
+}
+
+static void error(void **state)
+{
+    const char *group = *state;
+    struct mqtta_idle_stats stats;
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_local_join(agent, group, false), 0);
+    assert_int_equal(mosqagent_add_idle_call_budget(agent, failing_call,
+                                                    "failing", 0), 0);
+
+    errno = 0;
+    assert_int_equal(mosqagent_idle(agent), -1);
+    assert_int_equal(errno, EPROTO);
+    assert_int_equal(mosqagent_idle_stats(agent, "failing", &stats), 0);
+    assert_int_equal(stats.errors, 1);
+
+    mosqagent_close_agent(agent);
+}
+
+static void record_stall(struct mosqagent *agent,
+                         const char *running,
+                         const unsigned long stalled_ms,
+                         void *handler_data)
+{
+    struct state *s = handler_data;
+
+    (void) agent; /* unused */
+
+    snprintf(s->stalled_in, sizeof(s->stalled_in), "%s", running);
+    s->stalled_ms = stalled_ms;
+    __atomic_add_fetch(&s->stalls, 1, __ATOMIC_RELEASE);
+}
+
+static void watchdog(void **state)
+{
+    struct state s = { .sleep_ms = 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(&s);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_add_idle_call_budget(agent, sleeping_call,
+                                                    "sleeper", 0), 0);
+    assert_int_equal(mosqagent_watchdog(agent, 100, record_stall, &s), 0);
+
+    // a healthy loop
+    int i;
+    for (i = 0; i < 20; i++) {
+        mosqagent_idle(agent);
+        mqtta_test_sleep_ms(10);
+    }
+    assert_int_equal(__atomic_load_n(&s.stalls, __ATOMIC_ACQUIRE), 0);
+
+    // one stall, reported once
+    s.sleep_ms = 400;
+    mosqagent_idle(agent);
+    assert_int_equal(__atomic_load_n(&s.stalls, __ATOMIC_ACQUIRE), 1);
+    assert_string_equal(s.stalled_in, "sleeper");
+    assert_true(s.stalled_ms >= 100);
+
+    assert_int_equal(mosqagent_watchdog(agent, 0, NULL, NULL), 0);
+    mosqagent_close_agent(agent);
+}
+
+static void custom_loop(void **state)
+{
+    struct state s = { .sleep_ms = 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(&s);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_watchdog(agent, 100, record_stall, &s), 0);
+
+    // a loop of its own reports its iterations
+    int i;
+    for (i = 0; i < 30; i++) {
+        mosqagent_run_timers(agent);
+        mqtta_test_sleep_ms(10);
+        mosqagent_watchdog_iteration(agent);
+    }
+    assert_int_equal(__atomic_load_n(&s.stalls, __ATOMIC_ACQUIRE), 0);
+
+    mqtta_test_sleep_ms(400);
+    assert_int_equal(__atomic_load_n(&s.stalls, __ATOMIC_ACQUIRE), 1);
+    assert_string_equal(s.stalled_in, "loop");
+
+    mosqagent_close_agent(agent);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(budget),
+        cmocka_unit_test_setup_teardown(yield, mqtta_test_setup_group, mqtta_test_teardown_group),
+        cmocka_unit_test_setup_teardown(error, mqtta_test_setup_group, mqtta_test_teardown_group),
+        cmocka_unit_test(watchdog),
+        cmocka_unit_test(custom_loop),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,298 @@
+/*******************************************************************//**
+ * \file		mqtta-test-local.c
+ *
+ * \brief		Unit tests for the shared-memory transport.
+ *
+ * The members of a group are agents in the same process here, which use
+ * the same rings and wake-up sockets as separate processes would.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/wait.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-local.h>
+
+#include "mqtta-test-tmp.h"
+
+#define PAYLOAD_SIZE    1000
+
+struct receiver {
+    int received;
+    int last_seq;
+    bool in_order;
+    char last_payload[PAYLOAD_SIZE + 1];
+};
+
+static void receive_handler(struct mosqagent *agent,
+                            const struct mqtta_message *msg,
+                            void *handler_data)
+{
+    struct receiver *r = handler_data;
+    const int seq = atoi(msg->payload);
+
+    (void) agent; /* unused */
+
+    if (r->received && (seq <= r->last_seq))
+        r->in_order = false;
+    r->last_seq = seq;
+    r->received++;
+    snprintf(r->last_payload, sizeof(r->last_payload), "%s", msg->payload);
+}
+
+static int send_one(struct mosqagent *agent, const char *topic,
+                    const char *payload)
+{
+    struct mqtta_message msg = {
+        .topic = (char*)topic,
+        .payload = (char*)payload,
+        .payloadlen = strlen(payload),
+    };
+
+    errno = 0;
+    return mqtta_send_message(agent, &msg);
+}
+
+static void round_trip(void **state)
+{
+    const char *group = *state;
+    struct receiver r = { .in_order = true };
+
+    struct mosqagent *a = mosqagent_init_agent(NULL);
+    struct mosqagent *b = mosqagent_init_agent(NULL);
+    assert_non_null(a);
+    assert_non_null(b);
+
+    assert_int_equal(mosqagent_local_join(a, group, false), 0);
+    assert_int_equal(mosqagent_local_join(b, group, false), 0);
+    assert_int_equal(mosqagent_local_join(b, group, false), -1);
+    assert_int_equal(errno, EALREADY);
+
+    assert_int_equal(mosqagent_local_topic(a, "local/a/#"), 0);
+    assert_int_equal(mosqagent_local_topic(b, "local/#"), 0);
+    assert_int_equal(mosqagent_subscribe(b, "#", 0, receive_handler, &r), 0);
+
+    // local for both, so it does not need the broker
+    assert_int_equal(send_one(a, "local/a/1", "1"), 0);
+    // not local for the sender
+    assert_int_equal(send_one(a, "local/b", "2"), -1);
+    assert_int_equal(errno, ENOTCONN);
+    // not local at all
+    assert_int_equal(send_one(a, "remote", "3"), -1);
+    assert_int_equal(errno, ENOTCONN);
+
+    assert_int_equal(mosqagent_local_poll(b), 1);
+    assert_int_equal(r.received, 1);
+    assert_string_equal(r.last_payload, "1");
+
+    // the agent loop polls the ring as well
+    assert_int_equal(send_one(a, "local/a/2", "4"), 0);
+    mosqagent_idle(b);
+    assert_int_equal(r.received, 2);
+    assert_string_equal(r.last_payload, "4");
+
+    assert_int_equal(mosqagent_local_poll(b), 0);
+    assert_int_equal(mosqagent_local_dropped(b), 0);
+
+    mosqagent_close_agent(a);
+    mosqagent_close_agent(b);
+}
+
+static void ring_wraps(void **state)
+{
+    const char *group = *state;
+    struct receiver r = { .in_order = true };
+    char payload[PAYLOAD_SIZE + 1];
+    int seq = 0;
+    int round;
+
+    struct mosqagent *a = mosqagent_init_agent(NULL);
+    struct mosqagent *b = mosqagent_init_agent(NULL);
+    assert_non_null(a);
+    assert_non_null(b);
+
+    assert_int_equal(mosqagent_local_join(a, group, false), 0);
+    assert_int_equal(mosqagent_local_join(b, group, false), 0);
+    assert_int_equal(mosqagent_local_topic(a, "bulk"), 0);
+    assert_int_equal(mosqagent_local_topic(b, "bulk"), 0);
+    assert_int_equal(mosqagent_subscribe(b, "bulk", 0, receive_handler, &r), 0);
+
+    // a few times around the ring, in uneven steps
+    const int per_round = MQTTA_LOCAL_RING_SIZE / PAYLOAD_SIZE / 3;
+    for (round = 0; round < 10; round++) {
+        int i;
+        for (i = 0; i < per_round; i++) {
+            memset(payload, 'x', PAYLOAD_SIZE);
+            snprintf(payload, sizeof(payload), "%d", seq++);
+            payload[strlen(payload)] = ' ';
+            payload[PAYLOAD_SIZE] = '\0';
+            assert_int_equal(send_one(a, "bulk", payload), 0);
+        }
+        assert_int_equal(mosqagent_local_poll(b), per_round);
+    }
+    assert_int_equal(r.received, seq);
+    assert_true(r.in_order);
+    assert_int_equal(strlen(r.last_payload), PAYLOAD_SIZE);
+
+    // a full ring drops
+    const int too_many = MQTTA_LOCAL_RING_SIZE / PAYLOAD_SIZE + 10;
+    for (round = 0; round < too_many; round++)
+        assert_int_equal(send_one(a, "bulk", "0"), 0);
+    assert_true(mosqagent_local_dropped(b) == 0);
+    for (round = 0; round < too_many; round++) {
+        memset(payload, 'x', PAYLOAD_SIZE);
+        payload[PAYLOAD_SIZE] = '\0';
+        send_one(a, "bulk", payload);
+    }
+    assert_true(mosqagent_local_dropped(b) > 0);
+
+    // not with QoS 1
+    struct mqtta_message qos1 = {
+        .topic = "bulk",
+        .payload = payload,
+        .payloadlen = PAYLOAD_SIZE,
+        .qos = 1,
+    };
+    const uint64_t dropped = mosqagent_local_dropped(b);
+    assert_int_equal(mqtta_send_message(a, &qos1), -1);
+    assert_int_equal(errno, EAGAIN);
+    assert_true(mosqagent_local_dropped(b) == dropped + 1);
+
+    // again with space, the sender gets its local topics as well
+    mosqagent_local_poll(a);
+    mosqagent_local_poll(b);
+    assert_int_equal(mqtta_send_message(a, &qos1), 0);
+
+    mosqagent_close_agent(a);
+    mosqagent_close_agent(b);
+}
+
+static void busy_poll(void **state)
+{
+    const char *group = *state;
+    struct receiver r = { .in_order = true };
+
+    struct mosqagent *a = mosqagent_init_agent(NULL);
+    struct mosqagent *b = mosqagent_init_agent(NULL);
+    assert_non_null(a);
+    assert_non_null(b);
+
+    struct mqtta_loop_config loop = {
+        .mode = MQTTA_LOOP_BUSY_POLL,
+        .cpu = -1,
+        .fifo_priority = 100,
+    };
+    assert_int_equal(mosqagent_set_loop(b, &loop), -1);
+    assert_int_equal(errno, EINVAL);
+    loop.fifo_priority = 0;
+    assert_int_equal(mosqagent_set_loop(b, &loop), 0);
+
+    assert_int_equal(mosqagent_local_join(a, group, false), 0);
+    assert_int_equal(mosqagent_local_join(b, group, false), 0);
+    assert_int_equal(mosqagent_local_topic(a, "local/#"), 0);
+    assert_int_equal(mosqagent_local_topic(b, "local/#"), 0);
+    assert_int_equal(mosqagent_subscribe(b, "#", 0, receive_handler, &r), 0);
+
+    // an idle loop does not block
+    const time_t start = time(NULL);
+    int i;
+    for (i = 0; i < 1000; i++)
+        mosqagent_idle(b);
+    assert_true(time(NULL) - start < 2);
+
+    assert_int_equal(send_one(a, "local/a", "1"), 0);
+    mosqagent_idle(b);
+    assert_int_equal(r.received, 1);
+    assert_string_equal(r.last_payload, "1");
+
+    mosqagent_close_agent(a);
+    mosqagent_close_agent(b);
+}
+
+static void member_dies(void **state)
+{
+    const char *group = *state;
+    struct receiver r = { .in_order = true };
+
+    struct mosqagent *a = mosqagent_init_agent(NULL);
+    assert_non_null(a);
+    assert_int_equal(mosqagent_local_join(a, group, false), 0);
+    assert_int_equal(mosqagent_local_topic(a, "crash/#"), 0);
+    assert_int_equal(mosqagent_subscribe(a, "#", 0, receive_handler, &r), 0);
+
+    // Members that write large messages until they are killed, so they
+    // hold the lock of a ring most of the time. One of them at least
+    // dies with the lock.
+    static char large[200000];
+    memset(large, 'x', sizeof(large) - 1);
+
+    // a stuck lock ends the test
+    alarm(30);
+
+    int round;
+    for (round = 0; round < 8; round++) {
+        const pid_t child = fork();
+        assert_true(child >= 0);
+        if (!child) {
+            struct mosqagent *c = mosqagent_init_agent(NULL);
+            if (!c || mosqagent_local_join(c, group, false) ||
+                mosqagent_local_topic(c, "crash/#"))
+                _exit(1);
+            for (;;) {
+                send_one(c, "crash/c", large);
+                mosqagent_local_poll(c);
+            }
+        }
+
+        const int before = r.received;
+        while (r.received < before + 3)
+            mosqagent_local_poll(a);
+
+        kill(child, SIGKILL);
+        assert_int_equal(waitpid(child, NULL, 0), child);
+    }
+    mosqagent_local_poll(a);
+
+    // the others carry on, also with the rings of the dead member
+    assert_int_equal(send_one(a, "crash/a", "2"), 0);
+    assert_int_equal(mosqagent_local_poll(a), 1);
+    assert_string_equal(r.last_payload, "2");
+
+    struct mosqagent *b = mosqagent_init_agent(NULL);
+    assert_non_null(b);
+    assert_int_equal(mosqagent_local_join(b, group, false), 0);
+    assert_int_equal(mosqagent_local_topic(b, "crash/#"), 0);
+    alarm(0);
+
+    mosqagent_close_agent(a);
+    mosqagent_close_agent(b);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(round_trip, mqtta_test_setup_group, mqtta_test_teardown_group),
+        cmocka_unit_test_setup_teardown(ring_wraps, mqtta_test_setup_group, mqtta_test_teardown_group),
+        cmocka_unit_test_setup_teardown(busy_poll, mqtta_test_setup_group, mqtta_test_teardown_group),
+        cmocka_unit_test_setup_teardown(member_dies, mqtta_test_setup_group, mqtta_test_teardown_group),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
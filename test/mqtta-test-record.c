@@ -0,0 +1,167 @@
+/*******************************************************************//**
+ * \file		mqtta-test-record.c
+ *
+ * \brief		Unit tests for the traffic recorder.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-record.h>
+
+#include "mqtta-test-tmp.h"
+
+#define MESSAGES    (2 * MQTTA_RECORD_INDEX_INTERVAL + 100)
+
+static void round_trip(void **state)
+{
+    const char *path = *state;
+    char buf[32];
+    int i;
+
+    struct mqtta_recorder *rec = mqtta_recorder_open(path);
+    assert_non_null(rec);
+
+    for (i = 0; i < MESSAGES; i++) {
+        const int len = snprintf(buf, sizeof(buf), "%d", i);
+        assert_int_equal(mqtta_recorder_write(rec,
+                                              i % 2 ? MQTTA_RECORD_OUTBOUND
+                                                    : MQTTA_RECORD_INBOUND,
+                                              "test/topic", buf, len,
+                                              i % 3, i % 2), 0);
+    }
+    mqtta_recorder_close(rec);
+
+    // append to the existing log
+    rec = mqtta_recorder_open(path);
+    assert_non_null(rec);
+    assert_int_equal(mqtta_recorder_write(rec, MQTTA_RECORD_INBOUND,
+                                          "test/last", NULL, 0, 0, false), 0);
+    mqtta_recorder_close(rec);
+
+    struct mqtta_record_reader *reader = mqtta_record_reader_open(path);
+    assert_non_null(reader);
+    assert_int_equal(mqtta_record_reader_count(reader), MESSAGES + 1);
+
+    struct mqtta_record r;
+    uint64_t prev = 0;
+    for (i = 0; i < MESSAGES; i++) {
+        assert_int_equal(mqtta_record_reader_next(reader, &r), 1);
+        snprintf(buf, sizeof(buf), "%d", i);
+        assert_string_equal(r.topic, "test/topic");
+        assert_string_equal(r.payload, buf);
+        assert_int_equal(r.payloadlen, strlen(buf));
+        assert_int_equal(r.qos, i % 3);
+        assert_int_equal(r.retain, i % 2);
+        assert_int_equal(r.direction, i % 2 ? MQTTA_RECORD_OUTBOUND
+                                            : MQTTA_RECORD_INBOUND);
+        assert_true(r.timestamp_ns >= prev);
+        prev = r.timestamp_ns;
+    }
+
+    assert_int_equal(mqtta_record_reader_next(reader, &r), 1);
+    assert_string_equal(r.topic, "test/last");
+    assert_int_equal(r.payloadlen, 0);
+    const uint64_t last = r.timestamp_ns;
+
+    assert_int_equal(mqtta_record_reader_next(reader, &r), 0);
+
+    // seek through the index
+    assert_int_equal(mqtta_record_reader_seek(reader, last), 0);
+    assert_int_equal(mqtta_record_reader_next(reader, &r), 1);
+    assert_string_equal(r.topic, "test/last");
+
+    assert_int_equal(mqtta_record_reader_seek(reader, 0), 0);
+    assert_int_equal(mqtta_record_reader_next(reader, &r), 1);
+    assert_string_equal(r.payload, "0");
+
+    mqtta_record_reader_close(reader);
+}
+
+static void agent_records(void **state)
+{
+    const char *path = *state;
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_record(agent, path), 0);
+
+    mqtta_dispatch_message(agent, "in/a", "1", 1, 1, false);
+    mqtta_dispatch_message(agent, "in/b", "2", 1, 0, true);
+    mosqagent_close_agent(agent);
+
+    struct mqtta_record_reader *reader = mqtta_record_reader_open(path);
+    assert_non_null(reader);
+
+    struct mqtta_record r;
+    assert_int_equal(mqtta_record_reader_next(reader, &r), 1);
+    assert_string_equal(r.topic, "in/a");
+    assert_int_equal(r.direction, MQTTA_RECORD_INBOUND);
+    assert_int_equal(mqtta_record_reader_next(reader, &r), 1);
+    assert_string_equal(r.topic, "in/b");
+    assert_true(r.retain);
+    assert_int_equal(mqtta_record_reader_next(reader, &r), 0);
+
+    mqtta_record_reader_close(reader);
+}
+
+static void grow_fails(void **state)
+{
+    const char *path = *state;
+    static char large[1024 * 1024];
+    int i;
+
+    struct mqtta_recorder *rec = mqtta_recorder_open(path);
+    assert_non_null(rec);
+
+    // the file can not grow beyond the first map
+    struct rlimit old;
+    assert_int_equal(getrlimit(RLIMIT_FSIZE, &old), 0);
+    struct rlimit limit = { .rlim_cur = 4 * 1024 * 1024, .rlim_max = old.rlim_max };
+    signal(SIGXFSZ, SIG_IGN);
+    assert_int_equal(setrlimit(RLIMIT_FSIZE, &limit), 0);
+
+    for (i = 0; i < 8; i++)
+        if (mqtta_recorder_write(rec, MQTTA_RECORD_INBOUND, "test/large",
+                                 large, sizeof(large), 0, false))
+            break;
+    assert_true(i < 8);
+
+    // small messages still fit into the old map
+    assert_int_equal(mqtta_recorder_write(rec, MQTTA_RECORD_INBOUND,
+                                          "test/small", "1", 1, 0, false), 0);
+    mqtta_recorder_close(rec);
+
+    assert_int_equal(setrlimit(RLIMIT_FSIZE, &old), 0);
+    signal(SIGXFSZ, SIG_DFL);
+
+    struct mqtta_record_reader *reader = mqtta_record_reader_open(path);
+    assert_non_null(reader);
+    assert_int_equal(mqtta_record_reader_count(reader), i + 1);
+    mqtta_record_reader_close(reader);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(round_trip, mqtta_test_setup_file, mqtta_test_teardown_file),
+        cmocka_unit_test_setup_teardown(agent_records, mqtta_test_setup_file, mqtta_test_teardown_file),
+        cmocka_unit_test_setup_teardown(grow_fails, mqtta_test_setup_file, mqtta_test_teardown_file),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
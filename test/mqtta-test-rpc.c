@@ -0,0 +1,384 @@
+/*******************************************************************//**
+ * \file		mqtta-test-rpc.c
+ *
+ * \brief		Unit tests for request/response calls.
+ *
+ * The connect and publish calls of libmosquitto are wrapped (see
+ * test/CMakeLists.txt): requests are kept instead of sent, and the tests
+ * answer them through the agent's message callback.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mosquitto.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-rpc.h>
+
+#include "mqtta-test-tmp.h"
+
+#define IN_FLIGHT       1000
+#define CORRELATION_LEN 8
+
+typedef void (*message_callback)(struct mosquitto *, void *,
+                                 const struct mosquitto_message *,
+                                 const mosquitto_property *);
+
+static struct {
+    message_callback on_message;
+
+    char response_topic[128];
+    /** correlation data of the requests, in the order they were sent */
+    uint8_t correlation[IN_FLIGHT][CORRELATION_LEN];
+    int requests;
+} broker;
+
+int __wrap_mosquitto_connect_bind_v5(struct mosquitto *mosq,
+                                     const char *host,
+                                     int port,
+                                     int keepalive,
+                                     const char *bind_address,
+                                     const mosquitto_property *properties)
+{
+    (void) mosq;         /* unused */
+    (void) host;         /* unused */
+    (void) port;         /* unused */
+    (void) keepalive;    /* unused */
+    (void) bind_address; /* unused */
+    (void) properties;   /* unused */
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+void __wrap_mosquitto_message_v5_callback_set(struct mosquitto *mosq,
+                                              message_callback cb)
+{
+    (void) mosq; /* unused */
+
+    broker.on_message = cb;
+}
+
+int __wrap_mosquitto_publish_v5(struct mosquitto *mosq,
+                                int *mid,
+                                const char *topic,
+                                int payloadlen,
+                                const void *payload,
+                                int qos,
+                                bool retain,
+                                const mosquitto_property *properties)
+{
+    (void) mosq;       /* unused */
+    (void) topic;      /* unused */
+    (void) payloadlen; /* unused */
+    (void) payload;    /* unused */
+    (void) qos;        /* unused */
+    (void) retain;     /* unused */
+
+    char *response_topic = NULL;
+    void *correlation = NULL;
+    uint16_t len = 0;
+    mosquitto_property_read_string(properties, MQTT_PROP_RESPONSE_TOPIC,
+                                   &response_topic, false);
+    mosquitto_property_read_binary(properties, MQTT_PROP_CORRELATION_DATA,
+                                   &correlation, &len, false);
+    assert_non_null(response_topic);
+    assert_int_equal(len, CORRELATION_LEN);
+    assert_true(broker.requests < IN_FLIGHT);
+
+    snprintf(broker.response_topic, sizeof(broker.response_topic),
+             "%s", response_topic);
+    memcpy(broker.correlation[broker.requests++], correlation, len);
+    free(response_topic);
+    free(correlation);
+
+    if (mid)
+        *mid = broker.requests;
+    return MOSQ_ERR_SUCCESS;
+}
+
+struct response {
+    int calls;
+    int status;
+    char payload[16];
+};
+
+static void store_response(struct mosqagent *agent,
+                           int status,
+                           const struct mqtta_message *response,
+                           void *ctx)
+{
+    struct response *r = ctx;
+
+    (void) agent; /* unused */
+
+    r->calls++;
+    r->status = status;
+    if (response)
+        snprintf(r->payload, sizeof(r->payload), "%.*s",
+                 response->payloadlen, (const char*)response->payload);
+}
+
+static struct mosqagent_config config = {
+    .client_name = "rpc",
+    .host = "localhost",
+    .port = 1883,
+    .protocol_version = 5,
+};
+
+static struct mosqagent* setup_agent(void)
+{
+    memset(&broker, 0, sizeof(broker));
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    mqtta_set_configuration(agent, &config);
+    assert_int_equal(mosqagent_setup_mqtt(agent), 0);
+    assert_non_null(broker.on_message);
+
+    return agent;
+}
+
+/*
+ * Deliver a response as libmosquitto would.
+ */
+static void respond(struct mosqagent *agent,
+                    const void *correlation,
+                    const uint16_t len,
+                    const char *payload)
+{
+    mosquitto_property *props = NULL;
+    if (correlation)
+        assert_int_equal(mosquitto_property_add_binary(&props,
+                                                       MQTT_PROP_CORRELATION_DATA,
+                                                       correlation, len), 0);
+
+    const struct mosquitto_message msg = {
+        .topic = broker.response_topic,
+        .payload = (void*)payload,
+        .payloadlen = strlen(payload),
+        .qos = 1,
+    };
+    broker.on_message(agent->mosq, agent, &msg, props);
+
+    mosquitto_property_free_all(&props);
+}
+
+static void request_not_connected(void **state)
+{
+    struct response r = { 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mqtta_request(agent, "service/time", "now", 3, 1,
+                                   1000, store_response, &r), -1);
+    assert_int_equal(errno, ENOTCONN);
+
+    // a failed request is not pending and has no callback
+    assert_int_equal(mqtta_requests_pending(agent), 0);
+    mosqagent_close_agent(agent);
+    assert_int_equal(r.calls, 0);
+}
+
+static void request_invalid(void **state)
+{
+    struct response r = { 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mqtta_request(agent, "service/time", NULL, 0, 1,
+                                   0, store_response, &r), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mqtta_request(agent, "service/time", NULL, 0, 3,
+                                   1000, store_response, &r), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mqtta_request(agent, "service/time", NULL, 0, 1,
+                                   1000, NULL, NULL), -1);
+    assert_int_equal(errno, EINVAL);
+
+    mosqagent_close_agent(agent);
+}
+
+static void respond_without_response_topic(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    struct mqtta_message *msg;
+    msg = mqtta_create_message("service/time", "now", 1, false);
+    assert_non_null(msg);
+    assert_null(msg->properties);
+
+    assert_int_equal(mqtta_respond(agent, msg, "12:00", 5, 1), -1);
+    assert_int_equal(errno, EINVAL);
+
+    mqtta_dispose_message(msg);
+    mosqagent_close_agent(agent);
+}
+
+static void response_matches(void **state)
+{
+    struct response a = { 0 };
+    struct response b = { 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = setup_agent();
+
+    assert_int_equal(mqtta_request(agent, "service/a", "a", 1, 1,
+                                   10000, store_response, &a), 0);
+    assert_int_equal(mqtta_request(agent, "service/b", "b", 1, 1,
+                                   10000, store_response, &b), 0);
+    assert_int_equal(mqtta_requests_pending(agent), 2);
+    assert_int_equal(broker.requests, 2);
+
+    // in the other order
+    respond(agent, broker.correlation[1], CORRELATION_LEN, "for b");
+    assert_int_equal(b.calls, 1);
+    assert_int_equal(b.status, 0);
+    assert_string_equal(b.payload, "for b");
+    assert_int_equal(a.calls, 0);
+
+    respond(agent, broker.correlation[0], CORRELATION_LEN, "for a");
+    assert_int_equal(a.calls, 1);
+    assert_string_equal(a.payload, "for a");
+    assert_int_equal(mqtta_requests_pending(agent), 0);
+
+    // a second response for the same id is dropped
+    respond(agent, broker.correlation[0], CORRELATION_LEN, "again");
+    assert_int_equal(a.calls, 1);
+
+    mosqagent_close_agent(agent);
+}
+
+static void foreign_responses(void **state)
+{
+    struct response r = { 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = setup_agent();
+
+    assert_int_equal(mqtta_request(agent, "service/a", "a", 1, 1,
+                                   10000, store_response, &r), 0);
+
+    // without, with short, long or unknown correlation data
+    uint8_t forged[CORRELATION_LEN + 1];
+    memcpy(forged, broker.correlation[0], CORRELATION_LEN);
+    forged[CORRELATION_LEN] = 0;
+    respond(agent, NULL, 0, "none");
+    respond(agent, forged, 4, "short");
+    respond(agent, forged, CORRELATION_LEN + 1, "long");
+    forged[CORRELATION_LEN - 1] ^= 0x80;
+    respond(agent, forged, CORRELATION_LEN, "unknown");
+
+    assert_int_equal(r.calls, 0);
+    assert_int_equal(mqtta_requests_pending(agent), 1);
+
+    // the request is still served, and cancelled on close
+    mosqagent_close_agent(agent);
+    assert_int_equal(r.calls, 1);
+    assert_int_equal(r.status, ECANCELED);
+}
+
+static void timeout(void **state)
+{
+    struct response early = { 0 };
+    struct response late = { 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = setup_agent();
+
+    assert_int_equal(mqtta_request(agent, "service/a", "a", 1, 1,
+                                   10, store_response, &early), 0);
+    assert_int_equal(mqtta_request(agent, "service/b", "b", 1, 1,
+                                   10000, store_response, &late), 0);
+
+    mqtta_test_sleep_ms(50);
+    mosqagent_run_timers(agent);
+    assert_int_equal(early.calls, 1);
+    assert_int_equal(early.status, ETIMEDOUT);
+    assert_int_equal(late.calls, 0);
+    assert_int_equal(mqtta_requests_pending(agent), 1);
+
+    // the response after the timeout is dropped
+    respond(agent, broker.correlation[0], CORRELATION_LEN, "too late");
+    assert_int_equal(early.calls, 1);
+
+    respond(agent, broker.correlation[1], CORRELATION_LEN, "in time");
+    assert_int_equal(late.calls, 1);
+    assert_int_equal(late.status, 0);
+
+    mosqagent_close_agent(agent);
+}
+
+static void many_in_flight(void **state)
+{
+    static struct response r[IN_FLIGHT];
+    char expected[16];
+    int i;
+
+    (void) state; /* unused */
+
+    memset(r, 0, sizeof(r));
+    struct mosqagent *agent = setup_agent();
+
+    // far more than the initial table, which has to grow several times
+    for (i = 0; i < IN_FLIGHT; i++)
+        assert_int_equal(mqtta_request(agent, "service/a", "a", 1, 1,
+                                       10000, store_response, &r[i]), 0);
+    assert_int_equal(mqtta_requests_pending(agent), IN_FLIGHT);
+
+    // every other one first, then the rest backwards
+    for (i = 0; i < IN_FLIGHT; i += 2) {
+        snprintf(expected, sizeof(expected), "%d", i);
+        respond(agent, broker.correlation[i], CORRELATION_LEN, expected);
+    }
+    for (i = IN_FLIGHT - 1; i > 0; i -= 2) {
+        snprintf(expected, sizeof(expected), "%d", i);
+        respond(agent, broker.correlation[i], CORRELATION_LEN, expected);
+    }
+    assert_int_equal(mqtta_requests_pending(agent), 0);
+
+    for (i = 0; i < IN_FLIGHT; i++) {
+        snprintf(expected, sizeof(expected), "%d", i);
+        assert_int_equal(r[i].calls, 1);
+        assert_string_equal(r[i].payload, expected);
+    }
+
+    mosqagent_close_agent(agent);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(request_not_connected),
+        cmocka_unit_test(request_invalid),
+        cmocka_unit_test(respond_without_response_topic),
+        cmocka_unit_test(response_matches),
+        cmocka_unit_test(foreign_responses),
+        cmocka_unit_test(timeout),
+        cmocka_unit_test(many_in_flight),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
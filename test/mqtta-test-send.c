@@ -0,0 +1,377 @@
+/*******************************************************************//**
+ * \file		mqtta-test-send.c
+ *
+ * \brief		Unit tests for the outgoing message path.
+ *
+ * The agents are not connected, so a message that passes all send limits
+ * fails with `ENOTCONN`, while limited messages are queued or dropped.
+ * With priority lanes, messages wait in their lane for the connection.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <mqtt-tools/mqtta.h>
+
+#include "mqtta-test-tmp.h"
+
+static int send_one(struct mosqagent *agent, const char *topic)
+{
+    struct mqtta_message msg = {
+        .topic = (char*)topic,
+        .payload = "1",
+        .payloadlen = 1,
+    };
+
+    errno = 0;
+    return mqtta_send_message(agent, &msg);
+}
+
+static void rate_drop(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_add_rate_limit(agent, "limited/#", 1.0, 2,
+                                              MQTTA_RATE_DROP), 0);
+
+    // burst passes the limit
+    assert_int_equal(send_one(agent, "limited/a"), -1);
+    assert_int_equal(errno, ENOTCONN);
+    assert_int_equal(send_one(agent, "limited/a"), -1);
+    assert_int_equal(errno, ENOTCONN);
+
+    // bucket is empty
+    assert_int_equal(send_one(agent, "limited/a"), -1);
+    assert_int_equal(errno, EAGAIN);
+    // shared by all topics of the rule
+    assert_int_equal(send_one(agent, "limited/b"), -1);
+    assert_int_equal(errno, EAGAIN);
+
+    // other topics are not limited
+    assert_int_equal(send_one(agent, "free"), -1);
+    assert_int_equal(errno, ENOTCONN);
+
+    assert_int_equal(mosqagent_rate_limited_pending(agent), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+static void rate_delay_and_coalesce(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_add_rate_limit(agent, "delay/#", 100.0, 1,
+                                              MQTTA_RATE_DELAY), 0);
+    assert_int_equal(mosqagent_add_rate_limit(agent, "latest/#", 100.0, 1,
+                                              MQTTA_RATE_COALESCE), 0);
+
+    assert_int_equal(send_one(agent, "delay/a"), -1);
+    assert_int_equal(send_one(agent, "delay/a"), 0);
+    assert_int_equal(send_one(agent, "delay/a"), 0);
+
+    assert_int_equal(send_one(agent, "latest/a"), -1);
+    assert_int_equal(send_one(agent, "latest/a"), 0);
+    assert_int_equal(send_one(agent, "latest/a"), 0);
+
+    assert_int_equal(mosqagent_rate_limited_pending(agent), 3);
+
+    // the agent's timers send one message per topic every 10 ms
+    mqtta_test_sleep_ms(15);
+    mosqagent_run_timers(agent);
+    assert_int_equal(mosqagent_rate_limited_pending(agent), 1);
+    mqtta_test_sleep_ms(15);
+    mosqagent_run_timers(agent);
+    assert_int_equal(mosqagent_rate_limited_pending(agent), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+static void rate_agent_wide(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_add_rate_limit(agent, NULL, 1.0, 1,
+                                              MQTTA_RATE_DROP), 0);
+
+    assert_int_equal(send_one(agent, "a"), -1);
+    assert_int_equal(errno, ENOTCONN);
+    assert_int_equal(send_one(agent, "b"), -1);
+    assert_int_equal(errno, EAGAIN);
+
+    assert_int_equal(mosqagent_add_rate_limit(agent, NULL, 0.0, 1,
+                                              MQTTA_RATE_DROP), -1);
+    assert_int_equal(errno, EINVAL);
+
+    mosqagent_close_agent(agent);
+}
+
+static void rate_many_topics(void **state)
+{
+    char topic[32];
+    int i;
+
+    (void) state; /* unused */
+
+    struct mqtta_accounting acc;
+    mqtta_accounting_init(&acc, NULL, 0);
+
+    struct mosqagent *agent = mosqagent_init_agent_with(NULL, &acc.allocator);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_add_rate_limit(agent, "limited/#", 1e9, 1000000,
+                                              MQTTA_RATE_DROP), 0);
+    assert_int_equal(send_one(agent, "limited/0"), -1);
+    const size_t before = acc.live;
+
+    // topics come and go, the limiter only keeps the active ones
+    for (i = 0; i < 10000; i++) {
+        snprintf(topic, sizeof(topic), "limited/%d", i);
+        assert_int_equal(send_one(agent, topic), -1);
+        assert_int_equal(errno, ENOTCONN);
+        snprintf(topic, sizeof(topic), "free/%d", i);
+        assert_int_equal(send_one(agent, topic), -1);
+        assert_int_equal(errno, ENOTCONN);
+    }
+    assert_true(acc.live < before + 16 * 1024);
+
+    // rules can be added later on, also for known topics
+    assert_int_equal(mosqagent_add_rate_limit(agent, "free/#", 1.0, 1,
+                                              MQTTA_RATE_DROP), 0);
+    assert_int_equal(send_one(agent, "free/1"), -1);
+    assert_int_equal(errno, ENOTCONN);
+    assert_int_equal(send_one(agent, "free/2"), -1);
+    assert_int_equal(errno, EAGAIN);
+
+    mosqagent_close_agent(agent);
+    assert_int_equal(acc.live, 0);
+}
+
+static int send_priority(struct mosqagent *agent,
+                         const char *topic,
+                         const enum mqtta_priority priority)
+{
+    struct mqtta_message msg = {
+        .topic = (char*)topic,
+        .payload = "1",
+        .payloadlen = 1,
+        .priority = priority,
+    };
+
+    errno = 0;
+    return mqtta_send_message(agent, &msg);
+}
+
+static void lanes_by_priority(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_add_priority(agent, "alarm/#",
+                                            MQTTA_PRIORITY_CRITICAL), 0);
+
+    assert_int_equal(send_one(agent, "alarm/door"), 0);
+    assert_int_equal(send_one(agent, "telemetry/temp"), 0);
+    assert_int_equal(send_priority(agent, "alarm/test",
+                                   MQTTA_PRIORITY_LOW), 0);
+
+    struct mqtta_lane_stats stats;
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_CRITICAL,
+                                          &stats), 0);
+    assert_int_equal(stats.queued, 1);
+    assert_true(stats.bytes > 0);
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_NORMAL,
+                                          &stats), 0);
+    assert_int_equal(stats.queued, 1);
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_LOW,
+                                          &stats), 0);
+    assert_int_equal(stats.queued, 1);
+
+    // nothing is sent without a connection
+    assert_int_equal(mosqagent_flush_lanes(agent), 0);
+
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_DEFAULT,
+                                          &stats), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mosqagent_add_priority(agent, "alarm/#",
+                                            MQTTA_PRIORITY_DEFAULT), -1);
+    assert_int_equal(errno, EINVAL);
+
+    mosqagent_close_agent(agent);
+}
+
+static void lane_budgets(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_set_lane(agent, MQTTA_PRIORITY_LOW,
+                                        1024, true), 0);
+    assert_int_equal(mosqagent_set_lane(agent, MQTTA_PRIORITY_NORMAL,
+                                        1024, false), 0);
+
+    struct mqtta_lane_stats stats;
+    int i;
+
+    // drop oldest: the lane stays full
+    for (i = 0; i < 100; i++)
+        assert_int_equal(send_priority(agent, "bulk", MQTTA_PRIORITY_LOW), 0);
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_LOW,
+                                          &stats), 0);
+    assert_true(stats.bytes <= 1024);
+    assert_true(stats.queued > 0);
+    assert_int_equal(stats.queued + stats.dropped, 100);
+
+    // drop newest: sending fails once the lane is full
+    for (i = 0; i < 100; i++)
+        if (send_one(agent, "normal"))
+            break;
+    assert_true(i < 100);
+    assert_int_equal(errno, EAGAIN);
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_NORMAL,
+                                          &stats), 0);
+    assert_int_equal(stats.queued, i);
+    assert_int_equal(stats.dropped, 1);
+
+    // other lanes are not affected
+    assert_int_equal(send_priority(agent, "alarm", MQTTA_PRIORITY_HIGH), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+static void lane_expiry(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_add_expiry(agent, "sensor/#", 20, true), 0);
+
+    int i;
+    for (i = 0; i < 5; i++)
+        assert_int_equal(send_one(agent, "sensor/a"), 0);
+    assert_int_equal(send_one(agent, "sensor/b"), 0);
+
+    struct mqtta_message msg = {
+        .topic = "other",
+        .payload = "1",
+        .payloadlen = 1,
+        .ttl_ms = 10,
+    };
+    assert_int_equal(mqtta_send_message(agent, &msg), 0);
+
+    // latest only: one message per sensor topic
+    struct mqtta_lane_stats stats;
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_NORMAL,
+                                          &stats), 0);
+    assert_int_equal(stats.queued, 3);
+    assert_int_equal(stats.replaced, 4);
+
+    // expired messages make room for new ones
+    mqtta_test_sleep_ms(30);
+    assert_int_equal(send_one(agent, "fresh"), 0);
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_NORMAL,
+                                          &stats), 0);
+    assert_int_equal(stats.queued, 1);
+    assert_int_equal(stats.expired, 3);
+
+    mosqagent_close_agent(agent);
+}
+
+static void message_expiry(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    // without any lanes set up, the message waits in the agent
+    struct mqtta_message msg = {
+        .topic = "status",
+        .payload = "1",
+        .payloadlen = 1,
+        .ttl_ms = 10,
+    };
+    assert_int_equal(mqtta_send_message(agent, &msg), 0);
+
+    struct mqtta_lane_stats stats;
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_NORMAL,
+                                          &stats), 0);
+    assert_int_equal(stats.queued, 1);
+
+    // and is dropped locally once its time has passed
+    mqtta_test_sleep_ms(20);
+    assert_int_equal(send_one(agent, "fresh"), 0);
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_NORMAL,
+                                          &stats), 0);
+    assert_int_equal(stats.queued, 1);
+    assert_int_equal(stats.expired, 1);
+
+    mosqagent_close_agent(agent);
+}
+
+static void latest_by_topic(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mosqagent_add_expiry(agent, "sensor/#", 0, true), 0);
+
+    // enough topics to grow the index, each sent a few times
+    char topic[32];
+    int round;
+    int i;
+    for (round = 0; round < 3; round++)
+        for (i = 0; i < 100; i++) {
+            snprintf(topic, sizeof(topic), "sensor/%d", i);
+            assert_int_equal(send_one(agent, topic), 0);
+        }
+
+    struct mqtta_lane_stats stats;
+    assert_int_equal(mosqagent_lane_stats(agent, MQTTA_PRIORITY_NORMAL,
+                                          &stats), 0);
+    assert_int_equal(stats.queued, 100);
+    assert_int_equal(stats.replaced, 200);
+
+    mosqagent_close_agent(agent);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(rate_drop),
+        cmocka_unit_test(rate_delay_and_coalesce),
+        cmocka_unit_test(rate_agent_wide),
+        cmocka_unit_test(rate_many_topics),
+        cmocka_unit_test(lanes_by_priority),
+        cmocka_unit_test(lane_budgets),
+        cmocka_unit_test(lane_expiry),
+        cmocka_unit_test(message_expiry),
+        cmocka_unit_test(latest_by_topic),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
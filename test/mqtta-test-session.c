@@ -0,0 +1,230 @@
+/*******************************************************************//**
+ * \file		mqtta-test-session.c
+ *
+ * \brief		Unit tests for the persistent session with the broker.
+ *
+ * The connect and subscribe calls of libmosquitto are wrapped (see
+ * test/CMakeLists.txt), and the tests call the agent's callbacks as the
+ * client would after the broker's acknowledgements.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <mosquitto.h>
+
+#include <mqtt-tools/mqtta.h>
+
+typedef void (*connect_callback)(struct mosquitto *, void *, int, int);
+typedef void (*subscribe_callback)(struct mosquitto *, void *,
+                                   int, int, const int *);
+typedef void (*disconnect_callback)(struct mosquitto *, void *, int);
+
+static struct {
+    connect_callback on_connect;
+    subscribe_callback on_subscribe;
+    disconnect_callback on_disconnect;
+
+    int connects;
+    /** session expiry of the last CONNECT, -1 without the property */
+    int64_t session_expiry;
+
+    int subscribes;
+    int mid;
+} broker;
+
+int __wrap_mosquitto_connect_bind_v5(struct mosquitto *mosq,
+                                     const char *host,
+                                     int port,
+                                     int keepalive,
+                                     const char *bind_address,
+                                     const mosquitto_property *properties)
+{
+    (void) mosq;         /* unused */
+    (void) host;         /* unused */
+    (void) port;         /* unused */
+    (void) keepalive;    /* unused */
+    (void) bind_address; /* unused */
+
+    uint32_t expiry;
+    broker.session_expiry = -1;
+    if (mosquitto_property_read_int32(properties,
+                                      MQTT_PROP_SESSION_EXPIRY_INTERVAL,
+                                      &expiry, false))
+        broker.session_expiry = expiry;
+
+    broker.connects++;
+    return MOSQ_ERR_SUCCESS;
+}
+
+int __wrap_mosquitto_subscribe_multiple(struct mosquitto *mosq,
+                                        int *mid,
+                                        int sub_count,
+                                        char *const *const sub,
+                                        int qos,
+                                        int options,
+                                        const mosquitto_property *properties)
+{
+    (void) mosq;       /* unused */
+    (void) sub_count;  /* unused */
+    (void) sub;        /* unused */
+    (void) qos;        /* unused */
+    (void) options;    /* unused */
+    (void) properties; /* unused */
+
+    broker.subscribes++;
+    *mid = ++broker.mid;
+    return MOSQ_ERR_SUCCESS;
+}
+
+void __wrap_mosquitto_connect_with_flags_callback_set(struct mosquitto *mosq,
+                                                      connect_callback cb)
+{
+    (void) mosq; /* unused */
+
+    broker.on_connect = cb;
+}
+
+void __wrap_mosquitto_subscribe_callback_set(struct mosquitto *mosq,
+                                             subscribe_callback cb)
+{
+    (void) mosq; /* unused */
+
+    broker.on_subscribe = cb;
+}
+
+void __wrap_mosquitto_disconnect_callback_set(struct mosquitto *mosq,
+                                              disconnect_callback cb)
+{
+    (void) mosq; /* unused */
+
+    broker.on_disconnect = cb;
+}
+
+static void ignore_handler(struct mosqagent *agent,
+                           const struct mqtta_message *msg,
+                           void *handler_data)
+{
+    (void) agent;        /* unused */
+    (void) msg;          /* unused */
+    (void) handler_data; /* unused */
+}
+
+static struct mosqagent* setup_agent(struct mosqagent_config *config)
+{
+    memset(&broker, 0, sizeof(broker));
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    mqtta_set_configuration(agent, config);
+
+    assert_int_equal(mosqagent_subscribe(agent, "a/#", 0,
+                                         ignore_handler, NULL), 0);
+    assert_int_equal(mosqagent_subscribe(agent, "b/#", 1,
+                                         ignore_handler, NULL), 0);
+
+    assert_int_equal(mosqagent_setup_mqtt(agent), 0);
+    assert_int_equal(broker.connects, 1);
+    assert_non_null(broker.on_connect);
+    assert_non_null(broker.on_subscribe);
+    assert_non_null(broker.on_disconnect);
+
+    return agent;
+}
+
+static void session_expiry(void **state)
+{
+    struct mosqagent_config config = {
+        .client_name = "session",
+        .host = "localhost",
+        .port = 1883,
+        .protocol_version = 5,
+    };
+
+    (void) state; /* unused */
+
+    // by default the session does not expire
+    struct mosqagent *agent = setup_agent(&config);
+    assert_true(broker.session_expiry == MQTTA_SESSION_EXPIRY_NEVER);
+    mosqagent_close_agent(agent);
+
+    config.session_expiry = 3600;
+    agent = setup_agent(&config);
+    assert_true(broker.session_expiry == 3600);
+    mosqagent_close_agent(agent);
+
+    // MQTT 3.1.1 has no properties, the session is persistent anyway
+    config.protocol_version = 4;
+    agent = setup_agent(&config);
+    assert_true(broker.session_expiry == -1);
+    mosqagent_close_agent(agent);
+}
+
+static void resumed_session(void **state)
+{
+    struct mosqagent_config config = {
+        .client_name = "session",
+        .host = "localhost",
+        .port = 1883,
+        .protocol_version = 5,
+    };
+    struct mqtta_connection_stats stats;
+    const int granted[] = { 1 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = setup_agent(&config);
+    struct mosquitto *mosq = agent->mosq;
+
+    // a new session: one SUBSCRIBE per QoS level
+    broker.on_connect(mosq, agent, 0, 0);
+    assert_int_equal(broker.subscribes, 2);
+    assert_int_equal(mosqagent_connection_stats(agent, &stats), 0);
+    assert_int_equal(stats.connects, 1);
+    assert_int_equal(stats.resumed, 0);
+    assert_false(stats.ready);
+
+    broker.on_subscribe(mosq, agent, 1, 1, granted);
+    broker.on_subscribe(mosq, agent, 2, 1, granted);
+    assert_int_equal(mosqagent_connection_stats(agent, &stats), 0);
+    assert_true(stats.ready);
+
+    // the broker resumed the session and has the subscriptions
+    broker.on_disconnect(mosq, agent, 1);
+    broker.on_connect(mosq, agent, 0, 1);
+    assert_int_equal(broker.subscribes, 2);
+    assert_int_equal(mosqagent_connection_stats(agent, &stats), 0);
+    assert_int_equal(stats.connects, 2);
+    assert_int_equal(stats.resumed, 1);
+    assert_int_equal(stats.subscribe_packets, 2);
+    assert_true(stats.ready);
+
+    // the session expired, restore
+    broker.on_disconnect(mosq, agent, 1);
+    broker.on_connect(mosq, agent, 0, 0);
+    assert_int_equal(broker.subscribes, 4);
+    assert_int_equal(mosqagent_connection_stats(agent, &stats), 0);
+    assert_int_equal(stats.resumed, 1);
+    assert_false(stats.ready);
+
+    mosqagent_close_agent(agent);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(session_expiry),
+        cmocka_unit_test(resumed_session),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,287 @@
+/*******************************************************************//**
+ * \file		mqtta-test-shared.c
+ *
+ * \brief		Unit tests for (shared) subscriptions and message delivery.
+ *
+ * A small broker stand-in delivers each published message to every plain
+ * subscriber and to one member of the consumer group. Which member that is
+ * is the broker's business; the tests check what the agents subscribe and
+ * that each member handles exactly what it was given. Each group member is
+ * a separate agent, as it would be a separate process in production.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mqtt-tools/mqtta.h>
+
+#include "mqtta-test-tmp.h"
+
+#define WORKERS     3
+#define MESSAGES    300
+
+struct counter {
+    int received;
+    char last_topic[64];
+};
+
+static void count_handler(struct mosqagent *agent,
+                          const struct mqtta_message *msg,
+                          void *handler_data)
+{
+    struct counter *c = handler_data;
+
+    (void) agent; /* unused */
+
+    c->received++;
+    snprintf(c->last_topic, sizeof(c->last_topic), "%s", msg->topic);
+}
+
+/*
+ * Broker stand-in: one plain subscriber and one consumer group.
+ */
+struct broker {
+    struct mosqagent *observer;
+    struct mosqagent *group[WORKERS];
+    int delivered[WORKERS];
+};
+
+static void broker_publish(struct broker *b,
+                           const int member,
+                           const char *topic,
+                           const char *payload)
+{
+    const int len = strlen(payload);
+
+    assert_int_equal(mqtta_dispatch_message(b->observer, topic, payload, len,
+                                            1, false), 1);
+
+    // a shared subscription is served by exactly one group member
+    assert_int_equal(mqtta_dispatch_message(b->group[member], topic, payload,
+                                            len, 1, false), 1);
+    b->delivered[member]++;
+}
+
+static int setup_config(void **state)
+{
+    if (mqtta_test_setup_file(state))
+        return -1;
+
+    FILE *f = fopen(*state, "w");
+    if (!f) {
+        mqtta_test_teardown_file(state);
+        return -1;
+    }
+    fprintf(f, "mosqagent = {\n"
+               "    name = \"worker\";\n"
+               "    share_group = \"workers\";\n"
+               "};\n");
+    fclose(f);
+
+    return 0;
+}
+
+static void group_shares_load(void **state)
+{
+    const char *config = *state;
+    struct broker b;
+    struct counter observed = { 0 };
+    struct counter worked[WORKERS];
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    memset(worked, 0, sizeof(worked));
+
+    b.observer = mosqagent_init_agent(NULL);
+    assert_non_null(b.observer);
+    assert_int_equal(mosqagent_subscribe(b.observer, "sensors/#", 1,
+                                         count_handler, &observed), 0);
+    assert_string_equal(mosqagent_subscription(b.observer, 0), "sensors/#");
+
+    for (i = 0; i < WORKERS; i++) {
+        b.group[i] = mosqagent_init_agent(NULL);
+        assert_non_null(b.group[i]);
+
+        // membership comes from the configuration
+        assert_int_equal(mqtta_load_configuration(b.group[i], config), 0);
+        assert_int_equal(mosqagent_subscribe_shared(b.group[i], NULL,
+                                                    "sensors/+/raw", 1,
+                                                    count_handler,
+                                                    &worked[i]), 0);
+
+        // the broker is subscribed with the share prefix
+        assert_string_equal(mosqagent_subscription(b.group[i], 0),
+                            "$share/workers/sensors/+/raw");
+        errno = 0;
+        assert_null(mosqagent_subscription(b.group[i], 1));
+        assert_int_equal(errno, ENOENT);
+    }
+
+    // an uneven split, as a broker may choose any member
+    for (i = 0; i < MESSAGES; i++) {
+        char topic[32];
+        snprintf(topic, sizeof(topic), "sensors/%d/raw", i % 7);
+        broker_publish(&b, (i % 7) % WORKERS, topic, "42");
+    }
+
+    // the plain subscriber sees everything
+    assert_int_equal(observed.received, MESSAGES);
+
+    // each member handles what it was given and nothing else
+    int total = 0;
+    for (i = 0; i < WORKERS; i++) {
+        assert_int_equal(worked[i].received, b.delivered[i]);
+        total += worked[i].received;
+    }
+    assert_int_equal(total, MESSAGES);
+    assert_int_equal(mqtta_dispatch_message(b.group[0], "sensors/1/cooked",
+                                            "42", 2, 1, false), 0);
+    assert_int_equal(worked[0].received, b.delivered[0]);
+
+    // handlers get the original topic, not the share prefix
+    assert_string_equal(worked[(MESSAGES - 1) % 7 % WORKERS].last_topic,
+                        "sensors/5/raw");
+
+    mosqagent_close_agent(b.observer);
+    for (i = 0; i < WORKERS; i++)
+        mosqagent_close_agent(b.group[i]);
+}
+
+static void filter_is_matched(void **state)
+{
+    struct counter c = { 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_subscribe_shared(agent, "g", "a/+/c", 0,
+                                                count_handler, &c), 0);
+
+    assert_int_equal(mqtta_dispatch_message(agent, "a/b/c", "x", 1, 0, false), 1);
+    assert_int_equal(mqtta_dispatch_message(agent, "a/b/d", "x", 1, 0, false), 0);
+    assert_int_equal(mqtta_dispatch_message(agent, "$share/g/a/b/c", "x", 1, 0, false), 0);
+    // empty payloads are valid on receive
+    assert_int_equal(mqtta_dispatch_message(agent, "a/z/c", NULL, 0, 0, false), 1);
+    assert_int_equal(c.received, 2);
+
+    mosqagent_close_agent(agent);
+}
+
+static void group_is_required(void **state)
+{
+    struct counter c = { 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    // no configuration, so no default group
+    errno = 0;
+    assert_int_equal(mosqagent_subscribe_shared(agent, NULL, "a/#", 0,
+                                                count_handler, &c), -1);
+    assert_int_equal(errno, EINVAL);
+
+    // share names are a single topic level
+    assert_int_equal(mosqagent_subscribe_shared(agent, "a/b", "a/#", 0,
+                                                count_handler, &c), -1);
+    assert_int_equal(mosqagent_subscribe_shared(agent, "+", "a/#", 0,
+                                                count_handler, &c), -1);
+
+    // configured group is used as a fallback
+    struct mosqagent_config config = {
+        .client_name = "test",
+        .share_group = "configured",
+    };
+    mqtta_set_configuration(agent, &config);
+    assert_int_equal(mosqagent_subscribe_shared(agent, NULL, "a/#", 0,
+                                                count_handler, &c), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+struct keeper {
+    const char *seen_payload;
+    struct mqtta_memory_object kept;
+};
+
+static void keep_handler(struct mosqagent *agent,
+                         const struct mqtta_message *msg,
+                         void *handler_data)
+{
+    struct keeper *k = handler_data;
+
+    (void) agent; /* unused */
+
+    k->seen_payload = msg->payload;
+    assert_int_equal(mqtta_message_retain(msg, &k->kept), 0);
+}
+
+static void fan_out_is_shared(void **state)
+{
+    struct keeper k[2];
+    char payload[] = "shared";
+
+    (void) state; /* unused */
+
+    memset(k, 0, sizeof(k));
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_subscribe(agent, "fan/#", 0,
+                                         keep_handler, &k[0]), 0);
+    assert_int_equal(mosqagent_subscribe(agent, "fan/out", 0,
+                                         keep_handler, &k[1]), 0);
+
+    assert_int_equal(mqtta_dispatch_message(agent, "fan/out", payload,
+                                            strlen(payload), 1, false), 2);
+
+    // handlers see the receive buffer itself
+    assert_ptr_equal(k[0].seen_payload, payload);
+    assert_ptr_equal(k[1].seen_payload, payload);
+
+    // both keep the same copy, which outlives the buffer
+    const struct mqtta_message *kept = mqtta_mo_ptr(&k[0].kept);
+    assert_non_null(kept);
+    assert_ptr_equal(kept, mqtta_mo_ptr(&k[1].kept));
+    memset(payload, 'x', strlen(payload));
+    assert_string_equal(kept->topic, "fan/out");
+    assert_string_equal(kept->payload, "shared");
+    assert_int_equal(kept->qos, 1);
+
+    // a retained message can be retained again
+    struct mqtta_memory_object again;
+    assert_int_equal(mqtta_message_retain(kept, &again), 0);
+    assert_ptr_equal(mqtta_mo_ptr(&again), kept);
+
+    mqtta_mo_free(&k[0].kept);
+    mqtta_mo_free(&again);
+    assert_string_equal(kept->payload, "shared");
+    mqtta_mo_free(&k[1].kept);
+
+    mosqagent_close_agent(agent);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(group_shares_load,
+                                        setup_config, mqtta_test_teardown_file),
+        cmocka_unit_test(filter_is_matched),
+        cmocka_unit_test(group_is_required),
+        cmocka_unit_test(fan_out_is_shared),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,455 @@
+/*******************************************************************//**
+ * \file		mqtta-test-stream.c
+ *
+ * \brief		Unit tests for chunked streams and their reassembly.
+ *
+ * Sender and receiver are members of a local group, so the chunks go
+ * through the shared-memory transport instead of a broker.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-local.h>
+#include <mqtt-tools/mqtta-stream.h>
+
+#include "mqtta-test-tmp.h"
+
+#define OBJECT_SIZE     300001
+#define MAX_CHUNKS      8
+
+struct sender {
+    int done;
+    int status;
+    uint64_t id;
+
+    const uint8_t *data;
+    size_t produced;
+    int calls;
+};
+
+struct receiver {
+    struct mqtta_reassembly *r;
+    int fed;
+    int complete;
+    int errors;
+
+    // raw chunks for the error tests
+    int count;
+    uint8_t chunk[MAX_CHUNKS][MQTTA_STREAM_HEADER_SIZE + 16];
+    size_t len[MAX_CHUNKS];
+};
+
+static void done(struct mosqagent *agent,
+                 uint64_t id,
+                 int status,
+                 void *ctx)
+{
+    struct sender *s = ctx;
+
+    (void) agent; /* unused */
+
+    s->done++;
+    s->status = status;
+    s->id = id;
+}
+
+/*
+ * Hands out the object in odd pieces, with a pause now and then.
+ */
+static ssize_t produce(struct mosqagent *agent,
+                       void *buf,
+                       size_t len,
+                       void *ctx)
+{
+    struct sender *s = ctx;
+
+    (void) agent; /* unused */
+
+    if (++s->calls % 5 == 0)
+        return 0;
+
+    const size_t n = len < 333 ? len : 333;
+    memcpy(buf, s->data + s->produced, n);
+    s->produced += n;
+
+    return n;
+}
+
+static ssize_t never(struct mosqagent *agent,
+                     void *buf,
+                     size_t len,
+                     void *ctx)
+{
+    (void) agent; /* unused */
+    (void) buf;   /* unused */
+    (void) len;   /* unused */
+    (void) ctx;   /* unused */
+
+    return 0;
+}
+
+static void reassemble(struct mosqagent *agent,
+                       const struct mqtta_message *msg,
+                       void *handler_data)
+{
+    struct receiver *rc = handler_data;
+
+    (void) agent; /* unused */
+
+    const int ret = mqtta_reassembly_feed(rc->r, msg->payload,
+                                          msg->payloadlen);
+    rc->fed++;
+    if (ret > 0)
+        rc->complete++;
+    if (ret < 0)
+        rc->errors++;
+}
+
+static void capture(struct mosqagent *agent,
+                    const struct mqtta_message *msg,
+                    void *handler_data)
+{
+    struct receiver *rc = handler_data;
+
+    (void) agent; /* unused */
+
+    if ((rc->count < MAX_CHUNKS) &&
+        ((size_t)msg->payloadlen <= sizeof(rc->chunk[0]))) {
+        memcpy(rc->chunk[rc->count], msg->payload, msg->payloadlen);
+        rc->len[rc->count++] = msg->payloadlen;
+    }
+}
+
+static uint8_t* test_object(void)
+{
+    uint8_t *data = malloc(OBJECT_SIZE);
+    assert_non_null(data);
+
+    uint32_t x = 2463534242u;
+    size_t i;
+    for (i = 0; i < OBJECT_SIZE; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = x;
+    }
+
+    return data;
+}
+
+/*
+ * Change the object size in a chunk header, in network byte order.
+ */
+static void forge_size(uint8_t *chunk, uint64_t size)
+{
+    int i;
+    for (i = 7; i >= 0; i--) {
+        chunk[16 + i] = size & 0xff;
+        size >>= 8;
+    }
+}
+
+static void join(struct mosqagent *agent, const char *group)
+{
+    assert_int_equal(mosqagent_local_join(agent, group, false), 0);
+    assert_int_equal(mosqagent_local_topic(agent, "fw/#"), 0);
+}
+
+/*
+ * Run both agents until the stream is done and all chunks arrived.
+ */
+static void run(struct mosqagent *a, struct mosqagent *b,
+                const struct sender *s, const struct receiver *rc,
+                int chunks)
+{
+    int i;
+    for (i = 0; (i < 1000) && !(s->done && (rc->fed == chunks)); i++) {
+        mosqagent_idle(a);
+        mosqagent_idle(b);
+    }
+}
+
+static void file(void **state)
+{
+    const char *group = *state;
+    struct sender s = { .done = 0 };
+    struct receiver rc = { .r = NULL };
+    char in[512], out[512], part[520];
+
+    char *dir = mqtta_test_mkdtemp();
+    assert_non_null(dir);
+    uint8_t *data = test_object();
+    snprintf(in, sizeof(in), "%s/object.in", dir);
+    snprintf(out, sizeof(out), "%s/object.out", dir);
+    snprintf(part, sizeof(part), "%s.part", out);
+
+    FILE *f = fopen(in, "w");
+    assert_non_null(f);
+    assert_int_equal(fwrite(data, 1, OBJECT_SIZE, f), OBJECT_SIZE);
+    fclose(f);
+
+    struct mosqagent *a = mosqagent_init_agent(NULL);
+    struct mosqagent *b = mosqagent_init_agent(NULL);
+    join(a, group);
+    join(b, group);
+
+    rc.r = mqtta_reassembly_file(out, OBJECT_SIZE);
+    assert_non_null(rc.r);
+    assert_int_equal(mosqagent_subscribe(b, "fw/#", 0, reassemble, &rc), 0);
+
+    const struct mqtta_stream_config config = {
+        .chunk_size = 4096,
+        .window = 8,
+    };
+    uint64_t id;
+    assert_int_equal(mqtta_stream_file(a, "fw/image", "/nonexistent",
+                                       &config, done, &s, &id), -1);
+    assert_int_equal(errno, ENOENT);
+    assert_int_equal(mqtta_stream_file(a, "fw/+", in,
+                                       &config, done, &s, &id), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mqtta_stream_file(a, "fw/image", in,
+                                       &config, done, &s, &id), 0);
+    assert_int_equal(mqtta_streams_pending(a), 1);
+
+    run(a, b, &s, &rc, (OBJECT_SIZE + 4095) / 4096);
+
+    assert_int_equal(s.done, 1);
+    assert_int_equal(s.status, 0);
+    assert_true(s.id == id);
+    assert_int_equal(mqtta_streams_pending(a), 0);
+    assert_int_equal(rc.complete, 1);
+    assert_int_equal(rc.errors, 0);
+
+    struct mqtta_reassembly_status st;
+    mqtta_reassembly_status(rc.r, &st);
+    assert_true(st.id == id);
+    assert_int_equal(st.size, OBJECT_SIZE);
+    assert_int_equal(st.chunks, (OBJECT_SIZE + 4095) / 4096);
+    assert_int_equal(st.received, st.chunks);
+    assert_true(st.complete);
+
+    // moved into place
+    struct stat sb;
+    assert_int_equal(stat(part, &sb), -1);
+    assert_int_equal(stat(out, &sb), 0);
+    assert_int_equal(sb.st_size, OBJECT_SIZE);
+
+    uint8_t *copy = malloc(OBJECT_SIZE);
+    f = fopen(out, "r");
+    assert_non_null(f);
+    assert_int_equal(fread(copy, 1, OBJECT_SIZE, f), OBJECT_SIZE);
+    fclose(f);
+    assert_memory_equal(copy, data, OBJECT_SIZE);
+
+    mqtta_reassembly_destroy(rc.r);
+    mosqagent_close_agent(a);
+    mosqagent_close_agent(b);
+    mqtta_test_rmdir(dir);
+    free(copy);
+    free(data);
+}
+
+static void producer(void **state)
+{
+    const char *group = *state;
+    uint8_t *data = test_object();
+    struct sender s = { .data = data };
+    struct receiver rc = { .r = NULL };
+
+    struct mosqagent *a = mosqagent_init_agent(NULL);
+    struct mosqagent *b = mosqagent_init_agent(NULL);
+    join(a, group);
+    join(b, group);
+
+    // one byte short
+    uint8_t *buf = calloc(1, OBJECT_SIZE);
+    rc.r = mqtta_reassembly_buffer(buf, OBJECT_SIZE - 1);
+    assert_non_null(rc.r);
+    assert_int_equal(mosqagent_subscribe(b, "fw/#", 0, reassemble, &rc), 0);
+
+    const struct mqtta_stream_config config = { .chunk_size = 1000 };
+    assert_int_equal(mqtta_stream_produce(a, "fw/blob", OBJECT_SIZE,
+                                          produce, &config, done, &s, NULL),
+                     0);
+    run(a, b, &s, &rc, (OBJECT_SIZE + 999) / 1000);
+    assert_int_equal(s.done, 1);
+    assert_int_equal(s.status, 0);
+    assert_int_equal(rc.complete, 0);
+    assert_int_equal(rc.errors, (OBJECT_SIZE + 999) / 1000);
+    mqtta_reassembly_destroy(rc.r);
+
+    // fits
+    memset(&s, 0, sizeof(s));
+    s.data = data;
+    rc.fed = 0;
+    rc.errors = 0;
+    rc.r = mqtta_reassembly_buffer(buf, OBJECT_SIZE);
+    assert_non_null(rc.r);
+    assert_int_equal(mqtta_stream_produce(a, "fw/blob", OBJECT_SIZE,
+                                          produce, &config, done, &s, NULL),
+                     0);
+    run(a, b, &s, &rc, (OBJECT_SIZE + 999) / 1000);
+    assert_int_equal(s.done, 1);
+    assert_int_equal(s.status, 0);
+    assert_int_equal(s.produced, OBJECT_SIZE);
+    assert_int_equal(rc.complete, 1);
+    assert_int_equal(rc.errors, 0);
+    assert_memory_equal(buf, data, OBJECT_SIZE);
+
+    mqtta_reassembly_destroy(rc.r);
+    mosqagent_close_agent(a);
+    mosqagent_close_agent(b);
+    free(buf);
+    free(data);
+}
+
+static void integrity(void **state)
+{
+    const char *group = *state;
+    struct sender s = { .done = 0 };
+    struct receiver rc = { .count = 0 };
+    uint8_t buf[16];
+    char in[512];
+
+    char *dir = mqtta_test_mkdtemp();
+    assert_non_null(dir);
+    snprintf(in, sizeof(in), "%s/object.in", dir);
+    FILE *f = fopen(in, "w");
+    assert_non_null(f);
+    fputs("0123456789", f);
+    fclose(f);
+
+    struct mosqagent *a = mosqagent_init_agent(NULL);
+    struct mosqagent *b = mosqagent_init_agent(NULL);
+    join(a, group);
+    join(b, group);
+    assert_int_equal(mosqagent_subscribe(b, "fw/#", 0, capture, &rc), 0);
+
+    // two streams of three chunks
+    const struct mqtta_stream_config config = { .chunk_size = 4 };
+    assert_int_equal(mqtta_stream_file(a, "fw/small", in,
+                                       &config, done, &s, NULL), 0);
+    assert_int_equal(mqtta_stream_file(a, "fw/small", in,
+                                       &config, done, &s, NULL), 0);
+    int i;
+    for (i = 0; (i < 100) && (rc.count < 6); i++) {
+        mosqagent_idle(a);
+        mosqagent_idle(b);
+    }
+    assert_int_equal(s.done, 2);
+    assert_int_equal(rc.count, 6);
+    assert_int_equal(rc.len[0], MQTTA_STREAM_HEADER_SIZE + 4);
+    assert_int_equal(rc.len[2], MQTTA_STREAM_HEADER_SIZE + 2);
+
+    struct mqtta_reassembly *r = mqtta_reassembly_buffer(buf, sizeof(buf));
+    assert_non_null(r);
+
+    assert_int_equal(mqtta_reassembly_feed(r, "garbage", 7), -1);
+    assert_int_equal(errno, EBADMSG);
+
+    // a flipped bit in the data
+    rc.chunk[1][MQTTA_STREAM_HEADER_SIZE] ^= 1;
+    assert_int_equal(mqtta_reassembly_feed(r, rc.chunk[1], rc.len[1]), -1);
+    assert_int_equal(errno, EBADMSG);
+    rc.chunk[1][MQTTA_STREAM_HEADER_SIZE] ^= 1;
+
+    // out of order, with a duplicate and a chunk of the other stream
+    assert_int_equal(mqtta_reassembly_feed(r, rc.chunk[2], rc.len[2]), 0);
+    assert_int_equal(mqtta_reassembly_feed(r, rc.chunk[2], rc.len[2]), 0);
+    assert_int_equal(mqtta_reassembly_feed(r, rc.chunk[3], rc.len[3]), -1);
+    assert_int_equal(errno, ESTALE);
+    assert_int_equal(mqtta_reassembly_feed(r, rc.chunk[0], rc.len[0]), 0);
+    assert_int_equal(mqtta_reassembly_feed(r, rc.chunk[1], rc.len[1]), 1);
+    assert_memory_equal(buf, "0123456789", 10);
+
+    struct mqtta_reassembly_status st;
+    mqtta_reassembly_status(r, &st);
+    assert_int_equal(st.size, 10);
+    assert_int_equal(st.chunks, 3);
+    assert_true(st.complete);
+    assert_int_equal(mqtta_reassembly_feed(r, rc.chunk[0], rc.len[0]), 0);
+    mqtta_reassembly_destroy(r);
+
+    // forged sizes: more chunks than the count can hold, and a file
+    // larger than the receiver accepts
+    uint8_t forged[MQTTA_STREAM_HEADER_SIZE + 4];
+    char out[512], part[520];
+    struct stat sb;
+    memcpy(forged, rc.chunk[0], sizeof(forged));
+    snprintf(out, sizeof(out), "%s/object.out", dir);
+    snprintf(part, sizeof(part), "%s.part", out);
+
+    r = mqtta_reassembly_file(out, 1024);
+    assert_non_null(r);
+    forge_size(forged, (uint64_t)1 << 62);
+    assert_int_equal(mqtta_reassembly_feed(r, forged, sizeof(forged)), -1);
+    assert_int_equal(errno, EBADMSG);
+    forge_size(forged, (uint64_t)1 << 33);
+    assert_int_equal(mqtta_reassembly_feed(r, forged, sizeof(forged)), -1);
+    assert_int_equal(errno, EMSGSIZE);
+    assert_int_equal(stat(part, &sb), -1);
+    mqtta_reassembly_destroy(r);
+
+    mosqagent_close_agent(a);
+    mosqagent_close_agent(b);
+    mqtta_test_rmdir(dir);
+}
+
+static void cancel(void **state)
+{
+    struct sender s = { .done = 0 };
+    uint64_t id;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mqtta_stream_produce(agent, "fw/x", 100, never,
+                                          NULL, done, &s, &id), 0);
+    mosqagent_idle(agent);
+    assert_int_equal(s.done, 0);
+
+    assert_int_equal(mqtta_stream_cancel(agent, id + 1), -1);
+    assert_int_equal(errno, ENOENT);
+    assert_int_equal(mqtta_stream_cancel(agent, id), 0);
+    assert_int_equal(s.done, 1);
+    assert_int_equal(s.status, ECANCELED);
+
+    // not connected, waits for the broker
+    assert_int_equal(mqtta_stream_produce(agent, "fw/x", 100, never,
+                                          NULL, done, &s, &id), 0);
+    mosqagent_idle(agent);
+    assert_int_equal(mqtta_streams_pending(agent), 1);
+    mosqagent_close_agent(agent);
+    assert_int_equal(s.done, 2);
+    assert_int_equal(s.status, ECANCELED);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(file, mqtta_test_setup_group, mqtta_test_teardown_group),
+        cmocka_unit_test_setup_teardown(producer, mqtta_test_setup_group, mqtta_test_teardown_group),
+        cmocka_unit_test_setup_teardown(integrity, mqtta_test_setup_group, mqtta_test_teardown_group),
+        cmocka_unit_test(cancel),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,410 @@
+/*******************************************************************//**
+ * \file		mqtta-test-task.c
+ *
+ * \brief		Unit tests for the tasks.
+ *
+ * The agents are not connected, so waits for the broker can only be
+ * tested on their error paths.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-local.h>
+#include <mqtt-tools/mqtta-task.h>
+
+#include "mqtta-test-tmp.h"
+
+#define MANY        2000
+
+struct trace {
+    char log[64];
+    int done;
+};
+
+struct step {
+    struct trace *trace;
+    char name;
+};
+
+static void note(struct trace *t, const char c)
+{
+    const size_t len = strlen(t->log);
+    if (len + 1 < sizeof(t->log))
+        t->log[len] = c;
+}
+
+static void run(struct mosqagent *agent, const int *done, const int count)
+{
+    const uint64_t deadline = mqtta_now_ms() + 5000;
+    while ((*done < count) && (mqtta_now_ms() < deadline))
+        mosqagent_idle(agent);
+}
+
+static void take_steps(struct mosqagent *agent, void *data)
+{
+    struct step *s = data;
+
+    assert_true(mqtta_in_task(agent));
+
+    int i;
+    for (i = 0; i < 3; i++) {
+        note(s->trace, s->name);
+        assert_int_equal(mqtta_task_yield(agent), 0);
+    }
+    s->trace->done++;
+}
+
+static void yield(void **state)
+{
+    struct trace trace = { .done = 0 };
+    struct step steps[3] = {
+        { &trace, 'a' }, { &trace, 'b' }, { &trace, 'c' },
+    };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    // waits only work in tasks
+    assert_false(mqtta_in_task(agent));
+    assert_int_equal(mqtta_task_yield(agent), -1);
+    assert_int_equal(errno, EPERM);
+    assert_int_equal(mqtta_task_sleep(agent, 1), -1);
+    assert_int_equal(errno, EPERM);
+    assert_int_equal(mqtta_task_spawn(agent, NULL, NULL), -1);
+    assert_int_equal(errno, EINVAL);
+
+    int i;
+    for (i = 0; i < 3; i++)
+        assert_int_equal(mqtta_task_spawn(agent, take_steps, &steps[i]), 0);
+    assert_int_equal(mqtta_tasks_pending(agent), 3);
+
+    // started on the loop, in order, each runs up to its next yield
+    assert_string_equal(trace.log, "");
+    run(agent, &trace.done, 3);
+    assert_string_equal(trace.log, "abcabcabc");
+    assert_int_equal(mqtta_tasks_pending(agent), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+struct sleeper {
+    unsigned int ms;
+    uint64_t woken;
+    int *done;
+};
+
+static void sleep_twice(struct mosqagent *agent, void *data)
+{
+    struct sleeper *s = data;
+    char buf[4096];
+
+    // use some of the stack
+    memset(buf, 0x5a, sizeof(buf));
+
+    assert_int_equal(mqtta_task_sleep(agent, s->ms), 0);
+    assert_int_equal(mqtta_task_sleep(agent, s->ms), 0);
+    s->woken = mqtta_now_ms();
+
+    assert_int_equal(buf[sizeof(buf) - 1], 0x5a);
+    (*s->done)++;
+}
+
+static void sleep_many(void **state)
+{
+    static struct sleeper sleepers[MANY];
+    int done = 0;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    const struct mqtta_task_config config = {
+        .stack_size = 16 * 1024,
+        .pool = 8,
+    };
+    assert_int_equal(mqtta_task_configure(agent, &config), 0);
+
+    const uint64_t start = mqtta_now_ms();
+    int i;
+    for (i = 0; i < MANY; i++) {
+        sleepers[i].ms = 5 + 10 * (i % 3);
+        sleepers[i].done = &done;
+        assert_int_equal(mqtta_task_spawn(agent, sleep_twice, &sleepers[i]),
+                         0);
+    }
+
+    // no changes while there are tasks
+    assert_int_equal(mqtta_task_configure(agent, &config), -1);
+    assert_int_equal(errno, EBUSY);
+
+    run(agent, &done, MANY);
+    assert_int_equal(done, MANY);
+    assert_int_equal(mqtta_tasks_pending(agent), 0);
+
+    for (i = 0; i < MANY; i++)
+        assert_true(sleepers[i].woken >= start + 2 * sleepers[i].ms);
+
+    // and again after they returned
+    assert_int_equal(mqtta_task_configure(agent, &config), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+static void settings(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    const struct mqtta_task_config small = { .stack_size = 4096 };
+    assert_int_equal(mqtta_task_configure(agent, &small), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mqtta_task_configure(agent, NULL), -1);
+    assert_int_equal(errno, EINVAL);
+
+    const struct mqtta_task_config odd = { .stack_size = 20000 };
+    assert_int_equal(mqtta_task_configure(agent, &odd), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+struct received {
+    char topics[64];
+    char payloads[64];
+    int done;
+};
+
+static void handle_command(struct mosqagent *agent,
+                           const struct mqtta_message *msg,
+                           void *handler_data)
+{
+    struct received *r = handler_data;
+
+    // the message outlives the receive buffer
+    assert_int_equal(mqtta_task_sleep(agent, 1 + msg->payloadlen), 0);
+
+    strncat(r->topics, msg->topic, sizeof(r->topics) - strlen(r->topics) - 1);
+    strncat(r->payloads, msg->payload,
+            sizeof(r->payloads) - strlen(r->payloads) - 1);
+    r->done++;
+}
+
+static void subscribe(void **state)
+{
+    struct received r = { .done = 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mqtta_task_subscribe(agent, "cmd/#", 0,
+                                          NULL, &r), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mqtta_task_subscribe(agent, "cmd/#", 0,
+                                          handle_command, &r), 0);
+
+    // the later message sleeps less and finishes first
+    char payload[] = "xxxxxxxxxxxxxxxxxxxx";
+    assert_int_equal(mqtta_dispatch_message(agent, "cmd/a", payload, 20,
+                                            0, false), 1);
+    memset(payload, 'y', 2);
+    assert_int_equal(mqtta_dispatch_message(agent, "cmd/b", payload, 2,
+                                            0, false), 1);
+    assert_int_equal(mqtta_dispatch_message(agent, "other", "z", 1,
+                                            0, false), 0);
+    memset(payload, 'z', sizeof(payload) - 1);
+    assert_int_equal(mqtta_tasks_pending(agent), 2);
+
+    run(agent, &r.done, 2);
+    assert_string_equal(r.topics, "cmd/bcmd/a");
+    assert_string_equal(r.payloads, "yyxxxxxxxxxxxxxxxxxxxx");
+
+    mosqagent_close_agent(agent);
+}
+
+struct publisher {
+    int result;
+    int error;
+    int done;
+};
+
+static void publish_event(struct mosqagent *agent, void *data)
+{
+    struct publisher *p = data;
+    char topic[] = "events/door";
+    char payload[] = "open";
+
+    const struct mqtta_message msg = {
+        .topic = topic,
+        .payload = payload,
+        .payloadlen = 4,
+        .qos = 1,
+    };
+    errno = 0;
+    p->result = mqtta_task_publish(agent, &msg, 1000);
+    p->error = errno;
+    p->done++;
+}
+
+static void request_time(struct mosqagent *agent, void *data)
+{
+    struct publisher *p = data;
+    struct mqtta_memory_object response;
+
+    errno = 0;
+    p->result = mqtta_task_request(agent, "service/time", "now", 3, 1, 1000,
+                                   &response);
+    p->error = errno;
+    assert_null(mqtta_mo_ptr(&response));
+    p->done++;
+}
+
+static void publish_not_connected(void **state)
+{
+    struct publisher p = { .done = 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mqtta_task_publish(agent, NULL, 0), -1);
+    assert_int_equal(errno, EPERM);
+
+    assert_int_equal(mqtta_task_spawn(agent, publish_event, &p), 0);
+    run(agent, &p.done, 1);
+    assert_int_equal(p.result, -1);
+    assert_int_equal(p.error, ENOTCONN);
+
+    assert_int_equal(mqtta_task_spawn(agent, request_time, &p), 0);
+    run(agent, &p.done, 2);
+    assert_int_equal(p.result, -1);
+    assert_int_equal(p.error, ENOTCONN);
+
+    mosqagent_close_agent(agent);
+}
+
+static void count_event(struct mosqagent *agent,
+                        const struct mqtta_message *msg,
+                        void *handler_data)
+{
+    int *received = handler_data;
+
+    (void) agent; /* unused */
+
+    assert_memory_equal(msg->payload, "open", 4);
+    (*received)++;
+}
+
+static void publish_local(void **state)
+{
+    const char *group = *state;
+    struct publisher p = { .done = 0 };
+    int received = 0;
+
+    struct mosqagent *a = mosqagent_init_agent(NULL);
+    struct mosqagent *b = mosqagent_init_agent(NULL);
+    assert_int_equal(mosqagent_local_join(a, group, false), 0);
+    assert_int_equal(mosqagent_local_join(b, group, false), 0);
+    assert_int_equal(mosqagent_local_topic(a, "events/#"), 0);
+    assert_int_equal(mosqagent_local_topic(b, "events/#"), 0);
+    assert_int_equal(mosqagent_subscribe(b, "events/#", 0,
+                                         count_event, &received), 0);
+
+    // complete when delivered in the group
+    assert_int_equal(mqtta_task_spawn(a, publish_event, &p), 0);
+    run(a, &p.done, 1);
+    assert_int_equal(p.result, 0);
+
+    int i;
+    for (i = 0; (i < 100) && !received; i++)
+        mosqagent_idle(b);
+    assert_int_equal(received, 1);
+
+    mosqagent_close_agent(a);
+    mosqagent_close_agent(b);
+}
+
+struct closer {
+    int results[3];
+    int errors[3];
+    int done;
+};
+
+static void wait_forever(struct mosqagent *agent, void *data)
+{
+    struct closer *c = data;
+
+    c->results[0] = mqtta_task_sleep(agent, 60000);
+    c->errors[0] = errno;
+    // no more waits
+    c->results[1] = mqtta_task_yield(agent);
+    c->errors[1] = errno;
+    c->done++;
+}
+
+static void start_late(struct mosqagent *agent, void *data)
+{
+    struct closer *c = data;
+
+    c->results[2] = mqtta_task_sleep(agent, 1);
+    c->errors[2] = errno;
+    c->done++;
+}
+
+static void close_agent(void **state)
+{
+    struct closer c = { .done = 0 };
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mqtta_task_spawn(agent, wait_forever, &c), 0);
+    mosqagent_idle(agent);
+    assert_int_equal(mqtta_task_spawn(agent, start_late, &c), 0);
+    assert_int_equal(mqtta_tasks_pending(agent), 2);
+
+    // all tasks run to their end
+    mosqagent_close_agent(agent);
+    assert_int_equal(c.done, 2);
+
+    int i;
+    for (i = 0; i < 3; i++) {
+        assert_int_equal(c.results[i], -1);
+        assert_int_equal(c.errors[i], ECANCELED);
+    }
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(yield),
+        cmocka_unit_test(sleep_many),
+        cmocka_unit_test(settings),
+        cmocka_unit_test(subscribe),
+        cmocka_unit_test(publish_not_connected),
+        cmocka_unit_test_setup_teardown(publish_local,
+                                        mqtta_test_setup_group, mqtta_test_teardown_group),
+        cmocka_unit_test(close_agent),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
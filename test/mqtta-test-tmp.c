@@ -0,0 +1,128 @@
+/*******************************************************************//**
+ * \file		mqtta-test-tmp.c
+ *
+ * \brief		Temporary directories and local groups for unit tests.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include "mqtta-test-tmp.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <mqtt-tools/mqtta-local.h>
+
+#define FILE_NAME   "test"
+
+char* mqtta_test_mkdtemp(void)
+{
+    const char *tmp = getenv("TMPDIR");
+    if (!tmp || !*tmp)
+        tmp = "/tmp";
+
+    // room for a file name in the directory
+    const size_t len = strlen(tmp) + sizeof("/mqtta-test-XXXXXX/" FILE_NAME);
+    char *dir = malloc(len);
+    if (!dir)
+        return NULL;
+    snprintf(dir, len, "%s/mqtta-test-XXXXXX", tmp);
+
+    if (!mkdtemp(dir)) {
+        free(dir);
+        return NULL;
+    }
+
+    return dir;
+}
+
+void mqtta_test_rmdir(char *dir)
+{
+    if (!dir)
+        return;
+
+    DIR *d = opendir(dir);
+    if (d) {
+        struct dirent *e;
+        while ((e = readdir(d)))
+            if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+                unlinkat(dirfd(d), e->d_name, 0);
+        closedir(d);
+    }
+    rmdir(dir);
+
+    free(dir);
+}
+
+int mqtta_test_setup_dir(void **state)
+{
+    char *dir = mqtta_test_mkdtemp();
+    if (!dir)
+        return -1;
+
+    *state = dir;
+    return 0;
+}
+
+int mqtta_test_teardown_dir(void **state)
+{
+    mqtta_test_rmdir(*state);
+    return 0;
+}
+
+int mqtta_test_setup_file(void **state)
+{
+    char *path = mqtta_test_mkdtemp();
+    if (!path)
+        return -1;
+
+    // the buffer has room for the file name
+    strcat(path, "/" FILE_NAME);
+
+    *state = path;
+    return 0;
+}
+
+int mqtta_test_teardown_file(void **state)
+{
+    char *path = *state;
+
+    *strrchr(path, '/') = '\0';
+    mqtta_test_rmdir(path);
+
+    return 0;
+}
+
+int mqtta_test_setup_group(void **state)
+{
+    static char group[32];
+    snprintf(group, sizeof(group), "test%d", (int)getpid());
+
+    *state = group;
+    return 0;
+}
+
+int mqtta_test_teardown_group(void **state)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s", MQTTA_LOCAL_SHM_PREFIX,
+             (const char*)*state);
+    shm_unlink(name);
+
+    return 0;
+}
+
+void mqtta_test_sleep_ms(const long ms)
+{
+    const struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
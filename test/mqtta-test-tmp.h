@@ -0,0 +1,67 @@
+/*******************************************************************//**
+ * \file		mqtta-test-tmp.h
+ *
+ * \brief		Temporary directories and local groups for unit tests.
+ *
+ * Each test gets its own directory from `mkdtemp`, so file names inside it
+ * cannot be taken over by other users of the temporary directory. Local
+ * groups are named after the process, so that test runs in parallel do not
+ * share their shared memory.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#pragma once
+
+/**
+ * \brief Create a directory below `$TMPDIR` (or `/tmp`).
+ *
+ * \returns the allocated path or `NULL` with errno set.
+ */
+char* mqtta_test_mkdtemp(void);
+
+/**
+ * \brief Remove a directory from `mqtta_test_mkdtemp` with the files in it
+ *        and free the path.
+ */
+void mqtta_test_rmdir(char *dir);
+
+/**
+ * \brief Fixture with the path of a fresh directory as state.
+ */
+int mqtta_test_setup_dir(void **state);
+
+/**
+ * \brief Remove the directory of `mqtta_test_setup_dir`.
+ */
+int mqtta_test_teardown_dir(void **state);
+
+/**
+ * \brief Fixture with the path of a file in a fresh directory as state.
+ *
+ * The file does not exist yet.
+ */
+int mqtta_test_setup_file(void **state);
+
+/**
+ * \brief Remove the file's directory of `mqtta_test_setup_file`.
+ */
+int mqtta_test_teardown_file(void **state);
+
+/**
+ * \brief Fixture with the name of a local group as state.
+ */
+int mqtta_test_setup_group(void **state);
+
+/**
+ * \brief Remove the shared memory of the group of `mqtta_test_setup_group`.
+ */
+int mqtta_test_teardown_group(void **state);
+
+/**
+ * \brief Sleep for some milliseconds.
+ */
+void mqtta_test_sleep_ms(long ms);
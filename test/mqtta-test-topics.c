@@ -0,0 +1,231 @@
+/*******************************************************************//**
+ * \file		mqtta-test-topics.c
+ *
+ * \brief		Unit tests for the hot-topic and cardinality tracking.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-local.h>
+
+#include "mqtta-test-tmp.h"
+
+#define HOT         10
+#define TAIL        20000
+
+static void dispatch(struct mosqagent *agent, const char *topic, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        assert_int_equal(mqtta_dispatch_message(agent, topic, "x", 1,
+                                                0, false), 0);
+}
+
+static void hot_topics(void **state)
+{
+    char topic[32];
+    int i;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_track_topics(agent, NULL), 0);
+
+    // a long tail of topics with one to three messages, interleaved with
+    // ten busy ones
+    uint64_t total = 0;
+    for (i = 0; i < TAIL; i++) {
+        snprintf(topic, sizeof(topic), "tail/%d", i);
+        dispatch(agent, topic, 1 + i % 3);
+        total += 1 + i % 3;
+
+        if (i % 20 == 0) {
+            int h;
+            for (h = 0; h < HOT; h++) {
+                snprintf(topic, sizeof(topic), "hot/%d", h);
+                dispatch(agent, topic, HOT - h);
+                total += HOT - h;
+            }
+        }
+    }
+
+    struct mqtta_topics_stats stats;
+    assert_int_equal(mosqagent_topic_stats(agent, &stats), 0);
+    assert_true(stats.total == total);
+    // 1.6% standard error
+    assert_in_range(stats.distinct, (TAIL + HOT) * 95 / 100,
+                    (TAIL + HOT) * 105 / 100);
+    assert_true(stats.error > 0);
+
+    struct mqtta_topic_count top[HOT];
+    assert_int_equal(mosqagent_top_topics(agent, top, HOT), HOT);
+    for (i = 0; i < HOT; i++) {
+        const uint64_t count = (TAIL / 20) * (HOT - i);
+
+        snprintf(topic, sizeof(topic), "hot/%d", i);
+        assert_string_equal(top[i].topic, topic);
+        assert_in_range(top[i].count, count, count + stats.error);
+        assert_true(mosqagent_topic_estimate(agent, topic) == top[i].count);
+    }
+
+    // never more than the true count plus the bound
+    assert_in_range(mosqagent_topic_estimate(agent, "tail/0"),
+                    1, 1 + stats.error);
+    assert_true(mosqagent_topic_estimate(agent, "nowhere") <= stats.error);
+
+    mosqagent_reset_topics(agent);
+    assert_int_equal(mosqagent_topic_stats(agent, &stats), 0);
+    assert_int_equal(stats.total, 0);
+    assert_int_equal(stats.distinct, 0);
+    assert_int_equal(mosqagent_top_topics(agent, top, HOT), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+static void settings(void **state)
+{
+    struct mqtta_topics_stats stats;
+    struct mqtta_topic_count top[4];
+    char topic[MQTTA_TOPICS_NAME_LEN + 16];
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    // nothing without tracking
+    dispatch(agent, "a", 1);
+    assert_int_equal(mosqagent_topic_stats(agent, NULL), -1);
+    assert_int_equal(mosqagent_topic_stats(agent, &stats), 0);
+    assert_int_equal(stats.total, 0);
+    assert_int_equal(mosqagent_top_topics(agent, top, 4), 0);
+    assert_int_equal(mosqagent_topic_estimate(agent, "a"), 0);
+
+    const struct mqtta_topics_config coarse = { .precision = 3 };
+    const struct mqtta_topics_config deep = { .depth = 9 };
+    const struct mqtta_topics_config long_top = { .top = 257 };
+    assert_int_equal(mosqagent_track_topics(agent, &coarse), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mosqagent_track_topics(agent, &deep), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mosqagent_track_topics(agent, &long_top), -1);
+    assert_int_equal(errno, EINVAL);
+
+    // payload bytes, a short list and a long topic
+    const struct mqtta_topics_config bytes = {
+        .width = 100, .top = 2, .bytes = true,
+    };
+    assert_int_equal(mosqagent_track_topics(agent, &bytes), 0);
+
+    memset(topic, 'l', sizeof(topic) - 1);
+    topic[sizeof(topic) - 1] = '\0';
+    assert_int_equal(mqtta_dispatch_message(agent, "a", "1234", 4,
+                                            0, false), 0);
+    assert_int_equal(mqtta_dispatch_message(agent, "b", "12", 2,
+                                            0, false), 0);
+    assert_int_equal(mqtta_dispatch_message(agent, topic, "123", 3,
+                                            0, false), 0);
+    assert_int_equal(mqtta_dispatch_message(agent, "b", "", 0,
+                                            0, false), 0);
+
+    assert_int_equal(mosqagent_topic_stats(agent, &stats), 0);
+    assert_int_equal(stats.total, 9);
+    assert_int_equal(stats.distinct, 3);
+
+    // "b" is out, the list has two entries
+    assert_int_equal(mosqagent_top_topics(agent, top, 1), 1);
+    assert_string_equal(top[0].topic, "a");
+    assert_int_equal(top[0].count, 4);
+    assert_int_equal(mosqagent_top_topics(agent, top, 4), 2);
+    assert_int_equal(strlen(top[1].topic), MQTTA_TOPICS_NAME_LEN - 1);
+    assert_memory_equal(top[1].topic, topic, MQTTA_TOPICS_NAME_LEN - 1);
+    assert_int_equal(top[1].count, 3);
+
+    mosqagent_close_agent(agent);
+}
+
+struct snapshot {
+    int count;
+    char payload[1024];
+};
+
+static void receive_snapshot(struct mosqagent *agent,
+                             const struct mqtta_message *msg,
+                             void *handler_data)
+{
+    struct snapshot *s = handler_data;
+
+    (void) agent; /* unused */
+
+    s->count++;
+    snprintf(s->payload, sizeof(s->payload), "%.*s",
+             msg->payloadlen, msg->payload);
+}
+
+static void publish(void **state)
+{
+    const char *group = *state;
+    struct snapshot s = { .count = 0 };
+
+    struct mosqagent *a = mosqagent_init_agent(NULL);
+    struct mosqagent *b = mosqagent_init_agent(NULL);
+    assert_int_equal(mosqagent_local_join(a, group, false), 0);
+    assert_int_equal(mosqagent_local_join(b, group, false), 0);
+    assert_int_equal(mosqagent_local_topic(a, "stats/#"), 0);
+    assert_int_equal(mosqagent_local_topic(b, "stats/#"), 0);
+    assert_int_equal(mosqagent_subscribe(b, "stats/#", 0,
+                                         receive_snapshot, &s), 0);
+
+    char publish[] = "stats/topics";
+    const struct mqtta_topics_config config = {
+        .top = 2,
+        .publish = publish,
+        .interval_ms = 10,
+        .reset = true,
+    };
+    assert_int_equal(mosqagent_track_topics(a, &config), 0);
+
+    dispatch(a, "a/\"quoted\"", 3);
+    dispatch(a, "b", 1);
+
+    int i;
+    for (i = 0; (i < 100) && !s.count; i++) {
+        mosqagent_idle(a);
+        mosqagent_idle(b);
+    }
+    assert_int_equal(s.count, 1);
+    assert_string_equal(s.payload,
+        "{\"total\":4,\"distinct\":2,\"error\":1,\"top\":["
+        "{\"topic\":\"a/\\\"quoted\\\"\",\"count\":3},"
+        "{\"topic\":\"b\",\"count\":1}]}");
+
+    // started over, the agent counts its own snapshot from the group
+    assert_int_equal(mosqagent_topic_estimate(a, "b"), 0);
+
+    mosqagent_close_agent(a);
+    mosqagent_close_agent(b);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(hot_topics),
+        cmocka_unit_test(settings),
+        cmocka_unit_test_setup_teardown(publish, mqtta_test_setup_group, mqtta_test_teardown_group),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
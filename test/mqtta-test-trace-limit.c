@@ -0,0 +1,287 @@
+/*******************************************************************//**
+ * \file		mqtta-test-trace-limit.c
+ *
+ * \brief		Unit tests for the topic and source limits of tracing.
+ *
+ * The connect and publish calls of libmosquitto are wrapped (see
+ * test/CMakeLists.txt): the tests check the stamps of published messages
+ * and deliver stamped messages through the agent's message callback.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mosquitto.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-trace.h>
+
+#define MANY_TOPICS     1000
+
+typedef void (*message_callback)(struct mosquitto *, void *,
+                                 const struct mosquitto_message *,
+                                 const mosquitto_property *);
+
+static struct {
+    message_callback on_message;
+
+    int published;
+    /** whether the last published message had trace stamps */
+    bool stamped;
+} broker;
+
+int __wrap_mosquitto_connect_bind_v5(struct mosquitto *mosq,
+                                     const char *host,
+                                     int port,
+                                     int keepalive,
+                                     const char *bind_address,
+                                     const mosquitto_property *properties)
+{
+    (void) mosq;         /* unused */
+    (void) host;         /* unused */
+    (void) port;         /* unused */
+    (void) keepalive;    /* unused */
+    (void) bind_address; /* unused */
+    (void) properties;   /* unused */
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+void __wrap_mosquitto_message_v5_callback_set(struct mosquitto *mosq,
+                                              message_callback cb)
+{
+    (void) mosq; /* unused */
+
+    broker.on_message = cb;
+}
+
+int __wrap_mosquitto_publish_v5(struct mosquitto *mosq,
+                                int *mid,
+                                const char *topic,
+                                int payloadlen,
+                                const void *payload,
+                                int qos,
+                                bool retain,
+                                const mosquitto_property *properties)
+{
+    (void) mosq;       /* unused */
+    (void) topic;      /* unused */
+    (void) payloadlen; /* unused */
+    (void) payload;    /* unused */
+    (void) qos;        /* unused */
+    (void) retain;     /* unused */
+
+    char *name = NULL;
+    char *value = NULL;
+    broker.stamped = mosquitto_property_read_string_pair(properties,
+                                                        MQTT_PROP_USER_PROPERTY,
+                                                        &name, &value,
+                                                        false) != NULL;
+    free(name);
+    free(value);
+
+    broker.published++;
+    if (mid)
+        *mid = broker.published;
+    return MOSQ_ERR_SUCCESS;
+}
+
+static struct mosqagent_config config = {
+    .client_name = "trace",
+    .host = "localhost",
+    .port = 1883,
+    .protocol_version = 5,
+};
+
+static struct mosqagent* setup_agent(void)
+{
+    memset(&broker, 0, sizeof(broker));
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    mqtta_set_configuration(agent, &config);
+    assert_int_equal(mosqagent_setup_mqtt(agent), 0);
+    assert_non_null(broker.on_message);
+    assert_int_equal(mosqagent_trace(agent, NULL), 0);
+
+    return agent;
+}
+
+/*
+ * Deliver a message stamped by `source` as libmosquitto would.
+ */
+static void deliver(struct mosqagent *agent,
+                    const char *topic,
+                    const char *source,
+                    const uint64_t seq)
+{
+    char s[24];
+    char ts[24];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(s, sizeof(s), "%" PRIu64, seq);
+    snprintf(ts, sizeof(ts), "%" PRIu64,
+             (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec);
+
+    mosquitto_property *props = NULL;
+    assert_int_equal(mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY,
+                                                        MQTTA_TRACE_SOURCE, source), 0);
+    assert_int_equal(mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY,
+                                                        MQTTA_TRACE_SEQUENCE, s), 0);
+    assert_int_equal(mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY,
+                                                        MQTTA_TRACE_TIMESTAMP, ts), 0);
+
+    const struct mosquitto_message msg = {
+        .topic = (char*)topic,
+        .payload = "x",
+        .payloadlen = 1,
+    };
+    broker.on_message(agent->mosq, agent, &msg, props);
+
+    mosquitto_property_free_all(&props);
+}
+
+static int send_one(struct mosqagent *agent, const char *topic)
+{
+    struct mqtta_message msg = {
+        .topic = (char*)topic,
+        .payload = "x",
+        .payloadlen = 1,
+    };
+
+    return mqtta_send_message(agent, &msg);
+}
+
+static void count_topic(const char *topic,
+                        const struct mqtta_trace_stats *stats,
+                        void *data)
+{
+    (void) topic; /* unused */
+    (void) stats; /* unused */
+
+    (*(int*)data)++;
+}
+
+static void limit_without_trace(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mqtta_trace_limit(agent, 10, 10), -1);
+    assert_int_equal(errno, EINVAL);
+    assert_int_equal(mqtta_trace_overflow(agent), 0);
+
+    mosqagent_close_agent(agent);
+}
+
+static void topic_limit(void **state)
+{
+    struct mqtta_trace_stats stats;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = setup_agent();
+    assert_int_equal(mqtta_trace_limit(agent, 2, 0), 0);
+
+    deliver(agent, "sensor/a", "src", 1);
+    deliver(agent, "sensor/b", "src", 1);
+    deliver(agent, "sensor/c", "src", 1);
+    assert_int_equal(mqtta_trace_stats(agent, "sensor/a", &stats), 0);
+    assert_int_equal(mqtta_trace_stats(agent, "sensor/b", &stats), 0);
+    assert_int_equal(mqtta_trace_stats(agent, "sensor/c", &stats), -1);
+    assert_int_equal(errno, ENOENT);
+    assert_int_equal(mqtta_trace_overflow(agent), 1);
+
+    // known topics are still stamped, further ones are sent without
+    assert_int_equal(send_one(agent, "sensor/a"), 0);
+    assert_true(broker.stamped);
+    assert_int_equal(send_one(agent, "sensor/d"), 0);
+    assert_int_equal(broker.published, 2);
+    assert_false(broker.stamped);
+    assert_int_equal(mqtta_trace_overflow(agent), 2);
+
+    mosqagent_close_agent(agent);
+}
+
+static void source_limit(void **state)
+{
+    struct mqtta_trace_stats stats;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = setup_agent();
+    assert_int_equal(mqtta_trace_limit(agent, 0, 2), 0);
+
+    deliver(agent, "sensor/t", "one", 1);
+    deliver(agent, "sensor/t", "two", 1);
+    deliver(agent, "sensor/t", "three", 1);
+    // a gap of a known source, none for the one over the limit
+    deliver(agent, "sensor/t", "one", 3);
+    deliver(agent, "sensor/t", "three", 5);
+
+    assert_int_equal(mqtta_trace_stats(agent, "sensor/t", &stats), 0);
+    assert_int_equal(stats.count, 5);
+    assert_int_equal(stats.gaps, 1);
+    assert_int_equal(stats.lost, 1);
+    assert_int_equal(mqtta_trace_overflow(agent), 2);
+
+    mosqagent_close_agent(agent);
+}
+
+static void many_topics(void **state)
+{
+    struct mqtta_trace_stats stats;
+    char topic[32];
+    int i;
+
+    (void) state; /* unused */
+
+    struct mosqagent *agent = setup_agent();
+
+    // far more than the initial table, which has to grow several times
+    for (i = 0; i < MANY_TOPICS; i++) {
+        snprintf(topic, sizeof(topic), "sensor/%d", i);
+        deliver(agent, topic, "src", 1);
+        deliver(agent, topic, "src", 2);
+    }
+    assert_int_equal(mqtta_trace_overflow(agent), 0);
+
+    for (i = 0; i < MANY_TOPICS; i++) {
+        snprintf(topic, sizeof(topic), "sensor/%d", i);
+        assert_int_equal(mqtta_trace_stats(agent, topic, &stats), 0);
+        assert_int_equal(stats.count, 2);
+        assert_int_equal(stats.gaps, 0);
+    }
+
+    int topics = 0;
+    mqtta_trace_foreach(agent, count_topic, &topics);
+    assert_int_equal(topics, MANY_TOPICS);
+
+    mosqagent_close_agent(agent);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(limit_without_trace),
+        cmocka_unit_test(topic_limit),
+        cmocka_unit_test(source_limit),
+        cmocka_unit_test(many_topics),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
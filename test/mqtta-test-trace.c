@@ -0,0 +1,112 @@
+/*******************************************************************//**
+ * \file		mqtta-test-trace.c
+ *
+ * \brief		Unit tests for latency tracing.
+ *
+ * SPDX-License-Identifier: MIT
+ * License-Filename: LICENSES/MIT.txt
+ *
+ * \copyright	2019 Stefan Haun, Netz39 e.V., and mqtta contributors
+ **********************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mqtt-tools/mqtta.h>
+#include <mqtt-tools/mqtta-trace.h>
+
+#include "mqtta-test-tmp.h"
+
+static void ignore_handler(struct mosqagent *agent,
+                           const struct mqtta_message *msg,
+                           void *handler_data)
+{
+    (void) agent;        /* unused */
+    (void) msg;          /* unused */
+    (void) handler_data; /* unused */
+}
+
+static void spans_are_dumped(void **state)
+{
+    const char *path = *state;
+    char buf[4096];
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_trace(agent, "tester"), 0);
+    assert_int_equal(mosqagent_subscribe(agent, "a/#", 0,
+                                         ignore_handler, NULL), 0);
+
+    mosqagent_idle(agent);
+    assert_int_equal(mqtta_dispatch_message(agent, "a/b", "1", 1, 0, false), 1);
+
+    // messages without stamps have no latency
+    struct mqtta_trace_stats stats;
+    assert_int_equal(mqtta_trace_stats(agent, "a/b", &stats), -1);
+    assert_int_equal(errno, ENOENT);
+
+    assert_int_equal(mqtta_trace_dump(agent, path), 0);
+    mosqagent_close_agent(agent);
+
+    FILE *f = fopen(path, "r");
+    assert_non_null(f);
+    const size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    assert_non_null(strstr(buf, "{\"traceEvents\":["));
+    assert_non_null(strstr(buf, "\"name\":\"tester\""));
+    assert_non_null(strstr(buf, "\"name\":\"timers\""));
+    assert_non_null(strstr(buf, "\"name\":\"idle calls\""));
+    assert_non_null(strstr(buf, "\"name\":\"network\""));
+    assert_non_null(strstr(buf, "\"name\":\"dispatch\""));
+}
+
+static void source_is_escaped(void **state)
+{
+    const char *path = *state;
+    char buf[4096];
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+    assert_int_equal(mosqagent_trace(agent, "a \"quoted\\\tname"), 0);
+    assert_int_equal(mqtta_trace_dump(agent, path), 0);
+    mosqagent_close_agent(agent);
+
+    FILE *f = fopen(path, "r");
+    assert_non_null(f);
+    const size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    assert_non_null(strstr(buf, "\"name\":\"a \\\"quoted\\\\\\u0009name\""));
+}
+
+static void disabled(void **state)
+{
+    (void) state; /* unused */
+
+    struct mosqagent *agent = mosqagent_init_agent(NULL);
+    assert_non_null(agent);
+
+    assert_int_equal(mqtta_trace_dump(agent, "/dev/null"), -1);
+    assert_int_equal(errno, EINVAL);
+
+    mosqagent_close_agent(agent);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(spans_are_dumped, mqtta_test_setup_file, mqtta_test_teardown_file),
+        cmocka_unit_test_setup_teardown(source_is_escaped, mqtta_test_setup_file, mqtta_test_teardown_file),
+        cmocka_unit_test(disabled),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}